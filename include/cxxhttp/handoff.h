@@ -0,0 +1,338 @@
+/* Listening socket handoff.
+ *
+ * Lets a new process take the listening sockets of a server that's already
+ * running, so the server can be restarted without closing its sockets, which
+ * would refuse or drop the connections that are waiting to be accepted.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_HANDOFF_H)
+#define CXXHTTP_HANDOFF_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cxxhttp/network.h>
+
+namespace cxxhttp {
+namespace net {
+namespace handoff {
+/* File descriptors per message.
+ *
+ * Sockets are sent in batches of up to this many, so the receiving end knows
+ * how much room to make for them.
+ */
+static const std::size_t batch = 32;
+
+/* Send file descriptors.
+ * @socket A connected UNIX stream socket.
+ * @fds The descriptors to send; they stay open in this process.
+ *
+ * Each batch of descriptors goes with a single byte that says how many are in
+ * it, and an empty batch ends the list.
+ *
+ * @return `true` if all of the descriptors were sent.
+ */
+static inline bool send(int socket, const std::vector<int> &fds) {
+#if defined(MSG_NOSIGNAL)
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;
+#endif
+
+  for (std::size_t i = 0;;) {
+    const std::size_t n = std::min(batch, fds.size() - i);
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * batch));
+    unsigned char count = (unsigned char)n;
+    iovec data{&count, 1};
+    msghdr message{};
+
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    if (n > 0) {
+      message.msg_control = control.data();
+      message.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+      cmsghdr *header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(sizeof(int) * n);
+      std::memcpy(CMSG_DATA(header), fds.data() + i, sizeof(int) * n);
+    }
+
+    if (::sendmsg(socket, &message, flags) != 1) {
+      return false;
+    }
+    if (n == 0) {
+      return true;
+    }
+    i += n;
+  }
+}
+
+/* Receive file descriptors.
+ * @socket A connected UNIX stream socket.
+ * @fds Where to add the descriptors.
+ *
+ * Reads batches of descriptors, as written by send(), until the empty one
+ * that ends the list. If that fails part of the way, the descriptors that did
+ * arrive are closed again.
+ *
+ * @return `true` if the whole list was received.
+ */
+static inline bool receive(int socket, std::vector<int> &fds) {
+#if defined(MSG_CMSG_CLOEXEC)
+  const int flags = MSG_CMSG_CLOEXEC;
+#else
+  const int flags = 0;
+#endif
+  std::vector<int> received;
+  bool done = false;
+
+  while (!done) {
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * batch));
+    unsigned char count = 0;
+    iovec data{&count, 1};
+    msghdr message{};
+
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+
+    if (::recvmsg(socket, &message, flags) != 1) {
+      break;
+    }
+
+    for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr;
+         header = CMSG_NXTHDR(&message, header)) {
+      if (header->cmsg_level == SOL_SOCKET &&
+          header->cmsg_type == SCM_RIGHTS) {
+        const std::size_t n = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const std::size_t offset = received.size();
+        received.resize(offset + n);
+        std::memcpy(received.data() + offset, CMSG_DATA(header),
+                    sizeof(int) * n);
+      }
+    }
+
+    if ((message.msg_flags & MSG_CTRUNC) != 0) {
+      break;
+    }
+    done = count == 0;
+  }
+
+  if (!done) {
+    for (const int fd : received) {
+      ::close(fd);
+    }
+    return false;
+  }
+
+  fds.insert(fds.end(), received.begin(), received.end());
+  return true;
+}
+
+/* Handoff control socket.
+ *
+ * A process that's restarted starts a new copy of itself, which connects to
+ * the old one's control socket with takeOver(). The old process sends it all
+ * of the sockets its servers are listening on, and the new one adopts them,
+ * so that its servers accept connections on them rather than binding new
+ * ones. Once those servers are up and running, it tells the old process, which
+ * then drains its servers and stops listening for handoffs. Both processes
+ * accept connections in the meantime, and since the sockets are never closed,
+ * none of the connections waiting to be accepted get lost.
+ *
+ * If the new process goes away before its servers are running, the old one
+ * keeps going as if nothing happened.
+ */
+class control {
+ public:
+  /* Construct with I/O service.
+   * @pio The I/O service to use, defaults to the global one.
+   *
+   * The I/O service needs to be running for handoffs to go through.
+   */
+  control(service &pio = efgy::global<service>())
+      : io(pio), strand(pio), acceptor(pio), previous(pio), next(pio) {}
+
+  /* Destructor.
+   *
+   * Stops listening for handoffs.
+   */
+  ~control(void) { efgy::global<shutdown>().remove(this); }
+
+  /* Take over from a running process.
+   * @path Where the other process has its control socket.
+   *
+   * Adopts the other process's listening sockets, for servers that are set up
+   * afterwards to take. Once the I/O service runs, which is when those servers
+   * are accepting connections, the other process is told to drain, and any
+   * sockets that no server took are closed.
+   *
+   * @return `true` if there was a process to take over from, and it handed
+   * over its sockets.
+   */
+  bool takeOver(const std::string &path) {
+    asio::error_code ec;
+    std::vector<int> fds;
+
+    previous.connect(transport::unix::endpoint(path), ec);
+    if (ec) {
+      return false;
+    }
+
+    // don't wait forever if the other process is stuck.
+    timeval timeout{5, 0};
+    ::setsockopt(previous.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                 sizeof(timeout));
+
+    if (!receive(previous.native_handle(), fds)) {
+      previous.close(ec);
+      return false;
+    }
+
+    for (const int fd : fds) {
+      efgy::global<listeners>().adopt(fd);
+    }
+
+    io.post(strand.wrap([this]() {
+      asio::error_code ec;
+      efgy::global<listeners>().discard();
+      asio::write(previous, asio::buffer("d", 1), ec);
+      previous.close(ec);
+    }));
+
+    return true;
+  }
+
+  /* Listen for a process to take over.
+   * @path Where to create the control socket.
+   *
+   * Replaces whatever is at `path`, which is usually the control socket of the
+   * process this one took over from. Draining the servers, e.g. with a
+   * SIGTERM, stops listening again.
+   *
+   * @return `true` if the control socket was set up.
+   */
+  bool listen(const std::string &path) {
+    asio::error_code ec;
+    const transport::unix::endpoint endpoint(path);
+
+    (void)std::remove(path.c_str());
+
+    acceptor.open(endpoint.protocol(), ec);
+    if (!ec) {
+      acceptor.bind(endpoint, ec);
+    }
+    if (!ec) {
+      acceptor.listen(asio::socket_base::max_connections, ec);
+    }
+    if (ec) {
+      acceptor.close(ec);
+      return false;
+    }
+
+    efgy::global<shutdown>().add(
+        this, [this](std::chrono::milliseconds) { close(); });
+    strand.dispatch([this]() { startAccept(); });
+    return true;
+  }
+
+  /* Stop listening for handoffs.
+   *
+   * Also gives up on a handoff that's still going on. Doesn't remove the
+   * control socket's name, which may belong to the process that took over by
+   * now. May be called from any thread.
+   */
+  void close(void) {
+    strand.dispatch([this]() {
+      asio::error_code ec;
+      acceptor.close(ec);
+      next.close(ec);
+    });
+  }
+
+ protected:
+  /* The I/O service the control socket is using. */
+  service &io;
+
+  /* Handoff strand.
+   *
+   * There's only ever one handoff going on, and all of its handlers run
+   * through this.
+   */
+  asio::io_service::strand strand;
+
+  /* Control socket acceptor. */
+  transport::unix::acceptor acceptor;
+
+  /* Connection to the process this one took over from. */
+  transport::unix::socket previous;
+
+  /* Connection to the process that is taking over from this one. */
+  transport::unix::socket next;
+
+  /* Where the other process's go-ahead goes. */
+  char reply;
+
+  /* Wait for the next process to connect.
+   *
+   * Runs on <strand>.
+   */
+  void startAccept(void) {
+    acceptor.async_accept(next, strand.wrap([this](const asio::error_code &e) {
+      if (!e) {
+        handOver();
+      }
+    }));
+  }
+
+  /* Hand the listening sockets over.
+   *
+   * Sends the sockets of all servers that are currently listening, then waits
+   * for the other process to be ready. If it is, this process drains, and if
+   * it doesn't make it that far, this process goes on listening for handoffs.
+   * Runs on <strand>.
+   */
+  void handOver(void) {
+    if (!send(next.native_handle(), efgy::global<listeners>().active())) {
+      asio::error_code ec;
+      next.close(ec);
+      startAccept();
+      return;
+    }
+
+    asio::async_read(
+        next, asio::buffer(&reply, 1),
+        strand.wrap([this](const asio::error_code &error, std::size_t) {
+          asio::error_code ec;
+          next.close(ec);
+          if (!error) {
+            efgy::global<shutdown>().drain();
+          } else if (acceptor.is_open()) {
+            startAccept();
+          }
+        }));
+  }
+};
+}
+}
+}
+
+#endif
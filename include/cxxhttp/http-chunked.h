@@ -0,0 +1,327 @@
+/* HTTP chunked transfer coding.
+ *
+ * Helpers to frame message bodies with the 'chunked' Transfer-Encoding, which
+ * allows sending a body without knowing its length beforehand, and a decoder
+ * to read such bodies back in.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ * * RFC 7230, section 4.1: https://tools.ietf.org/html/rfc7230#section-4.1
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_HTTP_CHUNKED_H)
+#define CXXHTTP_HTTP_CHUNKED_H
+
+#include <algorithm>
+#include <cctype>
+#include <limits>
+#include <string>
+
+#include <cxxhttp/http-header.h>
+
+namespace cxxhttp {
+namespace http {
+namespace chunked {
+/* Frame a chunk of data.
+ * @data The chunk's payload. Must not be empty.
+ *
+ * Prepends the chunk size in hex and appends the trailing CRLF. An empty chunk
+ * would terminate the body, so use last() for that instead.
+ *
+ * @return The framed chunk.
+ */
+static inline std::string chunk(const std::string &data) {
+  static const char *digits = "0123456789abcdef";
+  std::string size;
+
+  for (std::size_t n = data.size(); n > 0; n >>= 4) {
+    size.insert(size.begin(), digits[n & 0xf]);
+  }
+
+  return size + "\r\n" + data + "\r\n";
+}
+
+/* Create the final chunk.
+ * @trailers Trailing header fields to send after the body.
+ *
+ * The last chunk is a zero-sized chunk, followed by any trailers and a final
+ * empty line.
+ *
+ * @return The final chunk, with trailers.
+ */
+static inline std::string last(const headers &trailers = {}) {
+  return "0\r\n" + std::string(parser<headers>{trailers}) + "\r\n";
+}
+
+/* Is a Transfer-Encoding just "chunked"?
+ * @transferEncoding The value of a Transfer-Encoding header.
+ *
+ * Transfer codings are case-insensitive. We only support the chunked coding on
+ * its own, not in combination with any other transfer codings.
+ *
+ * @return `true` if the value only lists the chunked coding.
+ */
+static inline bool only(const std::string &transferEncoding) {
+  static const caseInsensitiveLT lt;
+  static const std::string name = "chunked";
+  return !lt(transferEncoding, name) && !lt(name, transferEncoding);
+}
+
+/* Chunked body decoder state.
+ *
+ * Describes which part of a chunked body the decoder expects next.
+ */
+enum state {
+  /* Not decoding a chunked body. */
+  ckNone,
+  /* Waiting for a chunk size line. */
+  ckSize,
+  /* Reading chunk data. */
+  ckData,
+  /* Waiting for the line break after the chunk data. */
+  ckDataEnd,
+  /* Reading trailers after the last chunk. */
+  ckTrailer,
+  /* The body has been decoded completely. */
+  ckDone,
+  /* The body was malformed. */
+  ckError,
+  /* The decoded body would have been larger than allowed. */
+  ckOverflow
+};
+
+/* Chunked body decoder.
+ *
+ * Decodes a chunked message body straight out of a receive buffer and into the
+ * body string, so the payload is only copied once. Partial lines are left in
+ * the receive buffer until the rest of the line has arrived.
+ */
+class decoder {
+ public:
+  /* Current decoder state.
+   *
+   * ckNone unless start() has been called.
+   */
+  enum state state = ckNone;
+
+  /* Bytes left in the current chunk.
+   *
+   * Only meaningful in the ckData state.
+   */
+  std::size_t remaining = 0;
+
+  /* Maximum decoded body size.
+   *
+   * Bodies that would grow past this put the decoder in the ckOverflow state.
+   */
+  std::size_t limit = std::numeric_limits<std::size_t>::max();
+
+  /* Decoded body size so far.
+   *
+   * Counted here rather than taken from the body string, as that need not hold
+   * the whole body when it is being streamed.
+   */
+  std::size_t decoded = 0;
+
+  /* Maximum length of a chunk size or trailer line.
+   *
+   * We need to buffer these in full, so they need to be limited to keep
+   * clients from making us buffer arbitrary amounts of data.
+   */
+  std::size_t maxLine = 8192;
+
+  /* Trailing header fields.
+   *
+   * Any trailers that were sent after the last chunk.
+   */
+  parser<headers> trailers;
+
+  /* Begin decoding a new body.
+   * @pLimit The maximum decoded body size.
+   *
+   * Resets the decoder to expect the first chunk size line.
+   */
+  void start(std::size_t pLimit = std::numeric_limits<std::size_t>::max()) {
+    state = ckSize;
+    remaining = 0;
+    limit = pLimit;
+    decoded = 0;
+    trailers = {};
+  }
+
+  /* Whether we're decoding a chunked body.
+   *
+   * @return `true` if start() was called for the current message.
+   */
+  bool active(void) const { return state != ckNone; }
+
+  /* Decode buffered data.
+   * @data Start of the received data.
+   * @length Number of bytes available at `data`.
+   * @content The decoded body, which chunk data is appended to.
+   *
+   * Decodes as much as possible of the given data. This stops at the end of the
+   * body, at the first error, or when the rest of the data is only part of a
+   * line.
+   *
+   * @return The number of bytes used up; these should be removed from the
+   * receive buffer.
+   */
+  std::size_t absorb(const char *data, std::size_t length,
+                     std::string &content) {
+    std::size_t pos = 0;
+
+    while (pos < length && (state == ckSize || state == ckData ||
+                            state == ckDataEnd || state == ckTrailer)) {
+      if (state == ckData) {
+        const std::size_t n = std::min(remaining, length - pos);
+        content.append(data + pos, n);
+        pos += n;
+        decoded += n;
+        remaining -= n;
+        if (remaining == 0) {
+          state = ckDataEnd;
+        }
+        continue;
+      }
+
+      const char *begin = data + pos;
+      const char *end = std::find(begin, data + length, '\n');
+
+      if (end == data + length) {
+        // only part of a line is available, so wait for the rest.
+        if (std::size_t(end - begin) > maxLine) {
+          state = ckError;
+        }
+        break;
+      }
+
+      std::string line(begin, end);
+      pos += line.size() + 1;
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+
+      if (line.size() > maxLine) {
+        state = ckError;
+      } else if (state == ckSize) {
+        size(line);
+      } else if (state == ckDataEnd) {
+        state = line.empty() ? ckSize : ckError;
+      } else if (line.empty()) {
+        state = ckDone;
+      } else if (!trailers.absorb(line)) {
+        state = ckError;
+      }
+    }
+
+    return pos;
+  }
+
+ protected:
+  /* Parse a chunk size line.
+   * @line The line, without the line break.
+   *
+   * Chunk extensions are checked, but ignored otherwise. Switches to reading
+   * the chunk data, or to the trailers for the last chunk.
+   */
+  void size(const std::string &line) {
+    static const std::string digits = "0123456789abcdef";
+    std::size_t n = 0;
+    std::size_t i = 0;
+
+    for (; i < line.size(); i++) {
+      const auto d = digits.find(char(std::tolower((unsigned char)line[i])));
+      if (d == std::string::npos) {
+        break;
+      }
+      if (n > (std::numeric_limits<std::size_t>::max() >> 4)) {
+        state = ckOverflow;
+        return;
+      }
+      n = (n << 4) | d;
+    }
+
+    if (i == 0 || !extensions(line, i)) {
+      state = ckError;
+    } else if (n > limit || decoded > limit - n) {
+      state = ckOverflow;
+    } else if (n == 0) {
+      state = ckTrailer;
+    } else {
+      remaining = n;
+      state = ckData;
+    }
+  }
+
+  /* Check chunk extensions.
+   * @line The chunk size line.
+   * @i Where the chunk size ends.
+   *
+   * Goes by RFC 7230, section 4.1.1: each extension starts with a semicolon,
+   * followed by a token and optionally by an equals sign and a token or quoted
+   * string, with optional whitespace around the delimiters. Anything else after
+   * the chunk size makes the line invalid.
+   *
+   * @return `true` if the rest of the line is a valid list of extensions.
+   */
+  static bool extensions(const std::string &line, std::size_t i) {
+    static const std::string tchars = "!#$%&'*+-.^_`|~";
+    const auto space = [&line, &i]() {
+      while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) {
+        i++;
+      }
+    };
+    const auto token = [&line, &i]() {
+      const std::size_t start = i;
+      while (i < line.size() &&
+             (std::isalnum((unsigned char)line[i]) ||
+              tchars.find(line[i]) != std::string::npos)) {
+        i++;
+      }
+      return i > start;
+    };
+    const auto quoted = [&line, &i]() {
+      for (i++; i < line.size() && line[i] != '"'; i++) {
+        const unsigned char c = line[i];
+        if (c == '\\' && i + 1 < line.size()) {
+          i++;
+        } else if (c != '\t' && (c < ' ' || c == 0x7f || c == '\\')) {
+          return false;
+        }
+      }
+      return i++ < line.size();
+    };
+
+    for (space(); i < line.size(); space()) {
+      if (line[i] != ';') {
+        return false;
+      }
+      i++;
+      space();
+      if (!token()) {
+        return false;
+      }
+      space();
+      if (i < line.size() && line[i] == '=') {
+        i++;
+        space();
+        if ((i < line.size() && line[i] == '"') ? !quoted() : !token()) {
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+};
+}
+}
+}
+
+#endif
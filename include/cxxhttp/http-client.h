@@ -24,6 +24,27 @@
 
 namespace cxxhttp {
 namespace http {
+/* Tell an exchange where its attempt went.
+ * @processor The processor of the connection the attempt was queued on.
+ * @ex The exchange the attempt is for. Optional.
+ *
+ * So that hedges can go elsewhere, and so that an attempt that's stuck waiting
+ * for a reply doesn't hold up its connection after the exchange is settled.
+ * Only keeps a weak reference to the exchange, as the exchange keeps the
+ * callback.
+ */
+static inline void placeOn(processor::client &processor,
+                           std::shared_ptr<exchange> ex) {
+  if (ex) {
+    std::weak_ptr<exchange> w = ex;
+    ex->placed(&processor, [&processor, w]() {
+      if (auto e = w.lock()) {
+        processor.callOff(e);
+      }
+    });
+  }
+}
+
 /* Prepare and dispatch an HTTP client call.
  * @transport An ASIO transport type.
  * @uri What to get.
@@ -63,6 +84,25 @@ namespace http {
  * conneciton will be established via STDIN and STDOUT. Those file descriptors
  * would then have to be open and connected correctly.
  *
+ * Connections are taken from the global client pool, so once a request to a
+ * host is done, the next call() to that host may reuse its connection; see
+ * http::pool for the limits that apply.
+ *
+ * Host names are looked up in the global net::resolverCache. If it doesn't
+ * know the host yet, the request waits on a spare connection while the name is
+ * resolved in the background, instead of holding up the I/O service; calls
+ * made to the same host in the meantime wait for the same lookup. The request
+ * then goes to the pool like any other, so the pool's limits still apply.
+ *
+ * If the pool asks for retries, hedged requests or an overall timeout, the
+ * request becomes an http::exchange, and the callbacks are called once for the
+ * exchange as a whole, rather than for each attempt.
+ *
+ * Client limitation: the request may go out as soon as this returns, so with
+ * more than one thread running the I/O service, a quick reply can come back
+ * before the callbacks have been set. Make calls from an I/O service that runs
+ * on a single thread if that is a concern.
+ *
  * Client limitation: if a host name resolves to more than one address, only the
  * first of these addresses is used and the rest is ignored. This may be fixed
  * in the future.
@@ -82,13 +122,6 @@ static processor::client &call(
   std::smatch match;
 
   static processor::client failure;
-  static bool padded = false;
-
-  if (!padded) {
-    // pre-heat the connection pool a bit.
-    http::client<transport>::pad(5, clients, service);
-    padded = true;
-  }
 
   if (u.valid()) {
     std::string authority = u.authority();
@@ -110,22 +143,84 @@ static processor::client &call(
         io.start();
         return io.processor;
       } else {
-        net::endpoint<transport> endpoint(host, serv);
-        try {
-          for (net::endpointType<transport> e : endpoint) {
-            auto &s = client<transport>::get(e, clients, service);
+        const std::string path = u.path();
+        pool &p = efgy::global<pool>();
+
+        // queues the request on a connection to the host, other than the ones
+        // to avoid, and returns that connection's processor, or nullptr if the
+        // host couldn't be found or there was no connection to be had.
+        auto send = [=, &clients, &service, &p](
+            std::shared_ptr<exchange> ex,
+            const std::vector<const void *> &avoid) -> processor::client * {
+          net::endpoint<transport> endpoint(host, serv, service);
+          std::vector<net::endpointType<transport>> found;
+          asio::error_code error;
+
+          if (!endpoint.lookup(found, error)) {
+            // the host name needs resolving, so queue the request on a spare
+            // connection until we know where to send it; the spare never
+            // connects, the request is moved to a pooled connection once the
+            // name is known.
+            auto &s = client<transport>::spare(clients, service);
 
             s.processor.doFail = false;
-            s.processor.query(method, u.path(), header, content);
-            return s.processor;
+            s.processor.query(method, path, header, content, ex);
+            placeOn(s.processor, ex);
+            endpoint.resolve([&s, &p, &clients, &service](
+                const asio::error_code &error,
+                const std::vector<net::endpointType<transport>> &found) {
+              if (!error && !found.empty()) {
+                for (const auto &req : s.processor.withdraw()) {
+                  auto c = client<transport>::acquire(found.front(), p,
+                                                      clients, service);
+                  c->processor.doFail = false;
+                  c->processor.resume(req);
+                  placeOn(c->processor, req.exchange);
+                }
+              } else {
+                static sessionData none;
+                s.processor.recycle(none);
+              }
+              s.abandon();
+            });
+            return &s.processor;
+          } else if (!error && !found.empty()) {
+            auto c = client<transport>::acquire(found.front(), p, clients,
+                                                service, avoid);
+            if (c == nullptr) {
+              return nullptr;
+            }
 
-            // ignore setup and connection errors, which will fall through to
-            // the specially crafted failure client.
+            c->processor.doFail = false;
+            c->processor.query(method, path, header, content, ex);
+            placeOn(c->processor, ex);
+            return &c->processor;
+          }
+
+          return nullptr;
+        };
+
+        if (p.retries > 0 || p.hedge || p.totalTimeout.count() > 0) {
+          auto ex = std::make_shared<exchange>(
+              method, p, service,
+              [send](std::shared_ptr<exchange> ex,
+                     const std::vector<const void *> &avoid) {
+                return send(ex, avoid) != nullptr;
+              });
+          ex->start();
+          processor::client *c = send(ex, {});
+          if (c != nullptr) {
+            return *c;
+          }
+          ex->abandon();
+        } else {
+          processor::client *c = send(nullptr, {});
+          if (c != nullptr) {
+            return *c;
           }
-        } catch (...) {
-          // this will throw if the host to connect to can't be found, in which
-          // case we want to fall back to returning the failure client.
         }
+
+        // lookup errors fall through to the specially crafted failure client.
       }
     }
   }
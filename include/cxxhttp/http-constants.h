@@ -112,6 +112,8 @@ enum status {
   stContent,
   /* Currently processing the request. */
   stProcessing,
+  /* Keeping a client connection open, with nothing to send right now. */
+  stIdle,
   /* An error has occurred, and we won't continue parsing. */
   stError,
   /* Will shut down the connection now. Set in the destructor. */
@@ -0,0 +1,468 @@
+/* C++20 coroutines for servlets.
+ *
+ * Lets servlet handlers be written as coroutines, which can wait for the
+ * request body or for upstream requests without blocking the I/O thread and
+ * without nesting callbacks.
+ *
+ * Only available if the compiler supports coroutines, i.e. in C++20 mode.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_HTTP_COROUTINE_H)
+#define CXXHTTP_HTTP_COROUTINE_H
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+
+#include <cxxhttp/http-client.h>
+#include <cxxhttp/http-deferred.h>
+#include <cxxhttp/http-error.h>
+
+namespace cxxhttp {
+namespace http {
+/* A complete HTTP reply.
+ *
+ * What coroutine servlets co_return, and what fetch() results in. The fields
+ * are in the same order as the arguments to sessionData::reply().
+ */
+struct response {
+  /* The HTTP status code.
+   *
+   * For fetch(), this is zero if there was no reply at all.
+   */
+  int status;
+
+  /* The message body. */
+  std::string body;
+
+  /* Headers to send, or the headers that were received. */
+  headers header;
+};
+
+/* Coroutine servlet handler.
+ *
+ * Declare a servlet handler as returning this to make it a coroutine:
+ *
+ *     http::task hello(http::sessionData &session, std::smatch &match) {
+ *       const std::string name = match[1];
+ *       auto upstream = co_await http::fetch<transport::tcp>(url);
+ *       co_return http::response{200, name + ": " + upstream.body};
+ *     }
+ *
+ * The coroutine starts running right away, on the session's strand, and its
+ * reply is deferred as with a deferredReply token; it resumes on the strand
+ * after each co_await. The match results are only valid until the first
+ * co_await, so copy anything you need out of them before that.
+ *
+ * Coroutine frames are allocated from storage kept with the session, so that
+ * they don't need a heap allocation per request once the session has been
+ * used for a coroutine before.
+ */
+class task {
+ public:
+  /* Coroutine promise.
+   *
+   * Holds the deferred reply for the request the coroutine is handling.
+   */
+  class promise_type {
+   public:
+    /* Construct with coroutine arguments.
+     * @args The coroutine's arguments, which must include the session.
+     *
+     * Also gets the lambda as the first argument for lambda coroutines.
+     */
+    template <typename... A>
+    promise_type(A &... args)
+        : session(sessionOf(args...)), reply(sessionOf(args...)) {}
+
+    /* The session the coroutine runs on. */
+    sessionData &session;
+
+    /* The deferred reply to the request. */
+    deferredReply reply;
+
+    /* Create the coroutine's return object.
+     *
+     * @return An empty task; there's nothing to do with it.
+     */
+    task get_return_object(void) { return {}; }
+
+    /* Whether to suspend before running the coroutine.
+     *
+     * @return Never suspend, so the coroutine runs within the handler call.
+     */
+    std::suspend_never initial_suspend(void) { return {}; }
+
+    /* Whether to suspend when the coroutine is done.
+     *
+     * @return Never suspend, so the frame is destroyed right away.
+     */
+    std::suspend_never final_suspend(void) noexcept { return {}; }
+
+    /* Reply with the coroutine's result.
+     * @r The co_return'd reply.
+     */
+    void return_value(response r) { reply.reply(r.status, r.body, r.header); }
+
+    /* Reply with an error.
+     *
+     * Called if the coroutine throws. The client gets a 500, unless the
+     * request is not current anymore.
+     */
+    void unhandled_exception(void) {
+      reply.complete([](sessionData &sess) { error(sess).reply(500); });
+    }
+
+    /* Allocate a coroutine frame.
+     * @size The size of the frame.
+     * @args The coroutine's arguments, which must include the session.
+     *
+     * Uses the session's frame storage, growing it as needed, unless that is
+     * already in use. Each frame has a prefix that records which session it
+     * belongs to, if any, so operator delete can tell where it came from.
+     *
+     * @return The new frame.
+     */
+    template <typename... A>
+    static void *operator new(std::size_t size, A &... args) {
+      sessionData &sess = sessionOf(args...);
+      sessionData *owner = nullptr;
+      char *block;
+
+      if (!sess.frameInUse) {
+        if (sess.frameSize < prefix + size) {
+          sess.frame.reset(new char[prefix + size]);
+          sess.frameSize = prefix + size;
+        }
+        sess.frameInUse = true;
+        block = sess.frame.get();
+        owner = &sess;
+      } else {
+        block = static_cast<char *>(::operator new(prefix + size));
+      }
+
+      new (block) sessionData *(owner);
+      return block + prefix;
+    }
+
+    /* Free a coroutine frame.
+     * @frame The frame to free.
+     *
+     * Hands the frame back to its session, or frees it for real if it didn't
+     * come from a session's frame storage.
+     */
+    static void operator delete(void *frame) {
+      char *block = static_cast<char *>(frame) - prefix;
+      sessionData *owner = *reinterpret_cast<sessionData **>(block);
+
+      if (owner != nullptr) {
+        owner->frameInUse = false;
+      } else {
+        ::operator delete(block);
+      }
+    }
+
+   protected:
+    /* Size of the frame prefix.
+     *
+     * Large enough to hold the owner pointer, while keeping the frame itself
+     * suitably aligned.
+     */
+    static constexpr std::size_t prefix =
+        (sizeof(sessionData *) + alignof(std::max_align_t) - 1) /
+        alignof(std::max_align_t) * alignof(std::max_align_t);
+
+    /* Find the session in the coroutine arguments.
+     * @sess The session.
+     *
+     * @return The session.
+     */
+    template <typename... A>
+    static sessionData &sessionOf(sessionData &sess, A &...) {
+      return sess;
+    }
+
+    /* Find the session in the coroutine arguments.
+     * @args The remaining arguments.
+     *
+     * Skips over arguments that aren't the session.
+     *
+     * @return The session.
+     */
+    template <typename T, typename... A>
+    static sessionData &sessionOf(T &, A &... args) {
+      return sessionOf(args...);
+    }
+  };
+};
+
+/* Request gone.
+ *
+ * Thrown out of a co_await if the request the coroutine was handling is not
+ * current anymore, e.g. because its deadline has passed or the client has
+ * gone away, so that the coroutine stops touching the session.
+ */
+class cancelled : public std::runtime_error {
+ public:
+  /* Default constructor.
+   *
+   * Uses a fixed message.
+   */
+  cancelled(void) : std::runtime_error("request is not current anymore") {}
+};
+
+/* Awaitable for a request body.
+ *
+ * See readBody() for details.
+ */
+class bodyReader {
+ public:
+  /* Construct with session.
+   * @pSession The session with the request.
+   */
+  bodyReader(sessionData &pSession)
+      : session(pSession), buffer(std::make_shared<std::string>()) {}
+
+  /* Whether the body is already in.
+   *
+   * @return `true` unless the body is being streamed and still coming in.
+   */
+  bool await_ready(void) const {
+    return !session.streamingContent || session.contentComplete();
+  }
+
+  /* Wait for the rest of the body.
+   * @h The coroutine to resume once the body is in.
+   *
+   * Collects the body through the session's `onContent` callback. If the
+   * connection goes away before the body is in, the session drops that
+   * callback, and the coroutine is destroyed along with it.
+   */
+  void await_suspend(std::coroutine_handle<task::promise_type> h) {
+    auto b = buffer;
+    auto w = std::make_shared<waiter>(h);
+    promise = &h.promise();
+    session.onContent = [b, w](sessionData &sess) {
+      b->append(sess.content);
+      if (sess.contentComplete()) {
+        w->resume();
+      }
+    };
+  }
+
+  /* Get the body.
+   *
+   * @return The whole request body, whether it was read into memory, spilled
+   * to disk or streamed.
+   */
+  std::string await_resume(void) {
+    if (promise != nullptr && !promise->reply.current()) {
+      throw cancelled();
+    }
+    if (!session.streamingContent && session.contentFile.active()) {
+      const char *data = session.contentFile.map();
+      return data != nullptr ? std::string(data, session.contentFile.size())
+                             : session.content;
+    }
+    return session.streamingContent ? *buffer : session.content;
+  }
+
+ protected:
+  /* Suspended coroutine.
+   *
+   * Owns the coroutine until it's resumed, and destroys it if that never
+   * happens, so that its frame and deferred reply don't leak.
+   */
+  class waiter {
+   public:
+    /* Construct with coroutine.
+     * @pHandle The suspended coroutine.
+     */
+    waiter(std::coroutine_handle<task::promise_type> pHandle)
+        : handle(pHandle) {}
+
+    /* Destructor.
+     *
+     * Destroys the coroutine, unless it has been resumed.
+     */
+    ~waiter(void) {
+      if (handle) {
+        handle.destroy();
+      }
+    }
+
+    /* Resume the coroutine.
+     *
+     * Hands the coroutine back to itself, as it'll clean up after itself once
+     * it's done.
+     */
+    void resume(void) {
+      auto h = handle;
+      handle = nullptr;
+      h.resume();
+    }
+
+   protected:
+    /* The coroutine, until it's been resumed. */
+    std::coroutine_handle<task::promise_type> handle;
+  };
+
+  /* The session with the request. */
+  sessionData &session;
+
+  /* Streamed body parts. */
+  std::shared_ptr<std::string> buffer;
+
+  /* The waiting coroutine's promise, if it had to wait. */
+  task::promise_type *promise = nullptr;
+};
+
+/* Wait for the request body.
+ * @session The session with the request.
+ *
+ * For regular servlets, the body is already in by the time the handler runs,
+ * so this doesn't wait at all. For servlets with `streamContent` set, this
+ * waits for the rest of the body and collects it in memory; it needs to be
+ * awaited before anything else in that case, or parts of the body are lost.
+ *
+ * @return Something to co_await, which results in the body.
+ */
+static inline bodyReader readBody(sessionData &session) {
+  return bodyReader(session);
+}
+
+/* Awaitable for an upstream request.
+ * @transport The transport to use for the request.
+ *
+ * See fetch() for details.
+ */
+template <class transport>
+class fetcher {
+ public:
+  /* Construct with request.
+   * @pRequest The request to send.
+   * @pClients The client set to use.
+   * @pService The I/O service to run the request on.
+   */
+  fetcher(processor::request pRequest,
+          efgy::beacons<client<transport>> &pClients, service &pService)
+      : request(pRequest),
+        clients(pClients),
+        io(pService),
+        result(std::make_shared<response>(response{0, "", {}})) {}
+
+  /* Whether the reply is already in.
+   *
+   * @return Always `false`, as the request is only sent in await_suspend().
+   */
+  bool await_ready(void) const { return false; }
+
+  /* Send the request.
+   * @h The coroutine to resume once the reply is in.
+   *
+   * The reply comes in on the client's I/O service, so this posts back onto
+   * the session's strand before resuming the coroutine.
+   *
+   * @return `false` if the request could not be sent at all, so that the
+   * coroutine resumes right away.
+   */
+  bool await_suspend(std::coroutine_handle<task::promise_type> h) {
+    processor::client &c =
+        call<transport>(request.resource, request.header, request.body,
+                        request.method, clients, io);
+    promise = &h.promise();
+
+    if (c.doFail) {
+      return false;
+    }
+
+    auto r = result;
+    auto done = std::make_shared<std::atomic<bool>>(false);
+    sessionData &sess = promise->session;
+
+    c.then([r, done, h, &sess](sessionData &reply) {
+      if (done->exchange(true)) {
+        return;
+      }
+      if (reply.inboundStatus.valid()) {
+        *r = response{int(reply.inboundStatus.code), reply.content,
+                      reply.inbound.header};
+      }
+      if (sess.post) {
+        sess.post([h]() { h.resume(); });
+      } else {
+        h.resume();
+      }
+    });
+
+    return true;
+  }
+
+  /* Get the reply.
+   *
+   * @return The upstream reply; the status is zero if there was none.
+   */
+  response await_resume(void) {
+    if (promise != nullptr && !promise->reply.current()) {
+      throw cancelled();
+    }
+    return *result;
+  }
+
+ protected:
+  /* The request to send. */
+  processor::request request;
+
+  /* The client set to use. */
+  efgy::beacons<client<transport>> &clients;
+
+  /* The I/O service to run the request on. */
+  service &io;
+
+  /* The reply, once it's in. */
+  std::shared_ptr<response> result;
+
+  /* The waiting coroutine's promise. */
+  task::promise_type *promise = nullptr;
+};
+
+/* Fetch a resource from a coroutine servlet.
+ * @transport An ASIO transport type.
+ * @uri What to get.
+ * @header Additional headers for the request.
+ * @content What to send as the request body.
+ * @method The method to use when talking to the server.
+ * @clients The global client set.
+ * @service The ASIO IO service to use.
+ *
+ * Same as call(), but to co_await in a coroutine servlet instead of setting up
+ * callbacks.
+ *
+ * @return Something to co_await, which results in the upstream reply.
+ */
+template <class transport>
+static fetcher<transport> fetch(
+    const std::string &uri, headers header = {},
+    const std::string &content = "", const std::string method = "GET",
+    efgy::beacons<client<transport>> &
+        clients = efgy::global<efgy::beacons<client<transport>>>(),
+    service &service = efgy::global<cxxhttp::service>()) {
+  return fetcher<transport>(processor::request{method, uri, header, content},
+                            clients, service);
+}
+}
+}
+#endif
+
+#endif
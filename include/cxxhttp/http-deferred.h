@@ -0,0 +1,190 @@
+/* Deferred HTTP replies.
+ *
+ * Lets servlet handlers return before they've replied to a request, and send
+ * the reply later, e.g. once an upstream request has come back.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_HTTP_DEFERRED_H)
+#define CXXHTTP_HTTP_DEFERRED_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+
+#include <cxxhttp/http-session.h>
+
+namespace cxxhttp {
+namespace http {
+/* Deferred reply token.
+ *
+ * Create one of these in a servlet handler to tell the server that the reply
+ * will come later. The handler may then return without replying; the server
+ * stops reading further requests on the connection until the reply has been
+ * sent through the token, or until the deadline has passed, in which case the
+ * client gets a 504.
+ *
+ * Tokens can be copied around freely, e.g. into the callback of a client
+ * request, and the reply may be sent from any thread; it is always applied to
+ * the session on the session's own strand. Only the first reply through any
+ * copy of a token counts, and replies that come in after the deadline, or
+ * after the connection was closed, are dropped. Tokens don't keep the session
+ * alive, so they may also be completed after it's been destroyed.
+ */
+class deferredReply {
+ public:
+  /* Defer the reply to the current request.
+   * @pSession The session with the request to reply to.
+   * @timeout How long to wait for the reply; zero waits forever.
+   *
+   * Must be called from within the request's handler.
+   */
+  deferredReply(sessionData &pSession,
+                std::chrono::milliseconds timeout = std::chrono::seconds(30))
+      : state(std::make_shared<shared>(pSession)) {
+    pSession.awaiting = true;
+    pSession.replyTimeout = timeout;
+  }
+
+  /* Complete the request.
+   * @fn Called with the session, and should reply to the request.
+   *
+   * Use this instead of reply() for anything that isn't a simple reply, e.g.
+   * to start streaming a reply with beginReply().
+   *
+   * @return `false` if the request had been completed already through this
+   * token. A `true` return does not mean that the reply will still be sent, as
+   * the deadline may pass before the session gets to it.
+   */
+  bool complete(std::function<void(sessionData &)> fn) const {
+    if (state->done.exchange(true)) {
+      return false;
+    }
+
+    auto s = state;
+    auto run = [s, fn]() {
+      sessionData *sess = s->session();
+      if (sess != nullptr && sess->awaiting &&
+          sess->generation == s->generation) {
+        sess->awaiting = false;
+        fn(*sess);
+        if (sess->notify) {
+          sess->notify();
+        }
+      }
+    };
+
+    std::function<void(std::function<void(void)>)> post;
+
+    {
+      std::lock_guard<mutex> l(s->ref->lock);
+      if (s->ref->session == nullptr) {
+        // the session was destroyed, so there's nobody left to reply to.
+        return true;
+      }
+      post = s->ref->session->post;
+    }
+
+    if (post) {
+      post(run);
+    } else {
+      run();
+    }
+
+    return true;
+  }
+
+  /* Reply to the request.
+   * @status The HTTP status code to reply with.
+   * @body The message body.
+   * @header Any additional headers to send.
+   *
+   * Same as the session's reply(), but for a deferred request.
+   *
+   * @return `false` if the request had been completed already through this
+   * token.
+   */
+  bool reply(int status, const std::string &body,
+             const headers &header = {}) const {
+    return complete([status, body, header](sessionData &sess) {
+      sess.reply(status, body, header);
+    });
+  }
+
+  /* Whether the reply is still outstanding.
+   *
+   * @return `true` unless the request has been completed through this token.
+   */
+  bool pending(void) const { return !state->done; }
+
+  /* Whether the reply is still wanted.
+   *
+   * Only meaningful on the session's strand, e.g. in a handler or in a
+   * callback that was posted there.
+   *
+   * @return `true` if the reply is still outstanding, and neither the deadline
+   * has passed nor the connection gone away.
+   */
+  bool current(void) const {
+    const sessionData *sess = state->session();
+    return pending() && sess != nullptr && sess->awaiting &&
+           sess->generation == state->generation;
+  }
+
+ protected:
+  /* Token state.
+   *
+   * Shared between all copies of a token.
+   */
+  struct shared {
+    /* Construct with session.
+     * @pSession The session with the request to reply to.
+     *
+     * Remembers which request is being deferred.
+     */
+    shared(sessionData &pSession)
+        : ref(pSession.self), generation(pSession.generation), done(false) {}
+
+    /* The session with the request.
+     *
+     * Only use this on the session's strand, as the session may be destroyed
+     * at any other time.
+     *
+     * @return The session, or `nullptr` if it's been destroyed.
+     */
+    sessionData *session(void) const {
+      std::lock_guard<mutex> l(ref->lock);
+      return ref->session;
+    }
+
+    /* Reference to the session with the request. */
+    std::shared_ptr<sessionData::reference> ref;
+
+    /* The session's generation when the token was created.
+     *
+     * Used to make sure we only reply to the request the token was for.
+     */
+    const std::size_t generation;
+
+    /* Whether the request has been completed through this token. */
+    std::atomic<bool> done;
+  };
+
+  /* The token's shared state.
+   *
+   * Kept in a shared pointer, so that tokens can be copied into callbacks.
+   */
+  std::shared_ptr<shared> state;
+};
+}
+}
+
+#endif
@@ -0,0 +1,284 @@
+/* HTTP content codings.
+ *
+ * Implements the compression side of HTTP content codings, i.e. what is sent
+ * in Content-Encoding headers after negotiating them via Accept-Encoding.
+ *
+ * The actual codecs are optional, as they need external libraries: define
+ * USE_ZLIB to enable "gzip" and "deflate" (link with -lz), and USE_BROTLI to
+ * enable "br" (link with -lbrotlienc). Without either, only "identity" is
+ * available and replies are sent as-is.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_HTTP_ENCODING_H)
+#define CXXHTTP_HTTP_ENCODING_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#if defined(USE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(USE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#include <cxxhttp/negotiate.h>
+#include <cxxhttp/string.h>
+
+namespace cxxhttp {
+namespace http {
+namespace encoding {
+/* Content codings we can produce.
+ *
+ * Lists the non-identity codings that have been compiled in, in order of
+ * preference.
+ */
+static const std::vector<std::string> codings{
+#if defined(USE_BROTLI)
+    "br",
+#endif
+#if defined(USE_ZLIB)
+    "gzip", "deflate",
+#endif
+};
+
+/* Accept-Encoding negotiation value.
+ *
+ * Use this as the value for an "Accept-Encoding" servlet negotiation to enable
+ * compression for that servlet with all the codings we have available.
+ * "identity" is included with a low q-value, so that it's only picked if the
+ * client doesn't support any of the others; see also acceptsIdentity().
+ */
+static const std::string available =
+#if defined(USE_BROTLI)
+    "br, "
+#endif
+#if defined(USE_ZLIB)
+    "gzip;q=0.9, deflate;q=0.8, "
+#endif
+    "identity;q=0.1";
+
+/* Whether a client accepts the identity coding.
+ * @accept The client's Accept-Encoding header.
+ *
+ * As per RFC 7231, section 5.3.4, the identity coding is always acceptable,
+ * unless the client excluded it explicitly with "identity;q=0", or with "*;q=0"
+ * and no "identity" of its own.
+ *
+ * @return `false` if the client refuses unencoded replies.
+ */
+static inline bool acceptsIdentity(const std::string &accept) {
+  bool wildcard = true;
+
+  for (const auto &v : split(accept)) {
+    const qvalue coding(v);
+
+    if (coding.value == "identity") {
+      return coding.q > 0;
+    } else if (coding.value == "*") {
+      wildcard = coding.q > 0;
+    }
+  }
+
+  return wildcard;
+}
+
+#if defined(USE_ZLIB)
+/* Reusable zlib compressor.
+ *
+ * Keeps a zlib deflate stream around, so that compressing a reply only needs a
+ * deflateReset() instead of allocating the (rather large) compressor state all
+ * over again.
+ */
+class zlib {
+ public:
+  /* Construct with window bits.
+   * @pWindowBits zlib window bits; add 16 to get a gzip wrapper.
+   *
+   * The stream itself is only initialised on first use.
+   */
+  zlib(int pWindowBits) : windowBits(pWindowBits), ready(false) {}
+
+  /* Destructor.
+   *
+   * Releases the deflate state, if there was one.
+   */
+  ~zlib(void) {
+    if (ready) {
+      deflateEnd(&stream);
+    }
+  }
+
+  /* Compress a buffer.
+   * @in The data to compress.
+   * @out Where to write the compressed data to.
+   * @level The zlib compression level.
+   *
+   * Compresses all of `in` in one go, using a reset stream.
+   *
+   * @return `true` if compression succeeded.
+   */
+  bool compress(const std::string &in, std::string &out, int level) {
+    if (!ready) {
+      stream = z_stream();
+      ready = deflateInit2(&stream, level, Z_DEFLATED, windowBits, 8,
+                           Z_DEFAULT_STRATEGY) == Z_OK;
+      if (!ready) {
+        return false;
+      }
+    } else if (deflateReset(&stream) != Z_OK ||
+               deflateParams(&stream, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+      return false;
+    }
+
+    out.resize(deflateBound(&stream, in.size()));
+
+    stream.next_in = (Bytef *)in.data();
+    stream.avail_in = in.size();
+    stream.next_out = (Bytef *)&out[0];
+    stream.avail_out = out.size();
+
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+      return false;
+    }
+
+    out.resize(stream.total_out);
+    return true;
+  }
+
+ protected:
+  /* zlib window bits.
+   *
+   * Decides both the window size and the wrapper format.
+   */
+  const int windowBits;
+
+  /* Whether `stream` has been initialised.
+   *
+   * Set on first use.
+   */
+  bool ready;
+
+  /* zlib stream state.
+   *
+   * Only valid if `ready` is set.
+   */
+  z_stream stream;
+};
+#endif
+
+/* Encode a buffer with a given content coding.
+ * @coding The coding to use, e.g. "gzip".
+ * @in The data to encode.
+ * @out Where to write the encoded data.
+ * @best Whether to use maximum compression; for precompressed content.
+ *
+ * Compressor contexts are kept per thread, so they can be reused across
+ * requests without needing any locking.
+ *
+ * @return `true` if `out` now contains `in` in the requested coding. `false`
+ * for the "identity" coding, or any coding that wasn't compiled in.
+ */
+static inline bool encode(const std::string &coding, const std::string &in,
+                          std::string &out, bool best = false) {
+  static const caseInsensitiveLT lt;
+  const auto is = [&coding](const char *name) -> bool {
+    return !lt(coding, name) && !lt(name, coding);
+  };
+
+#if defined(USE_ZLIB)
+  if (is("gzip") || is("x-gzip")) {
+    static thread_local zlib gzip(15 + 16);
+    return gzip.compress(in, out, best ? 9 : 6);
+  } else if (is("deflate")) {
+    static thread_local zlib deflate(15);
+    return deflate.compress(in, out, best ? 9 : 6);
+  }
+#endif
+
+#if defined(USE_BROTLI)
+  if (is("br")) {
+    std::size_t size = BrotliEncoderMaxCompressedSize(in.size());
+    if (size == 0) {
+      return false;
+    }
+    out.resize(size);
+    if (!BrotliEncoderCompress(best ? BROTLI_MAX_QUALITY : 5,
+                               BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+                               in.size(), (const uint8_t *)in.data(), &size,
+                               (uint8_t *)&out[0])) {
+      return false;
+    }
+    out.resize(size);
+    return true;
+  }
+#endif
+
+  (void)is;
+  return false;
+}
+
+/* Precompressed reply body.
+ *
+ * Holds a reply body along with all the encoded variants of it that we can
+ * produce, so that frequently sent, constant content only has to be compressed
+ * once, rather than for every request.
+ */
+class variants {
+ public:
+  /* Construct with body.
+   * @pBody The unencoded body.
+   *
+   * Encodes the body with every available coding, at maximum compression. A
+   * variant is only kept if it is actually smaller than the original.
+   */
+  variants(const std::string &pBody) {
+    body["identity"] = pBody;
+
+    for (const auto &c : codings) {
+      std::string out;
+      if (encode(c, pBody, out, true) && out.size() < pBody.size()) {
+        body[c] = out;
+      }
+    }
+  }
+
+  /* Do we have a variant for a coding?
+   * @coding The content coding to look for.
+   *
+   * @return `true` if there is a variant of the body with that coding.
+   */
+  bool has(const std::string &coding) const { return body.count(coding) > 0; }
+
+  /* Get variant for coding.
+   * @coding The content coding to look for.
+   *
+   * @return The encoded variant, or the unencoded body if there's none.
+   */
+  const std::string &get(const std::string &coding) const {
+    const auto it = body.find(coding);
+    return it == body.end() ? body.find("identity")->second : it->second;
+  }
+
+ protected:
+  /* Body variants.
+   *
+   * Maps content codings to the body encoded with that coding.
+   */
+  std::map<std::string, std::string, caseInsensitiveLT> body;
+};
+}
+}
+}
+
+#endif
@@ -0,0 +1,408 @@
+/* HTTP client exchanges.
+ *
+ * Keeps track of the attempts at getting a reply to a client request, for
+ * retries, hedged requests and deadlines that span more than one connection.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_HTTP_EXCHANGE_H)
+#define CXXHTTP_HTTP_EXCHANGE_H
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <cxxhttp/http-pool.h>
+#include <cxxhttp/http-session.h>
+
+namespace cxxhttp {
+namespace http {
+/* Client request exchange.
+ *
+ * Ties together the attempts at getting a reply to one client request. Each
+ * attempt is a copy of the request, queued on some connection. The first reply
+ * to any of them settles the exchange, and replies to the others are dropped;
+ * copies that haven't been sent yet are skipped.
+ *
+ * Attempts that fail without a reply are tried again, as long as the method is
+ * idempotent and the pool allows for more retries. The pool may also ask for
+ * a hedged attempt on another connection, if the first one takes longer than
+ * most requests do, and for a limit on how long the whole exchange may take.
+ *
+ * Once the exchange is settled, attempts that are still waiting for a reply
+ * are called off, so that they don't hold up their connections.
+ */
+class exchange : public std::enable_shared_from_this<exchange> {
+ public:
+  /* Callback type, as for the processor's callbacks. */
+  using callback = std::function<void(sessionData &)>;
+
+  /* Attempt sender type.
+   *
+   * Queues a copy of the request for the exchange on some connection other
+   * than the ones given, and returns `false` if that wasn't possible.
+   */
+  using sender = std::function<bool(std::shared_ptr<exchange>,
+                                    const std::vector<const void *> &)>;
+
+  /* Whether a method is idempotent.
+   * @method The method to check.
+   *
+   * These are the methods that RFC 7231, section 4.2.2, says are idempotent.
+   *
+   * @return `true` if sending the request more than once is safe.
+   */
+  static bool isIdempotent(const std::string &method) {
+    static const std::set<std::string> methods{"GET",   "HEAD", "OPTIONS",
+                                               "TRACE", "PUT",  "DELETE"};
+    return methods.find(method) != methods.end();
+  }
+
+  /* Construct with method, pool and sender.
+   * @method The request method, to tell whether retries are safe.
+   * @pPool The pool with the limits to apply.
+   * @io The I/O service for the timers.
+   * @pSend How to send an attempt.
+   */
+  exchange(const std::string &method, http::pool &pPool, service &io,
+           sender pSend)
+      : pool(pPool),
+        send(pSend),
+        idempotent(isIdempotent(method)),
+        retries(pPool.retries),
+        started(std::chrono::steady_clock::now()),
+        deadline(io),
+        backoff(io),
+        hedger(io) {}
+
+  /* Start the exchange.
+   *
+   * Arms the deadline and the hedging timer, as the pool asks for. The caller
+   * sends the first attempt right after this, so that it can hand out the
+   * connection it went to; if that doesn't work out, it should abandon() the
+   * exchange.
+   */
+  void start(void) {
+    auto self = shared_from_this();
+    const auto hedgeAfter =
+        pool.hedgeAfter.count() > 0 ? pool.hedgeAfter : pool.percentile(95);
+
+    {
+      std::lock_guard<mutex> l(lock);
+
+      outstanding++;
+
+      if (pool.totalTimeout.count() > 0) {
+        deadline.expires_from_now(pool.totalTimeout);
+        deadline.async_wait([self](const std::error_code &error) {
+          if (!error) {
+            self->expire();
+          }
+        });
+      }
+
+      if (pool.hedge && idempotent && hedgeAfter.count() > 0) {
+        hedger.expires_from_now(hedgeAfter);
+        hedger.async_wait([self](const std::error_code &error) {
+          if (!error) {
+            self->hedge();
+          }
+        });
+      }
+    }
+  }
+
+  /* Give up on the exchange without a word.
+   *
+   * For when the first attempt couldn't even be sent. No callbacks are called.
+   */
+  void abandon(void) {
+    std::lock_guard<mutex> l(lock);
+    settled = true;
+    cancel();
+  }
+
+  /* Keep track of an attempt.
+   * @connection The connection the attempt was queued on.
+   * @callOff Calls off the attempt, if it's still waiting for a reply.
+   *
+   * Set up by the sender for every attempt, so that hedges can go to other
+   * connections, and so that attempts that are still waiting for a reply
+   * don't keep holding up their connections once the exchange is settled.
+   * <callOff> must not keep the exchange alive, and must leave the attempt
+   * alone if it already got its reply.
+   */
+  void placed(const void *connection, std::function<void(void)> callOff) {
+    std::lock_guard<mutex> l(lock);
+    if (!settled) {
+      placements.push_back({connection, callOff});
+    }
+  }
+
+  /* Set function to call upon success.
+   * @pCallback The callback.
+   */
+  void success(callback pCallback) {
+    std::lock_guard<mutex> l(lock);
+    onSuccess = pCallback;
+  }
+
+  /* Set function to call upon failure.
+   * @pCallback The callback.
+   */
+  void failure(callback pCallback) {
+    std::lock_guard<mutex> l(lock);
+    onFailure = pCallback;
+  }
+
+  /* Whether the exchange is done.
+   *
+   * Attempts that haven't been sent yet don't need to be, once it is.
+   *
+   * @return `true` if there was a reply, or the exchange was given up on.
+   */
+  bool done(void) const {
+    std::lock_guard<mutex> l(lock);
+    return settled;
+  }
+
+  /* Report how an attempt went.
+   * @replied Whether there was a reply at all.
+   * @good Whether the reply was good.
+   * @sess The session with the reply, if any.
+   *
+   * Settles the exchange with the first reply, or with the last failure if
+   * there's nothing left to try. Otherwise, retries after the backoff.
+   */
+  void complete(bool replied, bool good, sessionData &sess) {
+    std::vector<placement> attempts;
+    callback cb;
+
+    {
+      std::lock_guard<mutex> l(lock);
+
+      outstanding--;
+
+      if (settled || (!replied && outstanding > 0)) {
+        // either somebody else got here first, or there's another attempt
+        // that may still work out.
+        return;
+      } else if (!replied && idempotent && retries > 0) {
+        retries--;
+        pool.retried++;
+        retry();
+        return;
+      }
+
+      settled = true;
+      cb = good ? onSuccess : onFailure;
+      attempts.swap(placements);
+      cancel();
+
+      if (replied) {
+        pool.sample(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started));
+      }
+    }
+
+    if (cb) {
+      cb(sess);
+    }
+
+    // the attempt that replied isn't waiting anymore, so this only calls off
+    // the others.
+    for (const auto &a : attempts) {
+      a.callOff();
+    }
+  }
+
+ protected:
+  /* The pool with the limits to apply. */
+  http::pool &pool;
+
+  /* How to send an attempt. */
+  sender send;
+
+  /* Whether the request may be sent more than once. */
+  const bool idempotent;
+
+  /* How many retries are left. */
+  std::size_t retries;
+
+  /* When the exchange started. */
+  const std::chrono::steady_clock::time_point started;
+
+  /* Success callback. */
+  callback onSuccess;
+
+  /* Failure callback. */
+  callback onFailure;
+
+  /* How many attempts are queued or waiting for a reply. */
+  std::size_t outstanding = 0;
+
+  /* How many times the request was retried, for the backoff. */
+  std::size_t attempts = 0;
+
+  /* Whether the exchange is done. */
+  bool settled = false;
+
+  /* Whether a hedged attempt was sent. */
+  bool hedged = false;
+
+  /* Overall deadline. */
+  asio::steady_timer deadline;
+
+  /* Retry backoff timer. */
+  asio::steady_timer backoff;
+
+  /* Hedging timer. */
+  asio::steady_timer hedger;
+
+  /* Where an attempt was queued. */
+  struct placement {
+    /* The connection it was queued on. */
+    const void *connection;
+
+    /* How to call it off; see placed(). */
+    std::function<void(void)> callOff;
+  };
+
+  /* The attempts that were queued, oldest first; see placed(). */
+  std::vector<placement> placements;
+
+  /* Guards everything above, and the timers. */
+  mutable mutex lock;
+
+  /* Send another attempt.
+   * @avoid Connections not to send the attempt on.
+   *
+   * Fails the attempt right away if it can't be sent.
+   *
+   * @return Whether the attempt was sent.
+   */
+  bool attempt(const std::vector<const void *> &avoid = {}) {
+    {
+      std::lock_guard<mutex> l(lock);
+      if (settled) {
+        return false;
+      }
+      outstanding++;
+    }
+
+    if (!send(shared_from_this(), avoid)) {
+      static sessionData none;
+      complete(false, false, none);
+      return false;
+    }
+
+    return true;
+  }
+
+  /* Schedule a retry.
+   *
+   * Waits for the pool's backoff, doubled for every earlier retry and
+   * jittered by up to half either way. Needs <lock> to be held.
+   */
+  void retry(void) {
+    static thread_local std::minstd_rand random(std::random_device{}());
+    std::uniform_real_distribution<double> jitter(0.5, 1.5);
+    auto self = shared_from_this();
+    const auto delay =
+        pool.backoff * (1 << std::min<std::size_t>(attempts, 16)) *
+        jitter(random);
+
+    attempts++;
+    backoff.expires_from_now(
+        std::chrono::duration_cast<std::chrono::milliseconds>(delay));
+    backoff.async_wait([self](const std::error_code &error) {
+      if (!error) {
+        self->attempt();
+      }
+    });
+  }
+
+  /* Send a hedged attempt.
+   *
+   * Only if the first attempt is still the only one, and hasn't come back. The
+   * hedge goes to a different connection than the first attempt, as it would
+   * only be stuck behind it otherwise; if there's no other connection to be
+   * had, there's no hedge.
+   */
+  void hedge(void) {
+    std::vector<const void *> avoid;
+
+    {
+      std::lock_guard<mutex> l(lock);
+      if (settled || hedged || outstanding != 1) {
+        return;
+      }
+      hedged = true;
+      for (const auto &a : placements) {
+        avoid.push_back(a.connection);
+      }
+    }
+
+    if (attempt(avoid)) {
+      pool.hedged++;
+    }
+  }
+
+  /* Give up on the exchange.
+   *
+   * Called when the deadline passes. Fails the exchange, if nothing else has
+   * settled it yet, and calls off any attempts that are still out there.
+   */
+  void expire(void) {
+    static sessionData none;
+    std::vector<placement> attempts;
+    callback cb;
+
+    {
+      std::lock_guard<mutex> l(lock);
+      if (settled) {
+        return;
+      }
+      settled = true;
+      pool.timedOut++;
+      cb = onFailure;
+      attempts.swap(placements);
+      cancel();
+    }
+
+    if (cb) {
+      cb(none);
+    }
+
+    for (const auto &a : attempts) {
+      a.callOff();
+    }
+  }
+
+  /* Stop all timers.
+   *
+   * Also forgets about the attempts, as they're not needed anymore once the
+   * exchange is settled. Needs <lock> to be held.
+   */
+  void cancel(void) {
+    asio::error_code ec;
+    deadline.cancel(ec);
+    backoff.cancel(ec);
+    hedger.cancel(ec);
+    placements.clear();
+  }
+};
+}
+}
+
+#endif
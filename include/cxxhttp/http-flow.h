@@ -15,14 +15,20 @@
 #if !defined(CXXHTTP_HTTP_FLOW_H)
 #define CXXHTTP_HTTP_FLOW_H
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <functional>
 #include <system_error>
+#include <vector>
 
 #define ASIO_STANDALONE
 #include <asio.hpp>
 
 #include <cxxhttp/http-session.h>
 #include <cxxhttp/http-error.h>
+#include <cxxhttp/timer-wheel.h>
+#include <cxxhttp/tuning.h>
 
 namespace cxxhttp {
 namespace http {
@@ -90,6 +96,20 @@ class flow {
    */
   sessionData &session;
 
+  /* Session strand.
+   *
+   * All of the flow's handlers run through this, so that they never run at the
+   * same time, even if the I/O service is run on several threads.
+   */
+  asio::io_service::strand strand;
+
+  /* Deferred reply deadline.
+   *
+   * Armed while waiting for a deferred reply that has a timeout. Clients use
+   * it for the idle timeout, and while waiting for the status line of a reply.
+   */
+  asio::steady_timer deadline;
+
   /* Construct with I/O service.
    * @pProcessor Reference to the HTTP processor to use.
    * @service Which ASIO I/O service to bind to.
@@ -104,7 +124,32 @@ class flow {
       : processor(pProcessor),
         inputConnection(service),
         outputConnection(inputConnection),
-        session(pSession) {}
+        session(pSession),
+        strand(service),
+        deadline(service),
+        parked(false),
+        readParked(false),
+        offloading(false),
+        throttled(false),
+        corked(false),
+        turn(0),
+        wheel(asio::use_service<timerWheel<>>(service)),
+        readArmed(false),
+        writeArmed(false) {
+    session.notify = [this]() {
+      strand.dispatch(std::bind(&flow::resume, this));
+    };
+    session.post = [this](std::function<void(void)> fn) {
+      strand.dispatch(std::bind(&flow::handlePost, this, fn));
+    };
+    session.abort = [this]() { drain(true); };
+    readTimer.handler = [this]() {
+      strand.post(std::bind(&flow::handleReadTimeout, this));
+    };
+    writeTimer.handler = [this]() {
+      strand.post(std::bind(&flow::handleWriteTimeout, this));
+    };
+  }
 
   /* Construct with I/O service and input/output data.
    * @T Input and output connection parameter type.
@@ -124,28 +169,65 @@ class flow {
       : processor(pProcessor),
         inputConnection(service, pInput),
         outputConnection(service, pOutput),
-        session(pSession) {}
+        session(pSession),
+        strand(service),
+        deadline(service),
+        parked(false),
+        readParked(false),
+        offloading(false),
+        throttled(false),
+        corked(false),
+        turn(0),
+        wheel(asio::use_service<timerWheel<>>(service)),
+        readArmed(false),
+        writeArmed(false) {
+    session.notify = [this]() {
+      strand.dispatch(std::bind(&flow::resume, this));
+    };
+    session.post = [this](std::function<void(void)> fn) {
+      strand.dispatch(std::bind(&flow::handlePost, this, fn));
+    };
+    session.abort = [this]() { drain(true); };
+    readTimer.handler = [this]() {
+      strand.post(std::bind(&flow::handleReadTimeout, this));
+    };
+    writeTimer.handler = [this]() {
+      strand.post(std::bind(&flow::handleWriteTimeout, this));
+    };
+  }
 
   /* Destructor.
    *
    * Closes the descriptors, cancels all remaining requests and sets the status
    * to stShutdown.
    */
-  ~flow(void) { recycle(); }
+  ~flow(void) {
+    recycle();
+    wheel.cancel(readTimer);
+    wheel.cancel(writeTimer);
+  }
 
   /* Start processing.
    *
-   * Starts processing the incoming request.
+   * Starts processing the incoming request. This goes through the strand like
+   * everything else, as the reads that handleStart() issues may complete on
+   * another thread before it's returned.
    */
   void start(void) {
-    processor.start(session);
-    handleStart();
+    strand.dispatch([this]() {
+      processor.start(session);
+      handleStart();
+    });
   }
 
   /* Send the next message.
    *
    * Sends the next message in the <outboundQueue>, if there is one and no
-   * message is currently in flight.
+   * message is currently in flight. The message stays at the front of the
+   * queue until the write has finished, so that its buffer remains valid. With
+   * more messages behind it, such as the body after the head of a reply, the
+   * socket is corked if the processor's socket options say so, until the
+   * queue has been written.
    */
   void send(void) {
     if (session.status != stShutdown && !session.writePending) {
@@ -153,39 +235,166 @@ class flow {
         session.writePending = true;
         const std::string &msg = session.outboundQueue.front();
 
+        if (session.outboundQueue.size() > 1 && !corked &&
+            processor.socketOptions().cork) {
+          corked = net::cork(outputConnection.native_handle(), true);
+        }
+
+        armWrite(session.writeTimeout);
         asio::async_write(
             outputConnection, asio::buffer(msg),
-            std::bind(&flow::handleWrite, this, std::placeholders::_1));
-
-        session.outboundQueue.pop_front();
-      } else if (session.closeAfterSend) {
+            [this](const asio::error_code &error, std::size_t n) {
+              return progress(writeTimer, writeArmed, session.writeTimeout,
+                              error, n);
+            },
+            strand.wrap(
+                std::bind(&flow::handleWrite, this, std::placeholders::_1)));
+      } else if (session.closeAfterSend && !session.streaming) {
         recycle();
       }
     }
   }
 
+  /* Continue after out-of-band changes to the session.
+   *
+   * Used as the session's <notify> hook, through the <strand>, so it may be
+   * called from any thread. Sends whatever has been queued up in the meantime
+   * and, if the flow was parked waiting for a streamed reply or an offloaded
+   * handler to finish, resumes processing requests. Also continues reading a
+   * request body that was paused by a streaming servlet, and sends new
+   * requests on an idle client connection.
+   *
+   * Does nothing while an offloaded handler is running, as that has the session
+   * to itself; finishOffload() resumes once it's done.
+   */
+  void resume(void) {
+    if (offloading) {
+      return;
+    }
+
+    if (session.status == stIdle) {
+      session.status = processor.afterProcessing(session);
+      if (session.status != stIdle) {
+        deadline.cancel();
+        awaitStatus();
+      }
+    }
+
+    if (readParked && !session.contentPaused) {
+      readParked = false;
+      readContent();
+    }
+
+    if (parked && !busy()) {
+      parked = false;
+      deadline.cancel();
+      session.status = processor.afterProcessing(session);
+      handleStart();
+    } else {
+      send();
+    }
+  }
+
+  /* Wind down the connection.
+   * @force Whether to close the connection right away.
+   *
+   * Makes the reply to the current request the last one on the connection,
+   * and closes it once that's been sent. Connections that are waiting for a
+   * request, or that have stopped reading requests, are closed as soon as
+   * they have nothing left to send.
+   *
+   * If `force` is set, the connection is closed right away instead, unless an
+   * offloaded handler is using the session; that gets to finish its reply.
+   * May be called from any thread.
+   */
+  void drain(bool force = false) {
+    strand.dispatch([this, force]() {
+      if (session.status == stShutdown) {
+        return;
+      }
+
+      session.draining = true;
+
+      if (force && !offloading) {
+        recycle();
+      } else if (session.status == stRequest &&
+                 (session.input.size() == 0 || throttled)) {
+        session.closeAfterSend = true;
+        send();
+      }
+    });
+  }
+
   /* Read enough off the input socket to fill a line.
    *
    * Issue a read that will make sure there's at least one full line available
-   * for processing in the input buffer.
+   * for processing in the input buffer. If there already is one, it's handled
+   * right away instead, unless the session has used up its turn; then the
+   * flow yields to other sessions first, and carries on after them.
    */
   void readLine(void) {
-    asio::async_read_until(
-        inputConnection, session.input, "\n",
-        std::bind(&flow::handleRead, this, std::placeholders::_1,
-                  std::placeholders::_2));
+    if (!lineBuffered()) {
+      turn = 0;
+      asio::async_read_until(
+          inputConnection, session.input, "\n",
+          strand.wrap(std::bind(&flow::handleRead, this, std::placeholders::_1,
+                                std::placeholders::_2)));
+    } else if (turn < session.turnLength) {
+      turn++;
+      handleRead(std::error_code(), 0);
+    } else {
+      turn = 0;
+      strand.post(std::bind(&flow::handleYield, this, session.generation));
+    }
   }
 
   /* Read remainder of the request body.
    *
    * Issues a read for anything left to read in the request body, if there's
    * anything left to read.
+   *
+   * If we know how long the body is going to be, the rest of it is read
+   * straight into the session's content, rather than going through the input
+   * buffer first. The content only grows by up to <contentStep> bytes per
+   * read, so that a client can't make us allocate a large buffer just by
+   * announcing a large body. For chunked, streamed or spilled bodies, this
+   * reads whatever is available right now into the input buffer.
    */
   void readRemainingContent(void) {
-    asio::async_read(inputConnection, session.input,
-                     asio::transfer_at_least(session.remainingBytes()),
-                     std::bind(&flow::handleRead, this, std::placeholders::_1,
-                               std::placeholders::_2));
+    if (!session.chunks.active() && !session.streamingContent && !spilling()) {
+      const std::size_t have = session.content.size();
+      const std::size_t remaining = session.remainingBytes();
+      const std::size_t step = remaining < contentStep ? remaining : contentStep;
+
+      session.content.resize(have + step);
+
+      asio::async_read(
+          inputConnection, asio::buffer(&session.content[have], step),
+          [this](const asio::error_code &error, std::size_t n) {
+            return progress(readTimer, readArmed, session.bodyTimeout, error,
+                            n);
+          },
+          strand.wrap(std::bind(&flow::handleReadContent, this,
+                                std::placeholders::_1, std::placeholders::_2)));
+    } else {
+      asio::async_read(
+          inputConnection, session.input, asio::transfer_at_least(1),
+          strand.wrap(std::bind(&flow::handleRead, this, std::placeholders::_1,
+                                std::placeholders::_2)));
+    }
+  }
+
+  /* Read more of the message body.
+   *
+   * Chunked bodies need a full line to continue, unless we're in the middle of
+   * a chunk; everything else just needs more data.
+   */
+  void readContent(void) {
+    if (session.chunks.active() && session.chunks.state != chunked::ckData) {
+      readLine();
+    } else {
+      readRemainingContent();
+    }
   }
 
   /* Make session reusable for future use.
@@ -200,10 +409,32 @@ class flow {
       session.status = stShutdown;
 
       session.closeAfterSend = false;
-      session.outboundQueue.clear();
+      session.draining = false;
+      session.clearOutbound();
+
+      session.streaming = false;
+      session.congested = false;
+      session.onDrain = nullptr;
+      parked = false;
+      throttled = false;
+      corked = false;
+
+      session.streamingContent = false;
+      session.contentPaused = false;
+      session.onContent = nullptr;
+      readParked = false;
+
+      session.contentFile.close();
+      session.offload = nullptr;
+      session.awaiting = false;
+      session.generation++;
 
       asio::error_code ec;
 
+      deadline.cancel(ec);
+      armRead(std::chrono::milliseconds(0));
+      armWrite(std::chrono::milliseconds(0));
+
       maybeShutdown(inputConnection, ec);
       inputConnection.close(ec);
 
@@ -221,18 +452,415 @@ class flow {
       session.input.consume(session.input.size() + 1);
 
       session.free = true;
+
+      if (session.onRecycle) {
+        session.onRecycle();
+      }
     }
   }
 
  protected:
+  /* Whether we're waiting for a reply to finish.
+   *
+   * Set when a request has been handled, but its reply is still being
+   * streamed. No further requests are read until it's done.
+   */
+  bool parked;
+
+  /* Whether the message body goes to disk.
+   *
+   * This is the case if the body is larger than the session's spill
+   * threshold, or known to become larger than that.
+   *
+   * @return `true` if the body should be written to the session's content
+   * file.
+   */
+  bool spilling(void) const {
+    return session.spillThreshold > 0 &&
+           (session.contentFile.active() ||
+            session.contentLength > session.spillThreshold ||
+            session.content.size() > session.spillThreshold);
+  }
+
+  /* Largest read into the session's content.
+   *
+   * Bodies with a known length are read in steps of at most this many bytes.
+   */
+  static const std::size_t contentStep = 64 * 1024;
+
+  /* Whether we've stopped reading a request body.
+   *
+   * Set when the flow would have read more of the body, but the session had
+   * its <contentPaused> flag set.
+   */
+  bool readParked;
+
+  /* Whether an offloaded handler is running.
+   *
+   * The handler has the session to itself while this is set, so the flow must
+   * not touch it.
+   */
+  bool offloading;
+
+  /* Callbacks held back while an offloaded handler is running.
+   *
+   * Anything that is passed to the session's <post> hook in the meantime, e.g.
+   * by a deferred reply, is only run once the handler is done.
+   */
+  std::vector<std::function<void(void)>> held;
+
+  /* Whether we've stopped reading requests.
+   *
+   * Set when the next request would have been read, but the client has too
+   * much of its earlier replies left to read; see backlogged().
+   */
+  bool throttled;
+
+  /* Whether the output is corked.
+   *
+   * Set by send() while it writes more than one message in a row.
+   */
+  bool corked;
+
+  /* Lines handled in the current turn.
+   *
+   * Counts the lines that readLine() took from the input buffer without going
+   * back to the I/O service; see <sessionData::turnLength>.
+   */
+  std::size_t turn;
+
+  /* Whether there's a full line in the input buffer.
+   *
+   * @return `true` if readLine() has nothing to wait for.
+   */
+  bool lineBuffered(void) const {
+    const char *data = asio::buffer_cast<const char *>(session.input.data());
+    return std::memchr(data, '\n', session.input.size()) != nullptr;
+  }
+
+  /* Continue reading after yielding.
+   * @generation The session's generation when the flow yielded.
+   *
+   * Does nothing if the session has been recycled in the meantime.
+   */
+  void handleYield(std::size_t generation) {
+    if (session.generation == generation && session.status != stShutdown) {
+      readLine();
+    }
+  }
+
+  /* Whether the client is falling behind on its replies.
+   *
+   * That's when the session's queue has reached its high watermark, or when
+   * it has anything queued up at all while the shared budget is used up.
+   * Reading more requests would only pile up more replies.
+   *
+   * @return `true` if the flow should hold off on reading requests.
+   */
+  bool backlogged(void) const {
+    return session.outboundBytes >= session.highWatermark ||
+           (session.outboundBytes > 0 && session.overBudget());
+  }
+
+  /* Whether the client has caught up on its replies.
+   *
+   * Once everything has been sent, nothing else would pick up reading again,
+   * so the shared budget only counts while there's still something queued.
+   *
+   * @return `true` if a throttled flow can read requests again.
+   */
+  bool drained(void) const {
+    return session.outboundBytes == 0 ||
+           (session.outboundBytes <= session.lowWatermark &&
+            !session.overBudget());
+  }
+
+  /* The I/O service's timer wheel.
+   *
+   * Keeps the connection timeouts, which are checked far too rarely to be
+   * worth a timer per session.
+   */
+  timerWheel<> &wheel;
+
+  /* Read timeout.
+   *
+   * Covers the wait for the next request, the request's head and progress on
+   * its body, in turn.
+   */
+  timerWheel<>::entry readTimer;
+
+  /* Write timeout.
+   *
+   * Covers progress on the message that's being sent.
+   */
+  timerWheel<>::entry writeTimer;
+
+  /* Whether <readTimer> is meant to be running. */
+  bool readArmed;
+
+  /* Whether <writeTimer> is meant to be running. */
+  bool writeArmed;
+
+  /* Start or stop the read timeout.
+   * @timeout How long to allow for; zero stops the timeout.
+   */
+  void armRead(std::chrono::milliseconds timeout) {
+    arm(readTimer, readArmed, timeout);
+  }
+
+  /* Start or stop the write timeout.
+   * @timeout How long to allow for; zero stops the timeout.
+   */
+  void armWrite(std::chrono::milliseconds timeout) {
+    arm(writeTimer, writeArmed, timeout);
+  }
+
+  /* Start or stop a timeout.
+   * @timer The timeout.
+   * @armed Whether the timeout is meant to be running.
+   * @timeout How long to allow for; zero stops the timeout.
+   *
+   * Leaves the wheel alone if there's nothing to stop.
+   */
+  void arm(timerWheel<>::entry &timer, bool &armed,
+           std::chrono::milliseconds timeout) {
+    if (timeout.count() > 0) {
+      armed = true;
+      wheel.schedule(timer, timeout);
+    } else if (armed) {
+      armed = false;
+      wheel.cancel(timer);
+    }
+  }
+
+  /* Restart a timeout after some progress.
+   * @timer The timeout.
+   * @armed Whether the timeout is meant to be running.
+   * @timeout How long to allow for.
+   * @error Current error state.
+   * @n How much has been transferred so far.
+   *
+   * Used as the completion condition for reads and writes that may take a
+   * while, so that their timeouts only go off if they stall.
+   *
+   * @return How much to transfer next, as for asio::transfer_all().
+   */
+  std::size_t progress(timerWheel<>::entry &timer, const bool &armed,
+                       std::chrono::milliseconds timeout,
+                       const asio::error_code &error, std::size_t n) {
+    if (!error && n > 0 && armed) {
+      wheel.schedule(timer, timeout);
+    }
+    return asio::transfer_all()(error, n);
+  }
+
+  /* Close the connection after a read timeout.
+   *
+   * Unless the timeout was stopped or restarted after it went off, or an
+   * offloaded handler is still using the session.
+   */
+  void handleReadTimeout(void) {
+    if (readArmed && !wheel.pending(readTimer) && !offloading) {
+      readArmed = false;
+      recycle();
+    }
+  }
+
+  /* Close the connection after a write timeout.
+   *
+   * Unless the timeout was stopped or restarted after it went off, or an
+   * offloaded handler is still using the session.
+   */
+  void handleWriteTimeout(void) {
+    if (writeArmed && !wheel.pending(writeTimer) && !offloading) {
+      writeArmed = false;
+      recycle();
+    }
+  }
+
+  /* Whether the current request is still being worked on.
+   *
+   * That's the case while its reply is being streamed or has been deferred,
+   * or while its handler is waiting to be offloaded or running on a worker
+   * thread.
+   *
+   * @return `true` if the flow should stay parked.
+   */
+  bool busy(void) const {
+    return session.streaming || session.awaiting || session.offload ||
+           offloading;
+  }
+
+  /* Start waiting for a deferred reply.
+   *
+   * Arms the <deadline>, if the handler deferred its reply and asked for a
+   * timeout.
+   */
+  void awaitReply(void) {
+    if (session.awaiting && session.replyTimeout.count() > 0) {
+      deadline.expires_from_now(session.replyTimeout);
+      deadline.async_wait(
+          strand.wrap(std::bind(&flow::handleDeadline, this,
+                                std::placeholders::_1, session.generation)));
+    }
+  }
+
+  /* Give up on a deferred reply.
+   * @error Current error state.
+   * @generation The session's generation when the deadline was armed.
+   *
+   * Replies with a 504 if the deferred reply still hasn't come in, and then
+   * carries on with the next request. Any reply that comes in later is
+   * dropped.
+   */
+  void handleDeadline(const std::error_code &error, std::size_t generation) {
+    if (!error && session.awaiting && session.generation == generation) {
+      session.awaiting = false;
+      http::error(session).reply(504);
+      resume();
+    }
+  }
+
+  /* Hand the request's handler to a worker thread.
+   *
+   * Only called when there's no write in flight, as the handler gets to use
+   * the session on its own. Replies with a 503 if the worker pool is full.
+   */
+  void startOffload(void) {
+    auto offload = std::move(session.offload);
+    session.offload = nullptr;
+    offloading = true;
+
+    if (!offload([this]() {
+          strand.post(std::bind(&flow::finishOffload, this));
+        })) {
+      offloading = false;
+      http::error(session).reply(503);
+      resume();
+    }
+  }
+
+  /* Continue after an offloaded handler is done.
+   *
+   * Posted to the <strand> by the worker thread that ran the handler. Runs
+   * anything that was posted to the session while the handler was running,
+   * then sends whatever the handler queued up.
+   */
+  void finishOffload(void) {
+    offloading = false;
+    session.contentFile.close();
+
+    std::vector<std::function<void(void)>> pending;
+    pending.swap(held);
+    for (const auto &fn : pending) {
+      fn();
+    }
+
+    awaitReply();
+    resume();
+  }
+
+  /* Run something that was passed to the session's <post> hook.
+   * @fn What to run.
+   *
+   * Runs on the <strand>, but holds `fn` back while an offloaded handler is
+   * using the session.
+   */
+  void handlePost(std::function<void(void)> fn) {
+    if (offloading) {
+      held.push_back(fn);
+    } else {
+      fn();
+    }
+  }
+
+  /* Keep an idle client connection open.
+   *
+   * Reads on, so we notice if the server closes the connection; the next reply
+   * also comes in through that read, once a new request has been sent. Closes
+   * the connection if it's still idle after the session's <idleTimeout>.
+   */
+  void idle(void) {
+    readLine();
+
+    if (session.idleTimeout.count() > 0) {
+      deadline.expires_from_now(session.idleTimeout);
+      deadline.async_wait(
+          strand.wrap(std::bind(&flow::handleIdleTimeout, this,
+                                std::placeholders::_1, session.generation)));
+    }
+  }
+
+  /* Start waiting for the status line of a reply.
+   *
+   * Arms the <deadline>, if the session has a <firstByteTimeout>. The read for
+   * the status line is issued separately.
+   */
+  void awaitStatus(void) {
+    if (session.status == stStatus && session.firstByteTimeout.count() > 0) {
+      deadline.expires_from_now(session.firstByteTimeout);
+      deadline.async_wait(
+          strand.wrap(std::bind(&flow::handleFirstByteTimeout, this,
+                                std::placeholders::_1, session.generation)));
+    }
+  }
+
+  /* Give up on a reply that hasn't started.
+   * @error Current error state.
+   * @generation The session's generation when the timeout was armed.
+   *
+   * Closes the connection, which fails any requests that are still waiting for
+   * a reply on it.
+   */
+  void handleFirstByteTimeout(const std::error_code &error,
+                              std::size_t generation) {
+    if (!error && session.status == stStatus &&
+        session.generation == generation) {
+      recycle();
+    }
+  }
+
+  /* Close an idle client connection.
+   * @error Current error state.
+   * @generation The session's generation when the timeout was armed.
+   */
+  void handleIdleTimeout(const std::error_code &error,
+                         std::size_t generation) {
+    if (!error && session.status == stIdle &&
+        session.generation == generation) {
+      recycle();
+    }
+  }
+
   /* Decide what to do after an initial setup.
    *
    * This does what start() does after telling the processor to get going. We
    * also need this after processing an individual request.
    */
   void handleStart(void) {
+    if (session.status == stRequest && session.draining) {
+      // the last reply has been queued up, so there's nothing left to read.
+      session.closeAfterSend = true;
+      send();
+      return;
+    }
+
+    if (session.status == stRequest && backlogged()) {
+      // the write timeout takes care of clients that stop reading altogether.
+      throttled = true;
+      send();
+      return;
+    }
+
+    if (session.status == stRequest) {
+      armRead(session.idleTimeout);
+    }
+
     if (session.status == stRequest || session.status == stStatus) {
       readLine();
+      awaitStatus();
+    } else if (session.status == stIdle) {
+      idle();
     } else if (session.status == stShutdown) {
       recycle();
     }
@@ -252,7 +880,9 @@ class flow {
   void handleRead(const std::error_code &error, std::size_t length) {
     if (session.status == stShutdown) {
       return;
-    } else if (error) {
+    } else if (error || session.status == stIdle) {
+      // servers don't get to say anything on an idle connection, other than
+      // closing it.
       session.status = stError;
     }
 
@@ -266,6 +896,7 @@ class flow {
       session.status = session.inboundRequest.valid() ? stHeader : stError;
       version = session.inboundRequest.version;
     } else if (session.status == stStatus) {
+      deadline.cancel();
       session.inboundStatus = session.buffer();
       session.status = session.inboundStatus.valid() ? stHeader : stError;
       version = session.inboundStatus.version;
@@ -276,9 +907,15 @@ class flow {
       if (session.inbound.complete) {
         // we're done parsing headers, so change over to streaming in the
         // results.
+        session.content.clear();
+        session.contentOffset = 0;
+        session.streamingContent = false;
+        session.contentPaused = false;
+        session.onContent = nullptr;
+        session.contentFile.close();
+        session.generation++;
         session.status = processor.afterHeaders(session);
         send();
-        session.content.clear();
       }
     }
 
@@ -299,25 +936,164 @@ class flow {
       session.status = stProcessing;
     }
 
+    if (wasRequest && session.status == stHeader) {
+      // the request has started, so the rest of its head has to follow soon.
+      armRead(session.headerTimeout);
+    } else if (session.status == stContent) {
+      armRead(session.bodyTimeout);
+    }
+
     if (session.status == stHeader) {
       readLine();
+    } else if (session.status == stContent && session.chunks.active()) {
+      handleChunks();
     } else if (session.status == stContent) {
-      session.content += session.buffer();
-      if (session.remainingBytes() == 0) {
-        session.status = stProcessing;
+      // take whatever part of the body is already in the input buffer; the
+      // rest of it is read straight into the content.
+      const std::size_t n =
+          std::min(session.remainingBytes(), session.input.size());
+      session.content.append(
+          asio::buffer_cast<const char *>(session.input.data()), n);
+      session.input.consume(n);
+      handleBody(session.remainingBytes() == 0);
+    }
 
-        /* processing the request takes place here */
-        processor.handle(session);
+    if (session.status == stError) {
+      recycle();
+    }
+  }
 
-        session.status = processor.afterProcessing(session);
-        handleStart();
-      } else {
-        readRemainingContent();
+  /* Callback after reading more of a message body.
+   * @error Current error state.
+   * @length Length of the read; ignored.
+   *
+   * Called by ASIO once the next part of a body with a known length has been
+   * read directly into the session's content.
+   */
+  void handleReadContent(const std::error_code &error, std::size_t length) {
+    if (session.status == stShutdown) {
+      return;
+    } else if (error) {
+      session.status = stError;
+      recycle();
+    } else {
+      handleBody(session.remainingBytes() == 0);
+    }
+  }
+
+  /* Deal with newly read parts of the message body.
+   * @complete Whether the body has been read in full.
+   *
+   * Streamed bodies are passed on to the session's <onContent> callback right
+   * away, and then dropped; large bodies may be moved to disk. Other bodies
+   * keep piling up in the session until they're complete.
+   */
+  void handleBody(bool complete) {
+    if (session.streamingContent) {
+      if (session.onContent && (complete || !session.content.empty())) {
+        session.onContent(session);
       }
+      session.contentOffset += session.content.size();
+      session.content.clear();
+    } else if (spilling()) {
+      if ((!session.contentFile.active() && !session.contentFile.open()) ||
+          !session.contentFile.write(session.content)) {
+        failContent(500);
+        return;
+      }
+      session.contentOffset += session.content.size();
+      session.content.clear();
     }
 
-    if (session.status == stError) {
-      recycle();
+    if (complete) {
+      handleContent();
+    } else if (session.contentPaused) {
+      readParked = true;
+    } else {
+      readContent();
+    }
+  }
+
+  /* Process a complete request.
+   *
+   * Called once the full message body has been read. Hands the message to the
+   * processor, unless it has already been handled while streaming the body,
+   * then decides what to do next.
+   */
+  void handleContent(void) {
+    session.status = stProcessing;
+    armRead(std::chrono::milliseconds(0));
+
+    /* processing the request takes place here */
+    if (!session.streamingContent) {
+      processor.handle(session);
+    }
+
+    if (session.offload) {
+      // the handler still needs to run, and may want the body, so hold on to
+      // the body and the connection until it's done; it can only start once
+      // earlier replies have been written, as it'll have the session to itself.
+      parked = true;
+      if (!session.writePending) {
+        startOffload();
+      }
+      return;
+    }
+
+    // spilled bodies are only available while the request is being handled.
+    session.contentFile.close();
+
+    if (busy()) {
+      // the reply is still being streamed, or will only be sent later, so wait
+      // for it to finish before doing anything else.
+      parked = true;
+      awaitReply();
+      send();
+    } else {
+      session.status = processor.afterProcessing(session);
+      handleStart();
+    }
+  }
+
+  /* Decode chunked message body.
+   *
+   * Decodes whatever is in the input buffer directly into the session's
+   * content, then either processes the message or reads more, depending on
+   * where the decoder is at.
+   *
+   * If the body turns out to be malformed or too large, servers reply with an
+   * error and close the connection afterwards.
+   */
+  void handleChunks(void) {
+    const char *data = asio::buffer_cast<const char *>(session.input.data());
+    session.input.consume(
+        session.chunks.absorb(data, session.input.size(), session.content));
+
+    switch (session.chunks.state) {
+      case chunked::ckError:
+      case chunked::ckOverflow:
+        failContent(session.chunks.state == chunked::ckError ? 400 : 413);
+        break;
+      default:
+        handleBody(session.chunks.state == chunked::ckDone);
+    }
+  }
+
+  /* Give up on reading a message body.
+   * @status The HTTP status code that describes the problem.
+   *
+   * Servers reply with an error and close the connection afterwards; clients
+   * just close the connection.
+   */
+  void failContent(int status) {
+    armRead(std::chrono::milliseconds(0));
+
+    if (processor.listen()) {
+      http::error(session).reply(status);
+      session.status = stProcessing;
+      send();
+    } else {
+      session.status = stError;
     }
   }
 
@@ -332,12 +1108,36 @@ class flow {
    */
   void handleWrite(const std::error_code error) {
     session.writePending = false;
+    armWrite(std::chrono::milliseconds(0));
 
-    if (!error) {
-      if (session.status == stProcessing) {
+    if (!error && !session.outboundQueue.empty()) {
+      session.dequeue();
+
+      if (corked && session.outboundQueue.empty()) {
+        net::cork(outputConnection.native_handle(), false);
+        corked = false;
+      }
+
+      if (session.congested && session.outboundBytes <= session.lowWatermark) {
+        session.congested = false;
+        if (session.onDrain) {
+          session.onDrain(session);
+        }
+      }
+
+      if (session.status == stProcessing && !parked) {
         session.status = processor.afterProcessing(session);
       }
       send();
+
+      if (session.offload && !session.writePending) {
+        startOffload();
+      }
+
+      if (throttled && drained()) {
+        throttled = false;
+        handleStart();
+      }
     }
     if (error || session.status == stShutdown) {
       recycle();
@@ -0,0 +1,137 @@
+/* HTTP server connection limits.
+ *
+ * Caps on how many connections a server takes on at once, and what to do with
+ * the ones past that, and on how much the server holds on to for clients that
+ * don't read their replies.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_HTTP_LIMITS_H)
+#define CXXHTTP_HTTP_LIMITS_H
+
+#include <atomic>
+#include <string>
+
+#include <ef.gy/cli.h>
+#include <ef.gy/global.h>
+
+namespace cxxhttp {
+namespace http {
+/* Server connection limits.
+ *
+ * Every connection a server has open needs a session, and a file descriptor,
+ * so a sudden rush of clients can run a server out of either. With a limit in
+ * place, a server stops accepting connections once it has that many, and
+ * picks up where it left off when one of them is done; the backlog is left to
+ * the kernel, which turns clients away once that's full as well.
+ */
+class limits {
+ public:
+  /* Connection limit.
+   *
+   * How many connections each listening socket may have open at once. Zero
+   * means no limit.
+   */
+  std::size_t maxConnections = 0;
+
+  /* Whether to shed excess connections.
+   *
+   * If set, connections past the limit are still accepted, but they only get
+   * a canned 503 reply and are closed straight away, rather than waiting in
+   * the kernel's backlog. That keeps clients from hanging until they time out,
+   * at the cost of an accept() and a write() for each of them.
+   */
+  bool shed = false;
+
+  /* Outbound budget.
+   *
+   * How many bytes of replies the sessions of all servers with these limits
+   * may have queued up together. Once that's used up, sessions that still
+   * have replies to send stop reading requests, the same as they do when
+   * their own queue is over its high watermark. Zero means no limit.
+   */
+  std::size_t maxOutboundBytes = 0;
+
+  /* Number of reply bytes queued up.
+   *
+   * Across all sessions of the servers with these limits; kept up to date by
+   * the sessions themselves.
+   */
+  mutable std::atomic<std::size_t> outboundBytes{0};
+};
+
+/* Set the connection limit.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setMaxConnections(std::smatch &match) {
+  try {
+    efgy::global<limits>().maxConnections = std::stoul(match[1]);
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Connection limit CLI option.
+ *
+ * The format is `max-connections:(count)`. Needs to come before any servers on
+ * the command line.
+ */
+static efgy::cli::option connectionLimit(
+    "-{0,2}max-connections:([0-9]+)", setMaxConnections,
+    "stop accepting connections while [1] are open on a server socket");
+
+/* Set the outbound budget.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setOutboundBudget(std::smatch &match) {
+  try {
+    efgy::global<limits>().maxOutboundBytes = std::stoul(match[1]);
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Outbound budget CLI option.
+ *
+ * The format is `outbound-budget:(bytes)`.
+ */
+static efgy::cli::option outboundBudget(
+    "-{0,2}outbound-budget:([0-9]+)", setOutboundBudget,
+    "stop reading requests while [1] bytes of replies are waiting to be sent");
+
+/* Turn on connection shedding.
+ * @match The matches from the CLI option regex; ignored.
+ *
+ * @return `true` (always).
+ */
+static inline bool setShedConnections(std::smatch &match) {
+  efgy::global<limits>().shed = true;
+  return true;
+}
+
+/* Connection shedding CLI option.
+ *
+ * The format is `shed-connections`. Only has an effect with a connection
+ * limit.
+ */
+static efgy::cli::option connectionShedding(
+    "-{0,2}shed-connections", setShedConnections,
+    "reply with a 503 to connections over the limit, instead of not accepting "
+    "them");
+}
+}
+
+#endif
@@ -91,7 +91,16 @@ class session : public sessionData {
       : connection(pConnection),
         flow(connection.processor, connection.io, *this),
         socket(flow.inputConnection),
-        beacon(*this, connection.sessions) {}
+        beacon(*this, connection.sessions) {
+    onRecycle = [this]() { connection.release(this); };
+  }
+
+  /* Destructor.
+   *
+   * Only called by the connection, which holds its session lock while doing
+   * so, and doesn't need to be told about the flow recycling the session.
+   */
+  ~session(void) { onRecycle = nullptr; }
 
   /* Start processing.
    *
@@ -106,6 +115,13 @@ class session : public sessionData {
    */
   void recycle(void) { flow.recycle(); }
 
+  /* Wind down the connection.
+   * @force Whether to close the connection right away.
+   *
+   * Forwards to `flow.drain()`; used by the connection when it's drained.
+   */
+  void drain(bool force = false) { flow.drain(force); }
+
  protected:
   /* Session beacon.
    *
@@ -0,0 +1,469 @@
+/* HTTP client connection pool.
+ *
+ * Settings and statistics for keeping client connections open, so that later
+ * requests to the same host can reuse them.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_HTTP_POOL_H)
+#define CXXHTTP_HTTP_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <cxxhttp/network.h>
+
+namespace cxxhttp {
+namespace http {
+/* Client connection pool.
+ *
+ * Limits how many connections call() opens to any one host, and how many of
+ * those are kept open once they're done, and for how long. Requests to a host
+ * that already has as many connections as allowed wait for one of them.
+ *
+ * Also keeps count of what happened to the connections, so that services can
+ * tell whether the pool is large enough.
+ */
+class pool {
+ public:
+  /* Connection limit.
+   *
+   * How many connections to open to a single host at most.
+   */
+  std::size_t maxConnections = 8;
+
+  /* Idle connection limit.
+   *
+   * How many connections to a single host to keep open when there's nothing
+   * to send on them. Zero closes connections as soon as they're done.
+   */
+  std::size_t maxIdle = 4;
+
+  /* Idle connection timeout.
+   *
+   * How long to keep idle connections open, waiting for another request.
+   */
+  std::chrono::milliseconds idleTimeout = std::chrono::seconds(30);
+
+  /* Pipelining depth.
+   *
+   * How many requests to send on a connection before the first reply has come
+   * in. Replies still come back in the order the requests were sent in, and if
+   * the connection is closed, every request that didn't get a reply fails. The
+   * default of one doesn't pipeline at all. Requests that aren't idempotent are
+   * never pipelined.
+   */
+  std::size_t pipeline = 1;
+
+  /* Connect timeout.
+   *
+   * How long to wait for a new connection to be established before giving up
+   * on it, and on the requests queued on it. Zero means no limit.
+   */
+  std::chrono::milliseconds connectTimeout{0};
+
+  /* First byte timeout.
+   *
+   * How long to wait for the reply to a request to start coming in, once the
+   * request has been sent. If that takes too long, the connection is closed.
+   * Zero means no limit.
+   */
+  std::chrono::milliseconds firstByteTimeout{0};
+
+  /* Total timeout.
+   *
+   * How long a call may take, from start to finish, including any retries.
+   * Zero means no limit.
+   */
+  std::chrono::milliseconds totalTimeout{0};
+
+  /* Retry limit.
+   *
+   * How many more times to try idempotent requests that failed without getting
+   * a reply, e.g. because the connection was closed or timed out.
+   */
+  std::size_t retries = 0;
+
+  /* Retry backoff.
+   *
+   * How long to wait before the first retry. Doubles with each further retry,
+   * and is jittered by up to half either way, so that retries of requests that
+   * failed at the same time don't all go out at the same time again.
+   */
+  std::chrono::milliseconds backoff{50};
+
+  /* Whether to hedge idempotent requests.
+   *
+   * If set, a second copy of a request is sent on another connection if the
+   * first one takes longer than <hedgeAfter>, and whichever reply comes in
+   * first is used.
+   */
+  bool hedge = false;
+
+  /* When to hedge requests.
+   *
+   * Zero uses the 95th percentile of recent request latencies, and doesn't
+   * hedge until there's enough of those.
+   */
+  std::chrono::milliseconds hedgeAfter{0};
+
+  /* Socket options for the pool's connections.
+   *
+   * Client connections that aren't pooled use the global pool's.
+   */
+  net::tuning socket;
+
+  /* Number of connections that were opened. */
+  std::atomic<std::size_t> opened{0};
+
+  /* Number of requests sent on an idle connection that was kept open. */
+  std::atomic<std::size_t> reused{0};
+
+  /* Number of requests that had to wait for a busy connection. */
+  std::atomic<std::size_t> queued{0};
+
+  /* Number of idle connections that were closed.
+   *
+   * That's because they timed out, or because the server closed them.
+   */
+  std::atomic<std::size_t> closed{0};
+
+  /* Number of requests that were retried. */
+  std::atomic<std::size_t> retried{0};
+
+  /* Number of requests that were hedged. */
+  std::atomic<std::size_t> hedged{0};
+
+  /* Number of calls that ran out of time. */
+  std::atomic<std::size_t> timedOut{0};
+
+  /* Record a request latency.
+   * @latency How long it took to get a reply to a request.
+   *
+   * Only the most recent latencies are kept, for percentile().
+   */
+  void sample(std::chrono::milliseconds latency) {
+    std::lock_guard<mutex> l(lock);
+
+    if (latencies.size() < window) {
+      latencies.push_back(latency);
+    } else {
+      latencies[next] = latency;
+    }
+    next = (next + 1) % window;
+  }
+
+  /* Get a recent latency percentile.
+   * @p The percentile, between 0 and 100.
+   *
+   * @return The latency that `p` percent of recent requests got a reply in, or
+   * zero if there haven't been enough requests to tell.
+   */
+  std::chrono::milliseconds percentile(std::size_t p) const {
+    std::vector<std::chrono::milliseconds> sorted;
+
+    {
+      std::lock_guard<mutex> l(lock);
+      if (latencies.size() < minimumSamples) {
+        return std::chrono::milliseconds(0);
+      }
+      sorted = latencies;
+    }
+
+    const std::size_t n = std::min(sorted.size() - 1, sorted.size() * p / 100);
+    std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+    return sorted[n];
+  }
+
+ protected:
+  /* How many latencies to keep. */
+  static const std::size_t window = 128;
+
+  /* How many latencies percentile() needs. */
+  static const std::size_t minimumSamples = 20;
+
+  /* Recent latencies, in no particular order. Guarded by <lock>. */
+  std::vector<std::chrono::milliseconds> latencies;
+
+  /* Where to put the next latency, once there's <window> of them. */
+  std::size_t next = 0;
+
+  /* Guards the latencies. */
+  mutable mutex lock;
+};
+
+/* Set the per-host connection limit.
+ * @match The matches from the CLI option regex.
+ *
+ * Sets the connection limit of the global client pool to the value in
+ * match[1]; at least one.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setPoolConnections(std::smatch &match) {
+  try {
+    efgy::global<pool>().maxConnections =
+        std::max<std::size_t>(1, std::stoul(match[1]));
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Per-host connection limit CLI option.
+ *
+ * The format is `client-connections:(count)`.
+ */
+static efgy::cli::option poolConnections(
+    "-{0,2}client-connections:([0-9]+)", setPoolConnections,
+    "open at most [1] client connections to any one host");
+
+/* Set the per-host idle connection limit.
+ * @match The matches from the CLI option regex.
+ *
+ * Sets the idle connection limit of the global client pool to the value in
+ * match[1].
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setPoolIdle(std::smatch &match) {
+  try {
+    efgy::global<pool>().maxIdle = std::stoul(match[1]);
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Per-host idle connection limit CLI option.
+ *
+ * The format is `client-idle:(count)`.
+ */
+static efgy::cli::option poolIdle(
+    "-{0,2}client-idle:([0-9]+)", setPoolIdle,
+    "keep at most [1] idle client connections open to any one host");
+
+/* Set the idle connection timeout.
+ * @match The matches from the CLI option regex.
+ *
+ * Sets the idle connection timeout of the global client pool to the number of
+ * seconds in match[1].
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setPoolTimeout(std::smatch &match) {
+  try {
+    efgy::global<pool>().idleTimeout =
+        std::chrono::seconds(std::stoul(match[1]));
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Idle connection timeout CLI option.
+ *
+ * The format is `client-idle-timeout:(seconds)`.
+ */
+static efgy::cli::option poolTimeout(
+    "-{0,2}client-idle-timeout:([0-9]+)", setPoolTimeout,
+    "close idle client connections after [1] seconds");
+
+/* Set the pipelining depth.
+ * @match The matches from the CLI option regex.
+ *
+ * Sets the pipelining depth of the global client pool to the value in
+ * match[1]; at least one.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setPoolPipeline(std::smatch &match) {
+  try {
+    efgy::global<pool>().pipeline =
+        std::max<std::size_t>(1, std::stoul(match[1]));
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Pipelining depth CLI option.
+ *
+ * The format is `client-pipeline:(count)`.
+ */
+static efgy::cli::option poolPipeline(
+    "-{0,2}client-pipeline:([0-9]+)", setPoolPipeline,
+    "send up to [1] requests on a client connection before the first reply");
+
+/* Parse a number of milliseconds.
+ * @value Where to put the result.
+ * @text The number, as a string.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setMilliseconds(std::chrono::milliseconds &value,
+                                   const std::string &text) {
+  try {
+    value = std::chrono::milliseconds(std::stoul(text));
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Set the connect timeout.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setConnectTimeout(std::smatch &match) {
+  return setMilliseconds(efgy::global<pool>().connectTimeout, match[1]);
+}
+
+/* Connect timeout CLI option.
+ *
+ * The format is `client-connect-timeout:(milliseconds)`.
+ */
+static efgy::cli::option poolConnectTimeout(
+    "-{0,2}client-connect-timeout:([0-9]+)", setConnectTimeout,
+    "give up on client connections that take [1] ms to connect");
+
+/* Set the first byte timeout.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setFirstByteTimeout(std::smatch &match) {
+  return setMilliseconds(efgy::global<pool>().firstByteTimeout, match[1]);
+}
+
+/* First byte timeout CLI option.
+ *
+ * The format is `client-first-byte-timeout:(milliseconds)`.
+ */
+static efgy::cli::option poolFirstByteTimeout(
+    "-{0,2}client-first-byte-timeout:([0-9]+)", setFirstByteTimeout,
+    "close client connections if a reply doesn't start within [1] ms");
+
+/* Set the total timeout.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setTotalTimeout(std::smatch &match) {
+  return setMilliseconds(efgy::global<pool>().totalTimeout, match[1]);
+}
+
+/* Total timeout CLI option.
+ *
+ * The format is `client-timeout:(milliseconds)`.
+ */
+static efgy::cli::option poolTotalTimeout(
+    "-{0,2}client-timeout:([0-9]+)", setTotalTimeout,
+    "fail client calls that take longer than [1] ms");
+
+/* Set the retry limit.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setRetries(std::smatch &match) {
+  try {
+    efgy::global<pool>().retries = std::stoul(match[1]);
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Retry limit CLI option.
+ *
+ * The format is `client-retries:(count)`.
+ */
+static efgy::cli::option poolRetries(
+    "-{0,2}client-retries:([0-9]+)", setRetries,
+    "retry idempotent client requests up to [1] times");
+
+/* Turn on hedging.
+ * @match The matches from the CLI option regex.
+ *
+ * Hedges idempotent requests after the number of milliseconds in match[2],
+ * or after the 95th percentile of recent latencies if that's not given.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setHedge(std::smatch &match) {
+  pool &p = efgy::global<pool>();
+  p.hedge = true;
+  return match[2].length() == 0 || setMilliseconds(p.hedgeAfter, match[2]);
+}
+
+/* Hedging CLI option.
+ *
+ * The format is `client-hedge`, or `client-hedge:(milliseconds)`.
+ */
+static efgy::cli::option poolHedge(
+    "-{0,2}client-hedge(:([0-9]+))?", setHedge,
+    "send idempotent client requests again if they're slow, after [2] ms");
+
+/* Turn on a TCP option for client connections.
+ * @match The matches from the CLI option regex.
+ *
+ * match[1] says which one; Fast Open uses the default queue length, which
+ * doesn't matter for clients.
+ *
+ * @return `true` (always).
+ */
+static inline bool setClientOption(std::smatch &match) {
+  net::tuning &t = efgy::global<pool>().socket;
+  if (match[1] == "nodelay") {
+    t.noDelay = true;
+  } else if (match[1] == "quickack") {
+    t.quickAck = true;
+  } else if (match[1] == "cork") {
+    t.cork = true;
+  } else {
+    t.fastOpen = 1;
+  }
+  return true;
+}
+
+/* Client TCP option CLI option.
+ *
+ * The format is `client-tcp-(nodelay|quickack|cork|fastopen)`.
+ */
+static efgy::cli::option clientTCP(
+    "-{0,2}client-tcp-(nodelay|quickack|cork|fastopen)", setClientOption,
+    "turn on TCP [1] for client connections");
+
+/* Set a buffer size for client connections.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setClientBuffer(std::smatch &match) {
+  net::tuning &t = efgy::global<pool>().socket;
+  return net::setSize(match[1] == "receive" ? t.receiveBuffer : t.sendBuffer,
+                      match[2]);
+}
+
+/* Client buffer size CLI option.
+ *
+ * The format is `client-(receive|send)-buffer:(bytes)`.
+ */
+static efgy::cli::option clientBuffer(
+    "-{0,2}client-(receive|send)-buffer:([0-9]+)", setClientBuffer,
+    "set client sockets' [1] buffer to [2] bytes");
+}
+}
+
+#endif
@@ -15,16 +15,25 @@
 #define CXXHTTP_HTTP_PROCESSOR_H
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <functional>
 #include <list>
+#include <vector>
 
 #include <cxxhttp/negotiate.h>
 #include <cxxhttp/network.h>
+#include <cxxhttp/workers.h>
 
 #include <cxxhttp/http-constants.h>
+#include <cxxhttp/http-deferred.h>
 #include <cxxhttp/http-error.h>
+#include <cxxhttp/http-exchange.h>
+#include <cxxhttp/http-limits.h>
+#include <cxxhttp/http-pool.h>
 #include <cxxhttp/http-servlet.h>
 #include <cxxhttp/http-session.h>
+#include <cxxhttp/http-timeouts.h>
 
 namespace cxxhttp {
 namespace http {
@@ -38,6 +47,32 @@ static const headers defaultServerHeaders{
     {"Server", identifier},
 };
 
+/* Parse a Content-Length value.
+ * @value The header value, as sent.
+ * @length Where to store the parsed length.
+ *
+ * Only accepts what RFC 7230 allows for, i.e. a plain run of digits; signs,
+ * lists and trailing garbage are rejected, as is anything that doesn't fit.
+ *
+ * @return `true` if the value was valid, in which case `length` is set.
+ */
+static inline bool parseContentLength(const std::string &value,
+                                      std::size_t &length) {
+  if (value.empty() ||
+      !std::all_of(value.begin(), value.end(),
+                   [](unsigned char c) { return std::isdigit(c); })) {
+    return false;
+  }
+
+  try {
+    length = std::stoull(value);
+  } catch (...) {
+    return false;
+  }
+
+  return true;
+}
+
 /* HTTP processors
  *
  * This namespace is reserved for HTTP "processors", which contain the logic to
@@ -74,6 +109,37 @@ class server {
    */
   efgy::beacons<http::servlet> servlets;
 
+  /* Worker pool.
+   *
+   * Where handlers of servlets with `offload` set are run. Defaults to the
+   * global pool, which is set up with the `workers` and `worker-queue` CLI
+   * options.
+   */
+  workers *pool = &efgy::global<workers>();
+
+  /* Connection timeouts.
+   *
+   * Defaults to the global settings, which are set up with the `idle-timeout`,
+   * `header-timeout`, `body-timeout` and `write-timeout` CLI options.
+   */
+  const http::timeouts *timeout = &efgy::global<http::timeouts>();
+
+  /* Connection limits.
+   *
+   * Defaults to the global settings, which are set up with the
+   * `max-connections` and `shed-connections` CLI options.
+   */
+  const http::limits *limit = &efgy::global<http::limits>();
+
+  /* Socket options.
+   *
+   * Defaults to the global settings, which are set up with the `tcp-...`,
+   * `receive-buffer`, `send-buffer` and `backlog` CLI options. The listening
+   * socket is set up when the server is created, so to change this for a
+   * particular server, use the setup function of the server's constructor.
+   */
+  const net::tuning *tune = &efgy::global<net::tuning>();
+
   /* Handle request
    * @sess The session object where the request was made.
    *
@@ -81,6 +147,14 @@ class server {
    * to be handled, this will go through the registered list of regexen, and for
    * all that match it will call the registered function, until one of them
    * returns and has sent a response.
+   *
+   * Requests for streaming servlets are handled right after their headers have
+   * been read, and only by streaming servlets; these count as having handled
+   * the request if they've set up an `onContent` callback. Handlers may also
+   * defer their reply by creating a deferredReply token.
+   *
+   * Handlers of servlets that are to be offloaded are not run here; instead,
+   * they're handed to the flow through the session's `offload` hook.
    */
   void handle(sessionData &sess) const {
     std::set<std::string> methods;
@@ -109,18 +183,23 @@ class server {
       methodSupported = methodSupported || methodMatch;
 
       if (resourceMatch) {
-        if (methodMatch) {
+        if (methodMatch && servlet->streamContent == sess.streamingContent) {
           sess.outbound = {defaultServerHeaders};
           badNegotiation =
               badNegotiation || !sess.negotiate(servlet->negotiations);
 
-          if (!badNegotiation) {
+          if (!badNegotiation && servlet->offload && !sess.streamingContent) {
+            sess.offload =
+                offloaded(sess, *servlet, resource, resourceAndQuery);
+            return;
+          } else if (!badNegotiation) {
             const std::size_t q = sess.queries();
             servlet->handler(sess, matches);
 
-            if (sess.queries() > q) {
-              // we've sent something back to the client, so no need to process
-              // any further.
+            if (sess.queries() > q || sess.onContent || sess.awaiting) {
+              // we've sent something back to the client, or will do so once
+              // the body is in or the reply has been deferred, so no need to
+              // process any further.
               return;
             }
           }
@@ -149,6 +228,52 @@ class server {
     }
   }
 
+  /* Prepare to run a handler on a worker thread.
+   * @sess The session where the request was made.
+   * @servlet The servlet whose handler to run.
+   * @resource The requested resource.
+   * @resourceAndQuery The requested resource, with the query string.
+   *
+   * The match results refer to the resource strings, so the worker needs its
+   * own copies of those, and matches them again. If the handler doesn't reply
+   * to the request, the client gets a 404, as other servlets don't get a say
+   * once the request has been offloaded; if it throws, the client gets a 500.
+   *
+   * @return A function to use as the session's `offload` hook.
+   */
+  std::function<bool(std::function<void(void)>)> offloaded(
+      sessionData &sess, const http::servlet &servlet,
+      const std::string &resource, const std::string &resourceAndQuery) const {
+    workers *p = pool;
+    const http::servlet *s = &servlet;
+
+    return [&sess, p, s, resource, resourceAndQuery](
+               std::function<void(void)> done) -> bool {
+      return p->submit([&sess, s, resource, resourceAndQuery, done]() {
+        const std::size_t q = sess.queries();
+        std::smatch matches;
+
+        if (!std::regex_match(resource, matches, s->resource)) {
+          std::regex_match(resourceAndQuery, matches, s->resource);
+        }
+
+        try {
+          s->handler(sess, matches);
+        } catch (...) {
+          if (sess.queries() == q) {
+            error(sess).reply(500);
+          }
+        }
+
+        if (sess.queries() == q && !sess.awaiting) {
+          error(sess).reply(404);
+        }
+
+        done();
+      });
+    };
+  }
+
   /* Decide whether to expect content or not.
    * @sess The session that just finished parsing headers.
    *
@@ -160,6 +285,11 @@ class server {
   enum status afterHeaders(sessionData &sess) const {
     const auto &cli = sess.inbound.header.find("Content-Length");
     const auto &exp = sess.inbound.header.find("Expect");
+    const auto &te = sess.inbound.header.find("Transfer-Encoding");
+    const http::servlet *policy = bodyPolicy(sess);
+    const std::size_t limit = policy != nullptr && policy->maxContentLength > 0
+                                  ? policy->maxContentLength
+                                  : maxContentLength;
 
     if (exp != sess.inbound.header.end()) {
       if (exp->second == "100-continue") {
@@ -170,15 +300,29 @@ class server {
       }
     }
 
-    if (cli != sess.inbound.header.end()) {
-      try {
-        sess.contentLength = std::stoi(cli->second);
-      } catch (...) {
+    sess.chunks = {};
+
+    if (te != sess.inbound.header.end() && cli != sess.inbound.header.end()) {
+      // RFC 7230, section 3.3.3: a request with both may be an attempt at
+      // request smuggling, so don't guess which of the two framings to use.
+      error(sess).reply(400);
+      return stError;
+    } else if (te != sess.inbound.header.end()) {
+      // we only know how to decode the plain chunked coding.
+      if (!chunked::only(te->second)) {
+        error(sess).reply(501);
+        return stError;
+      }
+
+      sess.contentLength = 0;
+      sess.chunks.start(limit);
+    } else if (cli != sess.inbound.header.end()) {
+      if (!parseContentLength(cli->second, sess.contentLength)) {
         error(sess).reply(400);
         return stError;
       }
 
-      if (sess.contentLength > maxContentLength) {
+      if (sess.contentLength > limit) {
         error(sess).reply(413);
         return stError;
       }
@@ -186,9 +330,46 @@ class server {
       sess.contentLength = 0;
     }
 
+    sess.spillThreshold = policy != nullptr ? policy->spillContent : 0;
+
+    if (policy != nullptr && policy->streamContent) {
+      sess.streamingContent = true;
+      handle(sess);
+    }
+
     return stContent;
   }
 
+  /* Find the body policy for a request.
+   * @sess The session that just finished parsing headers.
+   *
+   * Looks for a servlet with `streamContent` or `spillContent` set that
+   * matches the resource and method of the current request, so that we know
+   * how to read the body before it comes in.
+   *
+   * @return The first matching servlet with a body policy, or `nullptr` if
+   * there's none.
+   */
+  const http::servlet *bodyPolicy(const sessionData &sess) const {
+    const std::string resource = sess.inboundRequest.resource.path();
+    const std::string resourceAndQuery = sess.inboundRequest.resource.path() +
+                                         "?" +
+                                         sess.inboundRequest.resource.query();
+    const std::string &method = sess.inboundRequest.method;
+
+    for (const auto &servlet : servlets) {
+      if ((servlet->streamContent || servlet->spillContent > 0) &&
+          (std::regex_match(resource, servlet->resource) ||
+           std::regex_match(resourceAndQuery, servlet->resource)) &&
+          (std::regex_match(method, servlet->method) ||
+           (method == "HEAD" && std::regex_match("GET", servlet->method)))) {
+        return servlet;
+      }
+    }
+
+    return nullptr;
+  }
+
   /* Decide what to do after handling a request.
    * @sess The session, after a request was handled.
    *
@@ -205,9 +386,18 @@ class server {
    * Called by a specific session object to indicate that a session and
    * connection have now been established.
    *
-   * In the HTTP server case, we begin by reading.
+   * In the HTTP server case, we begin by reading, with the server's timeouts
+   * and outbound budget.
    */
-  void start(sessionData &sess) const { sess.status = afterProcessing(sess); }
+  void start(sessionData &sess) const {
+    sess.idleTimeout = timeout->idle;
+    sess.headerTimeout = timeout->header;
+    sess.bodyTimeout = timeout->body;
+    sess.writeTimeout = timeout->write;
+    sess.outboundTotal = &limit->outboundBytes;
+    sess.outboundBudget = limit->maxOutboundBytes;
+    sess.status = afterProcessing(sess);
+  }
 
   /* Whether to listen for a connection.
    *
@@ -217,6 +407,43 @@ class server {
    */
   static bool listen(void) { return true; }
 
+  /* How many sessions to accept at once.
+   *
+   * @return The connection limit; zero means no limit.
+   */
+  std::size_t maxSessions(void) const { return limit->maxConnections; }
+
+  /* Options for the server's sockets.
+   *
+   * @return The settings in <tune>.
+   */
+  const net::tuning &socketOptions(void) const { return *tune; }
+
+  /* What to send to connections over the limit.
+   *
+   * The reply is put together once and then reused, as it's needed most when
+   * the server is busiest.
+   *
+   * @return A 503 reply that closes the connection, or an empty string if
+   * connections over the limit should be left waiting instead.
+   */
+  const std::string &overloadReply(void) const {
+    static const std::string none;
+    static const std::string reply = []() {
+      const std::string body = "# " + statusLine::getDescription(503) +
+                               "\n\n"
+                               "The server is too busy to take on any more "
+                               "connections. Please try again later.\n";
+      parser<headers> head{{{"Content-Type", "text/markdown"},
+                            {"Content-Length", std::to_string(body.size())},
+                            {"Connection", "close"}}};
+      head.insert(defaultServerHeaders);
+      return std::string(statusLine(503)) + std::string(head) + "\r\n" + body;
+    }();
+
+    return limit->shed ? reply : none;
+  }
+
   /* Do stuff upon recycling a session.
    * @sess The session being recycled.
    *
@@ -259,6 +486,27 @@ struct request {
    * it.
    */
   std::string body;
+
+  /* Success callback.
+   *
+   * Called with the reply, if it came back with a good status. Set with the
+   * processor's success() or then().
+   */
+  std::function<void(sessionData &)> onSuccess;
+
+  /* Failure callback.
+   *
+   * Called with whatever came back, if anything, if the request failed. Set
+   * with the processor's failure() or then().
+   */
+  std::function<void(sessionData &)> onFailure;
+
+  /* The exchange this request is an attempt for, if any.
+   *
+   * If set, the exchange gets to decide what to do with the reply, instead of
+   * the callbacks above.
+   */
+  std::shared_ptr<http::exchange> exchange;
 };
 
 /* Basic client processor.
@@ -283,29 +531,56 @@ class client {
    */
   bool gotInformationalResponse = false;
 
+  /* Connection pool.
+   *
+   * Decides whether, and for how long, connections are kept open after their
+   * last request, and keeps count of that. Set by pooled(); connections that
+   * aren't pooled are closed as soon as they're done.
+   */
+  http::pool *pool = nullptr;
+
+  /* Pipelining depth.
+   *
+   * How many requests to send before the first reply has come in, on
+   * connections that aren't pooled; pooled ones use the pool's setting.
+   */
+  std::size_t pipeline = 1;
+
   /* Process result of request.
    * @sess The session with the fully processed request.
    *
    * Called once a request has been fully processed. Will dispatch to the
-   * callback that the user gave us.
+   * callback that the user gave us for the oldest request that was still
+   * waiting for its reply.
    */
   void handle(sessionData &sess) {
+    bool good = false;
+    std::function<void(sessionData &)> callback;
+    std::shared_ptr<http::exchange> ex;
+
     if (sess.inboundStatus.valid()) {
       if (sess.inboundStatus.code >= 100 && sess.inboundStatus.code < 200) {
         gotInformationalResponse = true;
         return;
       }
-      if (sess.inboundStatus.code >= 200 && sess.inboundStatus.code < 400) {
-        received++;
-        if (onSuccess) {
-          onSuccess(sess);
-        }
-        return;
+      good = sess.inboundStatus.code >= 200 && sess.inboundStatus.code < 400;
+    }
+
+    {
+      std::lock_guard<mutex> l(lock);
+      reusable = idle != nullptr && persistent(sess);
+      if (!inFlight.empty()) {
+        const request &req = inFlight.front();
+        callback = good ? req.onSuccess : req.onFailure;
+        ex = req.exchange;
+        inFlight.pop_front();
       }
     }
-    received++;
-    if (onFailure) {
-      onFailure(sess);
+
+    if (ex) {
+      ex->complete(true, good, sess);
+    } else if (callback) {
+      callback(sess);
     }
   }
 
@@ -318,6 +593,8 @@ class client {
    * @return The parser state to switch to.
    */
   enum status afterHeaders(sessionData &sess) const {
+    sess.chunks = {};
+
     if (sess.isHEAD) {
       // if this is a HEAD request, ignore any Content-Length headers and assume
       // the response size will be zero octets long.
@@ -327,11 +604,16 @@ class client {
       sess.contentLength = 0;
     } else {
       const auto &cli = sess.inbound.header.find("Content-Length");
+      const auto &te = sess.inbound.header.find("Transfer-Encoding");
 
-      if (cli != sess.inbound.header.end()) {
-        try {
-          sess.contentLength = std::stoi(cli->second);
-        } catch (...) {
+      if (te != sess.inbound.header.end()) {
+        sess.contentLength = 0;
+        if (!chunked::only(te->second)) {
+          return stError;
+        }
+        sess.chunks.start();
+      } else if (cli != sess.inbound.header.end()) {
+        if (!parseContentLength(cli->second, sess.contentLength)) {
           sess.contentLength = 0;
           return stError;
         }
@@ -347,7 +629,12 @@ class client {
    * @sess The session, after a request was handled.
    *
    * Decides what to do with an open connection to a server after the request
-   * has been processed.
+   * has been processed: send as many of the queued requests as the pipelining
+   * depth allows for, in a single write, and wait for the next reply, if there
+   * are any requests left, but only pipeline idempotent requests; or keep the connection open for later requests, if
+   * the pool and the server allow for that; or close it.
+   *
+   * Queued requests for exchanges that are already done are dropped here.
    *
    * @return The parser state to switch to.
    */
@@ -355,15 +642,55 @@ class client {
     if (gotInformationalResponse) {
       gotInformationalResponse = false;
       return stStatus;
-    } else if (requests.size() > 0) {
-      auto req = requests.front();
+    }
+
+    std::lock_guard<mutex> l(lock);
 
-      requests.pop_front();
+    const std::size_t depth =
+        std::max<std::size_t>(1, pool != nullptr ? pool->pipeline : pipeline);
+    std::size_t batch = 0;
+
+    while (!requests.empty() && inFlight.size() < depth) {
+      const request &req = requests.front();
+
+      if (req.exchange && req.exchange->done()) {
+        requests.pop_front();
+        continue;
+      }
+      // requests that aren't idempotent are sent on their own, as it's not
+      // safe to send them again if the connection is closed before the reply.
+      if (!inFlight.empty() &&
+          (!exchange::isIdempotent(req.method) ||
+           !exchange::isIdempotent(inFlight.back().method))) {
+        break;
+      }
+      if (waiting != nullptr) {
+        waiting = nullptr;
+        (*idle)--;
+      }
+      if (reusable) {
+        pool->reused++;
+      }
 
-      sent++;
       sess.request(req.method, req.resource, req.header, req.body);
+      inFlight.splice(inFlight.end(), requests, requests.begin());
+      batch++;
+    }
+
+    if (!inFlight.empty()) {
+      sess.coalesce(batch);
+      sess.firstByteTimeout = pool != nullptr ? pool->firstByteTimeout
+                                              : std::chrono::milliseconds(0);
+      // replies come back in order, so the next one is for the oldest request.
+      sess.isHEAD = inFlight.front().method == "HEAD";
       return stStatus;
+    } else if (waiting != nullptr || keepAlive()) {
+      waiting = &sess;
+      sess.idleTimeout = pool->idleTimeout;
+      return stIdle;
     } else {
+      // the connection is closing, so ready() must not hand it out anymore.
+      reusable = false;
       return stShutdown;
     }
   }
@@ -374,24 +701,110 @@ class client {
    * Pops a new request off the list of pending requests, and processes it, if
    * there is something to process.
    */
-  void start(sessionData &sess) { sess.status = afterProcessing(sess); }
+  void start(sessionData &sess) {
+    {
+      std::lock_guard<mutex> l(lock);
+      current = &sess;
+    }
+    sess.status = afterProcessing(sess);
+  }
+
+  /* Call off an exchange's attempt.
+   * @ex The exchange that was settled, e.g. by another attempt's reply, or
+   *     because it ran out of time.
+   *
+   * Attempts that are still queued are skipped anyway, as the exchange is
+   * done, but one that has been sent holds up the connection until its reply
+   * comes in, which may well be never. So if the exchange has an attempt in
+   * flight on this connection, the connection is closed, which fails or retries
+   * whatever else is still waiting on it. The check is done on the session's
+   * strand, so this may be called from any thread.
+   */
+  void callOff(std::shared_ptr<http::exchange> ex) {
+    sessionData *sess;
+
+    {
+      std::lock_guard<mutex> l(lock);
+      sess = current;
+    }
+
+    if (sess == nullptr || !sess->post) {
+      return;
+    }
+
+    sess->post([this, sess, ex]() {
+      bool stuck = false;
+
+      {
+        std::lock_guard<mutex> l(lock);
+        for (const auto &req : inFlight) {
+          stuck = stuck || (current == sess && req.exchange == ex);
+        }
+      }
+
+      if (stuck && sess->abort) {
+        sess->abort();
+      }
+    });
+  }
 
   /* Queue up things to do on this connection.
    * @method The method for the request. Use GET if you're not sure.
    * @resource The resource to query from the server.
    * @header Any additional headers to send.
    * @body The body of the request to send. Optional.
+   * @ex The exchange the request is an attempt for. Optional.
    *
-   * Enqueues a new query to run on this connection, as appropriate.
+   * Enqueues a new query to run on this connection, as appropriate. If the
+   * connection was being kept open with nothing to do, it's woken up to send
+   * the query right away.
    *
    * @return A reference to this object, for easier pipelining of requests.
    */
   client &query(const std::string &method, const std::string &resource,
-                const headers &header, const std::string &body = "") {
-    requests.push_back(request{method, resource, header, body});
+                const headers &header, const std::string &body = "",
+                std::shared_ptr<http::exchange> ex = nullptr) {
+    return resume(request{method, resource, header, body, {}, {}, ex});
+  }
+
+  /* Queue up a request from another connection.
+   * @req The request, as taken from the other connection with withdraw().
+   *
+   * Like query(), but keeps the callbacks that were already set up for the
+   * request.
+   *
+   * @return A reference to this object, for easier pipelining of requests.
+   */
+  client &resume(const request &req) {
+    sessionData *sess;
+
+    {
+      std::lock_guard<mutex> l(lock);
+      requests.push_back(req);
+      sess = waiting;
+    }
+
+    if (sess != nullptr && sess->notify) {
+      sess->notify();
+    }
+
     return *this;
   }
 
+  /* Take the requests that haven't been sent yet.
+   *
+   * So that they can be sent on another connection instead, with resume().
+   * Callbacks set after this don't apply to them anymore.
+   *
+   * @return The requests, in the order they were queued in.
+   */
+  std::list<request> withdraw(void) {
+    std::list<request> queued;
+    std::lock_guard<mutex> l(lock);
+    queued.swap(requests);
+    return queued;
+  }
+
   /* Set function to call upon completion.
    * @callback The post-completion callback.
    *
@@ -408,31 +821,45 @@ class client {
   /* Set function to call upon success.
    * @callback The post-completion callback.
    *
-   * The naming here is vaguely in line with the naming scheme used in recent
-   * JavaScript libraries.
+   * Applies to the most recently queued request, or to the one that was sent
+   * last if there's nothing queued; or to its exchange, if it has one.
    *
    * @return A reference to the object's instance, to allow for chaining of
    * function calls.
    */
   client &success(std::function<void(sessionData &)> callback) {
-    onSuccess = callback;
+    std::lock_guard<mutex> l(lock);
+    request *req = latest();
+    if (req != nullptr && req->exchange) {
+      req->exchange->success(callback);
+    } else if (req != nullptr) {
+      req->onSuccess = callback;
+    }
     return *this;
   }
 
   /* Set function to call upon failure.
    * @callback The post-completion callback.
    *
-   * The naming here is vaguely in line with the naming scheme used in recent
-   * JavaScript libraries.
+   * Applies to the most recently queued request, or to the one that was sent
+   * last if there's nothing queued; or to its exchange, if it has one.
    *
    * @return A reference to the object's instance, to allow for chaining of
    * function calls.
    */
   client &failure(std::function<void(sessionData &)> callback) {
-    onFailure = callback;
-    if (doFail && onFailure) {
+    {
+      std::lock_guard<mutex> l(lock);
+      request *req = latest();
+      if (req != nullptr && req->exchange) {
+        req->exchange->failure(callback);
+      } else if (req != nullptr) {
+        req->onFailure = callback;
+      }
+    }
+    if (doFail && callback) {
       static sessionData none;
-      onFailure(none);
+      callback(none);
     }
     return *this;
   }
@@ -445,59 +872,217 @@ class client {
    */
   static bool listen(void) { return false; }
 
+  /* How many sessions to accept at once.
+   *
+   * Clients don't accept connections, so there's no limit.
+   *
+   * @return Zero, for no limit.
+   */
+  static std::size_t maxSessions(void) { return 0; }
+
+  /* What to send to connections over the limit.
+   *
+   * @return An empty string, as clients are never over the limit.
+   */
+  static const std::string &overloadReply(void) {
+    static const std::string none;
+    return none;
+  }
+
+  /* Options for the client's socket.
+   *
+   * @return The pool's settings, or the global pool's if the connection isn't
+   * pooled.
+   */
+  const net::tuning &socketOptions(void) const {
+    std::lock_guard<mutex> l(lock);
+    return (pool != nullptr ? *pool : efgy::global<http::pool>()).socket;
+  }
+
+  /* Add to a connection pool.
+   * @pPool The pool to use.
+   * @pIdle Where to count the host's idle connections.
+   *
+   * Lets the connection stay open after its requests are done. Needs to be
+   * done again whenever the connection is started, as closing it drops the
+   * host's idle count.
+   */
+  void pooled(http::pool &pPool, std::atomic<std::size_t> &pIdle) {
+    std::lock_guard<mutex> l(lock);
+    pool = &pPool;
+    idle = &pIdle;
+  }
+
+  /* Whether the connection is open with nothing to do.
+   *
+   * That's the case if it's being kept open, or if the last reply has just come
+   * in and allows for keeping the connection open.
+   *
+   * @return `true` if a new query would be sent right away.
+   */
+  bool ready(void) const {
+    std::lock_guard<mutex> l(lock);
+    return requests.empty() && inFlight.empty() &&
+           (waiting != nullptr || reusable);
+  }
+
+  /* How busy the connection is.
+   *
+   * @return The number of requests that are queued or waiting for a reply.
+   */
+  std::size_t load(void) const {
+    std::lock_guard<mutex> l(lock);
+    return requests.size() + inFlight.size();
+  }
+
   /* Do stuff upon recycling a session.
    * @sess The session being recycled.
    *
    * Called right before the session is recycled, with a reference to the plain
-   * version of it.
+   * version of it. Any requests that didn't get a reply fail, in the order
+   * they were queued in; those with an exchange let it decide whether to try
+   * again.
    */
   void recycle(sessionData &sess) {
-    if (sent != received || requests.size() > 0) {
-      // if not all sent requests have gotten a response back, then inform the
-      // client here.
-      received = sent;
+    std::list<request> failed;
+
+    {
+      std::lock_guard<mutex> l(lock);
 
-      if (onFailure) {
-        onFailure(sess);
+      if (waiting != nullptr) {
+        waiting = nullptr;
+        (*idle)--;
+        pool->closed++;
       }
+      reusable = false;
+      current = nullptr;
+      // the host's entry may go away once the connection is idle, so this has
+      // to be set again by pooled() before the connection is used again.
+      idle = nullptr;
+
+      // requests that were sent but didn't get a reply fail, and so do those
+      // that never made it out.
+      failed.splice(failed.end(), inFlight);
+      failed.splice(failed.end(), requests);
     }
 
-    // do something here if we still had queries to send.
-    requests.clear();
+    for (const auto &req : failed) {
+      if (req.exchange) {
+        req.exchange->complete(false, false, sess);
+      } else if (req.onFailure) {
+        req.onFailure(sess);
+      }
+    }
   }
 
  protected:
-  /* Requests sent.
+  /* Request pool.
    *
-   * How many requests this processor has sent down the wire.
+   * Will be processed in sequence until either the connection is closed or the
+   * list is empty. This allows for pipelining on the client side.
    */
-  unsigned sent = 0;
+  std::list<request> requests;
 
-  /* Requests processed.
+  /* Requests that were sent, but didn't get a reply yet.
    *
-   * How many requests this processor has heard back from over the wire.
+   * Oldest first, which is the order that the replies come back in.
    */
-  unsigned received = 0;
+  std::list<request> inFlight;
 
-  /* Request pool.
+  /* Idle session.
    *
-   * Will be processed in sequence until either the connection is closed or the
-   * list is empty. This allows for pipelining on the client side.
+   * The session that's being kept open with nothing to send, if any.
    */
-  std::list<request> requests;
+  sessionData *waiting = nullptr;
 
-  /* Success callback.
+  /* Idle connection count for the host, when pooled. */
+  std::atomic<std::size_t> *idle = nullptr;
+
+  /* The session the requests are sent on.
    *
-   * Called when a server has returned something to one of our queries.
+   * Set when the connection is started, and cleared when it's closed.
    */
-  std::function<void(sessionData &)> onSuccess;
+  sessionData *current = nullptr;
 
-  /* Failure callback.
+  /* Whether the connection may be used for another request.
    *
-   * Called when being recycled without valid content, or whenever a non-good
-   * return status is encountered.
+   * Set when a reply comes in, if the connection is pooled and the reply
+   * doesn't ask for the connection to be closed. Cleared when the connection
+   * is closed.
    */
-  std::function<void(sessionData &)> onFailure;
+  bool reusable = false;
+
+  /* Request lock.
+   *
+   * Guards the request queues and the idle state, as requests may be queued up
+   * from any thread.
+   */
+  mutable mutex lock;
+
+  /* Get the request that callbacks apply to.
+   *
+   * Needs <lock> to be held.
+   *
+   * @return The most recently queued or sent request, or `nullptr` if there
+   * is none.
+   */
+  request *latest(void) {
+    if (!requests.empty()) {
+      return &requests.back();
+    } else if (!inFlight.empty()) {
+      return &inFlight.back();
+    }
+    return nullptr;
+  }
+
+  /* Whether a reply allows for further requests on the connection.
+   * @sess The session, with the reply.
+   *
+   * That's the case for HTTP/1.1 replies, unless the server asked for the
+   * connection to be closed.
+   *
+   * @return `true` if the connection may be kept open.
+   */
+  static bool persistent(const sessionData &sess) {
+    static const http::version minVersion{1, 1};
+
+    if (!sess.inboundStatus.valid() ||
+        sess.inboundStatus.version < minVersion) {
+      return false;
+    }
+
+    const auto &c = sess.inbound.header.find("Connection");
+    if (c != sess.inbound.header.end()) {
+      std::string value = c->second;
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      if (value.find("close") != std::string::npos) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /* Whether to keep the connection open.
+   *
+   * Called after the last reply came in. Only reusable connections are kept
+   * open, and only if the pool doesn't have too many idle connections to the
+   * host already. Counts the connection as idle if it's kept open.
+   *
+   * @return `true` if the connection should be kept open.
+   */
+  bool keepAlive(void) {
+    if (!reusable || pool->idleTimeout.count() <= 0) {
+      return false;
+    }
+
+    if ((*idle)++ >= pool->maxIdle) {
+      (*idle)--;
+      return false;
+    }
+
+    return true;
+  }
 };
 }
 }
@@ -141,6 +141,61 @@ class servlet {
    */
   const std::string description;
 
+  /* Stream the request body?
+   *
+   * By default, the whole request body is read into the session before the
+   * handler is invoked. If this is set, the handler is invoked as soon as the
+   * request headers are in, with an empty body. It should then set the
+   * session's `onContent` callback to receive the body as it comes in, or
+   * reply straight away; the body is discarded otherwise.
+   *
+   * This keeps memory use down for large uploads, and allows a handler to start
+   * working on a request before the whole body has been sent.
+   */
+  bool streamContent = false;
+
+  /* Maximum request body size.
+   *
+   * Overrides the processor's `maxContentLength` for this servlet, if set. As
+   * streamed or spilled bodies don't need to fit in memory, it makes sense to
+   * set this to a much larger value when using <streamContent> or
+   * <spillContent>. Only applies to servlets with either of those set, as the
+   * limit needs to be known before the body is read.
+   */
+  std::size_t maxContentLength = 0;
+
+  /* Spill large request bodies to disk?
+   *
+   * If set to anything but zero, request bodies larger than this many bytes
+   * are written to an anonymous temporary file as they come in, rather than
+   * being kept in memory. The handler is still invoked once the whole body has
+   * been read, but with an empty `content`; the body is available through the
+   * session's `contentFile` instead, which can be mapped into memory.
+   *
+   * Smaller bodies are passed in `content`, as usual.
+   */
+  std::size_t spillContent = 0;
+
+  /* Run the handler on a worker thread?
+   *
+   * By default, handlers run on the I/O thread that read the request, which
+   * holds up every other connection on that thread until the handler returns.
+   * If this is set, the handler is run on the global worker pool instead, and
+   * the connection waits for it without blocking anything else. The request is
+   * answered with a 503 if the pool's queue is full.
+   *
+   * Meant for handlers that take a while to come up with a reply, e.g. because
+   * they need a lot of CPU time. The handler has the session to itself while
+   * it runs, but must not use anything else that is tied to the I/O thread.
+   * The connection holds off on the session until the handler returns: only
+   * then is anything sent, including the start of a streamed reply, and only
+   * then do callbacks run that were passed to the session's `post` hook, e.g.
+   * by a deferred reply. A handler that streams its reply therefore has to
+   * return before it waits for `onDrain`.
+   * Ignored for servlets with <streamContent> set.
+   */
+  bool offload = false;
+
   /* Generate a description of the servlets.
    *
    * Creates a Markdown snippet using the method and resource regexen, along
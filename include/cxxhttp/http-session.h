@@ -15,14 +15,21 @@
 #if !defined(CXXHTTP_HTTP_SESSION_H)
 #define CXXHTTP_HTTP_SESSION_H
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <list>
+#include <memory>
 
 #include <cxxhttp/negotiate.h>
 #include <cxxhttp/network.h>
 #include <cxxhttp/version.h>
 
+#include <cxxhttp/http-chunked.h>
+#include <cxxhttp/http-encoding.h>
 #include <cxxhttp/http-header.h>
 #include <cxxhttp/http-request.h>
+#include <cxxhttp/http-spool.h>
 #include <cxxhttp/http-status.h>
 
 namespace cxxhttp {
@@ -33,6 +40,17 @@ namespace http {
  */
 static const headers sendNegotiatedAs{
     {"Accept", "Content-Type"},
+    {"Accept-Encoding", "Content-Encoding"},
+};
+
+/* Default values for negotiated headers.
+ *
+ * Used in place of the client's value if it did not send the header at all.
+ * Without an Accept-Encoding header, we don't want to guess that the client
+ * will understand anything but the identity coding.
+ */
+static const headers negotiationDefaults{
+    {"Accept-Encoding", "identity"},
 };
 
 /* Default client headers.
@@ -109,10 +127,19 @@ class sessionData {
 
   /* HTTP request body
    *
-   * Contains the request body, if the request contained one.
+   * Contains the request body, if the request contained one. If the body is
+   * being streamed, this only contains the most recent part of it; see
+   * <onContent>.
    */
   std::string content;
 
+  /* Offset of <content> in the body.
+   *
+   * The number of body bytes that have already been passed to <onContent> and
+   * removed from <content>. Always zero unless the body is being streamed.
+   */
+  std::size_t contentOffset;
+
   /* Content length
    *
    * This is the value of the Content-Length header. Used when parsing a request
@@ -120,6 +147,38 @@ class sessionData {
    */
   std::size_t contentLength;
 
+  /* Chunked body decoder.
+   *
+   * Active if the current message body uses the chunked Transfer-Encoding, in
+   * which case <contentLength> is not used. Any trailers that were sent with
+   * the body end up in here as well.
+   */
+  chunked::decoder chunks;
+
+  /* Spilled request body.
+   *
+   * If the servlet for a request asked for large bodies to be spilled to disk,
+   * and the body was larger than <spillThreshold>, then the body is in this
+   * file instead of <content>. The file is closed once the request has been
+   * handled.
+   */
+  spool contentFile;
+
+  /* Body size past which to spill to disk.
+   *
+   * Set by the processor from the servlet's body policy; zero means bodies are
+   * always kept in memory.
+   */
+  std::size_t spillThreshold;
+
+  /* Minimum reply body size for compression.
+   *
+   * Reply bodies shorter than this are always sent with the identity coding,
+   * even if another coding has been negotiated, because compressing them is
+   * not worth the CPU time.
+   */
+  std::size_t minCompressLength;
+
   /* How many requests we've sent on this connection.
    *
    * Mostly for house-keeping purposes, and to keep track of whether a client
@@ -153,6 +212,109 @@ class sessionData {
    */
   std::list<std::string> outboundQueue;
 
+  /* Number of bytes in <outboundQueue>.
+   *
+   * Includes the message that is currently being written, if any, as that is
+   * only removed from the queue once the write has finished.
+   */
+  std::size_t outboundBytes;
+
+  /* Outbound queue high watermark.
+   *
+   * replyChunk() signals backpressure once <outboundBytes> reaches this, and
+   * servers stop reading further requests until the client has caught up.
+   */
+  std::size_t highWatermark;
+
+  /* Outbound queue low watermark.
+   *
+   * After backpressure has been signalled, <onDrain> is called once the
+   * <outboundBytes> have gone back down to this, and servers go back to
+   * reading requests.
+   */
+  std::size_t lowWatermark;
+
+  /* Outbound bytes across sessions.
+   *
+   * If set, <outboundBytes> are added to this as well, so that sessions can
+   * share an <outboundBudget>. Set by the processor.
+   */
+  std::atomic<std::size_t> *outboundTotal;
+
+  /* Shared outbound budget.
+   *
+   * Servers stop reading further requests on sessions that have anything
+   * queued up, while the <outboundTotal> is at or over this. Zero means no
+   * limit.
+   */
+  std::size_t outboundBudget;
+
+  /* Scheduling budget.
+   *
+   * How many lines the flow takes from the <input> buffer in one go, before
+   * it lets other sessions on the same I/O service have a turn. Lines that
+   * are already buffered, e.g. those of pipelined requests, are dealt with
+   * right away until then, without going back to the I/O service in between.
+   */
+  std::size_t turnLength;
+
+  /* Drain callback.
+   *
+   * Called when a streamed reply can take more data again, after replyChunk()
+   * returned `false`.
+   */
+  std::function<void(sessionData &)> onDrain;
+
+  /* Flow notification hook.
+   *
+   * Set by the flow that drives this session. Called whenever something was
+   * queued or completed outside of the flow's own callbacks, e.g. when a
+   * streamed reply is continued from a callback that was passed to <post>, so
+   * that the flow gets to send it.
+   */
+  std::function<void(void)> notify;
+
+  /* Request body callback.
+   *
+   * Set by the handler of a streaming servlet to receive the request body as
+   * it comes in. Called with each new part of the body in <content>, which is
+   * discarded afterwards, and one last time once the body is complete, which
+   * contentComplete() indicates. The handler needs to have replied by the time
+   * that last call returns.
+   */
+  std::function<void(sessionData &)> onContent;
+
+  /* Deferred request handler.
+   *
+   * Set by the processor instead of running a handler that is to be run on a
+   * worker thread. The flow calls this once nothing else is using the session,
+   * with a callback to invoke when the handler is done. Returns `false` if the
+   * handler could not be queued up.
+   */
+  std::function<bool(std::function<void(void)>)> offload;
+
+  /* Run something on the session's strand.
+   *
+   * Set by the flow that drives this session. Lets other threads safely get
+   * at the session, e.g. to complete a deferred reply.
+   */
+  std::function<void(std::function<void(void)>)> post;
+
+  /* Close the connection right away.
+   *
+   * Set by the flow that drives this session. Used to give up on a connection
+   * that is waiting for a reply that is no longer wanted. May be called from
+   * any thread.
+   */
+  std::function<void(void)> abort;
+
+  /* Recycling hook.
+   *
+   * Called by the flow once the session has been recycled and is free, so that
+   * whoever handed out the session can hand it out again.
+   */
+  std::function<void(void)> onRecycle;
+
   /* Whether to close the connection after sending something.
    *
    * Is picked up by the session's `send()` function, and will close the
@@ -160,6 +322,15 @@ class sessionData {
    */
   bool closeAfterSend;
 
+  /* Whether the connection is being wound down.
+   *
+   * Set by the flow when its server is drained. Final replies then ask the
+   * client to close the connection, and the connection is closed once they've
+   * been sent. Atomic, as an offloaded handler may be replying while the flow
+   * sets this.
+   */
+  std::atomic<bool> draining;
+
   /* Whether there's currently a write in progress.
    *
    * Set to true in `send()` whenever a write has been triggered, and cleared
@@ -170,9 +341,10 @@ class sessionData {
   /* Whether the session is "free".
    *
    * A free session can be used for a new connection. This is set to false as
-   * soon as an accept is pending against the session's socket.
+   * soon as an accept is pending against the session's socket. Atomic, as this
+   * is set by the session's own flow but looked at by the connection.
    */
-  bool free;
+  std::atomic<bool> free;
 
   /* The currently processing request is a HEAD request.
    *
@@ -183,6 +355,130 @@ class sessionData {
    */
   bool isHEAD;
 
+  /* Whether a streamed reply is in progress.
+   *
+   * Set by beginReply(), and cleared by endReply(). While this is set, the flow
+   * will not process any further requests on this session.
+   */
+  bool streaming;
+
+  /* Whether the streamed reply has a body.
+   *
+   * Set by beginReply(). Replies to HEAD requests, informational replies and
+   * 204 and 304 replies don't, so they're sent without any body framing.
+   */
+  bool streamingBody;
+
+  /* Whether backpressure has been signalled.
+   *
+   * Set when replyChunk() returns `false` and cleared when <onDrain> is called.
+   */
+  bool congested;
+
+  /* Whether the request body is being streamed.
+   *
+   * Set by the processor when it dispatched the request to a streaming servlet
+   * right after reading the headers, before the body came in.
+   */
+  bool streamingContent;
+
+  /* Whether to hold off reading the request body.
+   *
+   * Set with pauseContent() and cleared with resumeContent(). Lets the handler
+   * of a streaming servlet stop the flow from reading further parts of the body
+   * until it has dealt with the ones it already got.
+   */
+  bool contentPaused;
+
+  /* Request generation.
+   *
+   * Changes whenever a new request comes in, or the session is recycled, so
+   * that a deferred reply can tell if the request it was for is still current.
+   */
+  std::size_t generation;
+
+  /* Reference to a session that may outlive it.
+   *
+   * For things like deferred reply tokens, that may be completed after the
+   * session is gone, e.g. because its server was deleted. The session clears
+   * <session> when it's destroyed.
+   */
+  struct reference {
+    /* Construct with session.
+     * @pSession The session to refer to.
+     */
+    reference(sessionData *pSession) : session(pSession) {}
+
+    /* The session, or `nullptr` once it's been destroyed. */
+    sessionData *session;
+
+    /* Guards <session>. */
+    mutex lock;
+  };
+
+  /* The session's own reference; see <reference>. */
+  const std::shared_ptr<reference> self;
+
+  /* Whether a reply has been deferred.
+   *
+   * Set when a handler creates a deferredReply, and cleared once that reply
+   * comes in or its deadline passes. The flow waits until then before reading
+   * any further requests.
+   */
+  bool awaiting;
+
+  /* How long to wait for a deferred reply.
+   *
+   * Zero means no limit.
+   */
+  std::chrono::milliseconds replyTimeout;
+
+  /* How long to keep an idle connection open.
+   *
+   * Set by the client processor when it keeps the connection open for further
+   * requests, and by the server processor for the wait for the next request.
+   * Zero means no limit.
+   */
+  std::chrono::milliseconds idleTimeout;
+
+  /* How long a client may take to send the head of a request.
+   *
+   * Set by the server processor. Zero means no limit.
+   */
+  std::chrono::milliseconds headerTimeout;
+
+  /* How long a client may stall while sending a request body.
+   *
+   * Set by the server processor. Zero means no limit.
+   */
+  std::chrono::milliseconds bodyTimeout;
+
+  /* How long the other end may stall while a message is being sent to it.
+   *
+   * Set by the server processor. Zero means no limit.
+   */
+  std::chrono::milliseconds writeTimeout;
+
+  /* How long to wait for the status line of a reply.
+   *
+   * Set by the client processor from the pool when it sends requests. Zero
+   * means no limit.
+   */
+  std::chrono::milliseconds firstByteTimeout;
+
+  /* Coroutine frame storage.
+   *
+   * Kept from one request to the next, so that coroutine servlets can reuse
+   * it instead of allocating a new frame for every request.
+   */
+  std::unique_ptr<char[]> frame;
+
+  /* Size of the <frame> storage. */
+  std::size_t frameSize;
+
+  /* Whether the <frame> storage is taken by a running coroutine. */
+  bool frameInUse;
+
   /* Default constructor
    *
    * Sets up an empty data object with default values for the members that need
@@ -190,14 +486,53 @@ class sessionData {
    */
   sessionData(void)
       : status(stRequest),
+        contentOffset(0),
         contentLength(0),
+        spillThreshold(0),
+        minCompressLength(1024),
         requests(0),
         replies(0),
         errors(0),
+        outboundBytes(0),
+        highWatermark(1024 * 1024),
+        lowWatermark(1024 * 256),
+        outboundTotal(nullptr),
+        outboundBudget(0),
+        turnLength(64),
         closeAfterSend(false),
+        draining(false),
         writePending(false),
         free(false),
-        isHEAD(false) {}
+        isHEAD(false),
+        streaming(false),
+        streamingBody(false),
+        congested(false),
+        streamingContent(false),
+        contentPaused(false),
+        generation(0),
+        self(std::make_shared<reference>(this)),
+        awaiting(false),
+        replyTimeout(0),
+        idleTimeout(0),
+        headerTimeout(0),
+        bodyTimeout(0),
+        writeTimeout(0),
+        firstByteTimeout(0),
+        frameSize(0),
+        frameInUse(false) {}
+
+  /* Destructor.
+   *
+   * Drops the <onContent> callback before anything else, as that may still
+   * own a coroutine with its frame in our <frame> storage. Also lets anything
+   * that holds on to <self> know that the session is gone.
+   */
+  ~sessionData(void) {
+    onContent = nullptr;
+
+    std::lock_guard<mutex> l(self->lock);
+    self->session = nullptr;
+  }
 
   /* Calculate number of queries from this session.
    *
@@ -210,14 +545,81 @@ class sessionData {
 
   /* How many bytes are left to read.
    *
-   * Uses the known content length and the current content buffer's size to
-   * determine how much more to read.
+   * Uses the known content length and the amount of content we've seen so far
+   * to determine how much more to read.
    *
    * @return The number of bytes remaining that we'd expect in the current
    * message.
    */
   std::size_t remainingBytes(void) const {
-    return contentLength - content.size();
+    const std::size_t have = contentOffset + content.size();
+    return contentLength > have ? contentLength - have : 0;
+  }
+
+  /* Whether the whole message body has been read.
+   *
+   * Mostly useful in <onContent> callbacks, to find out if the body is
+   * complete.
+   *
+   * @return `true` if there's no more body to read for the current message.
+   */
+  bool contentComplete(void) const {
+    return chunks.active() ? chunks.state == chunked::ckDone
+                           : remainingBytes() == 0;
+  }
+
+  /* Stop reading the request body.
+   *
+   * Streaming servlets may call this to stop further calls to <onContent>,
+   * e.g. while the body parts they got so far are written out somewhere. Call
+   * resumeContent() to continue reading.
+   */
+  void pauseContent(void) { contentPaused = true; }
+
+  /* Continue reading the request body.
+   *
+   * Undoes pauseContent(). This is safe to call from outside of the flow's
+   * own callbacks, e.g. from a timer or another connection's handler, even on
+   * another thread, as it goes through <post>.
+   */
+  void resumeContent(void) {
+    auto run = [this]() {
+      contentPaused = false;
+
+      if (notify) {
+        notify();
+      }
+    };
+
+    if (post) {
+      post(run);
+    } else {
+      run();
+    }
+  }
+
+  /* Apply the negotiated content coding to a reply body.
+   * @status The status that will be sent with the body.
+   * @body The unencoded response body.
+   * @out Where to write the encoded body.
+   *
+   * Looks up the Content-Encoding that was negotiated for the current request
+   * and, if the body is large enough and allowed for the status, encodes the
+   * body with it.
+   *
+   * @return The coding that was applied; "identity" if `out` was not used.
+   */
+  std::string encode(int status, const std::string &body,
+                     std::string &out) const {
+    const std::string coding = outbound.get("Content-Encoding", "identity");
+    bool allowBody = status >= 200 && status != 204 && status != 304;
+
+    if (!allowBody || body.size() < minCompressLength ||
+        !encoding::encode(coding, body, out)) {
+      return "identity";
+    }
+
+    return coding;
   }
 
   /* Generate an HTTP reply message.
@@ -231,6 +633,10 @@ class sessionData {
    * This function will automatically add a Content-Length header for the body,
    * and will also append to the Server header, if the agent string is set.
    *
+   * If a Content-Encoding was negotiated, the body is encoded accordingly,
+   * unless `header` already has a Content-Encoding, in which case the body is
+   * assumed to have been encoded by the caller.
+   *
    * The code will always reply with an HTTP/1.1 reply, regardless of the
    * version in the request. If this is a concern for you, put the server behind
    * an nginx instance, which should fix up the output as necessary.
@@ -241,16 +647,24 @@ class sessionData {
                             const headers &header = {}) {
     // informational responses have no message body.
     bool allowBody = status >= 200 && !isHEAD;
-    // we automatically close connections when an error code is sent.
-    bool allowKeepAlive = status < 400;
+    // we automatically close connections when an error code is sent, or when
+    // this is the last reply before the connection is closed.
+    bool allowKeepAlive = status < 400 && (status < 200 || !draining);
 
     parser<headers> head;
 
+    std::string encoded;
+    const auto ce = header.find("Content-Encoding");
+    const std::string coding =
+        ce != header.end() ? ce->second : encode(status, body, encoded);
+    const std::string &payload =
+        (ce == header.end() && coding != "identity") ? encoded : body;
+
     // We set the Content-Length header for HEAD requests, even though those
     // do not actually get a body.
     if (allowBody || isHEAD) {
       head.insert({
-          {"Content-Length", std::to_string(body.size())},
+          {"Content-Length", std::to_string(payload.size())},
       });
     }
     if (!allowKeepAlive) {
@@ -266,11 +680,16 @@ class sessionData {
     // they haven't been overridden.
     head.insert(outbound.header);
 
+    // the identity coding must not be sent as a Content-Encoding.
+    if (coding == "identity") {
+      head.header.erase("Content-Encoding");
+    }
+
     std::string reply =
         std::string(statusLine(status)) + std::string(head) + "\r\n";
 
     if (allowBody) {
-      reply += body;
+      reply += payload;
     }
 
     return reply;
@@ -316,9 +735,16 @@ class sessionData {
     // and the client data.
     negotiated = {};
     for (const auto &n : negotiations) {
-      const std::string cv =
-          inbound.header.count(n.first) > 0 ? inbound.header[n.first] : "";
-      const std::string v = cxxhttp::negotiate(cv, n.second);
+      const auto d = negotiationDefaults.find(n.first);
+      const std::string cv = inbound.get(
+          n.first, d != negotiationDefaults.end() ? d->second : "");
+      std::string v = cxxhttp::negotiate(cv, n.second);
+
+      if (v.empty() && n.first == "Accept-Encoding" &&
+          encoding::acceptsIdentity(cv)) {
+        // we can always send a reply as-is, unless the client refuses that.
+        v = "identity";
+      }
 
       // modify the Vary value to indicate we used this header.
       outbound.append("Vary", n.first);
@@ -376,8 +802,8 @@ class sessionData {
     parser<headers> head{header};
     head.insert(defaultClientHeaders);
 
-    outboundQueue.push_back(requestLine(method, resource).assemble() +
-                            std::string(head) + "\r\n" + body);
+    enqueue(requestLine(method, resource).assemble() + std::string(head) +
+            "\r\n" + body);
 
     isHEAD = method == "HEAD";
 
@@ -399,13 +825,224 @@ class sessionData {
    * `send()` function in the session proper.
    */
   void reply(int status, const std::string &body, const headers &header = {}) {
-    outboundQueue.push_back(generateReply(status, body, header));
+    enqueue(generateReply(status, body, header));
 
-    closeAfterSend = closeAfterSend || status >= 400;
+    closeAfterSend = closeAfterSend || status >= 400 ||
+                     (status >= 200 && draining);
 
     replies++;
   }
 
+  /* Send precompressed reply.
+   * @status The status to return.
+   * @body The response body, with all of its encoded variants.
+   * @header The headers to send.
+   *
+   * Like the plain reply(), but picks the precompressed variant of the body
+   * that matches the negotiated Content-Encoding, instead of compressing the
+   * body for every request.
+   */
+  void reply(int status, const encoding::variants &body, headers header = {}) {
+    const std::string coding = outbound.get("Content-Encoding", "identity");
+
+    header.insert({"Content-Encoding", body.has(coding) ? coding : "identity"});
+
+    reply(status, body.get(coding), header);
+  }
+
+  /* Queue up a message to send.
+   * @message The raw message.
+   *
+   * Appends to <outboundQueue> and keeps track of the number of bytes queued.
+   */
+  void enqueue(std::string message) {
+    outboundBytes += message.size();
+    if (outboundTotal != nullptr) {
+      *outboundTotal += message.size();
+    }
+    outboundQueue.push_back(std::move(message));
+  }
+
+  /* Drop the message that has just been sent.
+   *
+   * Takes the message at the front of <outboundQueue> off the queue, and off
+   * the byte counts.
+   */
+  void dequeue(void) {
+    const std::size_t n = outboundQueue.front().size();
+    outboundBytes -= n;
+    if (outboundTotal != nullptr) {
+      *outboundTotal -= n;
+    }
+    outboundQueue.pop_front();
+  }
+
+  /* Drop everything that's left to send.
+   *
+   * Used when the connection is closed, so that nothing stays on the shared
+   * byte count.
+   */
+  void clearOutbound(void) {
+    if (outboundTotal != nullptr) {
+      *outboundTotal -= outboundBytes;
+    }
+    outboundQueue.clear();
+    outboundBytes = 0;
+  }
+
+  /* Whether the shared outbound budget is used up.
+   *
+   * @return `true` if there's a budget, and the sessions sharing it have at
+   * least that much queued up.
+   */
+  bool overBudget(void) const {
+    return outboundBudget > 0 && outboundTotal != nullptr &&
+           *outboundTotal >= outboundBudget;
+  }
+
+  /* Join the most recently queued messages.
+   * @n How many messages to join.
+   *
+   * Joins the last `n` messages in <outboundQueue> into one, so that they go
+   * out in a single write. The message that is being written right now, if
+   * any, is left alone.
+   */
+  void coalesce(std::size_t n) {
+    const std::size_t writing = writePending && !outboundQueue.empty() ? 1 : 0;
+    n = std::min(n, outboundQueue.size() - writing);
+
+    if (n > 1) {
+      const auto first = std::prev(outboundQueue.end(), n);
+      for (auto it = std::next(first); it != outboundQueue.end(); it++) {
+        first->append(*it);
+      }
+      outboundQueue.erase(std::next(first), outboundQueue.end());
+    }
+  }
+
+  /* Whether streamed replies use the chunked coding.
+   *
+   * The chunked Transfer-Encoding is only available to HTTP/1.1 clients; older
+   * clients get the body delimited by closing the connection instead.
+   *
+   * @return `true` if the current request was HTTP/1.1 or later.
+   */
+  bool chunkedReply(void) const {
+    static const http::version minVersion{1, 1};
+    return inboundRequest.version >= minVersion;
+  }
+
+  /* Begin a streamed reply.
+   * @status The status to return.
+   * @header The headers to send.
+   *
+   * Sends the status line and headers immediately, without a Content-Length.
+   * The body is then sent piece by piece with replyChunk(), and the reply is
+   * completed with endReply(). Until then, the flow will not process any more
+   * requests on this session, so the handler may well return and continue the
+   * reply from some other callback later.
+   *
+   * Like the rest of the streaming functions, this must only be called on the
+   * session's strand, i.e. from the handler, <onContent> or <onDrain>. To
+   * continue the reply from anywhere else, e.g. a timer or another
+   * connection's handler, pass a callback to <post> and do it in there, or use
+   * deferredReply::complete(), which does that for you.
+   *
+   * Streamed replies are never compressed automatically. If you set a
+   * Content-Encoding in `header`, you need to encode the body yourself.
+   *
+   * Replies that can't have a body, i.e. informational, 204 and 304 replies,
+   * and replies to HEAD requests, only consist of the headers; anything sent
+   * with replyChunk() is dropped for those.
+   */
+  void beginReply(int status, const headers &header = {}) {
+    bool allowKeepAlive = status < 400 && !draining;
+    parser<headers> head{header};
+
+    streamingBody = status >= 200 && status != 204 && status != 304 && !isHEAD;
+
+    if (streamingBody && chunkedReply()) {
+      head.insert({{"Transfer-Encoding", "chunked"}});
+    } else if (streamingBody) {
+      allowKeepAlive = false;
+    }
+    if (!allowKeepAlive) {
+      head.insert({{"Connection", "close"}});
+    }
+
+    head.insert(outbound.header);
+
+    if (header.find("Content-Encoding") == header.end()) {
+      head.header.erase("Content-Encoding");
+    }
+
+    enqueue(std::string(statusLine(status)) + std::string(head) + "\r\n");
+
+    closeAfterSend = closeAfterSend || !allowKeepAlive;
+    streaming = true;
+    congested = false;
+
+    replies++;
+
+    if (notify) {
+      notify();
+    }
+  }
+
+  /* Send part of a streamed reply.
+   * @data The data to send. Empty strings are ignored.
+   *
+   * Queues up `data` as the next part of the body of the reply started with
+   * beginReply(). Nothing is sent for replies that have no body.
+   * Only call this on the session's strand; see beginReply().
+   *
+   * @return `false` if the handler should stop sending data for the time being,
+   * because the client isn't reading fast enough. <onDrain> will be called
+   * once it has caught up. Also `false` if there is no streamed reply in
+   * progress, e.g. because the connection has been closed.
+   */
+  bool replyChunk(const std::string &data) {
+    if (!streaming) {
+      return false;
+    }
+
+    if (streamingBody && !data.empty()) {
+      enqueue(chunkedReply() ? chunked::chunk(data) : data);
+
+      if (notify) {
+        notify();
+      }
+    }
+
+    congested = congested || outboundBytes >= highWatermark;
+
+    return !congested;
+  }
+
+  /* Finish a streamed reply.
+   * @trailers Trailing header fields to send after the body.
+   *
+   * Sends the last chunk, with any trailers. Trailers are dropped if the
+   * client did not get a chunked reply. This also allows the flow to process
+   * further requests on the session. Only call this on the session's strand;
+   * see beginReply().
+   */
+  void endReply(const headers &trailers = {}) {
+    if (streaming) {
+      if (streamingBody && chunkedReply()) {
+        enqueue(chunked::last(trailers));
+      }
+
+      streaming = false;
+      congested = false;
+      onDrain = nullptr;
+
+      if (notify) {
+        notify();
+      }
+    }
+  }
+
   /* ASIO input stream buffer
    *
    * This is the stream buffer that the object is reading from. This is filled
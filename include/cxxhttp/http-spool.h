@@ -0,0 +1,206 @@
+/* Temporary files for message bodies.
+ *
+ * Large message bodies can be written to an anonymous temporary file instead
+ * of being kept in memory. This contains the helper class that manages such a
+ * file.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_HTTP_SPOOL_H)
+#define CXXHTTP_HTTP_SPOOL_H
+
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace cxxhttp {
+namespace http {
+/* Anonymous temporary file.
+ *
+ * A file that has no name in the file system, so it goes away on its own once
+ * it's closed, even if the programme crashes. Data can only be appended, and
+ * the contents can be mapped into memory for reading.
+ *
+ * Uses O_TMPFILE where available, and falls back to creating and immediately
+ * unlinking a regular file otherwise.
+ */
+class spool {
+ public:
+  /* Default constructor.
+   *
+   * Does not create a file yet; use open() for that.
+   */
+  spool(void) : fd(-1), length(0), mapping(nullptr) {}
+
+  /* Copying a spool is not supported.
+   *
+   * It owns a file descriptor, which would be closed twice.
+   */
+  spool(const spool &) = delete;
+
+  /* Copying a spool is not supported.
+   *
+   * It owns a file descriptor, which would be closed twice.
+   *
+   * @return Nothing, as it's deleted.
+   */
+  spool &operator=(const spool &) = delete;
+
+  /* Destructor.
+   *
+   * Closes the file, which also deletes it.
+   */
+  ~spool(void) { close(); }
+
+  /* Create the temporary file.
+   *
+   * The file is created in the directory named by the TMPDIR environment
+   * variable, or in /tmp if that is not set. Any previous file is closed
+   * first.
+   *
+   * @return `true` if the file could be created.
+   */
+  bool open(void) {
+    const char *env = std::getenv("TMPDIR");
+    const std::string directory = env != nullptr && *env ? env : "/tmp";
+
+    close();
+
+#if defined(O_TMPFILE)
+    do {
+      fd = ::open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    } while (fd < 0 && errno == EINTR);
+#endif
+
+    if (fd < 0) {
+      // either there's no O_TMPFILE, or the file system doesn't support it.
+      std::string name = directory + "/cxxhttp-spool-XXXXXX";
+      fd = mkstemp(&name[0]);
+      if (fd >= 0) {
+        unlink(name.c_str());
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+    }
+
+    return fd >= 0;
+  }
+
+  /* Is there a file?
+   *
+   * @return `true` if open() has been called successfully, and the file has
+   * not been closed since.
+   */
+  bool active(void) const { return fd >= 0; }
+
+  /* Append data to the file.
+   * @data The data to write.
+   *
+   * Writes all of the data, retrying on partial writes and interruptions. This
+   * is a blocking write, but as it's to a local file that should be fine.
+   *
+   * @return `true` if all of the data was written.
+   */
+  bool write(const std::string &data) {
+    std::size_t pos = 0;
+
+    if (fd < 0 || mapping != nullptr) {
+      return false;
+    }
+
+    while (pos < data.size()) {
+      const ssize_t r = ::write(fd, data.data() + pos, data.size() - pos);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      } else if (r <= 0) {
+        return false;
+      }
+      pos += std::size_t(r);
+    }
+
+    length += pos;
+    return true;
+  }
+
+  /* Size of the file.
+   *
+   * @return The number of bytes written to the file so far.
+   */
+  std::size_t size(void) const { return length; }
+
+  /* The file descriptor.
+   *
+   * Only valid until the file is closed. Use dup() if you need to keep the
+   * file around for longer than that.
+   *
+   * @return The file's descriptor, or -1 if there's no file.
+   */
+  int descriptor(void) const { return fd; }
+
+  /* Map the file into memory.
+   *
+   * The mapping is read-only, and remains valid until the file is closed. No
+   * further writes are allowed once the file has been mapped.
+   *
+   * @return A pointer to the file's contents, or `nullptr` if the file is
+   * empty or could not be mapped.
+   */
+  const char *map(void) {
+    if (mapping == nullptr && fd >= 0 && length > 0) {
+      void *m = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      mapping = m == MAP_FAILED ? nullptr : m;
+    }
+
+    return (const char *)mapping;
+  }
+
+  /* Close the file.
+   *
+   * Removes any mapping and closes the descriptor. As the file has no name,
+   * this deletes it as well.
+   */
+  void close(void) {
+    if (mapping != nullptr) {
+      munmap(mapping, length);
+      mapping = nullptr;
+    }
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    length = 0;
+  }
+
+ protected:
+  /* File descriptor.
+   *
+   * -1 when there's no file.
+   */
+  int fd;
+
+  /* File size.
+   *
+   * How much has been written to the file.
+   */
+  std::size_t length;
+
+  /* Memory mapping.
+   *
+   * Set up by map(), and `nullptr` otherwise.
+   */
+  void *mapping;
+};
+}
+}
+
+#endif
@@ -0,0 +1,149 @@
+/* HTTP server timeouts.
+ *
+ * Limits on how long clients may take to talk to a server.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_HTTP_TIMEOUTS_H)
+#define CXXHTTP_HTTP_TIMEOUTS_H
+
+#include <chrono>
+#include <string>
+
+#include <ef.gy/cli.h>
+#include <ef.gy/global.h>
+
+namespace cxxhttp {
+namespace http {
+/* Server connection timeouts.
+ *
+ * Connections that run over any of these are closed, so that clients that
+ * hold on to a connection without doing anything with it, or that send or
+ * read their data very slowly, can't tie up the server's sockets. Zero means
+ * no limit.
+ */
+class timeouts {
+ public:
+  /* Keep-alive timeout.
+   *
+   * How long to wait for the next request to start, on a connection that's
+   * done with its last one or that's just been accepted.
+   */
+  std::chrono::milliseconds idle = std::chrono::seconds(60);
+
+  /* Request head timeout.
+   *
+   * How long the client may take to send the request line and headers, once
+   * it has started with them. That's for all of them together, so sending one
+   * header line at a time doesn't make this any longer.
+   */
+  std::chrono::milliseconds header = std::chrono::seconds(30);
+
+  /* Request body timeout.
+   *
+   * How long the client may go without sending any more of a request body.
+   */
+  std::chrono::milliseconds body = std::chrono::seconds(30);
+
+  /* Write timeout.
+   *
+   * How long the client may go without reading any more of a reply, while
+   * there's still some of it left to send.
+   */
+  std::chrono::milliseconds write = std::chrono::seconds(60);
+};
+
+/* Parse a number of seconds.
+ * @value Where to put the result.
+ * @text The number, as a string.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setSeconds(std::chrono::milliseconds &value,
+                              const std::string &text) {
+  try {
+    value = std::chrono::seconds(std::stoul(text));
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Set the keep-alive timeout.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setIdleTimeout(std::smatch &match) {
+  return setSeconds(efgy::global<timeouts>().idle, match[1]);
+}
+
+/* Keep-alive timeout CLI option.
+ *
+ * The format is `idle-timeout:(seconds)`.
+ */
+static efgy::cli::option timeoutIdle(
+    "-{0,2}idle-timeout:([0-9]+)", setIdleTimeout,
+    "close connections that wait [1] seconds for a request");
+
+/* Set the request head timeout.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setHeaderTimeout(std::smatch &match) {
+  return setSeconds(efgy::global<timeouts>().header, match[1]);
+}
+
+/* Request head timeout CLI option.
+ *
+ * The format is `header-timeout:(seconds)`.
+ */
+static efgy::cli::option timeoutHeader(
+    "-{0,2}header-timeout:([0-9]+)", setHeaderTimeout,
+    "close connections that take [1] seconds to send request headers");
+
+/* Set the request body timeout.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setBodyTimeout(std::smatch &match) {
+  return setSeconds(efgy::global<timeouts>().body, match[1]);
+}
+
+/* Request body timeout CLI option.
+ *
+ * The format is `body-timeout:(seconds)`.
+ */
+static efgy::cli::option timeoutBody(
+    "-{0,2}body-timeout:([0-9]+)", setBodyTimeout,
+    "close connections that stall for [1] seconds sending a request body");
+
+/* Set the write timeout.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setWriteTimeout(std::smatch &match) {
+  return setSeconds(efgy::global<timeouts>().write, match[1]);
+}
+
+/* Write timeout CLI option.
+ *
+ * The format is `write-timeout:(seconds)`.
+ */
+static efgy::cli::option timeoutWrite(
+    "-{0,2}write-timeout:([0-9]+)", setWriteTimeout,
+    "close connections that stall for [1] seconds reading a reply");
+}
+}
+
+#endif
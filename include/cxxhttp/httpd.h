@@ -16,9 +16,15 @@
 #define CXXHTTP_HTTPD_H
 
 #include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <ef.gy/cli.h>
 
+#include <cxxhttp/handoff.h>
 #include <cxxhttp/http-network.h>
 #include <cxxhttp/http-stdio.h>
 
@@ -84,10 +90,22 @@ static inline bool setup(service &service = efgy::global<cxxhttp::service>(),
  * The server will have the default HTTP processor, with all registered TCP
  * servlets applied.
  *
+ * With more than one shard, this sets up one such server per shard, each with
+ * the shard's own I/O service.
+ *
  * @return 'true' if the setup was successful.
  */
 static inline bool setupTCP(std::smatch &match) {
-  return setup(net::endpoint<transport::tcp>(match[1], match[2]));
+  bool rv = false;
+
+  for (std::size_t i = 0; i < shards; i++) {
+    rv = setup(net::endpoint<transport::tcp>(match[1], match[2]),
+               efgy::global<efgy::beacons<http::server<transport::tcp>>>(),
+               shard(i)) ||
+         rv;
+  }
+
+  return rv;
 }
 
 /* Whether or not to delete new UNIX sockets.
@@ -105,13 +123,15 @@ static efgy::cli::flag<bool> keepSocket(
  *
  * This uses setup() to create a server on the socket file specified with
  * match[1]. The server will have the default HTTP processor, with all
- * registered UNIX servlets applied.
+ * registered UNIX servlets applied. A socket handed over by another process
+ * is kept, as it's the one clients are connecting to.
  *
  * @return 'true' if the setup was successful.
  */
 static inline bool setupUNIX(std::smatch &match) {
   const std::string socket = match[1];
-  if (!keepSocket) {
+  if (!keepSocket && !efgy::global<net::listeners>().has(
+                         transport::unix::endpoint(socket))) {
     // ignore errors when unlinking the socket name; if it still exists later,
     // we'll get an error trying to listen on it, if it never existed then the
     // error is moot anyway.
@@ -120,6 +140,151 @@ static inline bool setupUNIX(std::smatch &match) {
   return setup(net::endpoint<transport::unix>(socket));
 }
 
+/* Set up an HTTP server on a socket that's already listening.
+ * @transport The transport type of the socket, e.g. transport::tcp.
+ * @fd The socket, which the server takes over.
+ * @servers The set of servers to add the newly set up instance to.
+ * @service The I/O service to use, defaults to the global one.
+ * @servlets The servlets to bind, defaults to the global set for the transport.
+ *
+ * Like setup(), but for whatever endpoint the socket is bound to, and without
+ * binding a new socket to it.
+ *
+ * @return `true` if the setup was successful.
+ */
+template <class transport>
+static bool adopt(int fd,
+                  efgy::beacons<http::server<transport>> &servers =
+                      efgy::global<efgy::beacons<http::server<transport>>>(),
+                  service &service = efgy::global<cxxhttp::service>(),
+                  efgy::beacons<http::servlet> &
+                      servlets = efgy::global<efgy::beacons<http::servlet>>()) {
+  net::endpointType<transport> endpoint;
+
+  if (!net::localEndpoint(fd, endpoint)) {
+    return false;
+  }
+
+  efgy::global<net::listeners>().adopt(fd);
+  auto &s = http::server<transport>::get(endpoint, servers, service);
+  s.processor.servlets = servlets;
+
+  return true;
+}
+
+/* Set up an HTTP server on an inherited socket.
+ * @fd The socket, which must be a listening stream socket.
+ *
+ * Uses adopt() to set up a TCP or UNIX server, depending on the socket. The
+ * socket is closed on exec from here on, so it's not passed on any further.
+ *
+ * @return `true` if the setup was successful.
+ */
+static inline bool setupDescriptor(int fd) {
+  sockaddr_storage address;
+  socklen_t size = sizeof(address);
+  int type = 0;
+  socklen_t typeSize = sizeof(type);
+
+  if (::getsockname(fd, (sockaddr *)&address, &size) != 0 ||
+      ::getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typeSize) != 0 ||
+      type != SOCK_STREAM) {
+    return false;
+  }
+
+#if defined(SO_ACCEPTCONN)
+  int listening = 0;
+  socklen_t listeningSize = sizeof(listening);
+
+  if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening,
+                   &listeningSize) != 0 ||
+      listening == 0) {
+    return false;
+  }
+#endif
+
+  (void)::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  switch (address.ss_family) {
+    case AF_INET:
+    case AF_INET6:
+      return adopt<transport::tcp>(fd);
+    case AF_UNIX:
+      return adopt<transport::unix>(fd);
+  }
+
+  return false;
+}
+
+/* Set up an HTTP server on a socket by number.
+ * @match The matches from the descriptor regex.
+ *
+ * Uses setupDescriptor() on the socket with the number in match[1].
+ *
+ * @return `true` if the setup was successful.
+ */
+static inline bool setupFD(std::smatch &match) {
+  try {
+    return setupDescriptor(std::stoi(match[1]));
+  } catch (...) {
+    return false;
+  }
+}
+
+/* Set up HTTP servers on sockets from systemd.
+ * @match Matches from the CLI option regex; ignored.
+ *
+ * With socket activation, systemd passes the sockets it's listening on as
+ * descriptors 3 and up, with their number in the LISTEN_FDS environment
+ * variable, and the process they're meant for in LISTEN_PID. This sets up a
+ * server on each of them, with setupDescriptor(), and removes the variables so
+ * child processes don't try to do the same.
+ *
+ * @return `true` if there were sockets, and all of them could be set up.
+ */
+static inline bool setupSystemd(std::smatch &match) {
+  const char *pid = std::getenv("LISTEN_PID");
+  const char *fds = std::getenv("LISTEN_FDS");
+  unsigned long n = 0;
+
+  try {
+    if (pid == nullptr || fds == nullptr ||
+        std::stoul(pid) != (unsigned long)::getpid()) {
+      return false;
+    }
+    n = std::stoul(fds);
+  } catch (...) {
+    return false;
+  }
+
+  ::unsetenv("LISTEN_PID");
+  ::unsetenv("LISTEN_FDS");
+  ::unsetenv("LISTEN_FDNAMES");
+
+  bool rv = n > 0;
+
+  for (unsigned long i = 0; i < n; i++) {
+    rv = setupDescriptor(3 + int(i)) && rv;
+  }
+
+  return rv;
+}
+
+/* Set up listening socket handoffs.
+ * @match The matches from the handoff regex.
+ *
+ * Takes over the listening sockets of the process that has its control socket
+ * at match[1], if there is one, then listens there for the next process to
+ * take over from this one.
+ *
+ * @return `true` if the control socket was set up.
+ */
+static inline bool setupHandoff(std::smatch &match) {
+  auto &control = efgy::global<net::handoff::control>();
+  control.takeOver(match[1]);
+  return control.listen(match[1]);
+}
+
 /* Set up an HTTP server on STDIO.
  * @match Matches from the CLI option regex; ignored.
  *
@@ -133,10 +298,11 @@ static inline bool setupSTDIO(std::smatch &match) { return setup(); }
 /* TCP HTTP server CLI option.
  *
  * The format is `http:(interface-address):(port)`. The server that is set up
- * will have all available servlets registered.
+ * will have all available servlets registered. `fd` isn't taken as a host
+ * name, so that it doesn't get in the way of the descriptor option.
  */
 static efgy::cli::option TCP(
-    "-{0,2}http:(.+):([0-9]+)", setupTCP,
+    "-{0,2}http:(?!fd:)(.+):([0-9]+)", setupTCP,
     "listen for HTTP connections on the given host[1] and port[2]");
 
 /* UNIX socket HTTP server CLI option.
@@ -148,6 +314,25 @@ static efgy::cli::option UNIX(
     "-{0,2}http:unix:(.+)", setupUNIX,
     "listen for HTTP connections on the given unix socket[1]");
 
+/* Inherited socket HTTP server CLI option.
+ *
+ * The format is `http:fd:(descriptor)`, for a listening TCP or UNIX socket
+ * that was opened by whatever started the process. The server is only set up
+ * once, no matter how many shards there are.
+ */
+static efgy::cli::option FD(
+    "-{0,2}http:fd:([0-9]+)", setupFD,
+    "accept HTTP connections on the inherited listening socket [1]");
+
+/* Socket activation HTTP server CLI option.
+ *
+ * The format is `http:systemd`, which sets up a server for every socket that
+ * systemd passed to the process.
+ */
+static efgy::cli::option systemd(
+    "-{0,2}http:systemd", setupSystemd,
+    "accept HTTP connections on the sockets passed in by systemd");
+
 /* STDIO HTTP server CLI option.
  *
  * For when you want to talk on stdio. Because... testing things, maybe? Or
@@ -155,6 +340,16 @@ static efgy::cli::option UNIX(
  */
 static efgy::cli::option STDIO("-{0,2}http:stdio", setupSTDIO,
                                "process HTTP connections on STDIN and STDOUT");
+
+/* Listening socket handoff CLI option.
+ *
+ * The format is `handoff:(control-socket)`. Needs to come before any servers
+ * on the command line, so they can take over the sockets that were handed
+ * over.
+ */
+static efgy::cli::option handoff(
+    "-{0,2}handoff:(.+)", setupHandoff,
+    "take over sockets from the process listening on control socket [1]");
 }
 
 namespace usage {
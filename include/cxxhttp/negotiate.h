@@ -367,7 +367,8 @@ static inline std::string negotiate(std::set<qvalue> theirs,
   // we also need to recalculate the q-values.
   for (const auto &a : theirs) {
     for (const auto &b : mine) {
-      if (a == b) {
+      // a q-value of 0 means "not acceptable", so such values never match.
+      if (a == b && a.q > 0 && b.q > 0) {
         // Combined q-value. Combining like this allows for server-side q-value
         // influences.
         int q = a.q * b.q / 1000;
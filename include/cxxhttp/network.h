@@ -14,8 +14,34 @@
 #if !defined(CXXHTTP_NETWORK_H)
 #define CXXHTTP_NETWORK_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+#if !defined(ASIO_DISABLE_THREADS)
+#include <thread>
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #define ASIO_STANDALONE
 #include <asio.hpp>
@@ -23,6 +49,8 @@
 #include <ef.gy/cli.h>
 #include <ef.gy/global.h>
 
+#include <cxxhttp/tuning.h>
+
 namespace cxxhttp {
 /* asio::io_service type.
  *
@@ -30,6 +58,496 @@ namespace cxxhttp {
  */
 using service = asio::io_service;
 
+#if defined(ASIO_DISABLE_THREADS)
+/* Mutex type.
+ *
+ * Without threads, there's nothing to lock against, so this does nothing.
+ */
+class mutex {
+ public:
+  /* Lock the mutex.
+   *
+   * Does nothing.
+   */
+  void lock(void) {}
+
+  /* Unlock the mutex.
+   *
+   * Does nothing.
+   */
+  void unlock(void) {}
+};
+#else
+/* Mutex type.
+ *
+ * Used to guard data that is shared between the threads running an I/O
+ * service.
+ */
+using mutex = std::mutex;
+#endif
+
+/* Number of I/O threads.
+ *
+ * How many threads run() uses by default. Note that this is only ever
+ * increased with the `threads` option, if threads haven't been disabled with
+ * ASIO_DISABLE_THREADS.
+ */
+static std::size_t threads = 1;
+
+/* Run an I/O service.
+ * @io The I/O service to run.
+ * @n The number of threads to run it on.
+ *
+ * Runs the service on the calling thread, and on `n-1` additional threads,
+ * then waits for all of them to finish. Each session's handlers are run
+ * through a strand, so they never run concurrently, but different sessions
+ * are processed in parallel.
+ */
+static inline void run(service &io = efgy::global<service>(),
+                       std::size_t n = threads) {
+#if !defined(ASIO_DISABLE_THREADS)
+  std::vector<std::thread> pool;
+
+  for (std::size_t i = 1; i < n; i++) {
+    pool.emplace_back([&io]() { io.run(); });
+  }
+#endif
+
+  io.run();
+
+#if !defined(ASIO_DISABLE_THREADS)
+  for (auto &t : pool) {
+    t.join();
+  }
+#endif
+}
+
+/* Number of server shards.
+ *
+ * TCP servers are set up once per shard, each with its own I/O service and its
+ * own listening socket. The sockets are bound with SO_REUSEPORT, so that the
+ * kernel spreads new connections across all shards. Only ever increased with
+ * the `shards` option, if threads haven't been disabled.
+ */
+static std::size_t shards = 1;
+
+/* Get a shard's I/O service.
+ * @i The shard number.
+ *
+ * Shard 0 uses the global I/O service, all others get one of their own. Not
+ * thread-safe, so only use this when setting up servers.
+ *
+ * @return The I/O service for the given shard.
+ */
+static inline service &shard(std::size_t i) {
+  static std::deque<service> pool;
+
+  if (i == 0) {
+    return efgy::global<service>();
+  }
+
+  while (pool.size() < i) {
+    pool.emplace_back();
+  }
+
+  return pool[i - 1];
+}
+
+/* Pin the calling thread to a CPU core.
+ * @core The core to use; wraps around at the number of cores.
+ *
+ * Only does anything on Linux; elsewhere the scheduler decides. Threads that
+ * are started by a pinned thread start out on the same core, so use unpin()
+ * in those if they shouldn't stay there.
+ */
+static inline void pin(std::size_t core) {
+#if defined(__linux__) && !defined(ASIO_DISABLE_THREADS)
+  const std::size_t cores =
+      std::max<std::size_t>(1, std::thread::hardware_concurrency());
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(core % cores, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+/* Let the calling thread run on any CPU core.
+ *
+ * Undoes pin(), including a pin that was inherited from the thread that
+ * started this one. Only does anything on Linux.
+ */
+static inline void unpin(void) {
+#if defined(__linux__) && !defined(ASIO_DISABLE_THREADS)
+  const std::size_t cores =
+      std::max<std::size_t>(1, std::thread::hardware_concurrency());
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  for (std::size_t core = 0; core < cores && core < CPU_SETSIZE; core++) {
+    CPU_SET(core, &set);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+/* Run all shards.
+ *
+ * Runs every shard's I/O service on as many threads as run() would, with the
+ * first thread of the first shard being the calling thread. With more than one
+ * shard, every one of these threads is pinned to a core of its own, as far as
+ * there are enough cores.
+ *
+ * All the shards' I/O services are looked up before any threads are started,
+ * as shard() may need to create them.
+ */
+static inline void runShards(void) {
+#if !defined(ASIO_DISABLE_THREADS)
+  const bool pinned = shards > 1;
+  std::vector<service *> services;
+  std::vector<std::thread> pool;
+
+  for (std::size_t i = 0; i < shards; i++) {
+    services.push_back(&shard(i));
+  }
+
+  for (std::size_t i = 0; i < shards; i++) {
+    for (std::size_t t = i == 0 ? 1 : 0; t < threads; t++) {
+      const std::size_t core = i * threads + t;
+      service *io = services[i];
+
+      pool.emplace_back([io, core, pinned]() {
+        if (pinned) {
+          pin(core);
+        }
+        io->run();
+      });
+    }
+  }
+
+  if (pinned) {
+    pin(0);
+  }
+
+  services[0]->run();
+
+  for (auto &t : pool) {
+    t.join();
+  }
+#else
+  run(shard(0));
+#endif
+}
+
+#if !defined(ASIO_DISABLE_THREADS)
+/* Set the number of I/O threads.
+ * @match The matches from the CLI option regex.
+ *
+ * Sets the number of threads to the value in match[1]; at least one.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setThreads(std::smatch &match) {
+  try {
+    threads = std::max<std::size_t>(1, std::stoul(match[1]));
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* I/O thread count CLI option.
+ *
+ * The format is `threads:(count)`. Only available with thread support.
+ */
+static efgy::cli::option threadCount("-{0,2}threads:([0-9]+)", setThreads,
+                                     "run the I/O service on [1] threads");
+
+/* Set the number of server shards.
+ * @match The matches from the CLI option regex.
+ *
+ * Sets the number of shards to the value in match[1]; at least one.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setShards(std::smatch &match) {
+  try {
+    shards = std::max<std::size_t>(1, std::stoul(match[1]));
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Server shard count CLI option.
+ *
+ * The format is `shards:(count)`. Needs to come before any TCP servers on the
+ * command line. Only available with thread support.
+ */
+static efgy::cli::option shardCount(
+    "-{0,2}shards:([0-9]+)", setShards,
+    "set up TCP servers [1] times, each on its own core");
+#endif
+
+namespace net {
+/* Graceful shutdown.
+ *
+ * Servers register here while they're listening, so that they can all be
+ * drained at once: they stop accepting connections, answer the requests they
+ * are working on, and close their connections. Once that's done, there's
+ * nothing left for the I/O services to do, so they return from run().
+ */
+class shutdown {
+ public:
+  /* Drain timeout.
+   *
+   * How long to wait for requests in flight before closing their connections
+   * anyway. Zero means no limit.
+   */
+  std::chrono::milliseconds timeout = std::chrono::seconds(30);
+
+  /* Register a server.
+   * @owner The server, so it can take itself out again with remove().
+   * @hook Drains the server, with the timeout as its argument.
+   */
+  void add(const void *owner,
+           std::function<void(std::chrono::milliseconds)> hook) {
+    std::lock_guard<mutex> l(lock);
+    hooks[owner] = hook;
+  }
+
+  /* Take a server out again.
+   * @owner The server, as passed to add().
+   *
+   * Does nothing if the server wasn't registered.
+   */
+  void remove(const void *owner) {
+    std::lock_guard<mutex> l(lock);
+    hooks.erase(owner);
+  }
+
+  /* Whether there's anything to drain.
+   *
+   * @return `true` if no servers are registered.
+   */
+  bool empty(void) const {
+    std::lock_guard<mutex> l(lock);
+    return hooks.empty();
+  }
+
+  /* Drain all registered servers.
+   *
+   * Only starts draining, which is then done by the servers' I/O services, so
+   * this may be called from any thread.
+   */
+  void drain(void) const {
+    std::vector<std::function<void(std::chrono::milliseconds)>> pending;
+
+    {
+      std::lock_guard<mutex> l(lock);
+      for (const auto &hook : hooks) {
+        pending.push_back(hook.second);
+      }
+    }
+
+    for (const auto &hook : pending) {
+      hook(timeout);
+    }
+  }
+
+ protected:
+  /* Drain hooks, by server. */
+  std::unordered_map<const void *,
+                     std::function<void(std::chrono::milliseconds)>>
+      hooks;
+
+  /* Guards <hooks>. */
+  mutable mutex lock;
+};
+
+/* Set the drain timeout.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setDrainTimeout(std::smatch &match) {
+  try {
+    efgy::global<shutdown>().timeout =
+        std::chrono::seconds(std::stoul(match[1]));
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Drain timeout CLI option.
+ *
+ * The format is `drain-timeout:(seconds)`.
+ */
+static efgy::cli::option drainTimeout(
+    "-{0,2}drain-timeout:([0-9]+)", setDrainTimeout,
+    "on SIGTERM, wait [1] seconds for requests before closing connections");
+
+/* Get the address a socket is bound to.
+ * @endpoint The ASIO endpoint type, e.g. asio::ip::tcp::endpoint.
+ * @fd The socket's file descriptor.
+ * @local Set to the socket's address.
+ *
+ * Doesn't check that the address is of the right family for the endpoint
+ * type; callers need to do that.
+ *
+ * @return `true` if the address fit into the endpoint.
+ */
+template <typename endpoint>
+static inline bool localEndpoint(int fd, endpoint &local) {
+  sockaddr_storage address;
+  socklen_t size = sizeof(address);
+
+  if (::getsockname(fd, (sockaddr *)&address, &size) != 0 ||
+      size > local.capacity()) {
+    return false;
+  }
+
+  std::memcpy(local.data(), &address, size);
+  local.resize(size);
+  return true;
+}
+
+/* Whether a socket is bound to an endpoint.
+ * @endpoint The ASIO endpoint type, e.g. asio::ip::tcp::endpoint.
+ * @fd The socket's file descriptor.
+ * @target The endpoint to compare with.
+ *
+ * @return `true` if the socket's local address is `target`.
+ */
+template <typename endpoint>
+static inline bool boundTo(int fd, const endpoint &target) {
+  endpoint local;
+  return localEndpoint(fd, local) &&
+         local.data()->sa_family == target.data()->sa_family &&
+         local == target;
+}
+
+/* Listening sockets.
+ *
+ * Keeps track of the sockets that servers listen on, so they can be handed to
+ * another process, and of the ones that were handed to this process, so that
+ * servers can take them over instead of binding new ones. A server set up for
+ * the same endpoint as one of the latter starts accepting connections from its
+ * backlog right away, and nothing that was waiting there gets lost.
+ */
+class listeners {
+ public:
+  /* Destructor.
+   *
+   * Closes any sockets that no server took.
+   */
+  ~listeners(void) { discard(); }
+
+  /* Add a socket that was handed to this process.
+   * @fd The socket, which must be bound and listening already.
+   *
+   * The socket belongs to this object until a server takes it.
+   */
+  void adopt(int fd) {
+    std::lock_guard<mutex> l(lock);
+    adopted.push_back(fd);
+  }
+
+  /* Whether a socket was handed over for an endpoint.
+   * @target The endpoint that a server is to be set up for.
+   *
+   * @return `true` if take() would return a socket.
+   */
+  template <typename endpoint>
+  bool has(const endpoint &target) const {
+    std::lock_guard<mutex> l(lock);
+    for (const int fd : adopted) {
+      if (boundTo(fd, target)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Take a socket that was handed over.
+   * @target The endpoint that a server is to be set up for.
+   *
+   * Each socket is only returned once; with more than one shard, there may be
+   * several for the same endpoint.
+   *
+   * @return A socket bound to `target`, or -1 if there isn't one.
+   */
+  template <typename endpoint>
+  int take(const endpoint &target) {
+    std::lock_guard<mutex> l(lock);
+    for (auto it = adopted.begin(); it != adopted.end(); it++) {
+      if (boundTo(*it, target)) {
+        const int fd = *it;
+        adopted.erase(it);
+        return fd;
+      }
+    }
+    return -1;
+  }
+
+  /* Close the sockets that no server took.
+   *
+   * Called once all servers are set up, so that clients don't queue up on a
+   * socket that nobody will accept connections on.
+   */
+  void discard(void) {
+    std::lock_guard<mutex> l(lock);
+    for (const int fd : adopted) {
+      ::close(fd);
+    }
+    adopted.clear();
+  }
+
+  /* Register a server's listening socket.
+   * @owner The server, so it can take itself out again with remove().
+   * @fd The socket the server accepts connections on.
+   */
+  void add(const void *owner, int fd) {
+    std::lock_guard<mutex> l(lock);
+    open[owner] = fd;
+  }
+
+  /* Take a server out again.
+   * @owner The server, as passed to add().
+   *
+   * Must be called before the server closes its socket.
+   */
+  void remove(const void *owner) {
+    std::lock_guard<mutex> l(lock);
+    open.erase(owner);
+  }
+
+  /* Sockets that servers are listening on.
+   *
+   * @return The registered servers' sockets, which remain theirs.
+   */
+  std::vector<int> active(void) const {
+    std::lock_guard<mutex> l(lock);
+    std::vector<int> rv;
+    for (const auto &o : open) {
+      rv.push_back(o.second);
+    }
+    return rv;
+  }
+
+ protected:
+  /* Sockets that were handed over, which no server has taken yet. */
+  std::vector<int> adopted;
+
+  /* Listening sockets, by server. */
+  std::unordered_map<const void *, int> open;
+
+  /* Guards <adopted> and <open>. */
+  mutable mutex lock;
+};
+}
+
 // define USE_DEFAULT_IO_MAIN to use this main function, or just call it.
 #if defined(USE_DEFAULT_IO_MAIN)
 #define IO_MAIN_SPEC extern "C"
@@ -42,15 +560,41 @@ using service = asio::io_service;
  * @argv Argument vector.
  *
  * Applies all arguments with the efgy::cli facilities, then (tries to) run an
- * ASIO I/O loop.
+ * ASIO I/O loop, on as many threads and shards as requested.
+ *
+ * If that set up any servers, a SIGTERM drains them, and the function returns
+ * once they're done. Only the first SIGTERM is handled like that; another one
+ * kills the process as usual, without waiting any longer. The same goes for
+ * drains that were started some other way, e.g. by handing the servers'
+ * sockets to a new process.
  *
  * @return 0 on success, -1 on failure.
  */
 IO_MAIN_SPEC int main(int argc, char *argv[]) {
   efgy::cli::options opts(argc, argv);
+  service &io = efgy::global<service>();
+  asio::signal_set signals(io);
+  net::shutdown &stop = efgy::global<net::shutdown>();
 
-  efgy::global<service>().run();
+  if (!stop.empty()) {
+    signals.add(SIGTERM);
+    signals.async_wait([&stop](const asio::error_code &error, int) {
+      if (!error) {
+        stop.drain();
+      }
+    });
+    stop.add(&signals, [&io, &signals](std::chrono::milliseconds) {
+      io.post([&signals]() {
+        asio::error_code ec;
+        signals.clear(ec);
+        signals.cancel(ec);
+      });
+    });
+  }
+
+  runShards();
 
+  stop.remove(&signals);
   return opts.matches == 0 ? -1 : 0;
 }
 
@@ -60,6 +604,16 @@ using unix = asio::local::stream_protocol;
 }
 
 namespace net {
+#if defined(SO_REUSEPORT)
+/* SO_REUSEPORT socket option.
+ *
+ * ASIO doesn't have this one, but it's a plain boolean socket option, so we can
+ * define it easily enough.
+ */
+using reusePort =
+    asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
 /* Endpoint type alias.
  * @transport The ASIO transport type, e.g. asio::ip::tcp.
  *
@@ -69,6 +623,281 @@ namespace net {
 template <typename transport>
 using endpointType = typename transport::endpoint;
 
+/* Host name cache.
+ *
+ * Remembers what TCP host and port names resolved to, so that clients don't
+ * have to ask the system's resolver every time they connect somewhere. Failed
+ * lookups are remembered as well, though not for as long. Neither ASIO nor the
+ * system resolver tell us how long a DNS answer is valid for, so entries are
+ * kept for a fixed amount of time instead.
+ *
+ * Names can also be taken from a hosts file, with load(); these never expire,
+ * and are used in place of whatever the DNS would have said.
+ */
+class resolverCache {
+ public:
+  /* Endpoint list type.
+   *
+   * What a host and port resolve to, in the order that the resolver gave them.
+   */
+  using endpoints = std::vector<transport::tcp::endpoint>;
+
+  /* Lookup handler type.
+   *
+   * Called with the error and the endpoints that a lookup resulted in.
+   */
+  using handler =
+      std::function<void(const asio::error_code &, const endpoints &)>;
+
+  /* How long to remember successful lookups. */
+  std::chrono::milliseconds ttl = std::chrono::seconds(60);
+
+  /* How long to remember failed lookups. */
+  std::chrono::milliseconds negativeTtl = std::chrono::seconds(5);
+
+  /* How many lookups to remember.
+   *
+   * Once there's this many, expired entries are dropped when adding a new one.
+   * If that doesn't make room, everything is dropped.
+   */
+  std::size_t limit = 1024;
+
+  /* Load a hosts file.
+   * @file Path to the file.
+   *
+   * The file uses the same format as /etc/hosts: an address, followed by the
+   * names that it should be used for, with comments starting with a '#'.
+   *
+   * @return `true` if the file could be read.
+   */
+  bool load(const std::string &file) {
+    std::ifstream in(file);
+    std::string line;
+
+    if (!in) {
+      return false;
+    }
+
+    std::lock_guard<mutex> l(lock);
+
+    while (std::getline(in, line)) {
+      std::istringstream fields(line.substr(0, line.find('#')));
+      std::string address, name;
+      asio::error_code ec;
+
+      if (fields >> address) {
+        const auto a = asio::ip::make_address(address, ec);
+        while (!ec && fields >> name) {
+          hosts[name].push_back(a);
+        }
+      }
+    }
+
+    return true;
+  }
+
+  /* Look up a host and port.
+   * @host The host name.
+   * @port The port number or service name.
+   * @results Set to the endpoints that the names resolved to.
+   * @error Set to the error that the lookup resulted in.
+   *
+   * Only looks at the hosts file and at what has been store()d before, and
+   * never asks the resolver.
+   *
+   * @return `true` if the answer was known, `false` if it needs looking up.
+   */
+  bool find(const std::string &host, const std::string &port,
+            endpoints &results, asio::error_code &error) {
+    std::lock_guard<mutex> l(lock);
+    const auto h = hosts.find(host);
+
+    results.clear();
+    error = asio::error_code();
+
+    if (h != hosts.end()) {
+      const unsigned short p = number(port);
+      if (p == 0) {
+        error = asio::error::service_not_found;
+      }
+      for (const auto &a : h->second) {
+        if (p != 0) {
+          results.emplace_back(a, p);
+        }
+      }
+      return true;
+    }
+
+    const auto e = entries.find(key(host, port));
+    if (e == entries.end()) {
+      return false;
+    } else if (e->second.expires <= std::chrono::steady_clock::now()) {
+      entries.erase(e);
+      return false;
+    }
+
+    results = e->second.results;
+    error = e->second.error;
+    return true;
+  }
+
+  /* Remember a lookup.
+   * @host The host name.
+   * @port The port number or service name.
+   * @results The endpoints that the names resolved to.
+   * @error The error that the lookup resulted in, if any.
+   *
+   * Lookups that failed, or that didn't produce any endpoints, are kept for
+   * <negativeTtl>, all others for <ttl>.
+   */
+  void store(const std::string &host, const std::string &port,
+             const endpoints &results, const asio::error_code &error) {
+    const auto now = std::chrono::steady_clock::now();
+    const bool good = !error && !results.empty();
+    std::lock_guard<mutex> l(lock);
+
+    if (entries.size() >= limit) {
+      for (auto it = entries.begin(); it != entries.end();) {
+        it = it->second.expires <= now ? entries.erase(it) : std::next(it);
+      }
+      if (entries.size() >= limit) {
+        entries.clear();
+      }
+    }
+
+    entries[key(host, port)] = {results, error,
+                                now + (good ? ttl : negativeTtl)};
+  }
+
+  /* Wait for a lookup.
+   * @host The host name.
+   * @port The port number or service name.
+   * @waiter Called with the answer, once there is one.
+   *
+   * So that a name is only asked about once at a time, no matter how many want
+   * to know about it: the first to wait for a name needs to ask the resolver,
+   * and settle() the lookup with the answer. Everyone else just gets the same
+   * answer.
+   *
+   * @return `true` if the name needs looking up, `false` if that's already
+   * being done.
+   */
+  bool join(const std::string &host, const std::string &port,
+            handler waiter) {
+    std::lock_guard<mutex> l(lock);
+    auto &w = pending[key(host, port)];
+
+    w.push_back(waiter);
+    return w.size() == 1;
+  }
+
+  /* Settle a lookup.
+   * @host The host name.
+   * @port The port number or service name.
+   * @results The endpoints that the names resolved to.
+   * @error The error that the lookup resulted in, if any.
+   *
+   * Remembers the answer with store(), then passes it on to everything that
+   * join()ed the lookup, in the order they did so.
+   */
+  void settle(const std::string &host, const std::string &port,
+              const endpoints &results, const asio::error_code &error) {
+    std::vector<handler> waiters;
+
+    store(host, port, results, error);
+
+    {
+      std::lock_guard<mutex> l(lock);
+      const auto w = pending.find(key(host, port));
+      if (w != pending.end()) {
+        waiters.swap(w->second);
+        pending.erase(w);
+      }
+    }
+
+    for (const auto &waiter : waiters) {
+      waiter(error, results);
+    }
+  }
+
+ protected:
+  /* A remembered lookup. */
+  struct entry {
+    /* The endpoints that the lookup produced. */
+    endpoints results;
+
+    /* The error that the lookup resulted in, if any. */
+    asio::error_code error;
+
+    /* When to forget about the lookup. */
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  /* Remembered lookups, by host and port. Guarded by <lock>. */
+  std::unordered_map<std::string, entry> entries;
+
+  /* Addresses from the hosts file, by name. Guarded by <lock>. */
+  std::unordered_map<std::string, std::vector<asio::ip::address>> hosts;
+
+  /* What's waiting for lookups, by host and port. Guarded by <lock>. */
+  std::unordered_map<std::string, std::vector<handler>> pending;
+
+  /* Guards <entries>, <hosts> and <pending>. */
+  mutex lock;
+
+  /* Get the key for a lookup.
+   * @host The host name.
+   * @port The port number or service name.
+   *
+   * @return A string with both names, which can't be confused with another.
+   */
+  static std::string key(const std::string &host, const std::string &port) {
+    return host + '\0' + port;
+  }
+
+  /* Get a port number.
+   * @port A port number or service name.
+   *
+   * Service names are looked up in the system's service database, which is a
+   * local file, so this doesn't need to wait for the network.
+   *
+   * @return The port number, or 0 if there's no such service.
+   */
+  static unsigned short number(const std::string &port) {
+    if (!port.empty() &&
+        port.find_first_not_of("0123456789") == std::string::npos) {
+      try {
+        const unsigned long n = std::stoul(port);
+        return n <= 0xffff ? (unsigned short)n : 0;
+      } catch (...) {
+        return 0;
+      }
+    }
+
+    const struct servent *s = getservbyname(port.c_str(), "tcp");
+    return s == nullptr ? 0 : ntohs((unsigned short)s->s_port);
+  }
+};
+
+/* Load a hosts file into the host name cache.
+ * @match The matches from the CLI option regex.
+ *
+ * Loads the file named in match[1] into the global host name cache.
+ *
+ * @return `true` if the file could be read.
+ */
+static inline bool setHostsFile(std::smatch &match) {
+  return efgy::global<resolverCache>().load(match[1]);
+}
+
+/* Hosts file CLI option.
+ *
+ * The format is `hosts-file:(path)`.
+ */
+static efgy::cli::option hostsFile(
+    "-{0,2}hosts-file:(.+)", setHostsFile,
+    "resolve host names with the file [1] first");
+
 /* ASIO endpoint wrapper.
  * @transport The ASIO transport type, e.g. asio::ip::tcp.
  *
@@ -81,12 +910,42 @@ class endpoint : public std::array<endpointType<transport>, 1> {
   /* Construct with socket name.
    * @pSocket A UNIX socket address.
    * @service Ignored, for compatibility with TCP.
+   * @io Ignored as well, as there's nothing to resolve.
    *
    * Initialses the endpoint given a socket name. This merely forwards
    * construction to the base class.
    */
-  endpoint(const std::string &pSocket, const std::string &service = "")
+  endpoint(const std::string &pSocket, const std::string &service = "",
+           cxxhttp::service &io = efgy::global<cxxhttp::service>())
       : std::array<endpointType<transport>, 1>{{pSocket}} {}
+
+  /* Get the endpoints without waiting.
+   * @results Set to the socket's endpoint.
+   * @error Cleared, as there's nothing to look up.
+   *
+   * For symmetry with TCP, where the lookup may have to wait for the DNS.
+   *
+   * @return Always `true`.
+   */
+  bool lookup(std::vector<endpointType<transport>> &results,
+              asio::error_code &error) const {
+    results.assign(this->begin(), this->end());
+    error = asio::error_code();
+    return true;
+  }
+
+  /* Get the endpoints.
+   * @handler Called with an error code and the endpoints.
+   *
+   * Calls the handler right away, with the result of lookup().
+   */
+  template <typename handlerType>
+  void resolve(handlerType handler) const {
+    std::vector<endpointType<transport>> results;
+    asio::error_code error;
+    lookup(results, error);
+    handler(error, results);
+  }
 };
 
 /* ASIO TCP endpoint wrapper.
@@ -119,37 +978,129 @@ class endpoint<transport::tcp> {
    * @pHost The target host for the endpoint.
    * @pPort The target port for the endpoint. Can be a service name.
    * @pService IO service, for use when resolving host and port names.
+   * @pCache Where to remember what host and port names resolved to.
    *
    * Remembers a socket's host and port, but does not look them up just yet.
-   * with() does that.
+   * lookup(), resolve() and begin() do that.
    */
   endpoint(const std::string &pHost, const std::string &pPort,
-           cxxhttp::service &pService = efgy::global<cxxhttp::service>())
-      : host(pHost), port(pPort), service(pService) {}
+           cxxhttp::service &pService = efgy::global<cxxhttp::service>(),
+           resolverCache &pCache = efgy::global<resolverCache>())
+      : host(pHost), port(pPort), service(pService), cache(pCache) {}
+
+  /* Get the endpoints without waiting.
+   * @results Set to the endpoints that the host and port resolve to.
+   * @error Set to the error that the lookup resulted in.
+   *
+   * Works if the host is an IP address, or if the cache knows about the host.
+   * Without threads, ASIO can't resolve names in the background, so this
+   * resolves them right here and always works.
+   *
+   * @return `true` if there's an answer, `false` if resolve() is needed.
+   */
+  bool lookup(std::vector<endpointType> &results,
+              asio::error_code &error) const {
+    const auto address = asio::ip::make_address(host, error);
+
+    if (!error) {
+      results.clear();
+      for (auto it = resolver(service).resolve(
+               resolver::query(address.to_string(), port,
+                                resolver::query::numeric_host),
+               error);
+           it != resolver::iterator(); ++it) {
+        results.push_back(*it);
+      }
+      return true;
+    }
+
+    if (cache.find(host, port, results, error)) {
+      return true;
+    }
+
+#if defined(ASIO_DISABLE_THREADS)
+    results = wait(error);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  /* Get the endpoints.
+   * @handler Called with an error code and the endpoints.
+   *
+   * Calls the handler right away if lookup() knows the answer. Otherwise, the
+   * names are resolved in the background, and the handler is called on the
+   * I/O service once that's done. Either way, the cache remembers the answer.
+   * If the names are already being resolved, the handler waits for that
+   * answer instead of asking again.
+   */
+  template <typename handlerType>
+  void resolve(handlerType handler) const {
+    std::vector<endpointType> results;
+    asio::error_code error;
+
+    if (lookup(results, error)) {
+      handler(error, results);
+      return;
+    }
+
+    if (!cache.join(host, port, handler)) {
+      return;
+    }
+
+    auto r = std::make_shared<resolver>(service);
+    resolverCache &c = cache;
+    const std::string h = host, p = port;
+
+    r->async_resolve(resolver::query(host, port),
+                     [r, &c, h, p](const asio::error_code &error,
+                                   resolver::iterator it) {
+                       std::vector<endpointType> results;
+                       for (; it != resolver::iterator(); ++it) {
+                         results.push_back(*it);
+                       }
+                       c.settle(h, p, results, error);
+                     });
+  }
 
   /* Get first iterator for DNS resolution.
    *
-   * To make DNS resolution work all nice and shiny with C++11 for loops.
+   * To make DNS resolution work all nice and shiny with C++11 for loops. This
+   * waits for the DNS if the cache doesn't know about the host, so it's best
+   * kept to setting things up, before running the I/O service. Throws if the
+   * names can't be resolved.
    *
    * @return An interator pointing to the start of resolved endpoints.
    */
-  resolver::iterator begin(void) const {
-    return resolver(service).resolve(resolver::query(host, port));
+  std::vector<endpointType>::const_iterator begin(void) const {
+    asio::error_code error;
+
+    if (!lookup(results, error)) {
+      results = wait(error);
+    }
+    if (error) {
+      throw asio::system_error(error);
+    }
+
+    return results.begin();
   }
 
   /* Get final iterator for DNS resolution.
    *
-   * Basically an empty iterator, which is how ASIO works here.
+   * Only valid after begin() has been called.
    *
    * @return An iterator pointing past the final element of resolved endpoints.
    */
-  resolver::iterator end(void) const { return resolver::iterator(); }
+  std::vector<endpointType>::const_iterator end(void) const {
+    return results.end();
+  }
 
  protected:
   /* Host name.
    *
    * Passed into the constructor. Can be an IP address in string form, in which
-   * case the resolver will still get it right.
+   * case there's nothing to resolve.
    */
   const std::string host;
 
@@ -161,11 +1112,85 @@ class endpoint<transport::tcp> {
 
   /* IO service reference.
    *
-   * Used by with() to create a DNS resolver.
+   * Used to create DNS resolvers.
    */
   cxxhttp::service &service;
+
+  /* Host name cache. */
+  resolverCache &cache;
+
+  /* Endpoints for begin() and end(). */
+  mutable std::vector<endpointType> results;
+
+  /* Resolve host and port, waiting for the answer.
+   * @error Set to the error that the lookup resulted in.
+   *
+   * Remembers the answer in the cache.
+   *
+   * @return The endpoints that the host and port resolve to.
+   */
+  std::vector<endpointType> wait(asio::error_code &error) const {
+    std::vector<endpointType> found;
+
+    for (auto it = resolver(service).resolve(resolver::query(host, port),
+                                             error);
+         it != resolver::iterator(); ++it) {
+      found.push_back(*it);
+    }
+    cache.store(host, port, found, error);
+    return found;
+  }
 };
 
+/* Hash an endpoint.
+ * @endpoint The endpoint to hash.
+ *
+ * Falls back to std::hash for endpoint types that don't have an overload of
+ * their own.
+ *
+ * @return A hash of the endpoint.
+ */
+template <typename T>
+static inline std::size_t hash(const T &endpoint) {
+  return std::hash<T>()(endpoint);
+}
+
+/* Hash an IP endpoint.
+ * @endpoint The endpoint to hash.
+ *
+ * Uses the address bytes and the port, which is what endpoints are compared
+ * by.
+ *
+ * @return A hash of the endpoint.
+ */
+template <typename protocol>
+static inline std::size_t hash(
+    const asio::ip::basic_endpoint<protocol> &endpoint) {
+  const auto address = endpoint.address();
+  std::string bytes;
+
+  if (address.is_v4()) {
+    const auto b = address.to_v4().to_bytes();
+    bytes.assign(b.begin(), b.end());
+  } else {
+    const auto b = address.to_v6().to_bytes();
+    bytes.assign(b.begin(), b.end());
+  }
+
+  return std::hash<std::string>()(bytes) * 31 + endpoint.port();
+}
+
+/* Hash a UNIX socket endpoint.
+ * @endpoint The endpoint to hash.
+ *
+ * @return A hash of the socket's path.
+ */
+template <typename protocol>
+static inline std::size_t hash(
+    const asio::local::basic_endpoint<protocol> &endpoint) {
+  return std::hash<std::string>()(endpoint.path());
+}
+
 /* Basic asynchronous connection wrapper
  * @session The session type. We need this as they're registered.
  * @requestProcessor The class of something that can handle requests.
@@ -206,10 +1231,24 @@ class connection {
   /* Active sessions.
    *
    * The sessions that are currently active. This list is maintained using a
-   * beaon in the session object.
+   * beaon in the session object. Guarded by <sessionsLock>.
    */
   efgy::beacons<session> sessions;
 
+  /* Number of connections turned away.
+   *
+   * Counts connections over the processor's limit that were sent its overload
+   * reply and closed.
+   */
+  std::atomic<std::size_t> shed{0};
+
+  /* Number of times accepting connections was paused.
+   *
+   * Counts how often the processor's limit was reached, for processors that
+   * don't turn connections away.
+   */
+  std::atomic<std::size_t> pauses{0};
+
   /* Initialise with IO service.
    * @pio IO service to use.
    * @pConnections The root of the connection set to register with.
@@ -220,7 +1259,23 @@ class connection {
   connection(efgy::beacons<connection> &pConnections =
                  efgy::global<efgy::beacons<connection>>(),
              service &pio = efgy::global<service>())
-      : io(pio), pending(false), acceptor(pio), beacon(*this, pConnections) {}
+      : io(pio),
+        pending(false),
+        busy(0),
+        paused(false),
+        stopping(false),
+        connections(pConnections),
+        listed(false),
+        acceptor(pio),
+        overflow(pio),
+        target(),
+        beacon(*this, pConnections),
+        connectTimer(pio),
+        connectStrand(pio),
+        acceptStrand(pio),
+        drainTimer(pio) {
+    enlist(false);
+  }
 
   /* Initialise with IO service and endpoint.
    * @endpoint Where to connect to, or listen on.
@@ -233,19 +1288,60 @@ class connection {
              efgy::beacons<connection> &pConnections =
                  efgy::global<efgy::beacons<connection>>(),
              service &pio = efgy::global<service>())
+      : connection(endpoint, nullptr, pConnections, pio) {}
+
+  /* Initialise with IO service and endpoint, and set up the processor.
+   * @endpoint Where to connect to, or listen on.
+   * @setup Called with the new processor, before anything is started.
+   * @pio IO service to use.
+   * @pConnections The root of the connection set to register with.
+   *
+   * Servers bind and listen as soon as they're started, so settings that apply
+   * to the listening socket, like the processor's socket options, have to be
+   * made in <setup> to take effect.
+   */
+  connection(const endpointType<transport> &endpoint,
+             std::function<void(requestProcessor &)> setup,
+             efgy::beacons<connection> &pConnections =
+                 efgy::global<efgy::beacons<connection>>(),
+             service &pio = efgy::global<service>())
       : io(pio),
         pending(true),
+        busy(0),
+        paused(false),
+        stopping(false),
+        connections(pConnections),
+        listed(false),
         acceptor(pio),
+        overflow(pio),
         target(endpoint),
-        beacon(*this, pConnections) {
+        beacon(*this, pConnections),
+        connectTimer(pio),
+        connectStrand(pio),
+        acceptStrand(pio),
+        drainTimer(pio) {
+    enlist(true);
+    if (setup) {
+      setup(processor);
+    }
     start();
   }
 
   /* Destroy connection.
    *
-   * This kills all the sessions that this connection kept track of.
+   * This kills all the sessions that this connection kept track of, and takes
+   * the connection out of the set's index.
    */
   ~connection(void) {
+    delist();
+    efgy::global<shutdown>().remove(this);
+    efgy::global<listeners>().remove(this);
+
+    std::lock_guard<mutex> lock(sessionsLock);
+
+    // sessions that are deleted here must not start accepting again.
+    paused = false;
+
     while (sessions.size() > 0) {
       auto it = sessions.begin();
       auto s = *it;
@@ -259,9 +1355,10 @@ class connection {
    * @pio IO service to use.
    * @pConnections The root of the connection set to register with.
    *
-   * This will scan through all connections to find one that is either idle and
-   * return that one, or one that has the same parameters to tag along to, or it
-   * will create an entirely new one.
+   * This will look up a connection with the same parameters to tag along to,
+   * or take one off the set's idle list and point it at the endpoint, or it
+   * will create an entirely new one. Both lookups go through the set's index,
+   * so this takes the same time no matter how many connections there are.
    *
    * @return A connection, which is valid for the given parameters.
    */
@@ -269,30 +1366,130 @@ class connection {
                          efgy::beacons<connection> &pConnections =
                              efgy::global<efgy::beacons<connection>>(),
                          service &pio = efgy::global<service>()) {
-    connection *idle = 0;
-
-    for (auto &c : pConnections) {
-      if (&pio == &(c->io)) {
-        if (idle == 0 && c->idle()) {
-          idle = c;
-        } else if (c->target == endpoint) {
-          return *c;
-        }
+    std::lock_guard<mutex> lock(registryLock());
+    registry &ix = index(pConnections);
+
+    auto match = ix.hosts.find({&pio, endpoint});
+    if (match != ix.hosts.end() && !match->second.connections.empty()) {
+      connection &c = *match->second.connections.front();
+      if (c.idle()) {
+        c.pending = true;
+        c.start();
+      }
+      return c;
+    }
+
+    return fresh(endpoint, ix, pConnections, pio);
+  }
+
+  /* Get a pooled client connection.
+   * @endpoint Where to connect to.
+   * @pool The client pool, with its limits.
+   * @pConnections The root of the connection set to register with.
+   * @pio IO service to use.
+   * @avoid Processors of connections not to use, e.g. because an earlier
+   *     attempt at the same request is stuck on them.
+   *
+   * Prefers a connection to the endpoint that's being kept open with nothing
+   * to do, then one that's done and closed, then a new one, as long as the
+   * pool's connection limit for the host allows for that. Past that limit,
+   * requests wait for the connection to the host with the fewest of them.
+   *
+   * Only works for clients, as the processor needs to support pooling.
+   *
+   * @return A connection to send a request on, or `nullptr` if the host only
+   * has connections to avoid and no room for another one.
+   */
+  template <typename poolType>
+  static connection *acquire(const endpointType<transport> &endpoint,
+                             poolType &pool,
+                             efgy::beacons<connection> &pConnections =
+                                 efgy::global<efgy::beacons<connection>>(),
+                             service &pio = efgy::global<service>(),
+                             const std::vector<const void *> &avoid = {}) {
+    std::lock_guard<mutex> lock(registryLock());
+    registry &ix = index(pConnections);
+    auto &h = ix.hosts[{&pio, endpoint}];
+    connection *c = nullptr;
+    connection *least = nullptr;
+
+    for (auto candidate : h.connections) {
+      if (std::find(avoid.begin(), avoid.end(), &candidate->processor) !=
+          avoid.end()) {
+        continue;
+      } else if (candidate->processor.ready()) {
+        c = candidate;
+        break;
+      } else if (candidate->idle()) {
+        c = candidate;
+        c->pending = true;
+        c->processor.pooled(pool, h.idle);
+        c->start(pool.connectTimeout);
+        pool.opened++;
+        break;
+      } else if (least == nullptr ||
+                 candidate->processor.load() < least->processor.load()) {
+        least = candidate;
       }
     }
 
-    if (idle) {
-      // if we found an idle connection, then set it up and return it.
-      idle->pending = true;
-      idle->target = endpoint;
-      idle->start();
-      return *idle;
+    if (c == nullptr && least != nullptr &&
+        h.connections.size() >= pool.maxConnections) {
+      c = least;
+      pool.queued++;
+    } else if (c == nullptr && !avoid.empty() &&
+               h.connections.size() >= pool.maxConnections) {
+      // the host's connections are all to be avoided, and it's at its limit.
+      return nullptr;
+    } else if (c == nullptr) {
+      c = &fresh(endpoint, ix, pConnections, pio, pool.connectTimeout);
+      pool.opened++;
+    }
+
+    c->processor.pooled(pool, h.idle);
+    return c;
+  }
+
+  /* Get a client connection to point somewhere later.
+   * @pConnections The root of the connection set to register with.
+   * @pio IO service to use.
+   *
+   * For when it's not known yet where to connect to, e.g. while a host name is
+   * being resolved. The connection never connects anywhere, but requests can
+   * be queued on it in the meantime, until they're moved to a connection that
+   * does and the spare is given up on with abandon().
+   *
+   * @return A connection that nothing else will use.
+   */
+  static connection &spare(efgy::beacons<connection> &pConnections =
+                               efgy::global<efgy::beacons<connection>>(),
+                           service &pio = efgy::global<service>()) {
+    std::lock_guard<mutex> lock(registryLock());
+    registry &ix = index(pConnections);
+    connection *c = takeIdle(ix, pio);
+
+    if (c == nullptr) {
+      c = new connection(pConnections, pio);
+    }
+
+    c->pending = true;
+    return *c;
+  }
+
+  /* Give up on a spare connection.
+   *
+   * Puts a connection from spare() back on the idle list, without ever having
+   * connected it. Whatever was queued on it should be dealt with first.
+   */
+  void abandon(void) {
+    std::lock_guard<mutex> lock(registryLock());
+
+    {
+      std::lock_guard<mutex> l(sessionsLock);
+      pending = false;
     }
 
-    // since we use beacons that insert and remove from pConnections, this does
-    // not actually leak memory. Though it does seem to confuse valgrind. But
-    // reusal is working, so it can't be leaking.
-    return *(new connection(endpoint, pConnections, pio));
+    enlistIdle();
   }
 
   /* Pad a pool of connections to a given number.
@@ -312,11 +1509,26 @@ class connection {
   static void pad(std::size_t n, efgy::beacons<connection> &pConnections =
                                      efgy::global<efgy::beacons<connection>>(),
                   service &pio = efgy::global<service>()) {
+    std::lock_guard<mutex> lock(registryLock());
+
     while (pConnections.size() < n) {
       new connection(pConnections, pio);
     }
   }
 
+  /* Count the targets in a connection set's index.
+   * @pConnections The root of the connection set.
+   *
+   * Targets are only kept in the index while there are connections to them.
+   *
+   * @return How many different I/O service and endpoint pairs are indexed.
+   */
+  static std::size_t targets(const efgy::beacons<connection> &pConnections =
+                                 efgy::global<efgy::beacons<connection>>()) {
+    std::lock_guard<mutex> lock(registryLock());
+    return index(pConnections).hosts.size();
+  }
+
   /* Is this connection idle?
    *
    * Used when trying to find a connection to reuse. This determines whether the
@@ -325,13 +1537,8 @@ class connection {
    * @return Whether the session can be reused.
    */
   bool idle(void) const {
-    bool isIdle = !pending;
-
-    for (const auto &s : sessions) {
-      isIdle = isIdle && s->free;
-    }
-
-    return isIdle;
+    std::lock_guard<mutex> lock(sessionsLock);
+    return !pending && busy == 0;
   }
 
   /* Query local endpoint.
@@ -359,26 +1566,400 @@ class connection {
 
   /* Get a free session.
    *
-   * Steps through all sessions to obtain a free one, If no sessions are free,
-   * this will instead return a brand new one.
+   * Takes a session off the free list, or creates a brand new one if there's
+   * no free session.
    *
    * This allows recycling sessions, which in turn means we don't have to do
    * ugly things like kill sessions ourselves.
    *
-   * @return A free session, or null.
+   * @return A free session.
    */
   session *getSession(void) {
-    for (auto &sess : sessions) {
-      if (sess->free) {
-        sess->free = false;
-        return sess;
-      }
+    std::lock_guard<mutex> lock(sessionsLock);
+
+    busy++;
+
+    if (!freeSessions.empty()) {
+      session *sess = freeSessions.back();
+      freeSessions.pop_back();
+      sess->free = false;
+      return sess;
     }
 
     return new session(*this);
   }
 
+  /* Hand back a session.
+   * @sess A session from getSession() that is done.
+   *
+   * Marks the session as free and puts it on the free list, so getSession()
+   * can hand it out again. Sessions call this when they've been recycled, and
+   * must only do so once for each time they were handed out. If accepting new
+   * connections was paused, because there were too many, this picks it up
+   * again. If the connection is being drained and this was its last session,
+   * the drain timeout is no longer needed.
+   */
+  void release(session *sess) {
+    bool nowIdle;
+    bool unpause;
+    bool drained;
+
+    {
+      std::lock_guard<mutex> lock(sessionsLock);
+
+      sess->free = true;
+      freeSessions.push_back(sess);
+      busy--;
+      nowIdle = !pending && busy == 0;
+      unpause = paused;
+      paused = false;
+      drained = stopping && busy == 0;
+    }
+
+    if (nowIdle) {
+      std::lock_guard<mutex> lock(registryLock());
+      enlistIdle();
+    }
+
+    if (unpause && resume) {
+      resume();
+    }
+
+    if (drained) {
+      acceptStrand.post([this]() {
+        asio::error_code ec;
+        drainTimer.cancel(ec);
+      });
+    }
+  }
+
+  /* Stop accepting connections, and close the open ones.
+   * @timeout How long to wait for requests in flight; zero means no limit.
+   *
+   * Closes the listening socket, then has every session close its connection
+   * once it has answered the request it's working on; the reply to that
+   * request asks the client to close the connection, too. Connections that are
+   * waiting for a request are closed right away, and any that are still open
+   * after the timeout are closed regardless.
+   *
+   * After that, the connection has nothing left for the I/O service to do, and
+   * it can't be started again. Only used for servers; may be called from any
+   * thread.
+   */
+  void drain(std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+    acceptStrand.dispatch([this, timeout]() {
+      std::vector<session *> open;
+
+      {
+        std::lock_guard<mutex> lock(sessionsLock);
+
+        if (stopping) {
+          return;
+        }
+        stopping = true;
+        paused = false;
+        open = inUse();
+      }
+
+      asio::error_code ec;
+      efgy::global<listeners>().remove(this);
+      acceptor.close(ec);
+
+      if (timeout.count() > 0 && !open.empty()) {
+        drainTimer.expires_from_now(timeout);
+        drainTimer.async_wait(
+            acceptStrand.wrap([this](const std::error_code &error) {
+              std::vector<session *> left;
+
+              if (!error) {
+                std::lock_guard<mutex> lock(sessionsLock);
+                left = inUse();
+              }
+
+              for (auto s : left) {
+                s->drain(true);
+              }
+            }));
+      }
+
+      for (auto s : open) {
+        s->drain();
+      }
+    });
+  }
+
+  /* Connection registry lock.
+   *
+   * Guards the connection sets that get() and pad() look through and add to,
+   * and their indices. Connections that are created or destroyed directly,
+   * rather than through those functions, should be set up before running the
+   * I/O service on more than one thread.
+   *
+   * @return The lock for this connection type.
+   */
+  static mutex &registryLock(void) {
+    static mutex lock;
+    return lock;
+  }
+
  protected:
+  /* Session set lock.
+   *
+   * Guards <sessions> when running the I/O service on more than one thread.
+   */
+  mutable mutex sessionsLock;
+
+  /* Free sessions.
+   *
+   * Sessions that have been handed back with release(), and which getSession()
+   * hands out again, most recently used first. Guarded by <sessionsLock>.
+   */
+  std::vector<session *> freeSessions;
+
+  /* Number of sessions in use.
+   *
+   * Sessions handed out by getSession() that haven't been released yet.
+   * Guarded by <sessionsLock>.
+   */
+  std::size_t busy;
+
+  /* Whether accepting connections is paused.
+   *
+   * Set when the processor's session limit is reached, and cleared by the
+   * next release(). Guarded by <sessionsLock>.
+   */
+  bool paused;
+
+  /* Whether the connection is being drained.
+   *
+   * Set by drain(), and never cleared. Guarded by <sessionsLock>, but only
+   * ever set through <acceptStrand>, which may read it without the lock.
+   */
+  bool stopping;
+
+  /* The connection set this connection is registered with. */
+  efgy::beacons<connection> &connections;
+
+  /* Whether the connection is on its set's idle list.
+   *
+   * Guarded by registryLock().
+   */
+  bool listed;
+
+  /* Connection set index.
+   *
+   * Lets get() and acquire() find connections by I/O service and target
+   * endpoint, and idle connections by I/O service, without looking at every
+   * connection in the set. The idle lists may have connections on them that
+   * have since become busy again; get() skips over those, and they're put back
+   * on the list by release() once they're idle.
+   */
+  struct registry {
+    /* Index key.
+     *
+     * Connections can only be shared if they use the same I/O service.
+     */
+    struct key {
+      /* The connection's I/O service. */
+      const service *io;
+
+      /* The connection's target endpoint. */
+      endpointType<transport> target;
+
+      /* Compare keys.
+       * @k The key to compare to.
+       *
+       * @return Whether both keys have the same I/O service and target.
+       */
+      bool operator==(const key &k) const {
+        return io == k.io && target == k.target;
+      }
+    };
+
+    /* Index key hash function. */
+    struct keyHash {
+      /* Hash a key.
+       * @k The key to hash.
+       *
+       * @return A hash of both the I/O service and target.
+       */
+      std::size_t operator()(const key &k) const {
+        return std::hash<const service *>()(k.io) ^ net::hash(k.target);
+      }
+    };
+
+    /* Connections to one target. */
+    struct host {
+      /* The connections, oldest first. */
+      std::vector<connection *> connections;
+
+      /* How many of the connections are being kept open with nothing to do.
+       *
+       * Kept up to date by the connections' processors, if they're pooled.
+       */
+      std::atomic<std::size_t> idle{0};
+    };
+
+    /* Connections by I/O service and target endpoint. */
+    std::unordered_map<key, host, keyHash> hosts;
+
+    /* Idle connections by I/O service, most recently idle last. */
+    std::unordered_map<const service *, std::vector<connection *>> idle;
+
+    /* Add a connection to the target index.
+     * @c The connection to add.
+     */
+    void insert(connection &c) {
+      hosts[{&c.io, c.target}].connections.push_back(&c);
+    }
+
+    /* Remove a connection from the target index.
+     * @c The connection to remove.
+     *
+     * Targets that have no connections left are dropped as well, so that the
+     * index doesn't keep growing with every host that was ever talked to.
+     */
+    void erase(connection &c) {
+      auto h = hosts.find({&c.io, c.target});
+      if (h != hosts.end()) {
+        auto &v = h->second.connections;
+        v.erase(std::remove(v.begin(), v.end(), &c), v.end());
+        if (v.empty() && h->second.idle == 0) {
+          hosts.erase(h);
+        }
+      }
+    }
+
+    /* Forget about all connections. */
+    void clear(void) {
+      hosts.clear();
+      idle.clear();
+    }
+  };
+
+  /* Get a connection set's index.
+   * @set The connection set.
+   *
+   * Indices are kept by the set's address, so an empty set starts over with an
+   * empty index, in case it took the place of a set that's gone.
+   *
+   * @return The index for the set.
+   */
+  static registry &index(const efgy::beacons<connection> &set) {
+    static std::unordered_map<const efgy::beacons<connection> *, registry>
+        indices;
+    registry &ix = indices[&set];
+
+    if (set.empty()) {
+      ix.clear();
+    }
+
+    return ix;
+  }
+
+  /* Get a connection that isn't used for anything else.
+   * @endpoint Where to connect to, or listen on.
+   * @ix The connection set's index.
+   * @pConnections The root of the connection set to register with.
+   * @pio IO service to use.
+   * @timeout How long connecting may take; zero means no limit.
+   *
+   * Takes a connection off the set's idle list and points it at the endpoint,
+   * or creates an entirely new one. Needs registryLock() to be held.
+   *
+   * @return A connection to the endpoint.
+   */
+  static connection &fresh(
+      const endpointType<transport> &endpoint, registry &ix,
+      efgy::beacons<connection> &pConnections, service &pio,
+      std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+    connection *c = takeIdle(ix, pio);
+
+    if (c == nullptr) {
+      // since we use beacons that insert and remove from pConnections, this
+      // does not actually leak memory. Though it does seem to confuse
+      // valgrind. But reusal is working, so it can't be leaking.
+      c = new connection(pConnections, pio);
+    }
+
+    c->pending = true;
+    c->target = endpoint;
+    ix.insert(*c);
+    c->start(timeout);
+    return *c;
+  }
+
+  /* Take a connection off the idle list.
+   * @ix The connection set's index.
+   * @pio IO service to use.
+   *
+   * Skips over connections that aren't idle anymore, and takes the one it finds
+   * out of the target index. Needs registryLock() to be held.
+   *
+   * @return An idle connection, or `nullptr` if there is none.
+   */
+  static connection *takeIdle(registry &ix, service &pio) {
+    auto &idle = ix.idle[&pio];
+
+    while (!idle.empty()) {
+      connection *c = idle.back();
+      idle.pop_back();
+      c->listed = false;
+
+      if (c->idle()) {
+        ix.erase(*c);
+        return c;
+      }
+    }
+
+    return nullptr;
+  }
+
+  /* Add a new connection to its set's index.
+   * @targeted Whether the connection has a target endpoint yet.
+   *
+   * Called by the constructors, with registryLock() held when coming from
+   * get() or pad().
+   */
+  void enlist(bool targeted) {
+    registry &ix = index(connections);
+
+    if (connections.size() == 1) {
+      ix.clear();
+    }
+    if (targeted) {
+      ix.insert(*this);
+    }
+    if (!pending) {
+      enlistIdle();
+    }
+  }
+
+  /* Put the connection on its set's idle list.
+   *
+   * Does nothing if it's already on there. Needs registryLock() to be held.
+   */
+  void enlistIdle(void) {
+    if (!listed) {
+      listed = true;
+      index(connections).idle[&io].push_back(this);
+    }
+  }
+
+  /* Remove the connection from its set's index.
+   *
+   * Called by the destructor.
+   */
+  void delist(void) {
+    registry &ix = index(connections);
+
+    ix.erase(*this);
+    if (listed) {
+      auto &idle = ix.idle[&io];
+      idle.erase(std::remove(idle.begin(), idle.end(), this), idle.end());
+    }
+  }
+
   /* Socket acceptor
    *
    * This is the acceptor which has been bound to the socket specified in the
@@ -386,6 +1967,20 @@ class connection {
    */
   typename transport::acceptor acceptor;
 
+  /* Overflow socket.
+   *
+   * Connections over the processor's session limit are accepted into this,
+   * rather than into a session, if the processor wants them turned away.
+   */
+  typename transport::socket overflow;
+
+  /* Pick up accepting connections again.
+   *
+   * Set by start() for connections that listen, and called by release() if
+   * accepting was paused.
+   */
+  std::function<void(void)> resume;
+
   /* Target endpoint.
    *
    * This is where we want to connect to.
@@ -398,19 +1993,86 @@ class connection {
    */
   efgy::beacon<connection> beacon;
 
+  /* Connect timeout.
+   *
+   * Armed by startConnect(), if there's a limit on how long connecting may
+   * take.
+   */
+  asio::steady_timer connectTimer;
+
+  /* Connect strand.
+   *
+   * Keeps the connect handler and the connect timeout apart, so that the
+   * timeout never closes a socket that has just connected.
+   */
+  asio::io_service::strand connectStrand;
+
+  /* Accept strand.
+   *
+   * Accepting connections and draining the connection both use the acceptor,
+   * so they go through this.
+   */
+  asio::io_service::strand acceptStrand;
+
+  /* Drain timeout.
+   *
+   * Armed by drain(), and cancelled once the last session has been released.
+   */
+  asio::steady_timer drainTimer;
+
+  /* Sessions in use.
+   *
+   * Needs <sessionsLock> to be held.
+   *
+   * @return The sessions that haven't been released.
+   */
+  std::vector<session *> inUse(void) const {
+    std::vector<session *> rv;
+
+    for (auto s : sessions) {
+      if (!s->free) {
+        rv.push_back(s);
+      }
+    }
+
+    return rv;
+  }
+
   /* Start accepting connections or connecting.
+   * @timeout How long connecting may take; zero means no limit.
    *
    * Queries the processor to find out whether we should listen or connect to
-   * the target, then does that.
+   * the target, then does that. Servers use a listening socket that was handed
+   * to the process for the target, if there is one, rather than binding a new
+   * one; those keep the socket options they came with.
    */
-  void start(void) {
+  void start(std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
     if (processor.listen()) {
-      acceptor.open(target.protocol());
-      acceptor.bind(target);
-      acceptor.listen();
+      const int fd = efgy::global<listeners>().take(target);
+      if (fd >= 0) {
+        acceptor.assign(target.protocol(), fd);
+      } else {
+        acceptor.open(target.protocol());
+        processor.socketOptions().listener(acceptor);
+#if defined(SO_REUSEPORT)
+        if (shards > 1) {
+          // every shard binds its own socket to the same endpoint.
+          asio::error_code ec;
+          acceptor.set_option(reusePort(true), ec);
+        }
+#endif
+        acceptor.bind(target);
+        acceptor.listen(processor.socketOptions().listenBacklog());
+      }
+      efgy::global<listeners>().add(this, acceptor.native_handle());
+      resume = [this]() {
+        acceptStrand.dispatch([this]() { startAccept(); });
+      };
+      efgy::global<shutdown>().add(
+          this, [this](std::chrono::milliseconds t) { drain(t); });
       startAccept();
     } else {
-      startConnect();
+      startConnect(0, timeout);
     }
   }
 
@@ -418,34 +2080,104 @@ class connection {
    * @newSession An optional session to reuse.
    *
    * This function creates a new, blank session to handle the next incoming
-   * request.
+   * request, unless the processor's session limit has been reached. In that
+   * case, the next connection is accepted only to be turned away, if the
+   * processor has an overload reply; otherwise accepting is paused until a
+   * session is released. Once the connection is being drained, this only
+   * hands back the session it was given, if any.
    */
   void startAccept(session *newSession = 0) {
+    if (stopping) {
+      if (newSession != 0) {
+        newSession->recycle();
+      }
+      return;
+    }
+
     if (newSession == 0) {
-      newSession = getSession();
+      newSession = admit();
     }
 
-    acceptor.async_accept(newSession->socket.lowest_layer(),
-                          [newSession, this](const std::error_code &error) {
-      handleAccept(newSession, error);
-    });
+    if (newSession != 0) {
+      acceptor.async_accept(
+          newSession->socket.lowest_layer(),
+          acceptStrand.wrap([newSession, this](const std::error_code &error) {
+            handleAccept(newSession, error);
+          }));
+    } else if (!processor.overloadReply().empty()) {
+      acceptor.async_accept(
+          overflow, acceptStrand.wrap([this](const std::error_code &error) {
+            handleOverflow(error);
+          }));
+    }
+  }
+
+  /* Get a session for the next connection, if there's room for one.
+   *
+   * Checks the number of sessions in use against the processor's limit; if
+   * there's no room, accepting is marked as paused, which the next release()
+   * picks up on. Sessions are only ever taken for new connections by the one
+   * accept that's waiting, so there's still room when getSession() is called.
+   *
+   * @return A free session, or `0` if the limit has been reached.
+   */
+  session *admit(void) {
+    const std::size_t limit = processor.maxSessions();
+
+    if (limit > 0) {
+      std::lock_guard<mutex> lock(sessionsLock);
+
+      if (busy >= limit) {
+        paused = processor.overloadReply().empty();
+        if (paused) {
+          pauses++;
+        }
+        return 0;
+      }
+    }
+
+    return getSession();
   }
 
   /* Connect to the socket.
    * @newSession An optional session to reuse.
+   * @timeout How long connecting may take; zero means no limit.
    *
    * This function creates a new, blank session and attempts to connect to the
-   * given socket.
+   * given socket. If that takes longer than the timeout, the socket is closed,
+   * which fails the connection attempt. The socket is opened up front, so that
+   * the processor's socket options can be set before it connects.
    */
-  void startConnect(session *newSession = 0) {
+  void startConnect(
+      session *newSession = 0,
+      std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
     if (newSession == 0) {
       newSession = getSession();
     }
 
-    newSession->socket.lowest_layer().async_connect(
-        target, [newSession, this](const std::error_code &error) {
-          handleConnect(newSession, error);
-        });
+    auto &socket = newSession->socket.lowest_layer();
+    if (!socket.is_open()) {
+      asio::error_code ec;
+      socket.open(target.protocol(), ec);
+    }
+    processor.socketOptions().outbound(socket);
+
+    if (timeout.count() > 0) {
+      connectTimer.expires_from_now(timeout);
+      connectTimer.async_wait(
+          connectStrand.wrap([newSession, this](const std::error_code &error) {
+            if (!error && pending) {
+              asio::error_code ec;
+              newSession->socket.lowest_layer().close(ec);
+            }
+          }));
+    }
+
+    socket.async_connect(
+        target, connectStrand.wrap(
+                    [newSession, this](const std::error_code &error) {
+                      handleConnect(newSession, error);
+                    }));
   }
 
   /* Handle next incoming connection
@@ -454,10 +2186,12 @@ class connection {
    *
    * Called by asio.hpp when a new inbound connection has been accepted; this
    * will make the session parse the incoming request and dispatch it to the
-   * request processor specified as a template argument.
+   * request processor specified as a template argument. A connection that
+   * comes in after draining has started is closed right away.
    */
   void handleAccept(session *newSession, const std::error_code &error) {
-    if (!error) {
+    if (!error && !stopping) {
+      processor.socketOptions().connected(newSession->socket.lowest_layer());
       newSession->start();
       newSession = 0;
     }
@@ -465,6 +2199,31 @@ class connection {
     startAccept(newSession);
   }
 
+  /* Turn away a connection over the limit.
+   * @error Describes any error condition that may have occurred.
+   *
+   * Called by asio.hpp when a connection has been accepted into the overflow
+   * socket. The overload reply is written without waiting, as it fits into
+   * the socket's send buffer; any part of the request that's already come in
+   * is read and dropped, so closing the socket doesn't reset the connection
+   * before the client gets to read the reply.
+   */
+  void handleOverflow(const std::error_code &error) {
+    if (!error) {
+      asio::error_code ec;
+      char discard[1024];
+
+      shed++;
+      overflow.non_blocking(true, ec);
+      overflow.write_some(asio::buffer(processor.overloadReply()), ec);
+      overflow.shutdown(transport::socket::shutdown_send, ec);
+      overflow.read_some(asio::buffer(discard), ec);
+      overflow.close(ec);
+    }
+
+    startAccept();
+  }
+
   /* Handle new connection
    * @newSession The blank session object that was created by startConnect().
    * @error Describes any error condition that may have occurred.
@@ -473,12 +2232,15 @@ class connection {
    * allows the session object to begin interacting with the new session.
    */
   void handleConnect(session *newSession, const std::error_code &error) {
+    asio::error_code ec;
     pending = false;
+    connectTimer.cancel(ec);
 
     if (error) {
       newSession->errors++;
       newSession->recycle();
     } else {
+      processor.socketOptions().connected(newSession->socket.lowest_layer());
       newSession->start();
     }
   }
@@ -0,0 +1,362 @@
+/* Hierarchical timer wheel.
+ *
+ * For timeouts that almost never fire, but that need to be kept track of for
+ * lots of connections at once.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_TIMER_WHEEL_H)
+#define CXXHTTP_TIMER_WHEEL_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <cxxhttp/network.h>
+
+namespace cxxhttp {
+/* Hierarchical timer wheel.
+ * @clock The clock to measure time with.
+ *
+ * Keeps track of any number of timeouts with a single timer, which only runs
+ * while there's something to time out. Timeouts are rounded up to the wheel's
+ * resolution, and go into one of several wheels, depending on how far off they
+ * are; timeouts on the outer wheels are moved inwards as their time comes
+ * closer. Scheduling and cancelling a timeout takes the same time no matter how
+ * many there are, and so does every tick.
+ *
+ * There's one wheel per I/O service, which asio sets up the first time it's
+ * needed; use `asio::use_service<timerWheel<>>(io)` to get it.
+ */
+template <typename clock = std::chrono::steady_clock>
+class timerWheel : public asio::io_service::service {
+ public:
+  /* Service ID, for asio. */
+  static asio::io_service::id id;
+
+  /* Timeout.
+   *
+   * Owned by whatever wants to time out, and linked into the wheel while it's
+   * scheduled. Must be cancelled before it's destroyed.
+   */
+  class entry {
+   public:
+    /* What to do when the timeout passes.
+     *
+     * Called from the wheel's timer, not from whatever strand the owner may be
+     * using. The entry is no longer scheduled by then, unless it was
+     * scheduled again in the meantime.
+     */
+    std::function<void(void)> handler;
+
+   protected:
+    friend class timerWheel;
+
+    /* Previous entry in the same slot. */
+    entry *prev = nullptr;
+
+    /* Next entry in the same slot. */
+    entry *next = nullptr;
+
+    /* The slot the entry is in. */
+    entry **slot = nullptr;
+
+    /* The tick the entry is due at. */
+    std::uint64_t expiry = 0;
+
+    /* Whether the entry is linked into the wheel. */
+    bool linked = false;
+  };
+
+  /* Tick length.
+   *
+   * Timeouts are rounded up to a multiple of this.
+   */
+  const std::chrono::milliseconds resolution;
+
+  /* Construct with I/O service.
+   * @io The I/O service to run the timer on.
+   *
+   * Called by asio, through `asio::use_service()`.
+   */
+  explicit timerWheel(cxxhttp::service &io)
+      : asio::io_service::service(io),
+        resolution(100),
+        timer(io),
+        origin(clock::now()),
+        current(0),
+        count(0),
+        armed(false),
+        slots() {}
+
+  /* Schedule a timeout.
+   * @e The timeout to schedule.
+   * @timeout How long from now it's due.
+   *
+   * Moves the timeout if it was already scheduled.
+   */
+  void schedule(entry &e, std::chrono::milliseconds timeout) {
+    std::lock_guard<mutex> l(lock);
+
+    if (e.linked) {
+      unlink(e);
+      count--;
+    } else if (count == 0) {
+      // nothing was scheduled, so the wheel may be behind.
+      current = now();
+    }
+
+    // the wheel may not have caught up with the clock yet, and the current
+    // tick has already partly passed, so count from the end of the real one.
+    const std::uint64_t ticks =
+        (timeout + resolution - std::chrono::milliseconds(1)) / resolution;
+    e.expiry = std::max(current, now()) + ticks + 1;
+    insert(e);
+    count++;
+
+    if (!armed) {
+      arm();
+    }
+  }
+
+  /* Cancel a timeout.
+   * @e The timeout to cancel.
+   *
+   * Does nothing if it's not scheduled.
+   */
+  void cancel(entry &e) {
+    std::lock_guard<mutex> l(lock);
+
+    if (e.linked) {
+      unlink(e);
+      count--;
+
+      if (count == 0 && armed) {
+        // so that the I/O service can run out of things to do.
+        asio::error_code ec;
+        armed = false;
+        timer.cancel(ec);
+      }
+    }
+  }
+
+  /* Whether a timeout is scheduled.
+   * @e The timeout to check.
+   *
+   * @return `true` if it's waiting to go off.
+   */
+  bool pending(const entry &e) const {
+    std::lock_guard<mutex> l(lock);
+    return e.linked;
+  }
+
+  /* Number of scheduled timeouts.
+   *
+   * @return How many timeouts are waiting to go off.
+   */
+  std::size_t size(void) const {
+    std::lock_guard<mutex> l(lock);
+    return count;
+  }
+
+ protected:
+  /* Number of wheels. */
+  static const std::size_t levels = 4;
+
+  /* Bits of the tick count per wheel. */
+  static const std::size_t bits = 6;
+
+  /* Number of slots per wheel. */
+  static const std::size_t width = std::size_t(1) << bits;
+
+  /* The timer that drives the wheel. */
+  asio::basic_waitable_timer<clock> timer;
+
+  /* When tick zero was. */
+  const typename clock::time_point origin;
+
+  /* The last tick that was dealt with. */
+  std::uint64_t current;
+
+  /* Number of scheduled timeouts. */
+  std::size_t count;
+
+  /* Whether the timer is waiting. */
+  bool armed;
+
+  /* The wheels, innermost first. Each slot is a list of timeouts. */
+  std::array<std::array<entry *, width>, levels> slots;
+
+  /* Guards everything above. */
+  mutable mutex lock;
+
+  /* Stop the service.
+   *
+   * Called by asio when the I/O service goes away. Forgets about all scheduled
+   * timeouts, without calling them.
+   */
+  void shutdown(void) {
+    std::lock_guard<mutex> l(lock);
+
+    for (auto &level : slots) {
+      for (auto &slot : level) {
+        while (slot != nullptr) {
+          unlink(*slot);
+        }
+      }
+    }
+    count = 0;
+  }
+
+  /* Current tick.
+   *
+   * @return How many ticks have passed since <origin>.
+   */
+  std::uint64_t now(void) const {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() -
+                                                                 origin) /
+           resolution;
+  }
+
+  /* Link a timeout into the right slot.
+   * @e The timeout, with its expiry set.
+   *
+   * The further off a timeout is, the further out the wheel it goes into;
+   * anything past the outermost wheel goes into its last slot. Needs <lock>
+   * to be held.
+   */
+  void insert(entry &e) {
+    const std::uint64_t span = std::uint64_t(1) << (bits * levels);
+    std::size_t level = 0;
+
+    if (e.expiry - current >= span) {
+      e.expiry = current + span - 1;
+    }
+    while (e.expiry - current >= (std::uint64_t(1) << (bits * (level + 1)))) {
+      level++;
+    }
+
+    entry *&slot = slots[level][(e.expiry >> (bits * level)) & (width - 1)];
+    e.prev = nullptr;
+    e.next = slot;
+    e.slot = &slot;
+    if (slot != nullptr) {
+      slot->prev = &e;
+    }
+    slot = &e;
+    e.linked = true;
+  }
+
+  /* Take a timeout out of its slot.
+   * @e The timeout, which must be linked.
+   *
+   * Needs <lock> to be held.
+   */
+  void unlink(entry &e) {
+    if (e.prev != nullptr) {
+      e.prev->next = e.next;
+    } else {
+      *e.slot = e.next;
+    }
+    if (e.next != nullptr) {
+      e.next->prev = e.prev;
+    }
+    e.prev = nullptr;
+    e.next = nullptr;
+    e.slot = nullptr;
+    e.linked = false;
+  }
+
+  /* Wait for the next tick.
+   *
+   * Needs <lock> to be held.
+   */
+  void arm(void) {
+    armed = true;
+    timer.expires_at(origin + resolution * (current + 1));
+    timer.async_wait([this](const asio::error_code &error) { tick(error); });
+  }
+
+  /* Move the wheel on.
+   * @error Current error state.
+   *
+   * Deals with every tick that has passed since the last one, then calls the
+   * handlers of the timeouts that are due, in no particular order.
+   */
+  void tick(const asio::error_code &error) {
+    std::vector<std::function<void(void)>> due;
+
+    {
+      std::lock_guard<mutex> l(lock);
+
+      if (error || !armed) {
+        return;
+      }
+
+      const std::uint64_t target = now();
+
+      while (current < target && count > 0) {
+        current++;
+        cascade(1);
+
+        entry *&slot = slots[0][current & (width - 1)];
+        while (slot != nullptr) {
+          entry &e = *slot;
+          unlink(e);
+          count--;
+          due.push_back(e.handler);
+        }
+      }
+
+      if (count > 0) {
+        arm();
+      } else {
+        armed = false;
+      }
+    }
+
+    for (const auto &handler : due) {
+      if (handler) {
+        handler();
+      }
+    }
+  }
+
+  /* Move timeouts inwards.
+   * @level The wheel to move timeouts from.
+   *
+   * Whenever the wheel inside it comes round, the next slot of a wheel is moved
+   * to the wheels inside of it, starting with the outermost wheel that's due.
+   * Needs <lock> to be held.
+   */
+  void cascade(std::size_t level) {
+    if (level >= levels ||
+        (current & ((std::uint64_t(1) << (bits * level)) - 1)) != 0) {
+      return;
+    }
+
+    cascade(level + 1);
+
+    entry *&slot = slots[level][(current >> (bits * level)) & (width - 1)];
+    while (slot != nullptr) {
+      entry &e = *slot;
+      unlink(e);
+      insert(e);
+    }
+  }
+};
+
+template <typename clock>
+asio::io_service::id timerWheel<clock>::id;
+}
+
+#endif
@@ -0,0 +1,407 @@
+/* Socket tuning.
+ *
+ * Options for the sockets that servers listen on and accept, and for the ones
+ * that clients connect with: Nagle's algorithm, deferred accepts, TCP Fast
+ * Open, buffer sizes, the listen backlog, quick ACKs and corking.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_TUNING_H)
+#define CXXHTTP_TUNING_H
+
+#include <chrono>
+#include <string>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <asio.hpp>
+
+#include <ef.gy/cli.h>
+#include <ef.gy/global.h>
+
+namespace cxxhttp {
+namespace net {
+#if defined(TCP_DEFER_ACCEPT)
+/* TCP_DEFER_ACCEPT socket option.
+ *
+ * How many seconds the kernel may hold on to a new connection that hasn't sent
+ * anything yet, before it wakes up the server to accept it.
+ */
+using deferAccept =
+    asio::detail::socket_option::integer<IPPROTO_TCP, TCP_DEFER_ACCEPT>;
+#endif
+
+#if defined(TCP_FASTOPEN)
+/* TCP_FASTOPEN socket option.
+ *
+ * For listening sockets; the value is how many connections may be waiting for
+ * their handshake to finish after sending a request with their SYN.
+ */
+using fastOpen =
+    asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>;
+#endif
+
+#if defined(TCP_FASTOPEN_CONNECT)
+/* TCP_FASTOPEN_CONNECT socket option.
+ *
+ * For client sockets; defers the handshake to the first write, so the request
+ * can go out with the SYN if the server gave us a cookie before.
+ */
+using fastOpenConnect =
+    asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>;
+#endif
+
+#if defined(TCP_QUICKACK)
+/* TCP_QUICKACK socket option.
+ *
+ * Acknowledges segments right away instead of waiting for something to send
+ * the ACK along with. Linux clears this again whenever it feels like it, so it
+ * is more of a hint for the start of a connection.
+ */
+using quickAck =
+    asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_QUICKACK>;
+#endif
+
+/* Cork or uncork a socket.
+ * @fd The socket's descriptor.
+ * @on Whether to hold back partial segments.
+ *
+ * While a socket is corked, the kernel only sends full segments, so a header
+ * and a body written one after the other go out together. Uncorking sends
+ * whatever is left. Does nothing on systems without TCP_CORK.
+ *
+ * @return `true` if the setting was changed; `false` if e.g. the descriptor is
+ * not a TCP socket.
+ */
+static inline bool cork(int fd, bool on) {
+#if defined(TCP_CORK)
+  const int value = on ? 1 : 0;
+  return ::setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == 0;
+#else
+  (void)fd;
+  (void)on;
+  return false;
+#endif
+}
+
+/* Socket options.
+ *
+ * Everything is off, or left to the system, by default. Options that don't
+ * apply to a socket, such as TCP options on a UNIX socket, or that the system
+ * doesn't have, are skipped quietly.
+ *
+ * Servers use the global instance, which is set up with the `tcp-...`,
+ * `receive-buffer`, `send-buffer` and `backlog` CLI options; clients use the
+ * one in their connection pool.
+ */
+class tuning {
+ public:
+  /* Whether to set TCP_NODELAY.
+   *
+   * Sends small writes right away, rather than waiting for the ACK of what was
+   * sent before. Without this, a request or reply that takes more than one
+   * write may sit around for a round trip, or for the peer's delayed ACK.
+   */
+  bool noDelay = false;
+
+  /* TCP_DEFER_ACCEPT timeout.
+   *
+   * For listening sockets: how long to wait for a new connection's request
+   * before it's handed to the server. Zero turns this off.
+   */
+  std::chrono::seconds deferAccept{0};
+
+  /* TCP Fast Open.
+   *
+   * For listening sockets, the length of the queue of Fast Open connections
+   * that haven't finished their handshake. For clients, anything but zero
+   * sends requests with the SYN to servers that allow it. Zero turns this off.
+   */
+  std::size_t fastOpen = 0;
+
+  /* Receive buffer size, in bytes; SO_RCVBUF.
+   *
+   * Set on listening sockets before they listen, so accepted sockets inherit
+   * it. Zero leaves this to the system, which also keeps the kernel's
+   * auto-tuning of the buffer.
+   */
+  std::size_t receiveBuffer = 0;
+
+  /* Send buffer size, in bytes; SO_SNDBUF.
+   *
+   * Same as <receiveBuffer>, but for outbound data.
+   */
+  std::size_t sendBuffer = 0;
+
+  /* Listen backlog.
+   *
+   * How many connections may wait to be accepted; the kernel caps this at its
+   * own limit. Zero means as many as the system allows.
+   */
+  std::size_t backlog = 0;
+
+  /* Whether to set TCP_QUICKACK on new connections. */
+  bool quickAck = false;
+
+  /* Whether to cork sockets while more than one message is queued.
+   *
+   * Has the head of a reply and its body go out in as few segments as
+   * possible, even with <noDelay> set.
+   */
+  bool cork = false;
+
+  /* Set up a listening socket.
+   * @socket The socket, opened but not bound yet.
+   *
+   * Sets the buffer sizes, deferred accepts and Fast Open.
+   */
+  template <typename acceptor>
+  void listener(acceptor &socket) const {
+    asio::error_code ec;
+
+    buffers(socket);
+#if defined(TCP_DEFER_ACCEPT)
+    if (deferAccept.count() > 0) {
+      socket.set_option(net::deferAccept(int(deferAccept.count())), ec);
+    }
+#endif
+#if defined(TCP_FASTOPEN)
+    if (fastOpen > 0) {
+      socket.set_option(net::fastOpen(int(fastOpen)), ec);
+    }
+#endif
+  }
+
+  /* Listen backlog to use.
+   *
+   * @return <backlog>, or the system's limit if that's zero.
+   */
+  int listenBacklog(void) const {
+    return backlog > 0 ? int(backlog) : asio::socket_base::max_connections;
+  }
+
+  /* Set up a client socket.
+   * @socket The socket, opened but not connected yet.
+   *
+   * Sets the buffer sizes and Fast Open.
+   */
+  template <typename socketType>
+  void outbound(socketType &socket) const {
+    buffers(socket);
+#if defined(TCP_FASTOPEN_CONNECT)
+    if (fastOpen > 0) {
+      asio::error_code ec;
+      socket.set_option(fastOpenConnect(true), ec);
+    }
+#endif
+  }
+
+  /* Set up a connected socket.
+   * @socket A socket that was just accepted or connected.
+   *
+   * Sets TCP_NODELAY and TCP_QUICKACK.
+   */
+  template <typename socketType>
+  void connected(socketType &socket) const {
+    asio::error_code ec;
+
+    if (noDelay) {
+      socket.set_option(asio::ip::tcp::no_delay(true), ec);
+    }
+#if defined(TCP_QUICKACK)
+    if (quickAck) {
+      socket.set_option(net::quickAck(true), ec);
+    }
+#endif
+  }
+
+ protected:
+  /* Set the buffer sizes.
+   * @socket The socket to set them on.
+   */
+  template <typename socketType>
+  void buffers(socketType &socket) const {
+    asio::error_code ec;
+
+    if (receiveBuffer > 0) {
+      socket.set_option(
+          asio::socket_base::receive_buffer_size(int(receiveBuffer)), ec);
+    }
+    if (sendBuffer > 0) {
+      socket.set_option(asio::socket_base::send_buffer_size(int(sendBuffer)),
+                        ec);
+    }
+  }
+};
+
+/* Parse a size or count.
+ * @value Where to put the result.
+ * @text The number, as a string.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setSize(std::size_t &value, const std::string &text) {
+  try {
+    value = std::stoul(text);
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Turn on TCP_NODELAY for servers.
+ * @match The matches from the CLI option regex; ignored.
+ *
+ * @return `true` (always).
+ */
+static inline bool setNoDelay(std::smatch &) {
+  efgy::global<tuning>().noDelay = true;
+  return true;
+}
+
+/* TCP_NODELAY CLI option.
+ *
+ * The format is `tcp-nodelay`.
+ */
+static efgy::cli::option tcpNoDelay("-{0,2}tcp-nodelay", setNoDelay,
+                                    "send small replies without delay");
+
+/* Set the deferred accept timeout.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setDeferAccept(std::smatch &match) {
+  std::size_t seconds = 0;
+  if (!setSize(seconds, match[1])) {
+    return false;
+  }
+  efgy::global<tuning>().deferAccept = std::chrono::seconds(seconds);
+  return true;
+}
+
+/* TCP_DEFER_ACCEPT CLI option.
+ *
+ * The format is `tcp-defer-accept:(seconds)`. Needs to come before any servers
+ * on the command line, as do the other listener options.
+ */
+static efgy::cli::option tcpDeferAccept(
+    "-{0,2}tcp-defer-accept:([0-9]+)", setDeferAccept,
+    "only accept connections once they've sent data, for up to [1] seconds");
+
+/* Set the Fast Open queue length for servers.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setFastOpen(std::smatch &match) {
+  return setSize(efgy::global<tuning>().fastOpen, match[1]);
+}
+
+/* TCP_FASTOPEN CLI option.
+ *
+ * The format is `tcp-fastopen:(queue length)`.
+ */
+static efgy::cli::option tcpFastOpen(
+    "-{0,2}tcp-fastopen:([0-9]+)", setFastOpen,
+    "take requests with the SYN, with up to [1] pending handshakes");
+
+/* Set the receive buffer size for servers.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setReceiveBuffer(std::smatch &match) {
+  return setSize(efgy::global<tuning>().receiveBuffer, match[1]);
+}
+
+/* SO_RCVBUF CLI option.
+ *
+ * The format is `receive-buffer:(bytes)`.
+ */
+static efgy::cli::option receiveBufferSize(
+    "-{0,2}receive-buffer:([0-9]+)", setReceiveBuffer,
+    "set server sockets' receive buffer to [1] bytes");
+
+/* Set the send buffer size for servers.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setSendBuffer(std::smatch &match) {
+  return setSize(efgy::global<tuning>().sendBuffer, match[1]);
+}
+
+/* SO_SNDBUF CLI option.
+ *
+ * The format is `send-buffer:(bytes)`.
+ */
+static efgy::cli::option sendBufferSize(
+    "-{0,2}send-buffer:([0-9]+)", setSendBuffer,
+    "set server sockets' send buffer to [1] bytes");
+
+/* Set the listen backlog.
+ * @match The matches from the CLI option regex.
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setBacklog(std::smatch &match) {
+  return setSize(efgy::global<tuning>().backlog, match[1]);
+}
+
+/* Listen backlog CLI option.
+ *
+ * The format is `backlog:(count)`.
+ */
+static efgy::cli::option backlogLength(
+    "-{0,2}backlog:([0-9]+)", setBacklog,
+    "let up to [1] connections wait to be accepted on a server socket");
+
+/* Turn on TCP_QUICKACK for servers.
+ * @match The matches from the CLI option regex; ignored.
+ *
+ * @return `true` (always).
+ */
+static inline bool setQuickAck(std::smatch &) {
+  efgy::global<tuning>().quickAck = true;
+  return true;
+}
+
+/* TCP_QUICKACK CLI option.
+ *
+ * The format is `tcp-quickack`.
+ */
+static efgy::cli::option tcpQuickAck(
+    "-{0,2}tcp-quickack", setQuickAck,
+    "acknowledge requests right away on new connections");
+
+/* Turn on corking for servers.
+ * @match The matches from the CLI option regex; ignored.
+ *
+ * @return `true` (always).
+ */
+static inline bool setCork(std::smatch &) {
+  efgy::global<tuning>().cork = true;
+  return true;
+}
+
+/* TCP_CORK CLI option.
+ *
+ * The format is `tcp-cork`.
+ */
+static efgy::cli::option tcpCork(
+    "-{0,2}tcp-cork", setCork,
+    "send reply headers and bodies in as few packets as possible");
+}
+}
+
+#endif
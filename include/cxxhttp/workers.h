@@ -0,0 +1,271 @@
+/* Worker thread pool.
+ *
+ * For running things that would take too long to run on an I/O thread, such
+ * as CPU-heavy servlet handlers.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_WORKERS_H)
+#define CXXHTTP_WORKERS_H
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+
+#include <cxxhttp/network.h>
+
+#if !defined(ASIO_DISABLE_THREADS)
+#include <condition_variable>
+#include <thread>
+#endif
+
+namespace cxxhttp {
+/* Bounded worker thread pool.
+ *
+ * Runs jobs on a fixed number of threads, with a limit on how many jobs may be
+ * waiting for a thread. Jobs that don't fit are rejected, rather than queued
+ * up indefinitely, so callers can shed load instead of falling behind.
+ *
+ * The threads are only started when the first job is submitted. Without
+ * thread support, i.e. with ASIO_DISABLE_THREADS, jobs are run right away on
+ * the calling thread.
+ */
+class workers {
+ public:
+  /* Number of threads.
+   *
+   * How many jobs may run at the same time. Only used when the threads are
+   * started, so this needs to be set before the first job is submitted.
+   */
+  std::size_t size;
+
+  /* Queue depth limit.
+   *
+   * How many jobs may be waiting for a thread; any further jobs are rejected.
+   * Jobs that a free thread is about to pick up don't count, so with a limit
+   * of 0, jobs are only accepted if a thread is free to run them.
+   */
+  std::size_t limit;
+
+  /* Construct with pool size.
+   * @pSize The number of threads; defaults to the number of CPU cores.
+   * @pLimit The queue depth limit.
+   *
+   * Does not start any threads yet.
+   */
+  workers(std::size_t pSize = 0, std::size_t pLimit = 64)
+      : size(pSize > 0 ? pSize : defaultSize()),
+        limit(pLimit),
+        stopping(false),
+        running(0) {}
+
+  /* Destructor.
+   *
+   * Lets the threads finish the jobs that are already queued up, then waits
+   * for them to finish.
+   */
+  ~workers(void) {
+#if !defined(ASIO_DISABLE_THREADS)
+    {
+      std::lock_guard<mutex> lock(queueLock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : threads) {
+      t.join();
+    }
+#endif
+  }
+
+  /* Submit a job.
+   * @job What to run.
+   *
+   * Queues up the job to run on one of the pool's threads.
+   *
+   * @return `false` if the queue is full and the job was not accepted.
+   */
+  bool submit(std::function<void(void)> job) {
+#if defined(ASIO_DISABLE_THREADS)
+    job();
+#else
+    {
+      std::lock_guard<mutex> lock(queueLock);
+      const std::size_t idle = size > running ? size - running : 0;
+
+      if (queue.size() >= limit + idle) {
+        return false;
+      }
+
+      while (threads.size() < size) {
+        threads.emplace_back(std::bind(&workers::work, this));
+      }
+
+      queue.push_back(std::move(job));
+    }
+    wake.notify_one();
+#endif
+
+    return true;
+  }
+
+  /* Number of waiting jobs.
+   *
+   * @return How many jobs are queued up and not yet running.
+   */
+  std::size_t queued(void) {
+    std::lock_guard<mutex> lock(queueLock);
+    return queue.size();
+  }
+
+  /* Number of running jobs.
+   *
+   * @return How many jobs are currently running on a thread.
+   */
+  std::size_t active(void) {
+    std::lock_guard<mutex> lock(queueLock);
+    return running;
+  }
+
+ protected:
+  /* Queue lock.
+   *
+   * Guards the <queue> and the other bookkeeping variables.
+   */
+  mutex queueLock;
+
+  /* Waiting jobs.
+   *
+   * Jobs that have been submitted but not started yet.
+   */
+  std::deque<std::function<void(void)>> queue;
+
+  /* Whether the pool is being destroyed.
+   *
+   * Tells the threads to exit once the queue is empty.
+   */
+  bool stopping;
+
+  /* Running job count.
+   *
+   * How many threads are currently running a job.
+   */
+  std::size_t running;
+
+#if !defined(ASIO_DISABLE_THREADS)
+  /* Worker threads.
+   *
+   * Started on demand in submit().
+   */
+  std::vector<std::thread> threads;
+
+  /* Queue condition.
+   *
+   * Signalled when a job is added, or when the pool is being destroyed.
+   */
+  std::condition_variable wake;
+
+  /* Worker thread main loop.
+   *
+   * Runs jobs off the queue until the pool is destroyed. Workers may be started
+   * from a shard's I/O thread, which is pinned to one core, so they undo that
+   * first; they're meant to take work off the I/O threads, not to compete with
+   * them for the same core.
+   */
+  void work(void) {
+    unpin();
+
+    std::unique_lock<mutex> lock(queueLock);
+
+    while (true) {
+      wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+
+      if (queue.empty()) {
+        return;
+      }
+
+      auto job = std::move(queue.front());
+      queue.pop_front();
+      running++;
+
+      lock.unlock();
+      job();
+      lock.lock();
+
+      running--;
+    }
+  }
+#endif
+
+  /* Default pool size.
+   *
+   * @return The number of CPU cores, or 1 if that is not known.
+   */
+  static std::size_t defaultSize(void) {
+#if !defined(ASIO_DISABLE_THREADS)
+    return std::max<std::size_t>(1, std::thread::hardware_concurrency());
+#else
+    return 1;
+#endif
+  }
+};
+
+#if !defined(ASIO_DISABLE_THREADS)
+/* Set the number of worker threads.
+ * @match The matches from the CLI option regex.
+ *
+ * Sets the size of the global worker pool to the value in match[1].
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setWorkers(std::smatch &match) {
+  try {
+    efgy::global<workers>().size =
+        std::max<std::size_t>(1, std::stoul(match[1]));
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Worker thread count CLI option.
+ *
+ * The format is `workers:(count)`.
+ */
+static efgy::cli::option workerCount("-{0,2}workers:([0-9]+)", setWorkers,
+                                     "run offloaded handlers on [1] threads");
+
+/* Set the worker queue depth limit.
+ * @match The matches from the CLI option regex.
+ *
+ * Sets the queue depth limit of the global worker pool to the value in
+ * match[1].
+ *
+ * @return `true` if the value could be parsed.
+ */
+static inline bool setWorkerQueue(std::smatch &match) {
+  try {
+    efgy::global<workers>().limit = std::stoul(match[1]);
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* Worker queue depth CLI option.
+ *
+ * The format is `worker-queue:(count)`.
+ */
+static efgy::cli::option workerQueue(
+    "-{0,2}worker-queue:([0-9]+)", setWorkerQueue,
+    "queue up at most [1] offloaded handlers before replying with a 503");
+#endif
+}
+
+#endif
@@ -29,6 +29,10 @@ using efgy::cli::option;
 namespace cli {
 static int output = STDOUT_FILENO;
 
+// each URL is only fetched once, so don't keep connections open afterwards, or
+// we'd have to wait for them to time out before exiting.
+static void noIdle(void) { efgy::global<cxxhttp::http::pool>().maxIdle = 0; }
+
 static option outFD(
     "-{0,2}output-fd:([0-9]+)", [](std::smatch &m) -> bool {
                                   std::string fdn = m[1];
@@ -41,6 +45,7 @@ static option UNIX("-{0,2}http:unix:(.+):(.+)",
                    [](std::smatch &m) -> bool {
                      const std::string target = m[1];
                      const std::string path = m[2];
+                     noIdle();
                      call<unix>(path, {{"Host", target}})
                          .success([](sessionData &sess) {
                            write(output, sess.content.c_str(),
@@ -59,6 +64,7 @@ static option TCP(
     "http://([^@:/]+)(:[0-9]+|:stdio)?(/.*)",
     [](std::smatch &m) -> bool {
       const std::string url = m[0];
+      noIdle();
       call<tcp>(url)
           .success([](sessionData &sess) {
             write(output, sess.content.c_str(), sess.content.size());
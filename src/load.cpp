@@ -0,0 +1,172 @@
+/* HTTP load generator.
+ *
+ * Keeps a number of connections to an HTTP server busy with GET requests for a
+ * while, and reports how many requests per second the server answered. This is
+ * for seeing how well a server scales with its `threads:...` option, which is
+ * what src/test-case/scaling.sh does with the sample server.
+ *
+ * Call it like this:
+ *
+ *     $ ./load http://localhost:8080/ connections:64 duration:5
+ *
+ * Each connection gets a thread of its own, and sends its next request as soon
+ * as the reply to the last one is in, on the same connection.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <cxxhttp/network.h>
+
+using namespace cxxhttp;
+using efgy::cli::option;
+
+namespace cli {
+static std::string host, port, resource;
+static std::size_t connections = 16;
+static std::size_t duration = 5;
+
+static option target("http://([^@:/]+)(:([0-9]+))?(/.*)",
+                     [](std::smatch &m) -> bool {
+                       host = m[1];
+                       port = m[3].length() > 0 ? std::string(m[3]) : "80";
+                       resource = m[4];
+                       return true;
+                     },
+                     "load the given HTTP URL");
+
+static option connectionCount(
+    "-{0,2}connections:([0-9]+)", [](std::smatch &m) -> bool {
+      connections = std::max<std::size_t>(1, std::stoul(m[1]));
+      return true;
+    },
+    "keep [1] connections busy at once; the default is 16");
+
+static option seconds("-{0,2}duration:([0-9]+)", [](std::smatch &m) -> bool {
+  duration = std::max<std::size_t>(1, std::stoul(m[1]));
+  return true;
+}, "keep going for [1] seconds; the default is 5");
+}
+
+/* Keep a connection busy.
+ * @target Where to connect to.
+ * @until When to stop sending requests.
+ * @good Counts replies with a 2xx status.
+ * @bad Counts all other replies, and connections that broke.
+ *
+ * Uses a plain, blocking ASIO socket, so this can run on a thread of its own.
+ * Reconnects if the server closes the connection, or if a reply can't be read.
+ */
+static void busy(const net::endpointType<transport::tcp> &target,
+                 std::chrono::steady_clock::time_point until,
+                 std::atomic<std::size_t> &good,
+                 std::atomic<std::size_t> &bad) {
+  const std::string request = "GET " + cli::resource + " HTTP/1.1\r\nHost: " +
+                              cli::host + "\r\n\r\n";
+  asio::io_service io;
+
+  while (std::chrono::steady_clock::now() < until) {
+    transport::tcp::socket socket(io);
+
+    try {
+      socket.connect(target);
+
+      asio::streambuf input;
+      while (std::chrono::steady_clock::now() < until) {
+        asio::write(socket, asio::buffer(request));
+
+        const std::size_t h = asio::read_until(socket, input, "\r\n\r\n");
+        std::string header(asio::buffer_cast<const char *>(input.data()), h);
+        input.consume(h);
+
+        const auto p = header.find("Content-Length: ");
+        if (header.size() < 12 || p == std::string::npos) {
+          bad++;
+          break;
+        }
+        const std::size_t length = std::stoul(header.substr(p + 16));
+
+        if (input.size() < length) {
+          asio::read(socket, input,
+                     asio::transfer_exactly(length - input.size()));
+        }
+        input.consume(length);
+
+        (header[9] == '2' ? good : bad)++;
+
+        if (header.find("Connection: close") != std::string::npos) {
+          break;
+        }
+      }
+    } catch (...) {
+      bad++;
+    }
+  }
+}
+
+/* Load generator main function.
+ * @argc Argument count.
+ * @argv Argument vector.
+ *
+ * Applies the command line options, then keeps the connections busy for as
+ * long as it was asked to, and prints the results.
+ *
+ * @return 0 if the server answered every request, -1 otherwise.
+ */
+int main(int argc, char *argv[]) {
+  efgy::cli::options opts(argc, argv);
+
+  if (cli::host.empty()) {
+    std::cerr << "usage: " << argv[0]
+              << " http://host:port/path [connections:N] [duration:S]\n";
+    return -1;
+  }
+
+  const net::endpoint<transport::tcp> endpoint(cli::host, cli::port);
+  bool found = false;
+
+  try {
+    found = endpoint.begin() != endpoint.end();
+  } catch (...) {
+  }
+
+  if (!found) {
+    std::cerr << "could not resolve host: " << cli::host << "\n";
+    return -1;
+  }
+
+  const auto target = *endpoint.begin();
+  const auto start = std::chrono::steady_clock::now();
+  const auto until = start + std::chrono::seconds(cli::duration);
+  std::atomic<std::size_t> good(0), bad(0);
+  std::vector<std::thread> clients;
+
+  for (std::size_t i = 0; i < cli::connections; i++) {
+    clients.emplace_back([&target, until, &good, &bad]() {
+      busy(target, until, good, bad);
+    });
+  }
+  for (auto &t : clients) {
+    t.join();
+  }
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << good << " requests in " << elapsed.count() << " s, "
+            << std::size_t(good / elapsed.count()) << " requests/s, " << bad
+            << " errors\n";
+
+  return good > 0 && bad == 0 ? 0 : -1;
+}
@@ -0,0 +1,188 @@
+/* Test cases for the chunked transfer coding.
+ *
+ * Frames some sample data and compares the result with what it should look like
+ * on the wire.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+
+#include <ef.gy/test-case.h>
+
+#include <cxxhttp/http-chunked.h>
+
+using namespace cxxhttp;
+
+/* Test chunk framing.
+ * @log Test output stream.
+ *
+ * Frames chunks of different sizes, and final chunks with and without trailers.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testFraming(std::ostream &log) {
+  struct sampleData {
+    std::string data, chunk;
+  };
+
+  std::vector<sampleData> tests{
+      {"foo", "3\r\nfoo\r\n"},
+      {std::string(16, 'x'), "10\r\n" + std::string(16, 'x') + "\r\n"},
+      {std::string(4095, 'y'), "fff\r\n" + std::string(4095, 'y') + "\r\n"},
+  };
+
+  for (const auto &tt : tests) {
+    const auto v = http::chunked::chunk(tt.data);
+    if (v != tt.chunk) {
+      log << "chunk() = '" << v << "', but expected '" << tt.chunk << "'\n";
+      return false;
+    }
+  }
+
+  if (http::chunked::last() != "0\r\n\r\n") {
+    log << "unexpected final chunk: " << http::chunked::last() << "\n";
+    return false;
+  }
+
+  const auto t = http::chunked::last({{"Foo", "bar"}});
+  if (t != "0\r\nFoo: bar\r\n\r\n") {
+    log << "unexpected final chunk with trailers: " << t << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test chunked body decoding.
+ * @log Test output stream.
+ *
+ * Decodes sample bodies, both in one go and a byte at a time, to make sure
+ * partial lines and chunks are handled correctly.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testDecoder(std::ostream &log) {
+  struct sampleData {
+    std::string input;
+    std::size_t limit;
+    enum http::chunked::state state;
+    std::string content;
+    http::headers trailers;
+    std::size_t consumed;
+  };
+
+  std::vector<sampleData> tests{
+      {"3\r\nfoo\r\n0\r\n\r\n", 100, http::chunked::ckDone, "foo", {}, 13},
+      {"2\nfo\n1;ext=1\no\n0\n\n", 100, http::chunked::ckDone, "foo", {}, 18},
+      {"A\r\n0123456789\r\n0\r\nFoo: bar\r\n\r\nnext",
+       100,
+       http::chunked::ckDone,
+       "0123456789",
+       {{"Foo", "bar"}},
+       30},
+      {"3\r\nfoo\r\n", 100, http::chunked::ckSize, "foo", {}, 8},
+      {"3\r\nfo", 100, http::chunked::ckData, "fo", {}, 5},
+      {"3\r\nfoo\r\n1", 100, http::chunked::ckSize, "foo", {}, 8},
+      {"1 ;a = \"x\\\"y\" ; b\r\nz\r\n0\r\n\r\n",
+       100,
+       http::chunked::ckDone,
+       "z",
+       {},
+       27},
+      {"x\r\n", 100, http::chunked::ckError, "", {}, 3},
+      {"5 garbage\r\nhello\r\n", 100, http::chunked::ckError, "", {}, 11},
+      {"5;\r\nhello\r\n", 100, http::chunked::ckError, "", {}, 4},
+      {"5;a=\"b\r\nhello\r\n", 100, http::chunked::ckError, "", {}, 8},
+      {"3\r\nfooo\r\n", 100, http::chunked::ckError, "foo", {}, 9},
+      {"3\r\nfoo\r\n3\r\nbar\r\n", 5, http::chunked::ckOverflow, "foo", {}, 11},
+      {"ffffffffffffffffffff\r\n", 100, http::chunked::ckOverflow, "", {}, 22},
+  };
+
+  for (const auto &tt : tests) {
+    http::chunked::decoder d;
+    std::string content;
+
+    d.start(tt.limit);
+    const auto n = d.absorb(tt.input.data(), tt.input.size(), content);
+
+    if (d.state != tt.state || content != tt.content || n != tt.consumed ||
+        d.trailers.header != tt.trailers) {
+      log << "absorb('" << tt.input << "') = " << n << ", state " << d.state
+          << ", content '" << content << "'; expected " << tt.consumed
+          << ", state " << tt.state << ", content '" << tt.content << "'\n";
+      return false;
+    }
+
+    // feed the same data one byte at a time, but keep anything that wasn't
+    // consumed around, like a receive buffer would.
+    http::chunked::decoder b;
+    std::string buffer;
+    content.clear();
+    b.start(tt.limit);
+
+    for (const auto &c : tt.input) {
+      buffer.push_back(c);
+      buffer.erase(0, b.absorb(buffer.data(), buffer.size(), content));
+    }
+
+    if (b.state != tt.state || content != tt.content) {
+      log << "byte-wise absorb('" << tt.input << "') ended in state "
+          << b.state << ", content '" << content << "'; expected state "
+          << tt.state << ", content '" << tt.content << "'\n";
+      return false;
+    }
+  }
+
+  http::chunked::decoder d;
+  if (d.active()) {
+    log << "decoder should not be active before start()\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test Transfer-Encoding detection.
+ * @log Test output stream.
+ *
+ * Only the plain chunked coding is supported.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testOnly(std::ostream &log) {
+  struct sampleData {
+    std::string value;
+    bool result;
+  };
+
+  std::vector<sampleData> tests{
+      {"chunked", true},
+      {"Chunked", true},
+      {"gzip, chunked", false},
+      {"identity", false},
+      {"", false},
+  };
+
+  for (const auto &tt : tests) {
+    if (http::chunked::only(tt.value) != tt.result) {
+      log << "only('" << tt.value << "') != " << tt.result << "\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+namespace test {
+using efgy::test::function;
+
+static function framing(testFraming);
+static function decoder(testDecoder);
+static function only(testOnly);
+}
@@ -0,0 +1,228 @@
+/* Test cases for coroutine servlets.
+ *
+ * Runs coroutine servlets in a server flow over a socket pair, with an upstream
+ * TCP server on the same I/O service for them to fetch things from.
+ *
+ * These only do anything if the compiler supports C++20 coroutines.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+
+#define ASIO_DISABLE_THREADS
+#include <ef.gy/test-case.h>
+
+#include <cxxhttp/http-coroutine.h>
+
+#include "round-trip.h"
+
+#if defined(__cpp_impl_coroutine)
+using namespace cxxhttp;
+
+using test::roundTrip;
+
+/* Frame addresses seen by the test coroutine. */
+static std::vector<const void *> frames;
+
+/* Test coroutine servlet.
+ * @session The session with the request.
+ * @match The resource match results.
+ *
+ * Replies with the name from the resource and the request body, and remembers
+ * where its frame was.
+ *
+ * @return The coroutine's task.
+ */
+static http::task hello(http::sessionData &session, std::smatch &match) {
+  const std::string name = match[1];
+  frames.push_back(&name);
+
+  const std::string body = co_await http::readBody(session);
+  co_return http::response{200, name + ":" + std::to_string(body.size()) +
+                                    ":" + body.substr(0, 3)};
+}
+
+/* Test coroutine servlets.
+ * @log Test output stream.
+ *
+ * Sends pipelined requests to a coroutine servlet, with regular and streamed
+ * bodies, and makes sure they get the right replies, and that the coroutine
+ * frames are reused from one request to the next.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testCoroutine(std::ostream &log) {
+  struct sampleData {
+    bool stream;
+    std::string request;
+    std::vector<std::string> bodies;
+  };
+
+  const std::string large(100000, 'x');
+
+  std::vector<sampleData> tests{
+      {false,
+       "PUT /hello/a HTTP/1.1\r\nContent-Length: 3\r\n\r\nfoo"
+       "PUT /hello/b HTTP/1.1\r\nContent-Length: 6\r\n\r\nbarbaz",
+       {"a:3:foo", "b:6:bar"}},
+      {true,
+       "PUT /hello/c HTTP/1.1\r\nContent-Length: " +
+           std::to_string(large.size()) + "\r\n\r\n" + large +
+           "PUT /hello/d HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+           "3\r\nfoo\r\n3\r\nbar\r\n0\r\n\r\n",
+       {"c:100000:xxx", "d:6:foo"}},
+  };
+
+  for (const auto &tt : tests) {
+    asio::io_service service;
+    http::processor::server processor;
+
+    http::servlet servlet("/hello/(.*)", hello, "PUT", {},
+                          "coroutine test servlet", processor.servlets);
+    servlet.streamContent = tt.stream;
+    servlet.maxContentLength = large.size();
+
+    frames.clear();
+    const std::string reply = roundTrip(service, processor, tt.request);
+
+    std::size_t p = 0;
+    for (const auto &body : tt.bodies) {
+      p = reply.find("\r\n\r\n" + body, p);
+      if (p == std::string::npos) {
+        log << "missing reply body '" << body << "' in reply: '" << reply
+            << "'\n";
+        return false;
+      }
+    }
+
+    if (frames.size() != 2 || frames[0] != frames[1]) {
+      log << "coroutine frames were not reused\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Test fetching from coroutine servlets.
+ * @log Test output stream.
+ *
+ * A coroutine servlet fetches a resource from an upstream server and passes it
+ * on, which should make it to the client.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testCoroutineFetch(std::ostream &log) {
+  asio::io_service service;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  efgy::beacons<http::client<transport::tcp>> clients;
+  efgy::beacons<http::servlet> upstreamServlets;
+  http::processor::server processor;
+
+  http::servlet upstream("/upstream/(.*)",
+                         [](http::sessionData &session, std::smatch &match) {
+                           session.reply(200, "up " + std::string(match[1]));
+                         },
+                         "GET", {}, "upstream test servlet", upstreamServlets);
+
+  auto &server = http::server<transport::tcp>::get(
+      transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0), servers,
+      service);
+  server.processor.servlets = upstreamServlets;
+  const std::string authority =
+      "127.0.0.1:" + std::to_string(server.endpoint().port());
+
+  http::servlet proxy(
+      "/proxy/(.*)",
+      [&service, &clients, authority](
+          http::sessionData &session, std::smatch &match) -> http::task {
+        const std::string url =
+            "http://" + authority + "/upstream/" + std::string(match[1]);
+        auto reply = co_await http::fetch<transport::tcp>(
+            url, {}, "", "GET", clients, service);
+        co_return http::response{reply.status, "got " + reply.body};
+      },
+      "GET", {}, "proxy test servlet", processor.servlets);
+
+  const std::string reply =
+      roundTrip(service, processor, "GET /proxy/foo HTTP/1.1\r\n\r\n");
+
+  if (reply.compare(0, 15, "HTTP/1.1 200 OK") != 0 ||
+      reply.find("\r\n\r\ngot up foo") == std::string::npos) {
+    log << "unexpected reply: '" << reply << "'\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test coroutine servlets that lose their client.
+ * @log Test output stream.
+ *
+ * A coroutine servlet waits for a streamed body that never arrives in full, as
+ * the client goes away halfway through. The coroutine should be destroyed
+ * along with the connection, handing its frame back to the session.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testCoroutineCancel(std::ostream &log) {
+  asio::io_service service;
+  http::processor::server processor;
+  http::sessionData session;
+  std::size_t destroyed = 0;
+  bool resumed = false;
+
+  struct guard {
+    std::size_t &count;
+    ~guard(void) { count++; }
+  };
+
+  http::servlet servlet(
+      "/wait",
+      [&destroyed, &resumed](http::sessionData &session,
+                             std::smatch &) -> http::task {
+        guard g{destroyed};
+        const std::string body = co_await http::readBody(session);
+        resumed = true;
+        co_return http::response{200, body};
+      },
+      "PUT", {}, "cancelled coroutine test servlet", processor.servlets);
+  servlet.streamContent = true;
+
+  const std::string reply = roundTrip(
+      service, processor,
+      "PUT /wait HTTP/1.1\r\nContent-Length: 10\r\n\r\nabc", session);
+
+  if (!reply.empty() || resumed) {
+    log << "got a reply without the full body: '" << reply << "'\n";
+    return false;
+  }
+
+  if (destroyed != 1) {
+    log << "coroutine was destroyed " << destroyed
+        << " times after the client went away, expected once\n";
+    return false;
+  }
+
+  if (session.frameInUse) {
+    log << "coroutine frame was not handed back to the session\n";
+    return false;
+  }
+
+  return true;
+}
+
+namespace test {
+using efgy::test::function;
+
+static function coroutine(testCoroutine);
+static function coroutineFetch(testCoroutineFetch);
+static function coroutineCancel(testCoroutineCancel);
+}
+#endif
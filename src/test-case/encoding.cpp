@@ -0,0 +1,260 @@
+/* Test cases for HTTP content codings.
+ *
+ * Covers the Accept-Encoding negotiation and the compression of reply bodies.
+ * The actual codecs are only tested if they've been compiled in, i.e. with
+ * USE_ZLIB or USE_BROTLI defined.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+
+#define ASIO_DISABLE_THREADS
+#include <ef.gy/test-case.h>
+
+#include <cxxhttp/http-session.h>
+
+using namespace cxxhttp;
+
+#if defined(USE_ZLIB)
+/* Decompress gzip or deflate data.
+ * @in The compressed data.
+ *
+ * Uses zlib's automatic header detection, so this works for both codings.
+ *
+ * @return The decompressed data, or an empty string on errors.
+ */
+static std::string inflate(const std::string &in) {
+  z_stream stream = z_stream();
+  std::string out(1024 * 1024, 0);
+
+  if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+    return "";
+  }
+
+  stream.next_in = (Bytef *)in.data();
+  stream.avail_in = in.size();
+  stream.next_out = (Bytef *)&out[0];
+  stream.avail_out = out.size();
+
+  int r = ::inflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  inflateEnd(&stream);
+
+  return r == Z_STREAM_END ? out : "";
+}
+#endif
+
+/* Test Accept-Encoding negotiation.
+ * @log Test output stream.
+ *
+ * Negotiates content codings for a few sample client headers, and makes sure
+ * the outbound Content-Encoding header is set up correctly.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testNegotiate(std::ostream &log) {
+  struct sampleData {
+    http::headers inbound;
+    std::string mine, coding;
+    bool success;
+  };
+
+  std::vector<sampleData> tests{
+      {{}, "gzip, identity;q=0.1", "identity", true},
+      {{{"Accept-Encoding", "gzip"}}, "gzip, identity;q=0.1", "gzip", true},
+      {{{"Accept-Encoding", "deflate, gzip;q=0.5"}},
+       "gzip, deflate;q=0.9, identity;q=0.1",
+       "deflate",
+       true},
+      {{{"Accept-Encoding", "*"}}, "br, gzip;q=0.9", "br", true},
+      {{{"Accept-Encoding", "compress"}}, "gzip", "identity", true},
+      {{}, "gzip", "identity", true},
+      {{{"Accept-Encoding", "br;q=0.5, *;q=0"}}, "gzip", "", false},
+      {{{"Accept-Encoding", "*;q=0, identity"}}, "gzip", "identity", true},
+      {{{"Accept-Encoding", "compress, identity;q=0"}}, "gzip", "", false},
+  };
+
+  for (const auto &tt : tests) {
+    http::sessionData s;
+
+    s.inbound.header = tt.inbound;
+    bool success = s.negotiate({{"Accept-Encoding", tt.mine}});
+
+    if (success != tt.success) {
+      log << "negotiate()=" << success << ", but expected " << tt.success
+          << "\n";
+      return false;
+    }
+    if (success && s.outbound.get("Content-Encoding") != tt.coding) {
+      log << "negotiated coding '" << s.outbound.get("Content-Encoding")
+          << "', but expected '" << tt.coding << "'\n";
+      return false;
+    }
+    if (s.outbound.get("Vary") != "Accept-Encoding") {
+      log << "Vary header not set after negotiation\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Test reply encoding.
+ * @log Test output stream.
+ *
+ * Generates replies with a negotiated coding, and verifies that small bodies,
+ * bodyless replies and the identity coding are left alone.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testReply(std::ostream &log) {
+  struct sampleData {
+    int status;
+    std::string coding;
+    http::headers header;
+    std::string body, message;
+  };
+
+  std::vector<sampleData> tests{
+      {200,
+       "identity",
+       {},
+       "foo",
+       "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nfoo"},
+      {200,
+       "gzip",
+       {},
+       "foo",
+       "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nfoo"},
+      {204,
+       "gzip",
+       {},
+       "",
+       "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n"},
+      {200,
+       "gzip",
+       {{"Content-Encoding", "frob"}},
+       "foo",
+       "HTTP/1.1 200 OK\r\nContent-Encoding: frob\r\nContent-Length: "
+       "3\r\n\r\nfoo"},
+  };
+
+  for (const auto &tt : tests) {
+    http::sessionData s;
+
+    s.outbound.header["Content-Encoding"] = tt.coding;
+    const auto &v = s.generateReply(tt.status, tt.body, tt.header);
+
+    if (v != tt.message) {
+      log << "generateReply() = '" << v << "', but expected '" << tt.message
+          << "'\n";
+      return false;
+    }
+  }
+
+  const std::string large(4096, 'x');
+
+  for (const auto &c : http::encoding::codings) {
+    http::sessionData s;
+    std::string out;
+
+    s.outbound.header["Content-Encoding"] = c;
+    if (s.encode(200, large, out) != c) {
+      log << "encode() did not use coding '" << c << "'\n";
+      return false;
+    }
+    if (out.size() >= large.size()) {
+      log << "encoding with '" << c << "' did not compress the body\n";
+      return false;
+    }
+
+#if defined(USE_ZLIB)
+    if (c != "br" && inflate(out) != large) {
+      log << "encoding with '" << c << "' did not round trip\n";
+      return false;
+    }
+#endif
+
+    const std::string reply = s.generateReply(200, large);
+    const std::string expect = "Content-Encoding: " + c + "\r\n";
+    if (reply.find(expect) == std::string::npos ||
+        reply.find(large) != std::string::npos) {
+      log << "reply was not encoded with '" << c << "': " << reply << "\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Test precompressed variants.
+ * @log Test output stream.
+ *
+ * Sets up a precompressed body and makes sure the right variant is sent.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testVariants(std::ostream &log) {
+  const std::string large(4096, 'x');
+  const http::encoding::variants v(large);
+
+  if (!v.has("identity") || v.get("identity") != large) {
+    log << "precompressed body is missing its identity variant\n";
+    return false;
+  }
+
+  if (v.get("frob") != large) {
+    log << "unknown codings should get the identity variant\n";
+    return false;
+  }
+
+  for (const auto &c : http::encoding::codings) {
+    if (!v.has(c)) {
+      log << "precompressed body is missing coding '" << c << "'\n";
+      return false;
+    }
+
+    http::sessionData s;
+    s.outbound.header["Content-Encoding"] = c;
+    s.reply(200, v);
+
+    const std::string expect = "HTTP/1.1 200 OK\r\nContent-Encoding: " + c +
+                               "\r\nContent-Length: " +
+                               std::to_string(v.get(c).size()) + "\r\n\r\n" +
+                               v.get(c);
+
+    if (s.outboundQueue.size() != 1 || s.outboundQueue.front() != expect) {
+      log << "unexpected reply for precompressed coding '" << c << "'\n";
+      return false;
+    }
+  }
+
+  http::sessionData s;
+  s.outbound.header["Content-Encoding"] = "identity";
+  s.reply(200, v);
+
+  if (s.outboundQueue.size() != 1 ||
+      s.outboundQueue.front() != "HTTP/1.1 200 OK\r\nContent-Length: 4096\r\n"
+                                 "\r\n" +
+                                     large) {
+    log << "unexpected reply for identity coding: " << s.outboundQueue.front()
+        << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+namespace test {
+using efgy::test::function;
+
+static function negotiate(testNegotiate);
+static function reply(testReply);
+static function variants(testVariants);
+}
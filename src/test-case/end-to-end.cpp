@@ -17,6 +17,8 @@
 #define ASIO_DISABLE_THREADS
 #include <ef.gy/test-case.h>
 
+#include <set>
+
 #include <cxxhttp/http-client.h>
 #include <cxxhttp/httpd-options.h>
 #include <cxxhttp/httpd-trace.h>
@@ -186,9 +188,1464 @@ bool testTCP(std::ostream &log) {
   return true;
 }
 
+/* Open and close lots of TCP connections.
+ * @log Test output stream.
+ *
+ * Keeps a couple hundred connections to a loopback server open at a time, each
+ * sending one request and waiting for the server to close the connection, and
+ * does that for tens of thousands of connections. All of them need to get a
+ * reply, and the server should not need more sessions than there were
+ * connections open at once.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testConnectionChurn(std::ostream &log) {
+  static const std::string request = "GET /churn HTTP/1.1\r\n\r\n";
+  const std::size_t total = 20000;
+  const std::size_t parallel = 200;
+
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  auto &server = http::server<transport::tcp>::get(
+      transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0), servers,
+      io);
+  const auto endpoint = server.endpoint();
+
+  std::size_t started = 0;
+  std::size_t done = 0;
+  std::size_t good = 0;
+  std::size_t peak = 0;
+
+  std::function<void(void)> next = [&]() {
+    if (started == total) {
+      return;
+    }
+    started++;
+
+    auto socket = std::make_shared<transport::tcp::socket>(io);
+    auto reply = std::make_shared<asio::streambuf>();
+
+    auto finish = [&, socket, reply](const asio::error_code &, std::size_t) {
+      // there's no servlet, so the server says so and closes the connection.
+      const std::string data(asio::buffer_cast<const char *>(reply->data()),
+                             reply->size());
+      good += data.compare(0, 12, "HTTP/1.1 501") == 0 ? 1 : 0;
+      peak = std::max(peak, server.sessions.size());
+
+      if (++done == total) {
+        io.stop();
+      } else {
+        next();
+      }
+    };
+
+    socket->async_connect(
+        endpoint, [&, socket, reply, finish](const asio::error_code &error) {
+          if (error) {
+            finish(error, 0);
+            return;
+          }
+          asio::async_write(
+              *socket, asio::buffer(request),
+              [socket, reply, finish](const asio::error_code &, std::size_t) {
+                asio::async_read(*socket, *reply, asio::transfer_all(),
+                                 finish);
+              });
+        });
+  };
+
+  for (std::size_t i = 0; i < parallel; i++) {
+    next();
+  }
+
+  io.run();
+
+  if (good != total) {
+    log << "only " << good << " of " << total << " connections got a reply\n";
+    return false;
+  }
+
+  if (peak > parallel + 1) {
+    log << "server had " << peak << " sessions for " << parallel
+        << " connections at a time; sessions are not being reused\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Look up client connections in a large connection set.
+ * @log Test output stream.
+ *
+ * Sets up connections to lots of different endpoints, and makes sure get()
+ * finds the right ones again, doesn't mix up I/O services, and reuses
+ * connections once they're idle, without keeping their old targets around.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testConnectionRegistry(std::ostream &log) {
+  using client = http::client<transport::tcp>;
+
+  service io;
+  service idle;
+  efgy::beacons<client> clients;
+  std::vector<client *> byPort;
+  std::vector<transport::tcp::endpoint> closed;
+
+  // find ports that nobody is listening on, so connections to them fail.
+  for (std::size_t i = 0; i < 2; i++) {
+    transport::tcp::acceptor probe(
+        io, transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    closed.push_back(probe.local_endpoint());
+  }
+
+  // connections on this service never actually connect, as it's never run.
+  client::pad(3, clients, idle);
+
+  for (unsigned short port = 1; port <= 1000; port++) {
+    byPort.push_back(&client::get(
+        transport::tcp::endpoint(asio::ip::address_v4::loopback(), port),
+        clients, idle));
+  }
+
+  if (clients.size() != 1000) {
+    log << "expected padded connections to be reused, but have "
+        << clients.size() << " connections\n";
+    return false;
+  }
+
+  for (unsigned short port = 1; port <= 1000; port++) {
+    const transport::tcp::endpoint e(asio::ip::address_v4::loopback(), port);
+    if (&client::get(e, clients, idle) != byPort[port - 1]) {
+      log << "got the wrong connection back for " << e << "\n";
+      return false;
+    }
+  }
+
+  const transport::tcp::endpoint first(asio::ip::address_v4::loopback(), 1);
+  if (&client::get(first, clients, idle) != byPort[0] ||
+      &client::get(closed[0], clients, io) == &client::get(closed[0], clients,
+                                                            idle) ||
+      clients.size() != 1002) {
+    log << "expected a new connection for a different I/O service\n";
+    return false;
+  }
+
+  // connections that failed are idle again, and can be reused for anything.
+  for (std::size_t i = 0; i < 100; i++) {
+    client::get(closed[i % 2], clients, io);
+    io.run();
+    io.reset();
+  }
+
+  if (clients.size() != 1002) {
+    log << "expected idle connections to be reused, but have "
+        << clients.size() << " connections\n";
+    return false;
+  }
+
+  // the reused connection's old target must not be left behind in the index.
+  if (client::targets(clients) != clients.size()) {
+    log << "expected " << clients.size() << " targets in the index, but have "
+        << client::targets(clients) << "\n";
+    return false;
+  }
+
+  while (!clients.empty()) {
+    delete *clients.begin();
+  }
+
+  return true;
+}
+
+/* Make client calls through the connection pool.
+ * @log Test output stream.
+ *
+ * Sends requests to a loopback server one after the other, which should all
+ * go over the same connection, and then a bunch at the same time, which should
+ * be spread over as many connections as the pool allows. Idle connections
+ * should be closed after the pool's timeout.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testClientPool(std::ostream &log) {
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  efgy::beacons<http::client<transport::tcp>> clients;
+  efgy::beacons<http::servlet> servlets;
+  http::pool &pool = efgy::global<http::pool>();
+  const std::size_t maxConnections = pool.maxConnections;
+  const std::size_t maxIdle = pool.maxIdle;
+  const auto idleTimeout = pool.idleTimeout;
+
+  http::servlet echo("/pool/(.*)",
+                     [](http::sessionData &session, std::smatch &match) {
+                       session.reply(200, match[1]);
+                     },
+                     "GET", {}, "pool test servlet", servlets);
+
+  auto &server = http::server<transport::tcp>::get(
+      transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0), servers,
+      io);
+  server.processor.servlets = servlets;
+  const std::string base =
+      "http://127.0.0.1:" + std::to_string(server.endpoint().port()) + "/pool/";
+
+  const std::size_t total = 10;
+  std::size_t good = 0;
+  std::size_t done = 0;
+  asio::steady_timer linger(io);
+
+  // give idle connections some time to expire once everything is done.
+  auto finish = [&]() {
+    if (++done == total) {
+      linger.expires_from_now(std::chrono::milliseconds(300));
+      linger.async_wait([&io](const asio::error_code &) { io.stop(); });
+    }
+  };
+
+  pool.maxConnections = 2;
+  pool.maxIdle = 1;
+  pool.idleTimeout = std::chrono::milliseconds(50);
+
+  std::size_t opened = pool.opened;
+  std::size_t reused = pool.reused;
+  std::size_t closed = pool.closed;
+
+  std::function<void(std::size_t)> next = [&](std::size_t i) {
+    http::call<transport::tcp>(base + std::to_string(i), {}, "", "GET",
+                               clients, io)
+        .then([&, i](http::sessionData &session) {
+          good += session.content == std::to_string(i) ? 1 : 0;
+          if (i + 1 < total) {
+            next(i + 1);
+          }
+          finish();
+        });
+  };
+
+  next(0);
+  io.run();
+  io.reset();
+
+  if (good != total || pool.opened - opened != 1 ||
+      pool.reused - reused != total - 1 || pool.closed - closed != 1) {
+    log << "sequential calls: " << good << " good replies, "
+        << pool.opened - opened << " connections opened, "
+        << pool.reused - reused << " reused, " << pool.closed - closed
+        << " closed\n";
+    return false;
+  }
+
+  good = 0;
+  done = 0;
+  opened = pool.opened;
+  closed = pool.closed;
+
+  for (std::size_t i = 0; i < total; i++) {
+    http::call<transport::tcp>(base + std::to_string(i), {}, "", "GET",
+                               clients, io)
+        .then([&, i](http::sessionData &session) {
+          good += session.content == std::to_string(i) ? 1 : 0;
+          finish();
+        });
+  }
+
+  io.run();
+
+  pool.maxConnections = maxConnections;
+  pool.maxIdle = maxIdle;
+  pool.idleTimeout = idleTimeout;
+
+  // only one of the two connections may be kept open once they're done.
+  if (good != total || pool.opened - opened > 2 || pool.closed - closed != 1) {
+    log << "parallel calls: " << good << " good replies, "
+        << pool.opened - opened << " connections opened, "
+        << pool.closed - closed << " idle connections closed\n";
+    return false;
+  }
+
+  while (!clients.empty()) {
+    delete *clients.begin();
+  }
+
+  return true;
+}
+
+/* Closing pooled connections.
+ * @log Test output stream.
+ *
+ * Has a pooled client processor get a reply that would allow for keeping the
+ * connection open, while the pool doesn't allow for any idle connections. The
+ * connection is closed then, so it mustn't count as ready for new requests.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testClosingConnection(std::ostream &log) {
+  http::pool pool;
+  std::atomic<std::size_t> idle{0};
+  http::processor::client processor;
+  http::sessionData session;
+
+  pool.maxIdle = 0;
+  pool.idleTimeout = std::chrono::milliseconds(50);
+  processor.pooled(pool, idle);
+  processor.query("GET", "/", {}, "");
+  processor.start(session);
+
+  session.inboundStatus = http::statusLine("HTTP/1.1 200 OK");
+  processor.handle(session);
+
+  if (processor.afterProcessing(session) != http::stShutdown) {
+    log << "the connection should have been closed\n";
+    return false;
+  }
+
+  if (processor.ready() || idle != 0) {
+    log << "a connection that's being closed was still ready\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Pipeline only idempotent requests.
+ * @log Test output stream.
+ *
+ * Queues up a GET, a POST and two more GETs on a client processor with a
+ * pipelining depth of four, and replies to whatever is sent each time. The POST
+ * must only be sent once nothing else is in flight, and nothing may be sent
+ * while it is.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testPipelineIdempotent(std::ostream &log) {
+  http::processor::client processor;
+  http::sessionData session;
+  std::vector<std::string> sent;
+
+  processor.pipeline = 4;
+  processor.query("GET", "/1", {}, "");
+  processor.query("POST", "/2", {}, "body");
+  processor.query("GET", "/3", {}, "");
+  processor.query("GET", "/4", {}, "");
+  processor.start(session);
+
+  while (session.status == http::stStatus) {
+    std::string batch;
+    for (const auto &m : session.outboundQueue) {
+      batch += m;
+    }
+    session.outboundQueue.clear();
+
+    std::string paths;
+    for (std::size_t p = 0; (p = batch.find(" /", p)) != std::string::npos;
+         p++) {
+      paths += batch[p + 2];
+    }
+    sent.push_back(paths);
+
+    for (std::size_t i = 0; i < paths.size(); i++) {
+      session.inboundStatus = http::statusLine("HTTP/1.1 200 OK");
+      processor.handle(session);
+    }
+    session.status = processor.afterProcessing(session);
+  }
+
+  const std::vector<std::string> expected{"1", "2", "34"};
+  if (sent != expected) {
+    log << "expected the POST to be sent on its own, but got";
+    for (const auto &s : sent) {
+      log << " '" << s << "'";
+    }
+    log << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Pipeline client requests.
+ * @log Test output stream.
+ *
+ * Queues up six requests on a single connection, with a pipelining depth of
+ * four, to a bare socket that doesn't reply before it's seen four requests. It
+ * then replies to all of those at once, and to only one of the other two
+ * before closing the connection, so the last request has to fail.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testPipelining(std::ostream &log) {
+  service io;
+  efgy::beacons<http::client<transport::tcp>> clients;
+  http::pool &pool = efgy::global<http::pool>();
+  const std::size_t maxConnections = pool.maxConnections;
+  const std::size_t pipeline = pool.pipeline;
+
+  transport::tcp::acceptor acceptor(
+      io, transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  transport::tcp::socket socket(io);
+  asio::streambuf input;
+  asio::steady_timer deadline(io);
+  std::size_t seen = 0;
+  std::size_t together = 0;
+  std::vector<std::string> results;
+
+  auto reply = [](const std::string &body) {
+    return "HTTP/1.1 200 OK\r\nContent-Length: " +
+           std::to_string(body.size()) + "\r\n\r\n" + body;
+  };
+
+  std::function<void(void)> serve = [&]() {
+    asio::async_read_until(
+        socket, input, "\r\n\r\n",
+        [&](const asio::error_code &error, std::size_t length) {
+          if (error) {
+            return;
+          }
+          if (seen++ == 0) {
+            const std::string buffered(
+                asio::buffer_cast<const char *>(input.data()), input.size());
+            for (auto p = buffered.find("\r\n\r\n"); p != std::string::npos;
+                 p = buffered.find("\r\n\r\n", p + 4)) {
+              together++;
+            }
+          }
+          input.consume(length);
+
+          if (seen == 4) {
+            asio::write(socket, asio::buffer(reply("0") + reply("1") +
+                                             reply("2") + reply("3")));
+          } else if (seen == 6) {
+            asio::write(socket, asio::buffer(reply("4")));
+            socket.close();
+            return;
+          }
+          serve();
+        });
+  };
+
+  acceptor.async_accept(socket, [&](const asio::error_code &error) {
+    if (!error) {
+      serve();
+    }
+  });
+
+  // without pipelining, the server would never reply.
+  deadline.expires_from_now(std::chrono::seconds(5));
+  deadline.async_wait([&](const asio::error_code &error) {
+    if (!error) {
+      io.stop();
+    }
+  });
+
+  pool.maxConnections = 1;
+  pool.pipeline = 4;
+
+  const std::string base = "http://127.0.0.1:" +
+                           std::to_string(acceptor.local_endpoint().port()) +
+                           "/pipeline/";
+
+  for (std::size_t i = 0; i < 6; i++) {
+    http::call<transport::tcp>(base + std::to_string(i), {}, "", "GET",
+                               clients, io)
+        .success([&](http::sessionData &session) {
+          results.push_back(session.content);
+        })
+        .failure([&](http::sessionData &) {
+          results.push_back("failed");
+          if (results.size() == 6) {
+            deadline.cancel();
+            acceptor.close();
+          }
+        });
+  }
+
+  io.run();
+
+  pool.maxConnections = maxConnections;
+  pool.pipeline = pipeline;
+
+  while (!clients.empty()) {
+    delete *clients.begin();
+  }
+
+  const std::vector<std::string> expected{"0", "1", "2", "3", "4", "failed"};
+  if (results != expected) {
+    log << "got " << results.size() << " results from " << seen
+        << " pipelined requests:";
+    for (const auto &r : results) {
+      log << " '" << r << "'";
+    }
+    log << "\n";
+    return false;
+  }
+
+  if (together != 4) {
+    log << "expected the first four requests in one piece, but got "
+        << together << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test client deadlines, retries and hedging.
+ * @log Test output stream.
+ *
+ * Runs requests against a server that never answers some of them: the first
+ * request times out waiting for its reply and is retried, the second one is
+ * hedged onto another connection, and the third one runs out of time. The
+ * connections that the second and third requests were stuck on should then be
+ * closed, once the hedge has won and once time has run out, respectively.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testClientDeadlines(std::ostream &log) {
+  service io;
+  efgy::beacons<http::client<transport::tcp>> clients;
+  http::pool &pool = efgy::global<http::pool>();
+  const std::size_t retried = pool.retried;
+  const std::size_t hedged = pool.hedged;
+  const std::size_t timedOut = pool.timedOut;
+
+  transport::tcp::acceptor acceptor(
+      io, transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  std::list<transport::tcp::socket> sockets;
+  asio::steady_timer deadline(io);
+  std::size_t seen = 0;
+  std::vector<std::string> results;
+  std::set<transport::tcp::socket *> stuck;
+  std::size_t hungUp = 0;
+
+  // which of the requests get a reply, by the order they come in.
+  const std::vector<bool> answer{false, true, false, true, false};
+
+  std::function<void(transport::tcp::socket &,
+                     std::shared_ptr<asio::streambuf>)>
+      serve = [&](transport::tcp::socket &socket,
+                  std::shared_ptr<asio::streambuf> input) {
+        asio::async_read_until(
+            socket, *input, "\r\n\r\n",
+            [&, input](const asio::error_code &error, std::size_t length) {
+              if (error) {
+                if (stuck.count(&socket) > 0 && ++hungUp == 2) {
+                  io.stop();
+                }
+                return;
+              }
+              input->consume(length);
+              const std::size_t n = seen++;
+              if (n == 2 || n == 4) {
+                stuck.insert(&socket);
+              }
+              if (n < answer.size() && answer[n]) {
+                const std::string body = std::to_string(n);
+                asio::write(socket,
+                            asio::buffer("HTTP/1.1 200 OK\r\nContent-Length: " +
+                                         std::to_string(body.size()) +
+                                         "\r\n\r\n" + body));
+              }
+              serve(socket, input);
+            });
+      };
+
+  std::function<void(void)> accept = [&]() {
+    sockets.emplace_back(io);
+    acceptor.async_accept(sockets.back(), [&](const asio::error_code &error) {
+      if (!error) {
+        serve(sockets.back(), std::make_shared<asio::streambuf>());
+        accept();
+      }
+    });
+  };
+  accept();
+
+  deadline.expires_from_now(std::chrono::seconds(5));
+  deadline.async_wait([&](const asio::error_code &error) {
+    if (!error) {
+      io.stop();
+    }
+  });
+
+  const std::string base = "http://127.0.0.1:" +
+                           std::to_string(acceptor.local_endpoint().port()) +
+                           "/deadline";
+
+  std::function<void(http::sessionData &)> success =
+      [&](http::sessionData &session) { results.push_back(session.content); };
+  std::function<void(http::sessionData &)> failure =
+      [&](http::sessionData &) { results.push_back("failed"); };
+
+  std::function<void(void)> next = [&]() {
+    if (results.size() == 1) {
+      pool.firstByteTimeout = std::chrono::milliseconds(0);
+      pool.retries = 0;
+      pool.hedge = true;
+      pool.hedgeAfter = std::chrono::milliseconds(50);
+    } else if (results.size() == 2) {
+      pool.hedge = false;
+      pool.totalTimeout = std::chrono::milliseconds(100);
+    } else {
+      // wait for the client to hang up on the stuck requests.
+      return;
+    }
+
+    http::call<transport::tcp>(base, {}, "", "GET", clients, io)
+        .success([&](http::sessionData &session) {
+          success(session);
+          next();
+        })
+        .failure([&](http::sessionData &session) {
+          failure(session);
+          next();
+        });
+  };
+
+  pool.firstByteTimeout = std::chrono::milliseconds(100);
+  pool.retries = 1;
+  pool.backoff = std::chrono::milliseconds(10);
+
+  http::call<transport::tcp>(base, {}, "", "GET", clients, io)
+      .success([&](http::sessionData &session) {
+        success(session);
+        next();
+      })
+      .failure([&](http::sessionData &session) {
+        failure(session);
+        next();
+      });
+
+  io.run();
+
+  pool.firstByteTimeout = std::chrono::milliseconds(0);
+  pool.totalTimeout = std::chrono::milliseconds(0);
+  pool.retries = 0;
+  pool.backoff = std::chrono::milliseconds(50);
+  pool.hedge = false;
+  pool.hedgeAfter = std::chrono::milliseconds(0);
+
+  while (!clients.empty()) {
+    delete *clients.begin();
+  }
+
+  const std::vector<std::string> expected{"1", "3", "failed"};
+  if (results != expected) {
+    log << "got " << results.size() << " results from " << seen
+        << " requests:";
+    for (const auto &r : results) {
+      log << " '" << r << "'";
+    }
+    log << "\n";
+    return false;
+  }
+
+  if (hungUp != 2) {
+    log << "expected two connections with stuck requests to be closed, but "
+        << "got " << hungUp << "\n";
+    return false;
+  }
+
+  if (pool.retried != retried + 1 || pool.hedged != hedged + 1 ||
+      pool.timedOut != timedOut + 1) {
+    log << "expected one retry, hedge and timeout each, but got "
+        << pool.retried - retried << ", " << pool.hedged - hedged << " and "
+        << pool.timedOut - timedOut << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test hedging with a single connection.
+ * @log Test output stream.
+ *
+ * Sends a request to a server that never answers it, with hedging turned on
+ * but only one connection allowed to the host. The hedge would only end up
+ * stuck behind the first attempt on that connection, so it must not be sent
+ * at all; the request runs out of time instead.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testHedgeElsewhere(std::ostream &log) {
+  service io;
+  efgy::beacons<http::client<transport::tcp>> clients;
+  http::pool &pool = efgy::global<http::pool>();
+  const std::size_t maxConnections = pool.maxConnections;
+  const std::size_t pipeline = pool.pipeline;
+  const std::size_t hedged = pool.hedged;
+
+  transport::tcp::acceptor acceptor(
+      io, transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  transport::tcp::socket socket(io);
+  asio::streambuf input;
+  asio::steady_timer deadline(io);
+  std::size_t seen = 0;
+  std::string result;
+
+  std::function<void(void)> read = [&]() {
+    asio::async_read_until(socket, input, "\r\n\r\n",
+                           [&](const asio::error_code &error, std::size_t n) {
+                             if (!error) {
+                               input.consume(n);
+                               seen++;
+                               read();
+                             }
+                           });
+  };
+  acceptor.async_accept(socket, [&](const asio::error_code &error) {
+    if (!error) {
+      read();
+    }
+  });
+
+  deadline.expires_from_now(std::chrono::seconds(5));
+  deadline.async_wait([&](const asio::error_code &error) {
+    if (!error) {
+      io.stop();
+    }
+  });
+
+  pool.maxConnections = 1;
+  pool.pipeline = 4;
+  pool.hedge = true;
+  pool.hedgeAfter = std::chrono::milliseconds(20);
+  pool.totalTimeout = std::chrono::milliseconds(200);
+
+  http::call<transport::tcp>(
+      "http://127.0.0.1:" + std::to_string(acceptor.local_endpoint().port()) +
+          "/hedge",
+      {}, "", "GET", clients, io)
+      .success([&](http::sessionData &) {
+        result = "replied";
+        io.stop();
+      })
+      .failure([&](http::sessionData &) {
+        result = "failed";
+        io.stop();
+      });
+
+  io.run();
+
+  pool.maxConnections = maxConnections;
+  pool.pipeline = pipeline;
+  pool.hedge = false;
+  pool.hedgeAfter = std::chrono::milliseconds(0);
+  pool.totalTimeout = std::chrono::milliseconds(0);
+
+  while (!clients.empty()) {
+    delete *clients.begin();
+  }
+
+  if (result != "failed" || seen != 1 || pool.hedged != hedged) {
+    log << "call " << result << " after " << seen << " requests and "
+        << pool.hedged - hedged << " hedges; expected it to fail after one "
+        << "request and no hedges\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test server connection timeouts.
+ * @log Test output stream.
+ *
+ * Opens connections to a server with short timeouts: one that never sends
+ * anything, one that trickles in header lines and one that sends half a body.
+ * All of them should be closed by the server, the trickling one despite the
+ * steady stream of data, while a well-behaved request still gets its reply.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testServerTimeouts(std::ostream &log) {
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  auto &server = http::server<transport::tcp>::get(
+      transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0), servers,
+      io);
+  const auto endpoint = server.endpoint();
+
+  http::timeouts limits;
+  limits.idle = std::chrono::milliseconds(300);
+  limits.header = std::chrono::milliseconds(500);
+  limits.body = std::chrono::milliseconds(300);
+  limits.write = std::chrono::milliseconds(300);
+  server.processor.timeout = &limits;
+
+  struct sampleData {
+    std::string name;
+    std::string request;
+    bool trickle;
+    std::string reply;
+    std::chrono::steady_clock::duration took;
+  };
+
+  std::vector<sampleData> tests{
+      {"idle", "", false},
+      {"slow headers", "GET / HTTP/1.1\r\n", true},
+      {"stalled body",
+       "POST / HTTP/1.1\r\nContent-Length: 10\r\n\r\n12345", false},
+      {"good", "GET / HTTP/1.1\r\nConnection: close\r\n\r\n", false},
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  std::list<transport::tcp::socket> sockets;
+  std::list<asio::steady_timer> timers;
+  std::list<asio::streambuf> replies;
+  std::size_t done = 0;
+
+  // sends another header line every 100ms, until the server hangs up.
+  std::function<void(transport::tcp::socket &, asio::steady_timer &)> trickle =
+      [&](transport::tcp::socket &socket, asio::steady_timer &timer) {
+        timer.expires_from_now(std::chrono::milliseconds(100));
+        timer.async_wait([&](const asio::error_code &error) {
+          asio::error_code ec;
+          if (!error &&
+              asio::write(socket, asio::buffer("X-Slow: 1\r\n", 11), ec) > 0) {
+            trickle(socket, timer);
+          }
+        });
+      };
+
+  for (auto &tt : tests) {
+    sockets.emplace_back(io);
+    timers.emplace_back(io);
+    replies.emplace_back();
+    auto &socket = sockets.back();
+    auto &timer = timers.back();
+    auto &reply = replies.back();
+
+    socket.connect(endpoint);
+    if (!tt.request.empty()) {
+      asio::write(socket, asio::buffer(tt.request));
+    }
+    if (tt.trickle) {
+      trickle(socket, timer);
+    }
+
+    asio::async_read(socket, reply, asio::transfer_all(),
+                     [&](const asio::error_code &, std::size_t) {
+                       tt.reply = std::string(
+                           asio::buffer_cast<const char *>(reply.data()),
+                           reply.size());
+                       tt.took = std::chrono::steady_clock::now() - start;
+                       timer.cancel();
+                       if (++done == tests.size()) {
+                         io.stop();
+                       }
+                     });
+  }
+
+  asio::steady_timer deadline(io);
+  deadline.expires_from_now(std::chrono::seconds(5));
+  deadline.async_wait([&](const asio::error_code &error) {
+    if (!error) {
+      io.stop();
+    }
+  });
+
+  io.run();
+
+  bool result = done == tests.size();
+  if (!result) {
+    log << "only " << done << " of " << tests.size()
+        << " connections were closed\n";
+  }
+  for (const auto &tt : tests) {
+    const bool good = tt.name == "good";
+    if (good != (tt.reply.compare(0, 9, "HTTP/1.1 ") == 0)) {
+      log << tt.name << ": unexpected reply: '" << tt.reply << "'\n";
+      result = false;
+    }
+    if (!good && tt.took > std::chrono::seconds(2)) {
+      log << tt.name << ": connection wasn't closed in time\n";
+      result = false;
+    }
+  }
+
+  return result;
+}
+
+/* Test server connection limits.
+ * @log Test output stream.
+ *
+ * Sets up two servers that take two connections at most: one that stops
+ * accepting connections past that, and one that turns them away with a 503.
+ * Each gets two connections that sit there doing nothing, and a third one with
+ * a request. The first server must only reply to that request once one of the
+ * other connections has gone away, and the second one must reply straight
+ * away, with a 503.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testConnectionLimits(std::ostream &log) {
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  const transport::tcp::endpoint loopback(asio::ip::address_v4::loopback(), 0);
+
+  struct sampleData {
+    bool shed;
+    std::string expect;
+    http::limits limits;
+    std::unique_ptr<http::server<transport::tcp>> server;
+    std::list<transport::tcp::socket> idle;
+    std::string reply;
+    bool early = false;
+  };
+
+  // the limits can't be copied, so these are filled in in place.
+  std::list<sampleData> tests(2);
+  tests.front().shed = false;
+  tests.front().expect = "HTTP/1.1 501 ";
+  tests.back().shed = true;
+  tests.back().expect = "HTTP/1.1 503 ";
+
+  std::list<transport::tcp::socket> sockets;
+  std::list<asio::streambuf> replies;
+  std::size_t done = 0;
+  bool closed = false;
+
+  for (auto &tt : tests) {
+    // not get(), as that would return the same server both times.
+    tt.server.reset(new http::server<transport::tcp>(loopback, servers, io));
+    auto &server = *tt.server;
+    tt.limits.maxConnections = 2;
+    tt.limits.shed = tt.shed;
+    server.processor.limit = &tt.limits;
+
+    for (std::size_t i = 0; i < 2; i++) {
+      tt.idle.emplace_back(io);
+      tt.idle.back().connect(server.endpoint());
+    }
+
+    sockets.emplace_back(io);
+    replies.emplace_back();
+    auto &socket = sockets.back();
+    auto &reply = replies.back();
+
+    // the connection is still established, as the kernel accepts it for us.
+    socket.connect(server.endpoint());
+    asio::write(socket,
+                asio::buffer("GET / HTTP/1.1\r\nConnection: close\r\n\r\n"));
+    asio::async_read(socket, reply, asio::transfer_all(),
+                     [&](const asio::error_code &, std::size_t) {
+                       tt.reply = std::string(
+                           asio::buffer_cast<const char *>(reply.data()),
+                           reply.size());
+                       tt.early = !closed;
+                       if (++done == tests.size()) {
+                         io.stop();
+                       }
+                     });
+  }
+
+  asio::steady_timer timer(io);
+  timer.expires_from_now(std::chrono::milliseconds(300));
+  timer.async_wait([&](const asio::error_code &error) {
+    closed = true;
+    for (auto &tt : tests) {
+      tt.idle.pop_front();
+    }
+    timer.expires_from_now(std::chrono::seconds(5));
+    timer.async_wait([&](const asio::error_code &error) {
+      if (!error) {
+        io.stop();
+      }
+    });
+  });
+
+  io.run();
+
+  bool result = done == tests.size();
+  if (!result) {
+    log << "only " << done << " of " << tests.size() << " requests finished\n";
+  }
+
+  for (const auto &tt : tests) {
+    if (tt.reply.compare(0, tt.expect.size(), tt.expect) != 0) {
+      log << "expected '" << tt.expect << "', but got: '" << tt.reply << "'\n";
+      result = false;
+    }
+    if (tt.early != tt.shed) {
+      log << "reply came " << (tt.early ? "before" : "after")
+          << " a connection was closed; shedding: " << tt.shed << "\n";
+      result = false;
+    }
+    if (tt.server->shed != (tt.shed ? 1 : 0) ||
+        tt.server->pauses == (tt.shed ? 1 : 0)) {
+      log << "unexpected counts: shed " << tt.server->shed << ", paused "
+          << tt.server->pauses << "; shedding: " << tt.shed << "\n";
+      result = false;
+    }
+  }
+
+  return result;
+}
+
+/* Test backpressure on pipelined requests.
+ * @log Test output stream.
+ *
+ * Pipelines a few hundred requests for large replies, without reading any of
+ * the replies at first. The server needs to stop handling requests once the
+ * replies pile up: past the session's high watermark, or past the outbound
+ * budget, if there is one. Once the client does read the replies, it must get
+ * all of them, and nothing may be left on the shared count of queued bytes.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testBackpressure(std::ostream &log) {
+  static const std::size_t requests = 300;
+  static const std::string body(64 * 1024, 'x');
+  const transport::tcp::endpoint loopback(asio::ip::address_v4::loopback(), 0);
+
+  struct sampleData {
+    std::size_t budget;
+    std::size_t limit;
+  };
+
+  std::vector<sampleData> tests{
+      {0, 1024 * 1024}, {256 * 1024, 256 * 1024},
+  };
+
+  bool result = true;
+
+  for (const auto &tt : tests) {
+    service io;
+    efgy::beacons<http::server<transport::tcp>> servers;
+    http::server<transport::tcp> server(loopback, servers, io);
+    http::limits limits;
+    limits.maxOutboundBytes = tt.budget;
+    server.processor.limit = &limits;
+
+    std::size_t handled = 0;
+    std::size_t peak = 0;
+    http::servlet big("/big",
+                      [&](http::sessionData &sess, std::smatch &) {
+                        const std::size_t queued =
+                            tt.budget > 0 ? limits.outboundBytes.load()
+                                          : sess.outboundBytes;
+                        peak = std::max(peak, queued);
+                        handled++;
+                        sess.reply(200, body);
+                      },
+                      "GET", {}, "backpressure test servlet",
+                      server.processor.servlets);
+
+    std::string pipeline;
+    for (std::size_t i = 0; i < requests; i++) {
+      pipeline += "GET /big HTTP/1.1\r\n\r\n";
+    }
+
+    transport::tcp::socket socket(io);
+    asio::streambuf reply;
+    std::size_t early = 0;
+    bool done = false;
+
+    socket.connect(server.endpoint());
+    asio::async_write(socket, asio::buffer(pipeline),
+                      [](const asio::error_code &, std::size_t) {});
+
+    asio::steady_timer timer(io);
+    timer.expires_from_now(std::chrono::milliseconds(300));
+    timer.async_wait([&](const asio::error_code &) {
+      early = handled;
+      // all the replies are the same, so the first one's head says how much
+      // there is to read.
+      asio::async_read_until(
+          socket, reply, "\r\n\r\n",
+          [&](const asio::error_code &error, std::size_t head) {
+            const std::size_t total = requests * (head + body.size());
+            if (error || total < reply.size()) {
+              io.stop();
+              return;
+            }
+            asio::async_read(socket, reply,
+                             asio::transfer_exactly(total - reply.size()),
+                             [&](const asio::error_code &error, std::size_t) {
+                               done = !error;
+                               io.stop();
+                             });
+          });
+      timer.expires_from_now(std::chrono::seconds(10));
+      timer.async_wait([&](const asio::error_code &error) {
+        if (!error) {
+          io.stop();
+        }
+      });
+    });
+
+    io.run();
+
+    const std::string data(asio::buffer_cast<const char *>(reply.data()),
+                           reply.size());
+    std::size_t replies = 0;
+    for (auto p = data.find("HTTP/1.1 200 "); p != std::string::npos;
+         p = data.find("HTTP/1.1 200 ", p + 1)) {
+      replies++;
+    }
+
+    if (!done || replies != requests) {
+      log << "got " << replies << " of " << requests << " replies\n";
+      result = false;
+    }
+    if (early == requests) {
+      log << "all requests were handled before the client read anything\n";
+      result = false;
+    }
+    if (peak > tt.limit) {
+      log << "queued up " << peak << " bytes, with a limit of " << tt.limit
+          << "\n";
+      result = false;
+    }
+    if (limits.outboundBytes != 0) {
+      log << limits.outboundBytes << " bytes left on the shared count\n";
+      result = false;
+    }
+  }
+
+  return result;
+}
+
+/* Test fair scheduling between pipelining connections.
+ * @log Test output stream.
+ *
+ * One connection pipelines a few thousand requests in one go, and once the
+ * server is busy with those, another one sends a single request. With all of
+ * it on the same thread, the single request needs to be handled after no more
+ * than a few more of the other connection's requests, even though those are
+ * already in the server's input buffer.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testFairness(std::ostream &log) {
+  static const std::size_t requests = 5000;
+  static const std::size_t trigger = 100;
+  static const std::size_t bound = 200;
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  http::server<transport::tcp> server(
+      transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0), servers,
+      io);
+
+  transport::tcp::socket a(io);
+  transport::tcp::socket b(io);
+  std::size_t handled = 0;
+  std::size_t before = requests;
+
+  http::servlet bulk("/bulk",
+                     [&](http::sessionData &sess, std::smatch &) {
+                       if (++handled == trigger) {
+                         asio::write(b, asio::buffer("GET /single HTTP/1.1"
+                                                     "\r\n\r\n"));
+                       }
+                       sess.reply(200, "");
+                     },
+                     "GET", {}, "fairness test servlet",
+                     server.processor.servlets);
+  http::servlet single("/single",
+                       [&](http::sessionData &sess, std::smatch &) {
+                         before = handled;
+                         sess.reply(200, "");
+                       },
+                       "GET", {}, "fairness test servlet",
+                       server.processor.servlets);
+
+  // the long header makes the server's input buffer grow, so that it'll read
+  // lots of requests at a time after that.
+  std::string pipeline = "GET /bulk HTTP/1.1\r\nX-Padding: " +
+                         std::string(8000, 'x') + "\r\n\r\n";
+  for (std::size_t i = 1; i < requests; i++) {
+    pipeline += "GET /bulk HTTP/1.1\r\n\r\n";
+  }
+
+  asio::streambuf replies;
+  char reply[512];
+
+  a.connect(server.endpoint());
+  b.connect(server.endpoint());
+  asio::write(a, asio::buffer(pipeline));
+
+  asio::async_read(a, replies, asio::transfer_all(),
+                   [](const asio::error_code &, std::size_t) {});
+  b.async_read_some(asio::buffer(reply),
+                    [](const asio::error_code &, std::size_t) {});
+
+  asio::steady_timer timer(io);
+  std::function<void(void)> check = [&]() {
+    timer.expires_from_now(std::chrono::milliseconds(10));
+    timer.async_wait([&](const asio::error_code &) {
+      if (handled < requests || before == requests) {
+        check();
+      } else {
+        io.stop();
+      }
+    });
+  };
+  check();
+
+  asio::steady_timer deadline(io);
+  deadline.expires_from_now(std::chrono::seconds(10));
+  deadline.async_wait([&](const asio::error_code &) { io.stop(); });
+
+  io.run();
+
+  if (handled != requests) {
+    log << "only " << handled << " of " << requests << " requests handled\n";
+    return false;
+  }
+  if (before - trigger > bound) {
+    log << "single request had to wait for " << before - trigger
+        << " pipelined ones\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test draining a server.
+ * @log Test output stream.
+ *
+ * Drains a server with three connections: one that's waiting for a request,
+ * one with two pipelined requests, the first of which gets its reply a little
+ * later, and one that never finishes sending its request. The first one needs
+ * to be closed right away. The second one needs to get the one reply, which
+ * asks it to close the connection, and then be closed. The third one needs to
+ * be closed once the drain timeout has passed, and the request after the one
+ * that was answered must not be handled at all. After that, the server must
+ * not take any new connections, and the I/O service must run out of things to
+ * do.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testDrain(std::ostream &log) {
+  using clock = std::chrono::steady_clock;
+  static const std::chrono::milliseconds timeout(500);
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  http::server<transport::tcp> server(
+      transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0), servers,
+      io);
+  const auto endpoint = server.endpoint();
+
+  asio::steady_timer later(io);
+  std::size_t handled = 0;
+  http::servlet slow("/slow",
+                     [&](http::sessionData &sess, std::smatch &) {
+                       http::deferredReply token(sess);
+                       handled++;
+                       later.expires_from_now(std::chrono::milliseconds(200));
+                       later.async_wait([token](const asio::error_code &) {
+                         token.reply(200, "done");
+                       });
+                     },
+                     "GET", {}, "drain test servlet",
+                     server.processor.servlets);
+
+  struct sampleData {
+    std::string name, request;
+    std::size_t replies;
+    std::chrono::milliseconds minimum, maximum;
+    std::string reply;
+    clock::duration closed;
+  };
+
+  std::list<sampleData> tests{
+      {"idle", "", 0, std::chrono::milliseconds(0),
+       std::chrono::milliseconds(150)},
+      {"busy", "GET /slow HTTP/1.1\r\n\r\nGET /slow HTTP/1.1\r\n\r\n", 1,
+       std::chrono::milliseconds(100), timeout},
+      {"stuck", "GET /slow HTTP/1.1\r\n", 0, timeout,
+       timeout + std::chrono::seconds(1)},
+  };
+
+  std::list<transport::tcp::socket> sockets;
+  std::list<asio::streambuf> replies;
+  clock::time_point start;
+  std::size_t done = 0;
+
+  asio::steady_timer watchdog(io);
+  watchdog.expires_from_now(std::chrono::seconds(10));
+  watchdog.async_wait([&](const asio::error_code &error) {
+    if (!error) {
+      io.stop();
+    }
+  });
+
+  for (auto &tt : tests) {
+    sockets.emplace_back(io);
+    replies.emplace_back();
+    auto &socket = sockets.back();
+    auto &reply = replies.back();
+
+    socket.connect(endpoint);
+    asio::write(socket, asio::buffer(tt.request));
+    asio::async_read(socket, reply, asio::transfer_all(),
+                     [&](const asio::error_code &, std::size_t) {
+                       tt.closed = clock::now() - start;
+                       tt.reply = std::string(
+                           asio::buffer_cast<const char *>(reply.data()),
+                           reply.size());
+                       if (++done == tests.size()) {
+                         asio::error_code ec;
+                         watchdog.cancel(ec);
+                       }
+                     });
+  }
+
+  asio::steady_timer timer(io);
+  timer.expires_from_now(std::chrono::milliseconds(50));
+  timer.async_wait([&](const asio::error_code &) {
+    start = clock::now();
+    server.drain(timeout);
+  });
+
+  io.run();
+
+  bool result = done == tests.size();
+  if (!result) {
+    log << "only " << done << " of " << tests.size()
+        << " connections were closed\n";
+  }
+  if (handled != 1) {
+    log << "handled " << handled << " requests, but expected only one\n";
+    result = false;
+  }
+
+  for (const auto &tt : tests) {
+    std::size_t n = 0;
+    for (auto p = tt.reply.find("HTTP/1.1 200 "); p != std::string::npos;
+         p = tt.reply.find("HTTP/1.1 200 ", p + 1)) {
+      n++;
+    }
+
+    const bool closing =
+        tt.reply.find("Connection: close\r\n") != std::string::npos;
+    if (n != tt.replies || (n > 0 && !closing)) {
+      log << tt.name << ": expected " << tt.replies
+          << " replies that close the connection, but got: '" << tt.reply
+          << "'\n";
+      result = false;
+    }
+    if (tt.closed < tt.minimum || tt.closed > tt.maximum) {
+      log << tt.name << ": closed after "
+          << std::chrono::duration_cast<std::chrono::milliseconds>(tt.closed)
+                 .count()
+          << "ms\n";
+      result = false;
+    }
+  }
+
+  transport::tcp::socket late(io);
+  asio::error_code error;
+  late.connect(endpoint, error);
+  if (!error) {
+    log << "the server still took a new connection after draining\n";
+    result = false;
+  }
+
+  return result;
+}
+
+/* Set up a server on a socket that's already listening.
+ * @log Test output stream.
+ *
+ * Opens a socket like systemd would for socket activation, and connects to it
+ * before there's a server. Sockets that aren't listening yet mustn't be taken,
+ * and once there is a server on it, the connection that was waiting in the
+ * backlog needs to get its reply.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testAdopt(std::ostream &log) {
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  efgy::beacons<http::servlet> servlets;
+  http::servlet hello("/adopt",
+                      [](http::sessionData &session, std::smatch &) {
+                        session.reply(200, "adopted");
+                      },
+                      "GET", {}, "adopt test servlet", servlets);
+
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (fd < 0 || ::bind(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+    log << "could not bind a socket\n";
+    return false;
+  }
+
+  if (httpd::cli::setupDescriptor(fd)) {
+    log << "set up a server on a socket that isn't listening\n";
+    return false;
+  }
+
+  transport::tcp::endpoint endpoint;
+  transport::tcp::socket early(io);
+  if (::listen(fd, 16) != 0 || !net::localEndpoint(fd, endpoint)) {
+    log << "could not listen on the socket\n";
+    return false;
+  }
+  early.connect(endpoint);
+
+  if (!httpd::cli::adopt<transport::tcp>(fd, servers, io, servlets) ||
+      servers.size() != 1) {
+    log << "could not set up a server on the socket\n";
+    return false;
+  }
+
+  auto &server = **servers.begin();
+  if (server.endpoint() != endpoint) {
+    log << "server is at " << server.endpoint() << " rather than " << endpoint
+        << "\n";
+    return false;
+  }
+
+  asio::streambuf reply;
+  asio::write(early,
+              asio::buffer(std::string("GET /adopt HTTP/1.1\r\n"
+                                       "Connection: close\r\n\r\n")));
+  asio::async_read(early, reply, asio::transfer_all(),
+                   [&](const asio::error_code &, std::size_t) {
+                     server.drain();
+                   });
+
+  io.run();
+
+  const std::string data(asio::buffer_cast<const char *>(reply.data()),
+                         reply.size());
+  bool result = true;
+  if (data.find("HTTP/1.1 200 ") != 0 ||
+      data.find("\r\n\r\nadopted") == std::string::npos) {
+    log << "unexpected reply: '" << data << "'\n";
+    result = false;
+  }
+
+  while (!servers.empty()) {
+    delete *servers.begin();
+  }
+
+  return result;
+}
+
 namespace test {
 using efgy::test::function;
 
 static function UNIX(testUNIX);
 static function TCP(testTCP);
+static function connectionChurn(testConnectionChurn);
+static function connectionRegistry(testConnectionRegistry);
+static function clientPool(testClientPool);
+static function closingConnection(testClosingConnection);
+static function pipelineIdempotent(testPipelineIdempotent);
+static function pipelining(testPipelining);
+static function clientDeadlines(testClientDeadlines);
+static function hedgeElsewhere(testHedgeElsewhere);
+static function serverTimeouts(testServerTimeouts);
+static function connectionLimits(testConnectionLimits);
+static function backpressure(testBackpressure);
+static function fairness(testFairness);
+static function drain(testDrain);
+static function adoptSocket(testAdopt);
 }
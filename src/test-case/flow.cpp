@@ -0,0 +1,420 @@
+/* Test cases for the HTTP I/O control flow.
+ *
+ * Runs a server flow over one end of a socket pair, and plays the client on the
+ * other end, so that we can test how request bodies are read and passed on to
+ * servlets.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+
+#define ASIO_DISABLE_THREADS
+#include <ef.gy/test-case.h>
+
+#include "round-trip.h"
+
+using namespace cxxhttp;
+
+using test::roundTrip;
+
+/* Get the body of a reply.
+ * @reply The full reply.
+ *
+ * @return Everything after the header.
+ */
+static std::string body(const std::string &reply) {
+  const auto p = reply.find("\r\n\r\n");
+  return p == std::string::npos ? "" : reply.substr(p + 4);
+}
+
+/* Test streamed request bodies.
+ * @log Test output stream.
+ *
+ * Sends requests to a streaming servlet, which counts the body parts it sees,
+ * and makes sure the body is only dispatched once and arrives in full.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testStreamingContent(std::ostream &log) {
+  struct sampleData {
+    std::string request;
+    std::string status, body;
+    bool handled;
+  };
+
+  const std::string large(100000, 'x');
+
+  std::vector<sampleData> tests{
+      {"PUT /stream HTTP/1.1\r\nContent-Length: 6\r\n\r\nfoobar",
+       "HTTP/1.1 200 OK", "6 foobar", true},
+      {"PUT /stream HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+       "3\r\nfoo\r\n3\r\nbar\r\n0\r\n\r\n",
+       "HTTP/1.1 200 OK", "6 foobar", true},
+      {"PUT /stream HTTP/1.1\r\nContent-Length: 0\r\n\r\n", "HTTP/1.1 200 OK",
+       "0 ", true},
+      {"PUT /stream HTTP/1.1\r\nContent-Length: " +
+           std::to_string(large.size()) + "\r\n\r\n" + large,
+       "HTTP/1.1 200 OK", std::to_string(large.size()) + " xxxxxx", true},
+      {"PUT /stream HTTP/1.1\r\nContent-Length: 200000\r\n\r\n",
+       "HTTP/1.1 413 Request Entity Too Large", "", false},
+      {"PUT /buffer HTTP/1.1\r\nContent-Length: 6\r\n\r\nfoobar",
+       "HTTP/1.1 200 OK", "foobar", false},
+      {"PUT /buffer HTTP/1.1\r\nContent-Length: 20\r\n\r\nfoobar",
+       "HTTP/1.1 413 Request Entity Too Large", "", false},
+      {"PUT /buffer HTTP/1.1\r\nContent-Length: 6\r\n"
+       "Transfer-Encoding: chunked\r\n\r\n3\r\nfoo\r\n0\r\n\r\n",
+       "HTTP/1.1 400 Client Error", "", false},
+      {"PUT /buffer HTTP/1.1\r\nContent-Length: +6\r\n\r\nfoobar",
+       "HTTP/1.1 400 Client Error", "", false},
+      {"PUT /buffer HTTP/1.1\r\nContent-Length: 6abc\r\n\r\nfoobar",
+       "HTTP/1.1 400 Client Error", "", false},
+      {"PUT /buffer HTTP/1.1\r\nContent-Length: -1\r\n\r\nfoobar",
+       "HTTP/1.1 400 Client Error", "", false},
+      {"PUT /buffer HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+       "3 garbage\r\nfoo\r\n0\r\n\r\n",
+       "HTTP/1.1 400 Client Error", "", false},
+  };
+
+  for (const auto &tt : tests) {
+    asio::io_service service;
+    http::processor::server processor;
+    std::size_t dispatched = 0;
+    std::size_t maxPart = 0;
+
+    processor.maxContentLength = 10;
+
+    http::servlet streaming(
+        "/stream",
+        [&dispatched, &maxPart](http::sessionData &session, std::smatch &) {
+          auto seen = std::make_shared<std::string>();
+          dispatched++;
+
+          session.onContent = [seen, &maxPart](http::sessionData &session) {
+            maxPart = std::max(maxPart, session.content.size());
+            if (seen->size() < 6) {
+              seen->append(session.content.substr(0, 6 - seen->size()));
+            }
+            if (session.contentComplete()) {
+              const std::size_t total =
+                  session.contentOffset + session.content.size();
+              session.reply(200, std::to_string(total) + " " + *seen);
+            }
+          };
+        },
+        "PUT", {}, "streaming test servlet", processor.servlets);
+    streaming.streamContent = true;
+    streaming.maxContentLength = 150000;
+
+    http::servlet buffering(
+        "/buffer",
+        [](http::sessionData &session, std::smatch &) {
+          session.reply(200, session.content);
+        },
+        "PUT", {}, "buffering test servlet", processor.servlets);
+
+    const std::string reply = roundTrip(service, processor, tt.request);
+
+    if (reply.compare(0, tt.status.size(), tt.status) != 0) {
+      log << "unexpected reply: '" << reply << "'; expected status '"
+          << tt.status << "'\n";
+      return false;
+    }
+
+    if (!tt.body.empty() && body(reply) != tt.body) {
+      log << "unexpected reply body: '" << body(reply) << "'; expected '"
+          << tt.body << "'\n";
+      return false;
+    }
+
+    if (tt.handled && dispatched != 1) {
+      log << "streaming servlet was dispatched " << dispatched
+          << " times, expected once\n";
+      return false;
+    }
+
+    if (maxPart > 65536) {
+      log << "streaming servlet got a body part of " << maxPart
+          << " bytes; the body should not be buffered\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Test pausing streamed request bodies.
+ * @log Test output stream.
+ *
+ * A streaming servlet that pauses after every part of the body, and resumes
+ * from a separate callback, should still see the whole body, and never get a
+ * body part while paused.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testPauseContent(std::ostream &log) {
+  asio::io_service service;
+  http::processor::server processor;
+  const std::string large(200000, 'x');
+  std::size_t parts = 0;
+  bool paused = false;
+  bool overrun = false;
+
+  http::servlet streaming(
+      "/stream",
+      [&](http::sessionData &session, std::smatch &) {
+        session.onContent = [&](http::sessionData &session) {
+          overrun = overrun || paused;
+          parts++;
+
+          if (session.contentComplete()) {
+            session.reply(200, std::to_string(session.contentOffset +
+                                              session.content.size()));
+          } else {
+            paused = true;
+            session.pauseContent();
+            service.post([&paused, &session]() {
+              paused = false;
+              session.resumeContent();
+            });
+          }
+        };
+      },
+      "PUT", {}, "pausing test servlet", processor.servlets);
+  streaming.streamContent = true;
+  streaming.maxContentLength = large.size();
+
+  const std::string reply = roundTrip(
+      service, processor, "PUT /stream HTTP/1.1\r\nContent-Length: " +
+                              std::to_string(large.size()) + "\r\n\r\n" +
+                              large);
+
+  if (body(reply) != std::to_string(large.size())) {
+    log << "unexpected reply: '" << reply << "'\n";
+    return false;
+  }
+
+  if (overrun) {
+    log << "got a body part while reading was paused\n";
+    return false;
+  }
+
+  if (parts < 2) {
+    log << "body was only delivered in " << parts << " parts\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test reading request bodies with a known length.
+ * @log Test output stream.
+ *
+ * Sends a large body and a couple of pipelined requests to a regular servlet,
+ * to make sure bodies that are read straight into the session's content come
+ * out right, and that nothing past the end of the body is read with them.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testReadContent(std::ostream &log) {
+  asio::io_service service;
+  http::processor::server processor;
+  const std::string large(300000, 'y');
+  std::vector<std::string> bodies;
+
+  http::servlet buffering(
+      "/buffer",
+      [&bodies](http::sessionData &session, std::smatch &) {
+        bodies.push_back(session.content);
+        session.reply(200, std::to_string(session.content.size()));
+      },
+      "PUT", {}, "buffering test servlet", processor.servlets);
+
+  const std::string reply = roundTrip(
+      service, processor,
+      "PUT /buffer HTTP/1.1\r\nContent-Length: 3\r\n\r\nfoo"
+      "PUT /buffer HTTP/1.1\r\nContent-Length: " +
+          std::to_string(large.size()) + "\r\n\r\n" + large +
+          "PUT /buffer HTTP/1.1\r\nContent-Length: 3\r\n\r\nbar");
+
+  const std::vector<std::string> expected{"foo", large, "bar"};
+
+  if (bodies != expected) {
+    log << "got " << bodies.size() << " bodies, which were not what was sent; "
+        << "reply: '" << reply << "'\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test spilling request bodies to disk.
+ * @log Test output stream.
+ *
+ * Sends bodies of different sizes to a servlet that spills large bodies to a
+ * temporary file, and checks that the body ends up in the right place.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testSpillContent(std::ostream &log) {
+  struct sampleData {
+    std::string request;
+    std::string body;
+    bool spilled;
+  };
+
+  const std::string large(200000, 'z');
+
+  std::vector<sampleData> tests{
+      {"PUT /spill HTTP/1.1\r\nContent-Length: 6\r\n\r\nfoobar", "foobar",
+       false},
+      {"PUT /spill HTTP/1.1\r\nContent-Length: " +
+           std::to_string(large.size()) + "\r\n\r\n" + large,
+       large, true},
+      {"PUT /spill HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+       "6\r\nfoobar\r\n0\r\n\r\n",
+       "foobar", false},
+      {"PUT /spill HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+       "6\r\nfoobar\r\n14\r\n01234567890123456789\r\n0\r\n\r\n",
+       "foobar01234567890123456789", true},
+  };
+
+  for (const auto &tt : tests) {
+    asio::io_service service;
+    http::processor::server processor;
+    std::string body;
+    bool spilled = false;
+
+    http::servlet spilling(
+        "/spill",
+        [&body, &spilled](http::sessionData &session, std::smatch &) {
+          spilled = session.contentFile.active();
+          if (spilled && session.content.empty()) {
+            const char *data = session.contentFile.map();
+            body = data != nullptr
+                       ? std::string(data, session.contentFile.size())
+                       : "";
+          } else {
+            body = session.content;
+          }
+          session.reply(200, "");
+        },
+        "PUT", {}, "spilling test servlet", processor.servlets);
+    spilling.spillContent = 16;
+    spilling.maxContentLength = large.size();
+
+    const std::string reply = roundTrip(service, processor, tt.request);
+
+    if (body != tt.body) {
+      log << "servlet did not see the right body; reply: '" << reply << "'\n";
+      return false;
+    }
+
+    if (spilled != tt.spilled) {
+      log << "body spilled: " << spilled << ", expected: " << tt.spilled
+          << "\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Test deferred replies.
+ * @log Test output stream.
+ *
+ * A servlet that defers its reply and sends it from a later callback should
+ * have its reply go out before the next pipelined request is handled. One that
+ * never replies should have the client get a 504 once its deadline passes, and
+ * any later reply should be dropped. So should replies to sessions that have
+ * been destroyed in the meantime.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testDeferredReply(std::ostream &log) {
+  asio::io_service service, expiring;
+  http::processor::server processor;
+  std::vector<std::string> handled;
+  asio::steady_timer late(expiring);
+
+  http::servlet deferring(
+      "/defer/(.*)",
+      [&service, &handled](http::sessionData &session, std::smatch &m) {
+        const std::string name = m[1];
+        http::deferredReply token(session);
+        handled.push_back(name);
+        service.post([token, name, &handled]() {
+          handled.push_back(name + " done");
+          token.reply(200, name);
+        });
+      },
+      "GET", {}, "deferring test servlet", processor.servlets);
+
+  http::servlet timeout(
+      "/timeout",
+      [&late](http::sessionData &session, std::smatch &) {
+        http::deferredReply token(session, std::chrono::milliseconds(20));
+        late.expires_from_now(std::chrono::milliseconds(100));
+        late.async_wait([token](const asio::error_code &) {
+          token.reply(200, "too late");
+        });
+      },
+      "GET", {}, "timeout test servlet", processor.servlets);
+
+  const std::string reply = roundTrip(
+      service, processor,
+      "GET /defer/a HTTP/1.1\r\n\r\nGET /defer/b HTTP/1.1\r\n\r\n");
+  const std::vector<std::string> order{"a", "a done", "b", "b done"};
+
+  if (handled != order) {
+    log << "deferred requests were not handled one after the other\n";
+    return false;
+  }
+
+  const auto a = reply.find("\r\n\r\na");
+  const auto b = reply.find("\r\n\r\nb");
+  if (a == std::string::npos || b == std::string::npos || a > b) {
+    log << "unexpected replies to deferred requests: '" << reply << "'\n";
+    return false;
+  }
+
+  const std::string expired =
+      roundTrip(expiring, processor, "GET /timeout HTTP/1.1\r\n\r\n");
+
+  if (expired.compare(0, 28, "HTTP/1.1 504 Gateway Timeout") != 0 ||
+      expired.find("too late") != std::string::npos) {
+    log << "unexpected reply to expired request: '" << expired << "'\n";
+    return false;
+  }
+
+  std::size_t posted = 0;
+  auto gone = new http::sessionData();
+  gone->post = [&posted](std::function<void(void)> fn) {
+    posted++;
+    fn();
+  };
+  http::deferredReply orphan(*gone);
+  delete gone;
+
+  if (!orphan.reply(200, "gone") || orphan.current() || posted != 0) {
+    log << "reply to a session that's gone wasn't dropped\n";
+    return false;
+  }
+
+  return true;
+}
+
+namespace test {
+using efgy::test::function;
+
+static function streamingContent(testStreamingContent);
+static function pauseContent(testPauseContent);
+static function readContent(testReadContent);
+static function spillContent(testSpillContent);
+static function deferredReply(testDeferredReply);
+}
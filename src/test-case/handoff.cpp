@@ -0,0 +1,143 @@
+/* Listening socket handoff tests.
+ *
+ * Sends file descriptors over a socket pair, and makes sure adopted listening
+ * sockets are only given to servers for the endpoint they're bound to. Handing
+ * sockets from one process to another is tested with the sample server, in
+ * handoff.sh.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+
+#include <ef.gy/test-case.h>
+
+#define ASIO_DISABLE_THREADS
+#define NO_DEFAULT_OPTIONS
+#include <cxxhttp/handoff.h>
+
+using namespace cxxhttp;
+
+/* Test sending file descriptors.
+ * @log Test output stream.
+ *
+ * Sends more descriptors than fit in a single batch, each a copy of a pipe's
+ * write end, and writes through the ones that came out the other side. A list
+ * that's cut short must not be accepted.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testDescriptors(std::ostream &log) {
+  int pair[2], pipe[2];
+  std::vector<int> fds, received;
+  bool result = true;
+
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0 || ::pipe(pipe) != 0) {
+    log << "could not set up sockets\n";
+    return false;
+  }
+
+  for (std::size_t i = 0; i < net::handoff::batch + 8; i++) {
+    fds.push_back(::dup(pipe[1]));
+  }
+
+  if (!net::handoff::send(pair[0], fds)) {
+    log << "could not send descriptors\n";
+    result = false;
+  } else if (!net::handoff::receive(pair[1], received)) {
+    log << "could not receive descriptors\n";
+    result = false;
+  } else if (received.size() != fds.size()) {
+    log << "sent " << fds.size() << " descriptors, but received "
+        << received.size() << "\n";
+    result = false;
+  }
+
+  for (const int fd : received) {
+    char c = 'x';
+    if (::write(fd, &c, 1) != 1 || ::read(pipe[0], &c, 1) != 1 || c != 'x') {
+      log << "received descriptor " << fd << " isn't the pipe\n";
+      result = false;
+    }
+    ::close(fd);
+  }
+
+  // a batch, but without the empty one that ends the list.
+  const unsigned char count = 1;
+  received.clear();
+  if (::write(pair[0], &count, 1) != 1) {
+    log << "could not cut the list short\n";
+    result = false;
+  }
+  ::close(pair[0]);
+  if (net::handoff::receive(pair[1], received) || !received.empty()) {
+    log << "received a list that was cut short\n";
+    result = false;
+  }
+
+  for (const int fd : fds) {
+    ::close(fd);
+  }
+  ::close(pair[1]);
+  ::close(pipe[0]);
+  ::close(pipe[1]);
+
+  return result;
+}
+
+/* Test adopting listening sockets.
+ * @log Test output stream.
+ *
+ * Adopts a copy of a listening TCP socket, which only a server for the same
+ * address and port gets to take, and only once.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testListeners(std::ostream &log) {
+  service io;
+  net::listeners l;
+  transport::tcp::acceptor acceptor(
+      io, transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  const auto endpoint = acceptor.local_endpoint();
+  const auto other = transport::tcp::endpoint(
+      asio::ip::address_v4::loopback(), endpoint.port() + 1);
+  const auto local = transport::unix::endpoint("/tmp/cxxhttp-handoff-test");
+  const int fd = ::dup(acceptor.native_handle());
+
+  l.adopt(fd);
+
+  if (!l.has(endpoint) || l.has(other) || l.has(local)) {
+    log << "adopted socket matches the wrong endpoints\n";
+    return false;
+  }
+
+  if (l.take(other) != -1 || l.take(local) != -1) {
+    log << "took a socket for the wrong endpoint\n";
+    return false;
+  }
+
+  if (l.take(endpoint) != fd) {
+    log << "could not take the adopted socket\n";
+    return false;
+  }
+
+  if (l.take(endpoint) != -1 || l.has(endpoint)) {
+    log << "took the same socket twice\n";
+    return false;
+  }
+
+  ::close(fd);
+  return true;
+}
+
+namespace test {
+using efgy::test::function;
+
+static function descriptors(testDescriptors);
+static function listeners(testListeners);
+}
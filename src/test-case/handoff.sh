@@ -0,0 +1,79 @@
+#!/bin/sh
+# Test handing a listening socket from one `server` process to another
+
+port="8082"
+control="/tmp/cxxhttp-handoff-test-control"
+uri="http://localhost:${port}/"
+out="data/test/fetch/hello"
+tmp="/tmp/cxxhttp-handoff-test-hello"
+
+rm -f "${control}"
+./server "http:localhost:${port}" "handoff:${control}" &
+old=$!
+rv="true"
+
+# sleep for a while to make sure the server is initialised.
+sleep 1
+
+printf "running test case 1: "
+
+if ./fetch "${uri}" > "${tmp}" && diff --ignore-all-space -u "${out}" "${tmp}"
+then
+  echo "OK"
+else
+  echo "FAIL"
+  rv="false"
+fi
+
+printf "running test case 2: "
+
+# keep fetching while the new process takes over; none of these may fail.
+(
+  for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+    ./fetch "${uri}" > /dev/null 2>&1 || echo "failed"
+  done
+) > "${tmp}-load" &
+load=$!
+
+./server "handoff:${control}" "http:localhost:${port}" &
+new=$!
+
+sleep 1
+wait ${load}
+
+if kill -0 ${old} 2>/dev/null; then
+  echo "FAIL: old process is still running"
+  kill -KILL ${old}
+  rv="false"
+elif ! wait ${old}; then
+  echo "FAIL: old process didn't exit cleanly"
+  rv="false"
+elif [ -s "${tmp}-load" ]; then
+  echo "FAIL: connections failed during the handoff"
+  rv="false"
+else
+  echo "OK"
+fi
+
+printf "running test case 3: "
+
+if ./fetch "${uri}" > "${tmp}" && diff --ignore-all-space -u "${out}" "${tmp}"
+then
+  echo "OK"
+else
+  echo "FAIL"
+  rv="false"
+fi
+
+printf "running test case 4: "
+
+kill -TERM ${new}
+
+if wait ${new}; then
+  echo "OK"
+else
+  echo "FAIL"
+  rv="false"
+fi
+
+exec ${rv}
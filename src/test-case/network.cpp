@@ -13,7 +13,9 @@
  * under the terms of an MIT/X11-style licence, described in the COPYING file.
  */
 
+#include <fstream>
 #include <sstream>
+#include <thread>
 
 #include <ef.gy/test-case.h>
 
@@ -163,6 +165,149 @@ bool testLookup(std::ostream &log) {
   return true;
 }
 
+/* Test the host name cache.
+ * @log Test output stream.
+ *
+ * Uses a hosts file in place of the DNS, and remembers and settles lookups
+ * directly, so this doesn't need a network to work.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testResolverCache(std::ostream &log) {
+  const char *file = "/tmp/cxxhttp-test.hosts";
+  std::ofstream(file) << "# test hosts\n"
+                         "127.0.0.1 pool.test alias.test # comment\n"
+                         "::1 six.test\n"
+                         "not-an-address broken.test\n";
+
+  service io;
+  net::resolverCache cache;
+  net::resolverCache::endpoints results;
+  asio::error_code error;
+
+  if (cache.load("/tmp/cxxhttp-test.missing") || !cache.load(file)) {
+    log << "loading the hosts file did not work as expected\n";
+    return false;
+  }
+
+  struct sampleData {
+    std::string host, port, expected;
+  };
+
+  std::vector<sampleData> tests{
+      {"pool.test", "8080", "127.0.0.1:8080"},
+      {"alias.test", "http", "127.0.0.1:80"},
+      {"six.test", "21", "::1:21"},
+      {"127.0.0.2", "80", "127.0.0.2:80"},
+  };
+
+  for (const auto &tt : tests) {
+    const net::endpoint<transport::tcp> e(tt.host, tt.port, io, cache);
+    int c = 0;
+    for (net::endpointType<transport::tcp> a : e) {
+      if (address(a) != tt.expected) {
+        log << "unexpected lookup result: " << address(a) << " for host '"
+            << tt.host << "', expected " << tt.expected << "\n";
+        return false;
+      }
+      c++;
+    }
+    if (c != 1) {
+      log << "expected one result for host '" << tt.host << "', got " << c
+          << "\n";
+      return false;
+    }
+  }
+
+  if (cache.find("broken.test", "80", results, error) ||
+      !cache.find("pool.test", "no-such-service", results, error) || !error) {
+    log << "hosts file should have no entry for broken.test, and pool.test "
+           "should not resolve with an unknown service\n";
+    return false;
+  }
+
+  cache.ttl = std::chrono::milliseconds(50);
+  cache.negativeTtl = std::chrono::milliseconds(10);
+  cache.store("cached.test", "80",
+              {transport::tcp::endpoint(asio::ip::address_v4::loopback(), 80)},
+              asio::error_code());
+  cache.store("missing.test", "80", {}, asio::error::host_not_found);
+
+  if (!cache.find("cached.test", "80", results, error) || error ||
+      results.size() != 1 || address(results[0]) != "127.0.0.1:80") {
+    log << "remembered lookup not found\n";
+    return false;
+  }
+
+  if (!cache.find("missing.test", "80", results, error) ||
+      error != asio::error::host_not_found || !results.empty()) {
+    log << "failed lookup should have been remembered\n";
+    return false;
+  }
+
+  if (cache.find("cached.test", "81", results, error)) {
+    log << "lookup for a different port should not be known\n";
+    return false;
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+  if (cache.find("missing.test", "80", results, error) ||
+      !cache.find("cached.test", "80", results, error)) {
+    log << "failed lookup should expire before successful ones\n";
+    return false;
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(40));
+
+  if (cache.find("cached.test", "80", results, error)) {
+    log << "remembered lookup should have expired\n";
+    return false;
+  }
+
+  cache.limit = 2;
+  cache.ttl = std::chrono::seconds(60);
+  for (const std::string host : {"a.test", "b.test", "c.test"}) {
+    cache.store(host, "80", {}, asio::error::host_not_found);
+  }
+  if (!cache.find("c.test", "80", results, error) ||
+      !cache.find("pool.test", "80", results, error)) {
+    log << "cache limit should not drop the newest entry or the hosts file\n";
+    return false;
+  }
+
+  std::size_t answers = 0;
+  auto waiter = [&answers](const asio::error_code &error,
+                           const net::resolverCache::endpoints &results) {
+    if (!error && results.size() == 1) {
+      answers++;
+    }
+  };
+
+  const bool first = cache.join("joined.test", "80", waiter);
+  const bool second = cache.join("joined.test", "80", waiter);
+  const bool other = cache.join("joined.test", "81", waiter);
+  cache.settle(
+      "joined.test", "80",
+      {transport::tcp::endpoint(asio::ip::address_v4::loopback(), 80)},
+      asio::error_code());
+
+  if (!first || second || !other || answers != 2 ||
+      !cache.find("joined.test", "80", results, error)) {
+    log << "lookups for the same name should be joined and settled together, "
+           "got "
+        << answers << " answers\n";
+    return false;
+  }
+
+  if (!cache.join("joined.test", "80", waiter)) {
+    log << "settled lookup should not be waited for anymore\n";
+    return false;
+  }
+
+  return true;
+}
+
 /* Test session and connection recycling invariants.
  * @log Test output stream.
  *
@@ -178,6 +323,7 @@ bool testRecycling(std::ostream &log) {
   struct tr {
     using endpoint = int;
     using acceptor = acc;
+    using socket = acc;
   };
   struct proc {};
   struct sess;
@@ -229,7 +375,12 @@ bool testRecycling(std::ostream &log) {
     }
 
     c.pending = true;
-    s->free = true;
+    c.release(s);
+
+    if (!s->free) {
+      log << "session should be free after releasing it.\n";
+      return false;
+    }
 
     if (c.idle()) {
       log << "connection should not be idle after setting the pending flag.\n";
@@ -242,6 +393,16 @@ bool testRecycling(std::ostream &log) {
       log << "connection should idle again after setting pending to false.\n";
       return false;
     }
+
+    if (c.getSession() != s || s->free) {
+      log << "expected to get the released session back.\n";
+      return false;
+    }
+
+    if (c.idle() || c.getSession() == s || c.sessions.size() != 2) {
+      log << "expected a new session while the first one is in use.\n";
+      return false;
+    }
   }
 
   if (!conns.empty()) {
@@ -256,5 +417,6 @@ namespace test {
 using efgy::test::function;
 
 static function lookup(testLookup);
+static function resolverCache(testResolverCache);
 static function recycling(testRecycling);
 }
@@ -0,0 +1,93 @@
+/* Server flow test fixture.
+ *
+ * Runs a server flow over one end of a socket pair, and plays the client on the
+ * other end. Shared by the test cases that need to send raw requests through a
+ * flow and look at what comes back.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+#if !defined(CXXHTTP_TEST_CASE_ROUND_TRIP_H)
+#define CXXHTTP_TEST_CASE_ROUND_TRIP_H
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cxxhttp/http-flow.h>
+#include <cxxhttp/http-processor.h>
+
+namespace test {
+/* Flow type for the tests.
+ *
+ * Same as what the STDIO server uses, but with a socket pair instead of the
+ * actual STDIO descriptors.
+ */
+using testFlow = cxxhttp::http::flow<cxxhttp::http::processor::server,
+                                     asio::posix::stream_descriptor,
+                                     asio::posix::stream_descriptor>;
+
+/* Send a request through a server flow.
+ * @service The I/O service to run on.
+ * @processor The server processor, with all the servlets to use.
+ * @request The raw request to send.
+ * @session The session for the flow to use.
+ *
+ * Writes the request and then closes the client's side for writing, so the
+ * flow shuts down once it's done with the request. Stops the I/O service once
+ * the reply is in, as there may be servers running on it as well.
+ *
+ * @return Everything the server sent back.
+ */
+static inline std::string roundTrip(asio::io_service &service,
+                                    cxxhttp::http::processor::server &processor,
+                                    const std::string &request,
+                                    cxxhttp::http::sessionData &session) {
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    return "";
+  }
+
+  testFlow flow(processor, service, session, fds[0], dup(fds[0]));
+  asio::posix::stream_descriptor client(service, fds[1]);
+  asio::streambuf reply;
+
+  flow.start();
+
+  asio::async_write(client, asio::buffer(request),
+                    [&client](const asio::error_code &, std::size_t) {
+                      shutdown(client.native_handle(), SHUT_WR);
+                    });
+  asio::async_read(client, reply, asio::transfer_all(),
+                   [&service](const asio::error_code &, std::size_t) {
+                     service.stop();
+                   });
+
+  service.run();
+
+  return std::string(asio::buffer_cast<const char *>(reply.data()),
+                     reply.size());
+}
+
+/* Send a request through a server flow, with a new session.
+ * @service The I/O service to run on.
+ * @processor The server processor, with all the servlets to use.
+ * @request The raw request to send.
+ *
+ * @return Everything the server sent back.
+ */
+static inline std::string roundTrip(asio::io_service &service,
+                                    cxxhttp::http::processor::server &processor,
+                                    const std::string &request) {
+  cxxhttp::http::sessionData session;
+  return roundTrip(service, processor, request, session);
+}
+}
+
+#endif
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Load the sample server with more and more I/O threads, and report how many
+# requests per second it answers with each; set THREADS, CONNECTIONS or
+# DURATION to change how it's loaded.
+
+port="8083"
+uri="http://localhost:${port}/"
+rv="true"
+
+for threads in ${THREADS:-1 2 4}; do
+  ./server "http:localhost:${port}" "threads:${threads}" &
+  server=$!
+
+  # sleep for a while to make sure the server is initialised.
+  sleep 1
+
+  printf "running with threads:%s: " "${threads}"
+
+  if ! ./load "${uri}" "connections:${CONNECTIONS:-64}" \
+      "duration:${DURATION:-2}"; then
+    echo "FAIL"
+    rv="false"
+  fi
+
+  kill -TERM ${server}
+
+  if ! wait ${server}; then
+    echo "FAIL: server didn't exit cleanly"
+    rv="false"
+  fi
+done
+
+exec ${rv}
@@ -205,6 +205,136 @@ bool testTrigger405(std::ostream &log) {
   return true;
 }
 
+/* Test streamed replies.
+ * @log Test output stream.
+ *
+ * Streams a few replies and makes sure the right messages are queued up, with
+ * the chunked coding where it's supported and without it where it isn't, and
+ * with only the headers for replies that can't have a body.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testStreamingReply(std::ostream &log) {
+  struct sampleData {
+    std::string request;
+    int status;
+    std::vector<std::string> chunks;
+    http::headers trailers;
+    std::vector<std::string> messages;
+    bool close;
+  };
+
+  std::vector<sampleData> tests{
+      {"GET / HTTP/1.1",
+       200,
+       {"foo", "", "bar"},
+       {},
+       {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n",
+        "3\r\nfoo\r\n", "3\r\nbar\r\n", "0\r\n\r\n"},
+       false},
+      {"GET / HTTP/1.1",
+       200,
+       {"foo"},
+       {{"Foo", "bar"}},
+       {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n",
+        "3\r\nfoo\r\n", "0\r\nFoo: bar\r\n\r\n"},
+       false},
+      {"GET / HTTP/1.0",
+       200,
+       {"foo"},
+       {{"Foo", "bar"}},
+       {"HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n", "foo"},
+       true},
+      {"HEAD / HTTP/1.1",
+       200,
+       {"foo"},
+       {{"Foo", "bar"}},
+       {"HTTP/1.1 200 OK\r\n\r\n"},
+       false},
+      {"GET / HTTP/1.1", 204, {"foo"}, {}, {"HTTP/1.1 204 No Content\r\n\r\n"},
+       false},
+      {"GET / HTTP/1.0",
+       304,
+       {"foo"},
+       {},
+       {"HTTP/1.1 304 Not Modified\r\n\r\n"},
+       false},
+  };
+
+  for (const auto &tt : tests) {
+    http::sessionData s;
+    int notified = 0;
+
+    s.inboundRequest = tt.request;
+    s.isHEAD = s.inboundRequest.method == "HEAD";
+    s.notify = [&notified]() { notified++; };
+
+    s.beginReply(tt.status);
+    if (!s.streaming || s.replies != 1) {
+      log << "beginReply() did not start a streamed reply\n";
+      return false;
+    }
+
+    for (const auto &c : tt.chunks) {
+      if (!s.replyChunk(c)) {
+        log << "replyChunk() signalled backpressure unexpectedly\n";
+        return false;
+      }
+    }
+
+    s.endReply(tt.trailers);
+    if (s.streaming) {
+      log << "endReply() did not finish the streamed reply\n";
+      return false;
+    }
+
+    if (s.replyChunk("foo")) {
+      log << "replyChunk() accepted data after endReply()\n";
+      return false;
+    }
+
+    const std::vector<std::string> v(s.outboundQueue.begin(),
+                                     s.outboundQueue.end());
+    if (v != tt.messages) {
+      log << "streamed reply did not queue up the expected messages\n";
+      return false;
+    }
+
+    std::size_t bytes = 0;
+    for (const auto &m : v) {
+      bytes += m.size();
+    }
+    if (s.outboundBytes != bytes) {
+      log << "outboundBytes=" << s.outboundBytes << ", but expected " << bytes
+          << "\n";
+      return false;
+    }
+
+    if (s.closeAfterSend != tt.close) {
+      log << "closeAfterSend=" << s.closeAfterSend << ", but expected "
+          << tt.close << "\n";
+      return false;
+    }
+
+    if (notified == 0) {
+      log << "streamed reply did not notify the flow\n";
+      return false;
+    }
+  }
+
+  http::sessionData s;
+  s.inboundRequest = std::string("GET / HTTP/1.1");
+  s.highWatermark = 10;
+
+  s.beginReply(200);
+  if (s.replyChunk("foo")) {
+    log << "replyChunk() should have signalled backpressure\n";
+    return false;
+  }
+
+  return true;
+}
+
 namespace test {
 using efgy::test::function;
 
@@ -212,4 +342,5 @@ static function basicSession(testBasicSession);
 static function reply(testReply);
 static function negotiate(testNegotiate);
 static function trigger405(testTrigger405);
+static function streamingReply(testStreamingReply);
 }
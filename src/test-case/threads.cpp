@@ -0,0 +1,588 @@
+/* Test cases for running servers on several threads.
+ *
+ * Runs TCP servers on a pool of I/O threads, or sharded across several I/O
+ * services, and talks to them from several client threads at once, to make
+ * sure nothing gets mixed up. Also covers offloading handlers to worker
+ * threads.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+
+#include <ef.gy/test-case.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include <cxxhttp/http-client.h>
+
+using namespace cxxhttp;
+
+/* Query a server a few times.
+ * @port The port the server is listening on, on localhost.
+ * @id A client ID to send along and expect back.
+ * @n How many requests to send on the connection.
+ *
+ * Uses plain, blocking ASIO sockets, so that this can run on its own thread.
+ *
+ * @return The number of correct replies.
+ */
+static std::size_t query(unsigned short port, std::size_t id, std::size_t n) {
+  asio::io_service io;
+  transport::tcp::socket socket(io);
+  std::size_t good = 0;
+
+  try {
+    socket.connect(transport::tcp::endpoint(asio::ip::address_v4::loopback(),
+                                            port));
+
+    asio::streambuf input;
+    for (std::size_t i = 0; i < n; i++) {
+      const std::string tag = std::to_string(id) + "/" + std::to_string(i);
+      const std::string request = "GET /echo/" + tag +
+                                  " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+      asio::write(socket, asio::buffer(request));
+
+      const std::size_t h = asio::read_until(socket, input, "\r\n\r\n");
+      std::string header(asio::buffer_cast<const char *>(input.data()), h);
+      input.consume(h);
+
+      const auto p = header.find("Content-Length: ");
+      if (p == std::string::npos) {
+        break;
+      }
+      const std::size_t length = std::stoul(header.substr(p + 16));
+
+      if (input.size() < length) {
+        asio::read(socket, input,
+                   asio::transfer_exactly(length - input.size()));
+      }
+      std::string body(asio::buffer_cast<const char *>(input.data()), length);
+      input.consume(length);
+
+      if (body == tag) {
+        good++;
+      }
+    }
+  } catch (...) {
+  }
+
+  return good;
+}
+
+/* Fetch a resource.
+ * @port The port the server is listening on, on localhost.
+ * @resource The resource to request.
+ *
+ * Sends a single GET request on a new connection, with a blocking socket.
+ *
+ * @return The status code and the reply body, separated by a space.
+ */
+static std::string fetch(unsigned short port, const std::string &resource) {
+  asio::io_service io;
+  transport::tcp::socket socket(io);
+
+  try {
+    socket.connect(transport::tcp::endpoint(asio::ip::address_v4::loopback(),
+                                            port));
+
+    const std::string request =
+        "GET " + resource + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    asio::write(socket, asio::buffer(request));
+
+    asio::streambuf input;
+    const std::size_t h = asio::read_until(socket, input, "\r\n\r\n");
+    std::string header(asio::buffer_cast<const char *>(input.data()), h);
+    input.consume(h);
+
+    const auto p = header.find("Content-Length: ");
+    const std::size_t length =
+        p == std::string::npos ? 0 : std::stoul(header.substr(p + 16));
+    if (input.size() < length) {
+      asio::read(socket, input, asio::transfer_exactly(length - input.size()));
+    }
+
+    return header.substr(9, 3) + " " +
+           std::string(asio::buffer_cast<const char *>(input.data()), length);
+  } catch (...) {
+  }
+
+  return "";
+}
+
+/* Wait for something to happen.
+ * @condition Returns `true` once it's happened.
+ *
+ * Gives up after a few seconds, so a broken test doesn't hang forever.
+ *
+ * @return Whether the condition became true.
+ */
+static bool await(std::function<bool(void)> condition) {
+  for (std::size_t i = 0; i < 500; i++) {
+    if (condition()) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return condition();
+}
+
+/* Test a server running on several threads.
+ * @log Test output stream.
+ *
+ * Several clients query the server at the same time, each on their own
+ * connection. All of them need to get the right replies.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testThreadedServer(std::ostream &log) {
+  const std::size_t clients = 8;
+  const std::size_t requests = 50;
+
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  efgy::beacons<http::servlet> servlets;
+
+  http::servlet echo("/echo/(.*)",
+                     [](http::sessionData &session, std::smatch &match) {
+                       session.reply(200, match[1]);
+                     },
+                     "GET", {}, "echo test servlet", servlets);
+
+  auto &server = http::server<transport::tcp>::get(
+      transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0), servers,
+      io);
+  server.processor.servlets = servlets;
+  const unsigned short port = server.endpoint().port();
+
+  std::thread runner([&io]() { run(io, 4); });
+
+  std::vector<std::thread> pool;
+  std::vector<std::size_t> good(clients, 0);
+  for (std::size_t i = 0; i < clients; i++) {
+    pool.emplace_back(
+        [&good, port, i, requests]() { good[i] = query(port, i, requests); });
+  }
+  for (auto &t : pool) {
+    t.join();
+  }
+
+  io.stop();
+  runner.join();
+
+  for (std::size_t i = 0; i < clients; i++) {
+    if (good[i] != requests) {
+      log << "client " << i << " only got " << good[i] << " of " << requests
+          << " correct replies\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Test sharded servers.
+ * @log Test output stream.
+ *
+ * Sets up two servers on the same port, each with its own I/O service, and
+ * makes sure that works and that clients get the right replies from either.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testShardedServer(std::ostream &log) {
+  const std::size_t clients = 16;
+  const std::size_t requests = 20;
+
+  efgy::beacons<http::server<transport::tcp>> servers;
+  efgy::beacons<http::servlet> servlets;
+  std::vector<http::server<transport::tcp> *> shardServers;
+
+  http::servlet echo("/echo/(.*)",
+                     [](http::sessionData &session, std::smatch &match) {
+                       session.reply(200, match[1]);
+                     },
+                     "GET", {}, "echo test servlet", servlets);
+
+  unsigned short port = 0;
+  shards = 2;
+
+  try {
+    for (std::size_t i = 1; i <= 2; i++) {
+      auto &server = http::server<transport::tcp>::get(
+          transport::tcp::endpoint(asio::ip::address_v4::loopback(), port),
+          servers, shard(i));
+      server.processor.servlets = servlets;
+      port = server.endpoint().port();
+      shardServers.push_back(&server);
+    }
+  } catch (std::exception &e) {
+    log << "could not set up sharded servers: " << e.what() << "\n";
+    shards = 1;
+    return false;
+  }
+
+  shards = 1;
+
+  if (shardServers[0]->endpoint() != shardServers[1]->endpoint()) {
+    log << "sharded servers are not on the same endpoint\n";
+    return false;
+  }
+
+  std::vector<std::thread> runners;
+  for (std::size_t i = 1; i <= 2; i++) {
+    runners.emplace_back([i]() { run(shard(i)); });
+  }
+
+  std::vector<std::thread> pool;
+  std::vector<std::size_t> good(clients, 0);
+  for (std::size_t i = 0; i < clients; i++) {
+    pool.emplace_back(
+        [&good, port, i, requests]() { good[i] = query(port, i, requests); });
+  }
+  for (auto &t : pool) {
+    t.join();
+  }
+
+  for (std::size_t i = 1; i <= 2; i++) {
+    shard(i).stop();
+  }
+  for (auto &t : runners) {
+    t.join();
+  }
+
+  for (std::size_t i = 0; i < clients; i++) {
+    if (good[i] != requests) {
+      log << "client " << i << " only got " << good[i] << " of " << requests
+          << " correct replies\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Test offloading handlers to a worker pool.
+ * @log Test output stream.
+ *
+ * Runs a server on a single I/O thread, with a slow servlet that is offloaded
+ * to a pool with one thread and room for one more request in the queue. While
+ * the slow handler is blocked, other requests need to be answered right away,
+ * and requests past the queue limit need to be turned away with a 503.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testOffload(std::ostream &log) {
+  workers pool(1, 1);
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  efgy::beacons<http::servlet> servlets;
+  std::atomic<std::size_t> started(0);
+  std::promise<void> release;
+  std::shared_future<void> released(release.get_future());
+
+  http::servlet slow("/slow",
+                     [&started, released](http::sessionData &session,
+                                          std::smatch &) {
+                       started++;
+                       released.wait();
+                       session.reply(200, "slow");
+                     },
+                     "GET", {}, "slow test servlet", servlets);
+  slow.offload = true;
+
+  http::servlet fast("/fast",
+                     [](http::sessionData &session, std::smatch &) {
+                       session.reply(200, "fast");
+                     },
+                     "GET", {}, "fast test servlet", servlets);
+
+  auto &server = http::server<transport::tcp>::get(
+      transport::tcp::endpoint(asio::ip::address_v4::loopback(), 0), servers,
+      io);
+  server.processor.servlets = servlets;
+  server.processor.pool = &pool;
+  const unsigned short port = server.endpoint().port();
+
+  std::thread runner([&io]() { run(io, 1); });
+
+  std::string first, second, fastReply, rejected;
+  std::thread firstClient([&first, port]() { first = fetch(port, "/slow"); });
+  const bool running = await([&started]() { return started == 1; });
+
+  if (running) {
+    fastReply = fetch(port, "/fast");
+  }
+
+  std::thread secondClient(
+      [&second, port]() { second = fetch(port, "/slow"); });
+  const bool queued = await([&pool]() { return pool.queued() == 1; });
+
+  if (queued) {
+    rejected = fetch(port, "/slow");
+  }
+
+  release.set_value();
+  firstClient.join();
+  secondClient.join();
+
+  io.stop();
+  runner.join();
+
+  if (!running || !queued) {
+    log << "offloaded handler did not get to run or queue up\n";
+    return false;
+  }
+
+  if (fastReply != "200 fast") {
+    log << "unexpected reply while a handler was blocked: '" << fastReply
+        << "'\n";
+    return false;
+  }
+
+  if (rejected.compare(0, 3, "503") != 0) {
+    log << "request past the queue limit got '" << rejected
+        << "', expected a 503\n";
+    return false;
+  }
+
+  if (first != "200 slow" || second != "200 slow") {
+    log << "unexpected replies from the offloaded handler: '" << first
+        << "', '" << second << "'\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test a worker pool without a queue.
+ * @log Test output stream.
+ *
+ * With a queue depth limit of 0, jobs should still be accepted while there's
+ * a thread free to run them, and only be turned away once there isn't.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testWorkerQueue(std::ostream &log) {
+  workers pool(1, 0);
+  std::promise<void> release;
+  std::shared_future<void> released(release.get_future());
+  std::atomic<std::size_t> ran(0);
+
+  const bool first = pool.submit([released, &ran]() {
+    released.wait();
+    ran++;
+  });
+  const bool running = await([&pool]() { return pool.active() == 1; });
+  const bool second = pool.submit([&ran]() { ran++; });
+
+  release.set_value();
+  const bool done = await([&ran]() { return ran == 1; });
+  const bool idle = await([&pool]() { return pool.active() == 0; });
+  const bool third = idle && pool.submit([&ran]() { ran++; });
+
+  if (!first || !running || !done || !idle) {
+    log << "job was not accepted by an idle pool without a queue\n";
+    return false;
+  }
+
+  if (second) {
+    log << "job was accepted by a busy pool without a queue\n";
+    return false;
+  }
+
+  if (!third || !await([&ran]() { return ran == 2; })) {
+    log << "job was not accepted once the pool was idle again\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test calls that need to resolve a host name.
+ * @log Test output stream.
+ *
+ * The first call to `localhost` has to ask the resolver, which happens in the
+ * background while the I/O thread carries on; the second one should find the
+ * name in the cache. Both need to get to the server, which listens on the
+ * first address that `localhost` resolves to.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testResolveInBackground(std::ostream &log) {
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  efgy::beacons<http::client<transport::tcp>> clients;
+  efgy::beacons<http::servlet> servlets;
+  net::resolverCache probe;
+  net::resolverCache &cache = efgy::global<net::resolverCache>();
+  net::resolverCache::endpoints results;
+  asio::error_code error;
+  std::atomic<std::size_t> good(0), bad(0);
+
+  http::servlet echo("/echo/(.*)",
+                     [](http::sessionData &session, std::smatch &match) {
+                       session.reply(200, match[1]);
+                     },
+                     "GET", {}, "echo test servlet", servlets);
+
+  const net::endpoint<transport::tcp> local("localhost", "0", io, probe);
+  auto &server = http::server<transport::tcp>::get(*local.begin(), servers, io);
+  server.processor.servlets = servlets;
+  const std::string port = std::to_string(server.endpoint().port());
+
+  if (cache.find("localhost", port, results, error)) {
+    log << "localhost should not be known to the cache yet\n";
+    return false;
+  }
+
+  auto fetch = [&](const std::string &tag) {
+    http::call<transport::tcp>("http://localhost:" + port + "/echo/" + tag, {},
+                               "", "GET", clients, io)
+        .success([&good, &bad, tag](http::sessionData &session) {
+          (session.content == tag ? good : bad)++;
+        })
+        .failure([&bad](http::sessionData &) { bad++; });
+  };
+
+  // one I/O thread, so replies can't be handled before the callbacks are set;
+  // the resolver still runs on a thread of its own.
+  asio::io_service::work work(io);
+  std::thread runner([&io]() { run(io, 1); });
+
+  io.post([&fetch]() { fetch("first"); });
+  const bool first = await([&good, &bad]() { return good + bad == 1; });
+  const bool cached = cache.find("localhost", port, results, error);
+
+  io.post([&fetch]() { fetch("second"); });
+  const bool second = await([&good, &bad]() { return good + bad == 2; });
+
+  io.stop();
+  runner.join();
+
+  for (auto c = clients.begin(); c != clients.end(); c = clients.begin()) {
+    delete *c;
+  }
+
+  if (!first || !second || good != 2) {
+    log << "expected two good replies, got " << good << " good and " << bad
+        << " bad ones\n";
+    return false;
+  }
+
+  if (!cached || error || results.empty() ||
+      results.front() != server.endpoint()) {
+    log << "localhost should have been remembered by the cache\n";
+    return false;
+  }
+
+  return true;
+}
+
+/* Test several calls waiting for the same host name.
+ * @log Test output stream.
+ *
+ * A few calls to `localhost` are made at once, before the name is known, so
+ * they all have to wait for it to be resolved. They should wait for the same
+ * lookup, and then share the pool's connections to the host, rather than each
+ * opening a connection of their own.
+ *
+ * @return 'true' on success, 'false' otherwise.
+ */
+bool testResolveTogether(std::ostream &log) {
+  const std::size_t calls = 6;
+
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  efgy::beacons<http::client<transport::tcp>> clients;
+  efgy::beacons<http::servlet> servlets;
+  net::resolverCache probe;
+  net::resolverCache &cache = efgy::global<net::resolverCache>();
+  net::resolverCache::endpoints results;
+  asio::error_code error;
+  http::pool &pool = efgy::global<http::pool>();
+  std::atomic<std::size_t> good(0), bad(0);
+
+  http::servlet echo("/echo/(.*)",
+                     [](http::sessionData &session, std::smatch &match) {
+                       session.reply(200, match[1]);
+                     },
+                     "GET", {}, "echo test servlet", servlets);
+
+  const net::endpoint<transport::tcp> local("localhost", "0", io, probe);
+  auto &server = http::server<transport::tcp>::get(*local.begin(), servers, io);
+  server.processor.servlets = servlets;
+  const std::string port = std::to_string(server.endpoint().port());
+
+  if (cache.find("localhost", port, results, error)) {
+    log << "localhost should not be known to the cache yet\n";
+    return false;
+  }
+
+  const std::size_t maxConnections = pool.maxConnections;
+  pool.maxConnections = 2;
+  const std::size_t opened = pool.opened;
+
+  auto fetch = [&](const std::string &tag) {
+    http::call<transport::tcp>("http://localhost:" + port + "/echo/" + tag, {},
+                               "", "GET", clients, io)
+        .success([&good, &bad, tag](http::sessionData &session) {
+          (session.content == tag ? good : bad)++;
+        })
+        .failure([&bad](http::sessionData &) { bad++; });
+  };
+
+  asio::io_service::work work(io);
+  std::thread runner([&io]() { run(io, 1); });
+
+  io.post([&fetch, calls]() {
+    for (std::size_t i = 0; i < calls; i++) {
+      fetch(std::to_string(i));
+    }
+  });
+  const bool done = await([&good, &bad, calls]() {
+    return good + bad == calls;
+  });
+
+  io.stop();
+  runner.join();
+
+  for (auto c = clients.begin(); c != clients.end(); c = clients.begin()) {
+    delete *c;
+  }
+
+  const std::size_t connections = pool.opened - opened;
+  pool.maxConnections = maxConnections;
+
+  if (!done || good != calls) {
+    log << "expected " << calls << " good replies, got " << good
+        << " good and " << bad << " bad ones\n";
+    return false;
+  }
+
+  if (connections > 2) {
+    log << "calls waiting for the same name opened " << connections
+        << " connections, but the pool only allows for 2\n";
+    return false;
+  }
+
+  return true;
+}
+
+namespace test {
+using efgy::test::function;
+
+static function threadedServer(testThreadedServer);
+static function shardedServer(testShardedServer);
+static function offload(testOffload);
+static function workerQueue(testWorkerQueue);
+static function resolveInBackground(testResolveInBackground);
+static function resolveTogether(testResolveTogether);
+}
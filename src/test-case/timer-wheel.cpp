@@ -0,0 +1,136 @@
+/* Timer wheel tests.
+ *
+ * Runs the wheel on a clock that goes a lot faster than real time, so that
+ * timeouts on all of its wheels come round without the test taking hours.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+
+#include <list>
+
+#include <ef.gy/test-case.h>
+
+#define ASIO_DISABLE_THREADS
+#define NO_DEFAULT_OPTIONS
+#include <cxxhttp/timer-wheel.h>
+
+using namespace cxxhttp;
+
+/* A clock that runs 100000 times faster than the steady clock.
+ *
+ * A tick of the wheel passes in a microsecond, and two days in under two
+ * seconds.
+ */
+class fastClock {
+ public:
+  using duration = std::chrono::steady_clock::duration;
+  using rep = duration::rep;
+  using period = duration::period;
+  using time_point = std::chrono::time_point<fastClock>;
+  static const bool is_steady = true;
+
+  /* Get the current time.
+   *
+   * Counts from the first time this is called, rather than from the steady
+   * clock's epoch, which may be long enough ago to overflow once sped up.
+   *
+   * @return The steady clock's time, sped up.
+   */
+  static time_point now(void) {
+    static const auto origin = std::chrono::steady_clock::now();
+    return time_point((std::chrono::steady_clock::now() - origin) * 100000);
+  }
+};
+
+/* Test timeouts at all distances.
+ * @log Test output stream.
+ *
+ * Schedules timeouts that go into each of the wheels, and makes sure they go
+ * off, and not before they're due. Cancelled and moved timeouts must not go
+ * off, or only once, respectively, and the I/O service needs to run out of
+ * things to do once all of them are done.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testTimeouts(std::ostream &log) {
+  using wheel = timerWheel<fastClock>;
+
+  struct sampleData {
+    std::chrono::milliseconds timeout;
+    fastClock::time_point due;
+    std::size_t fired;
+    wheel::entry entry;
+  };
+
+  service io;
+  wheel &w = asio::use_service<wheel>(io);
+  bool result = true;
+
+  std::vector<std::chrono::milliseconds> timeouts{
+      std::chrono::milliseconds(50), std::chrono::seconds(1),
+      std::chrono::minutes(10), std::chrono::hours(5), std::chrono::hours(48)};
+  std::list<sampleData> tests;
+
+  for (const auto &t : timeouts) {
+    tests.push_back({t, fastClock::now() + t, 0, {}});
+    auto &tt = tests.back();
+    tt.entry.handler = [&log, &result, &tt]() {
+      if (fastClock::now() < tt.due) {
+        log << "timeout of " << tt.timeout.count() << "ms went off early\n";
+        result = false;
+      }
+      tt.fired++;
+    };
+    w.schedule(tt.entry, t);
+  }
+
+  wheel::entry cancelled;
+  cancelled.handler = [&log, &result]() {
+    log << "cancelled timeout went off\n";
+    result = false;
+  };
+  w.schedule(cancelled, std::chrono::hours(1));
+
+  // moving a timeout shouldn't leave a copy of it behind.
+  auto &moved = tests.front();
+  w.schedule(moved.entry, std::chrono::seconds(30));
+  moved.timeout = std::chrono::seconds(30);
+  moved.due = fastClock::now() + moved.timeout;
+
+  if (w.size() != timeouts.size() + 1 || !w.pending(cancelled)) {
+    log << "expected " << timeouts.size() + 1 << " timeouts, but have "
+        << w.size() << "\n";
+    return false;
+  }
+
+  w.cancel(cancelled);
+  io.run();
+
+  for (const auto &tt : tests) {
+    if (tt.fired != 1) {
+      log << "timeout of " << tt.timeout.count() << "ms went off " << tt.fired
+          << " times\n";
+      result = false;
+    }
+  }
+
+  if (w.size() != 0) {
+    log << "expected no timeouts to be left, but have " << w.size() << "\n";
+    result = false;
+  }
+
+  return result;
+}
+
+namespace test {
+using efgy::test::function;
+
+static function timeouts(testTimeouts);
+}
@@ -0,0 +1,236 @@
+/* Socket tuning tests.
+ *
+ * Sets the socket options on a listening socket and on both ends of a
+ * connection, and reads them back. Also sets up a server with its own listener
+ * options, and has a server cork its replies.
+ *
+ * See also:
+ * * Project Documentation: https://ef.gy/documentation/cxxhttp
+ * * Project Source Code: https://github.com/ef-gy/cxxhttp
+ * * Licence Terms: https://github.com/ef-gy/cxxhttp/blob/master/COPYING
+ *
+ * @copyright
+ * This file is part of the cxxhttp project, which is released as open source
+ * under the terms of an MIT/X11-style licence, described in the COPYING file.
+ */
+
+#include <ef.gy/test-case.h>
+
+#define ASIO_DISABLE_THREADS
+#define NO_DEFAULT_OPTIONS
+#include <cxxhttp/http-network.h>
+
+using namespace cxxhttp;
+
+/* Read an integer socket option.
+ * @fd The socket's descriptor.
+ * @level The option's level, e.g. IPPROTO_TCP.
+ * @name The option, e.g. TCP_NODELAY.
+ *
+ * @return The option's value, or -1 if it couldn't be read.
+ */
+static int option(int fd, int level, int name) {
+  int value = 0;
+  socklen_t length = sizeof(value);
+  if (::getsockopt(fd, level, name, &value, &length) != 0) {
+    return -1;
+  }
+  return value;
+}
+
+/* Test setting socket options.
+ * @log Test output stream.
+ *
+ * Listens on a loopback port with all of the listener options, and connects to
+ * it with the client options. Options that the system caps or rounds, like the
+ * buffer sizes, only need to be at least what was asked for. A connection
+ * with the default options must not have TCP_NODELAY set.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testOptions(std::ostream &log) {
+  service io;
+  net::tuning tune, defaults;
+  const transport::tcp::endpoint loopback(asio::ip::address_v4::loopback(), 0);
+  transport::tcp::acceptor acceptor(io);
+  transport::tcp::socket client(io), server(io), plain(io), accepted(io);
+  bool result = true;
+
+  tune.noDelay = true;
+  tune.deferAccept = std::chrono::seconds(5);
+  tune.fastOpen = 16;
+  tune.receiveBuffer = 65536;
+  tune.sendBuffer = 65536;
+  tune.backlog = 8;
+  tune.quickAck = true;
+
+  if (tune.listenBacklog() != 8 ||
+      defaults.listenBacklog() != asio::socket_base::max_connections) {
+    log << "unexpected listen backlog\n";
+    return false;
+  }
+
+  acceptor.open(loopback.protocol());
+  tune.listener(acceptor);
+  acceptor.bind(loopback);
+  acceptor.listen(tune.listenBacklog());
+
+  const int listener = acceptor.native_handle();
+  if (option(listener, SOL_SOCKET, SO_RCVBUF) < 65536 ||
+      option(listener, SOL_SOCKET, SO_SNDBUF) < 65536) {
+    log << "buffer sizes weren't set on the listening socket\n";
+    result = false;
+  }
+#if defined(TCP_DEFER_ACCEPT)
+  if (option(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT) <= 0) {
+    log << "deferred accepts weren't turned on\n";
+    result = false;
+  }
+#endif
+
+  client.open(loopback.protocol());
+  tune.outbound(client);
+  if (option(client.native_handle(), SOL_SOCKET, SO_SNDBUF) < 65536) {
+    log << "buffer sizes weren't set on the client socket\n";
+    result = false;
+  }
+
+  // the accept only goes through once the client has sent something.
+  client.connect(acceptor.local_endpoint());
+  tune.connected(client);
+  asio::write(client, asio::buffer("x", 1));
+  acceptor.accept(server);
+  tune.connected(server);
+
+  plain.connect(acceptor.local_endpoint());
+  asio::write(plain, asio::buffer("x", 1));
+  acceptor.accept(accepted);
+  defaults.connected(accepted);
+
+  if (option(client.native_handle(), IPPROTO_TCP, TCP_NODELAY) <= 0 ||
+      option(server.native_handle(), IPPROTO_TCP, TCP_NODELAY) <= 0) {
+    log << "TCP_NODELAY wasn't set on a connection\n";
+    result = false;
+  }
+  if (option(accepted.native_handle(), IPPROTO_TCP, TCP_NODELAY) != 0) {
+    log << "TCP_NODELAY was set without being asked for\n";
+    result = false;
+  }
+
+  return result;
+}
+
+/* Test a server's listener options.
+ * @log Test output stream.
+ *
+ * Sets up a server with its own socket options, which have to be in place
+ * before the server binds its socket, so the listening socket needs to have
+ * deferred accepts turned on.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testServerOptions(std::ostream &log) {
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  const transport::tcp::endpoint loopback(asio::ip::address_v4::loopback(), 0);
+  net::tuning tune;
+
+  tune.deferAccept = std::chrono::seconds(5);
+
+  http::server<transport::tcp> server(
+      loopback,
+      [&tune](http::processor::server &processor) {
+        processor.tune = &tune;
+      },
+      servers, io);
+
+  const std::vector<int> listening = efgy::global<net::listeners>().active();
+  if (listening.size() != 1) {
+    log << "expected one listening socket, but got " << listening.size()
+        << "\n";
+    return false;
+  }
+
+#if defined(TCP_DEFER_ACCEPT)
+  if (option(listening[0], IPPROTO_TCP, TCP_DEFER_ACCEPT) <= 0) {
+    log << "deferred accepts weren't turned on for the server\n";
+    return false;
+  }
+#endif
+
+  return true;
+}
+
+/* Test corked replies.
+ * @log Test output stream.
+ *
+ * Has a server with TCP_NODELAY and corking send a streamed reply, in a few
+ * pieces. The reply needs to arrive whole, and without waiting for the kernel
+ * to give up on the cork, which takes 200ms.
+ *
+ * @return `true` on success, `false` otherwise.
+ */
+bool testCork(std::ostream &log) {
+  service io;
+  efgy::beacons<http::server<transport::tcp>> servers;
+  efgy::beacons<http::servlet> servlets;
+  const transport::tcp::endpoint loopback(asio::ip::address_v4::loopback(), 0);
+  http::servlet stream("/corked",
+                       [](http::sessionData &session, std::smatch &) {
+                         session.beginReply(200);
+                         session.replyChunk("corked ");
+                         session.replyChunk("reply");
+                         session.endReply();
+                       },
+                       "GET", {}, "cork test servlet", servlets);
+  http::server<transport::tcp> server(loopback, servers, io);
+  net::tuning tune;
+
+  tune.noDelay = true;
+  tune.cork = true;
+  server.processor.tune = &tune;
+  server.processor.servlets = servlets;
+
+  transport::tcp::socket socket(io);
+  asio::streambuf reply;
+  std::chrono::steady_clock::duration elapsed{0};
+  const auto start = std::chrono::steady_clock::now();
+
+  socket.connect(server.endpoint());
+  asio::write(socket, asio::buffer(std::string("GET /corked HTTP/1.1\r\n"
+                                               "\r\n")));
+  asio::async_read_until(socket, reply, "\r\n0\r\n\r\n",
+                         [&](const asio::error_code &, std::size_t) {
+                           elapsed = std::chrono::steady_clock::now() - start;
+                           io.stop();
+                         });
+
+  io.run();
+
+  const std::string data(asio::buffer_cast<const char *>(reply.data()),
+                         reply.size());
+  bool result = true;
+  if (data.find("HTTP/1.1 200 ") != 0 ||
+      data.find("\r\n\r\n7\r\ncorked \r\n5\r\nreply\r\n0\r\n\r\n") ==
+          std::string::npos) {
+    log << "unexpected reply: '" << data << "'\n";
+    result = false;
+  }
+  if (elapsed >= std::chrono::milliseconds(150)) {
+    log << "reply took "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed)
+               .count()
+        << "ms; was the socket left corked?\n";
+    result = false;
+  }
+
+  return result;
+}
+
+namespace test {
+using efgy::test::function;
+
+static function options(testOptions);
+static function serverOptions(testServerOptions);
+static function cork(testCork);
+}